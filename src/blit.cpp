@@ -0,0 +1,194 @@
+#include <bit>
+#include <cstring>
+
+#include <d3dcompiler.h>
+
+#include "blit.h"
+#include "impl.h"
+
+namespace atfix {
+
+namespace {
+
+    const char* g_blitVertexShader = R"(
+void main(uint id : SV_VertexID, out float4 pos : SV_Position, out float2 uv : TEXCOORD0) {
+    uv = float2((id << 1) & 2, id & 2);
+    pos = float4(uv * float2(2.0f, -2.0f) + float2(-1.0f, 1.0f), 0.0f, 1.0f);
+}
+)";
+
+    pD3DCompile getCompiler() {
+        static pD3DCompile s_compile = [] {
+            HMODULE lib = LoadLibraryA("d3dcompiler_47.dll");
+
+            pD3DCompile proc = lib
+                ? std::bit_cast<pD3DCompile>(GetProcAddress(lib, "D3DCompile"))
+                : nullptr;
+
+#ifndef NDEBUG
+            if (!proc)
+                log("Blit: Failed to load d3dcompiler_47.dll");
+#endif
+            return proc;
+        }();
+
+        return s_compile;
+    }
+
+    template<typename T>
+    void release(T*& pObject) {
+        if (pObject)
+            pObject->Release();
+
+        pObject = nullptr;
+    }
+
+}
+
+
+bool compileShader(
+  const char*                     pSource,
+  const char*                     pEntryPoint,
+  const char*                     pTarget,
+        std::vector<uint8_t>*     pCode) {
+    pD3DCompile compile = getCompiler();
+
+    if (!compile)
+        return false;
+
+    ID3DBlob* code = nullptr;
+    ID3DBlob* errors = nullptr;
+
+    HRESULT hr = compile(pSource, std::strlen(pSource), nullptr, nullptr, nullptr,
+        pEntryPoint, pTarget, D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &code, &errors);
+
+    if (FAILED(hr)) {
+#ifndef NDEBUG
+        log("Blit: Failed to compile shader: ", errors
+            ? static_cast<const char*>(errors->GetBufferPointer()) : "unknown error");
+#endif
+        release(errors);
+        return false;
+    }
+
+    auto* data = static_cast<const uint8_t*>(code->GetBufferPointer());
+    pCode->assign(data, data + code->GetBufferSize());
+
+    release(code);
+    release(errors);
+    return true;
+}
+
+
+BlitPass::~BlitPass() {
+    release(m_state);
+    release(m_vs);
+    release(m_constants);
+    release(m_linear);
+    release(m_point);
+    release(m_depthWrite);
+}
+
+
+bool BlitPass::init(ID3D11Device* pDevice) {
+    m_device = pDevice;
+
+    ID3D11Device1* device1 = nullptr;
+
+    if (FAILED(pDevice->QueryInterface(IID_PPV_ARGS(&device1))))
+        return false;
+
+    D3D_FEATURE_LEVEL level = pDevice->GetFeatureLevel();
+    HRESULT hr = device1->CreateDeviceContextState(0, &level, 1,
+        D3D11_SDK_VERSION, __uuidof(ID3D11Device), nullptr, &m_state);
+    device1->Release();
+
+    if (FAILED(hr))
+        return false;
+
+    std::vector<uint8_t> code;
+
+    if (!compileShader(g_blitVertexShader, "main", "vs_5_0", &code)
+     || FAILED(pDevice->CreateVertexShader(code.data(), code.size(), nullptr, &m_vs)))
+        return false;
+
+    D3D11_BUFFER_DESC cbDesc = { };
+    cbDesc.ByteWidth = sizeof(BlitArgs::constants);
+    cbDesc.Usage = D3D11_USAGE_DEFAULT;
+    cbDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+
+    D3D11_SAMPLER_DESC samplerDesc = { };
+    samplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+    samplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+    samplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+    samplerDesc.MaxLOD = 1000.0f;
+
+    D3D11_DEPTH_STENCIL_DESC depthDesc = { };
+    depthDesc.DepthEnable = TRUE;
+    depthDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ALL;
+    depthDesc.DepthFunc = D3D11_COMPARISON_ALWAYS;
+
+    if (FAILED(pDevice->CreateBuffer(&cbDesc, nullptr, &m_constants))
+     || FAILED(pDevice->CreateSamplerState(&samplerDesc, &m_linear))
+     || FAILED(pDevice->CreateDepthStencilState(&depthDesc, &m_depthWrite)))
+        return false;
+
+    samplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_POINT;
+    return SUCCEEDED(pDevice->CreateSamplerState(&samplerDesc, &m_point));
+}
+
+
+ID3D11PixelShader* BlitPass::createPixelShader(const char* pSource) const {
+    std::vector<uint8_t> code;
+    ID3D11PixelShader* ps = nullptr;
+
+    if (compileShader(pSource, "main", "ps_5_0", &code))
+        m_device->CreatePixelShader(code.data(), code.size(), nullptr, &ps);
+
+    return ps;
+}
+
+
+void BlitPass::run(ID3D11DeviceContext* pContext, const BlitArgs& Args) {
+    const auto* procs = getContextProcs(pContext);
+
+    ID3D11DeviceContext1* context1 = nullptr;
+
+    if (FAILED(pContext->QueryInterface(IID_PPV_ARGS(&context1))))
+        return;
+
+    flushPendingDraw(pContext);
+
+    ID3D11DeviceContextState* prevState = nullptr;
+    context1->SwapDeviceContextState(m_state, &prevState);
+
+    /* Go through the original methods, so that the hooks do not track any of this */
+    procs->UpdateSubresource(pContext, m_constants, 0, nullptr, Args.constants.data(), 0, 0);
+
+    ID3D11SamplerState* sampler = Args.linear ? m_linear : m_point;
+
+    procs->IASetPrimitiveTopology(pContext, D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    procs->VSSetShader(pContext, m_vs, nullptr, 0);
+    procs->PSSetShader(pContext, Args.ps, nullptr, 0);
+    std::array<ID3D11ShaderResourceView*, 2> srvs = { Args.srv, Args.depthSrv };
+
+    procs->PSSetShaderResources(pContext, 0, Args.depthSrv ? 2 : 1, srvs.data());
+    procs->PSSetConstantBuffers(pContext, 0, 1, &m_constants);
+    pContext->PSSetSamplers(0, 1, &sampler);
+    procs->OMSetRenderTargets(pContext, Args.rtv ? 1 : 0, &Args.rtv, Args.dsv);
+    procs->OMSetDepthStencilState(pContext, Args.dsv ? m_depthWrite : nullptr, 0);
+    procs->OMSetBlendState(pContext, Args.blend, Args.blendFactor.data(), Args.sampleMask);
+    procs->RSSetViewports(pContext, 1, &Args.viewport);
+    procs->Draw(pContext, 3, 0);
+
+    context1->SwapDeviceContextState(prevState, nullptr);
+
+    if (prevState)
+        prevState->Release();
+
+    context1->Release();
+}
+
+}
@@ -0,0 +1,86 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <d3d11_1.h>
+
+namespace atfix {
+
+/**
+ * \brief Compiles HLSL source at runtime
+ *
+ * Uses \c d3dcompiler_47.dll, which ships with Windows, so that
+ * shaders do not need to be precompiled into the binary.
+ * \returns \c false if the compiler is unavailable or fails
+ */
+bool compileShader(
+  const char*                     pSource,
+  const char*                     pEntryPoint,
+  const char*                     pTarget,
+        std::vector<uint8_t>*     pCode);
+
+/** Parameters of a full-screen pass */
+struct BlitArgs {
+    ID3D11PixelShader*            ps        = nullptr;
+    ID3D11ShaderResourceView*     srv       = nullptr;
+    ID3D11ShaderResourceView*     depthSrv  = nullptr;   /**< Optional depth input in \c t1 */
+    ID3D11RenderTargetView*       rtv       = nullptr;
+    ID3D11DepthStencilView*       dsv       = nullptr;   /**< Written with \c SV_Depth, always passes */
+    D3D11_VIEWPORT                viewport  = { };
+    bool                          linear    = true;
+    std::array<float, 8>          constants = { };       /**< Pixel shader constants in \c b0 */
+    ID3D11BlendState*             blend     = nullptr;   /**< Blends with the target if set */
+    std::array<float, 4>          blendFactor = { };
+    UINT                          sampleMask = ~0u;
+};
+
+/**
+ * \brief Full-screen pass on the immediate context
+ *
+ * Draws a single triangle with the given pixel shader. The vertex
+ * shader passes texture coordinates from 0 to 1 across the viewport.
+ *
+ * The pass runs in a context state object of its own, so that none
+ * of the application's state needs to be saved, and none of the
+ * state tracking sees it.
+ */
+class BlitPass {
+
+public:
+
+    BlitPass() { }
+    ~BlitPass();
+
+    BlitPass(const BlitPass&) = delete;
+    BlitPass& operator = (const BlitPass&) = delete;
+
+    /**
+     * \brief Creates the shared objects
+     * \returns \c false if the device lacks D3D11.1 or compilation fails
+     */
+    bool init(ID3D11Device* pDevice);
+
+    /** Compiles a pixel shader for use with \ref run */
+    ID3D11PixelShader* createPixelShader(const char* pSource) const;
+
+    /** Runs the pass, leaving the application's state untouched */
+    void run(ID3D11DeviceContext* pContext, const BlitArgs& Args);
+
+private:
+
+    ID3D11Device*               m_device      = nullptr;
+    ID3D11DeviceContextState*   m_state       = nullptr;
+    ID3D11VertexShader*         m_vs          = nullptr;
+    ID3D11Buffer*               m_constants   = nullptr;
+    ID3D11SamplerState*         m_linear      = nullptr;
+    ID3D11SamplerState*         m_point       = nullptr;
+    ID3D11DepthStencilState*    m_depthWrite  = nullptr;
+
+};
+
+}
+
+#endif
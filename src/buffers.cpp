@@ -0,0 +1,900 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <d3d11.h>
+#include <immintrin.h>
+
+#include "buffers.h"
+#include "config.h"
+#include "hash.h"
+#include "impl.h"
+#include "util.h"
+#include "vcache.h"
+#include "worker.h"
+
+namespace atfix {
+
+/**
+ * \brief Pool of large default-usage buffers
+ *
+ * Each chunk keeps a sorted free list of ranges, allocation is
+ * first-fit and adjacent ranges are merged again on free.
+ */
+class BufferPool : public BufferAllocator {
+
+public:
+
+    static constexpr UINT Alignment = 16u;
+
+    bool allocate(ID3D11Device* pDevice, UINT Size, ID3D11Buffer** ppBacking, UINT* pOffset) {
+        Size = align(Size);
+
+        std::lock_guard lock(m_mutex);
+
+        for (auto& chunk : m_chunks) {
+            if (allocateFromChunk(chunk, Size, pOffset)) {
+                *ppBacking = chunk.buffer;
+                return true;
+            }
+        }
+
+        D3D11_BUFFER_DESC desc = { };
+        desc.ByteWidth = g_config.poolChunkSize;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_INDEX_BUFFER;
+
+        Chunk chunk = { };
+
+        if (FAILED(getDeviceProcs(pDevice)->CreateBuffer(pDevice, &desc, nullptr, &chunk.buffer)))
+            return false;
+
+#ifndef NDEBUG
+        log("Buffer pool: Allocated chunk ", m_chunks.size(), " (", desc.ByteWidth, " bytes)");
+#endif
+
+        chunk.freeRanges.push_back({ 0u, desc.ByteWidth });
+
+        if (!allocateFromChunk(chunk, Size, pOffset)) {
+            chunk.buffer->Release();
+            return false;
+        }
+
+        *ppBacking = chunk.buffer;
+        m_chunks.push_back(std::move(chunk));
+        return true;
+    }
+
+    void free(ID3D11Buffer* pBacking, UINT Offset, UINT Size) override {
+        Size = align(Size);
+
+        std::lock_guard lock(m_mutex);
+
+        auto chunk = std::find_if(m_chunks.begin(), m_chunks.end(),
+            [pBacking] (const Chunk& c) { return c.buffer == pBacking; });
+
+        if (chunk == m_chunks.end())
+            return;
+
+        auto& ranges = chunk->freeRanges;
+
+        auto next = std::lower_bound(ranges.begin(), ranges.end(), Offset,
+            [] (const Range& r, UINT o) { return r.offset < o; });
+
+        next = ranges.insert(next, { Offset, Size });
+
+        if (next + 1 != ranges.end() && next->offset + next->size == (next + 1)->offset) {
+            next->size += (next + 1)->size;
+            ranges.erase(next + 1);
+        }
+
+        if (next != ranges.begin() && (next - 1)->offset + (next - 1)->size == next->offset) {
+            (next - 1)->size += next->size;
+            ranges.erase(next);
+        }
+    }
+
+private:
+
+    struct Range {
+        UINT offset;
+        UINT size;
+    };
+
+    struct Chunk {
+        ID3D11Buffer*       buffer = nullptr;
+        std::vector<Range>  freeRanges;
+    };
+
+    mutex               m_mutex;
+    std::vector<Chunk>  m_chunks;
+
+    static UINT align(UINT Size) {
+        return (Size + Alignment - 1u) & ~(Alignment - 1u);
+    }
+
+    static bool allocateFromChunk(Chunk& chunk, UINT Size, UINT* pOffset) {
+        for (auto r = chunk.freeRanges.begin(); r != chunk.freeRanges.end(); r++) {
+            if (r->size < Size)
+                continue;
+
+            *pOffset = r->offset;
+            r->offset += Size;
+            r->size -= Size;
+
+            if (!r->size)
+                chunk.freeRanges.erase(r);
+
+            return true;
+        }
+
+        return false;
+    }
+
+};
+
+
+/**
+ * \brief Content-addressed cache of immutable buffers
+ *
+ * Buffers are keyed by a hash of their initial data plus the parts
+ * of the description that affect how they can be used. Each entry
+ * counts the proxy buffers referencing it and is destroyed together
+ * with the last one.
+ */
+class BufferCache : public BufferAllocator {
+
+public:
+
+    bool acquire(ID3D11Device* pDevice, const D3D11_BUFFER_DESC& Desc, const void* pData, ID3D11Buffer** ppBacking) {
+        Key key = { hashData(pData, Desc.ByteWidth), Desc.ByteWidth, Desc.BindFlags };
+
+        {   std::lock_guard lock(m_mutex);
+
+            if (lookup(key, ppBacking))
+                return true;
+        }
+
+        D3D11_SUBRESOURCE_DATA initialData = { };
+        initialData.pSysMem = pData;
+
+        ID3D11Buffer* buffer = nullptr;
+
+        if (FAILED(getDeviceProcs(pDevice)->CreateBuffer(pDevice, &Desc, &initialData, &buffer)))
+            return false;
+
+        std::lock_guard lock(m_mutex);
+
+        /* Another thread may have created the same buffer meanwhile */
+        if (lookup(key, ppBacking)) {
+            buffer->Release();
+            return true;
+        }
+
+        m_entries.emplace(key, Entry { buffer, 1u });
+        m_keys.emplace(buffer, key);
+
+        *ppBacking = buffer;
+        return true;
+    }
+
+    void free(ID3D11Buffer* pBacking, [[maybe_unused]] UINT Offset, UINT Size) override {
+        std::lock_guard lock(m_mutex);
+
+        auto key = m_keys.find(pBacking);
+
+        if (key == m_keys.end())
+            return;
+
+        auto entry = m_entries.find(key->second);
+
+        if (--entry->second.refCount) {
+            m_bytesSaved -= Size;
+            m_changed = true;
+            return;
+        }
+
+        entry->second.buffer->Release();
+        m_entries.erase(entry);
+        m_keys.erase(key);
+    }
+
+    /** Logs the memory saved by sharing if it changed since the last report */
+    void report() {
+        std::lock_guard lock(m_mutex);
+
+        if (!m_changed)
+            return;
+
+        m_changed = false;
+
+        log("Buffer cache: ", m_entries.size(), " shared buffers, saving ",
+            m_bytesSaved, " bytes (", m_bytesSavedTotal, " total)");
+    }
+
+private:
+
+    struct Key {
+        Hash128 hash;
+        UINT    byteWidth;
+        UINT    bindFlags;
+
+        bool operator == (const Key&) const = default;
+    };
+
+    struct KeyHasher {
+        size_t operator () (const Key& k) const {
+            return Hash128Hasher()(k.hash) ^ (size_t(k.bindFlags) << 32);
+        }
+    };
+
+    struct Entry {
+        ID3D11Buffer* buffer;
+        uint32_t      refCount;
+    };
+
+    mutex                                           m_mutex;
+    std::unordered_map<Key, Entry, KeyHasher>       m_entries;
+    std::unordered_map<ID3D11Buffer*, Key>          m_keys;
+    uint64_t                                        m_bytesSaved = 0u;
+    uint64_t                                        m_bytesSavedTotal = 0u;
+    bool                                            m_changed = false;
+
+    bool lookup(const Key& key, ID3D11Buffer** ppBacking) {
+        auto entry = m_entries.find(key);
+
+        if (entry == m_entries.end())
+            return false;
+
+        entry->second.refCount += 1u;
+        m_bytesSaved += key.byteWidth;
+        m_bytesSavedTotal += key.byteWidth;
+        m_changed = true;
+
+#ifndef NDEBUG
+        log("Buffer cache: Shared ", key.byteWidth, " byte buffer (", entry->second.refCount, " refs), saving ",
+            m_bytesSaved, " bytes (", m_bytesSavedTotal, " total)");
+#endif
+
+        *ppBacking = entry->second.buffer;
+        return true;
+    }
+
+};
+
+
+/**
+ * \brief Allocator for buffers owned by a single proxy
+ *
+ * The proxy holds the only reference to the backing buffer,
+ * so there is nothing left to do once it goes away.
+ */
+class UniqueBufferAllocator : public BufferAllocator {
+
+public:
+
+    void free(
+            [[maybe_unused]] ID3D11Buffer*  pBacking,
+            [[maybe_unused]] UINT           Offset,
+            [[maybe_unused]] UINT           Size) override {
+
+    }
+
+};
+
+
+namespace {
+    BufferPool              g_bufferPool;
+    BufferCache             g_bufferCache;
+    UniqueBufferAllocator   g_uniqueBuffers;
+
+    WorkerThread            g_reorderWorker;
+
+    /* Frames between reports of the memory saved by shared buffers */
+    constexpr uint32_t BufferReportInterval = 600u;
+    uint32_t g_bufferFrame = 0u;
+
+    /* Drivers without native command list support expect the source
+     * pointer of UpdateSubresource on deferred contexts to be offset
+     * by the destination box, see the UpdateSubresource remarks. */
+    bool g_deferredUpdateOffsetBug = false;
+
+    /**
+     * \brief Creates an immutable buffer for a proxy
+     *
+     * Looks the contents up in the content cache if sharing is enabled.
+     * The returned buffer holds one reference owned by the caller.
+     */
+    ID3D11Buffer* acquireImmutableBuffer(
+            ID3D11Device*             pDevice,
+      const D3D11_BUFFER_DESC&        Desc,
+      const void*                     pData,
+            BufferAllocator**         ppAllocator) {
+        ID3D11Buffer* buffer = nullptr;
+
+        if (g_config.shareImmutableBuffers) {
+            if (!g_bufferCache.acquire(pDevice, Desc, pData, &buffer))
+                return nullptr;
+
+            buffer->AddRef();
+            *ppAllocator = &g_bufferCache;
+            return buffer;
+        }
+
+        D3D11_SUBRESOURCE_DATA initialData = { };
+        initialData.pSysMem = pData;
+
+        if (FAILED(getDeviceProcs(pDevice)->CreateBuffer(pDevice, &Desc, &initialData, &buffer)))
+            return nullptr;
+
+        *ppAllocator = &g_uniqueBuffers;
+        return buffer;
+    }
+}
+
+
+ProxyBuffer::ProxyBuffer(
+        BufferAllocator*          pAllocator,
+        ID3D11Buffer*             pBacking,
+        UINT                      Offset,
+  const D3D11_BUFFER_DESC&        Desc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData)
+: m_allocator(pAllocator), m_backing(pBacking), m_offset(Offset), m_size(Desc.ByteWidth), m_desc(Desc) {
+    s_vtable.store(*reinterpret_cast<void**>(this), std::memory_order_relaxed);
+
+    m_backing->AddRef();
+
+    if (Desc.Usage != D3D11_USAGE_DYNAMIC)
+        return;
+
+    m_shadow.resize(Desc.ByteWidth);
+
+    /* Creation may happen on any thread, so the initial data is
+     * uploaded by the first context that uses the buffer. */
+    if (pInitialData && pInitialData->pSysMem) {
+        std::memcpy(m_shadow.data(), pInitialData->pSysMem, m_shadow.size());
+        m_dirty.store(true, std::memory_order_release);
+    }
+}
+
+
+ProxyBuffer::~ProxyBuffer() {
+    m_allocator->free(m_backing, m_offset, m_size);
+    m_backing->Release();
+
+    if (m_wide)
+        m_wide->Release();
+
+    if (m_reordered) {
+        m_allocator->free(m_reordered, 0u, m_size);
+        m_reordered->Release();
+    }
+}
+
+
+HRESULT STDMETHODCALLTYPE ProxyBuffer::QueryInterface(REFIID riid, void** ppvObject) {
+    if (!ppvObject)
+        return E_POINTER;
+
+    *ppvObject = nullptr;
+
+    if (riid == __uuidof(IUnknown)
+     || riid == __uuidof(ID3D11DeviceChild)
+     || riid == __uuidof(ID3D11Resource)
+     || riid == __uuidof(ID3D11Buffer)) {
+        AddRef();
+        *ppvObject = static_cast<ID3D11Buffer*>(this);
+        return S_OK;
+    }
+
+    return E_NOINTERFACE;
+}
+
+
+ULONG STDMETHODCALLTYPE ProxyBuffer::AddRef() {
+    return ++m_refCount;
+}
+
+
+ULONG STDMETHODCALLTYPE ProxyBuffer::Release() {
+    ULONG refCount = --m_refCount;
+
+    if (!refCount)
+        delete this;
+
+    return refCount;
+}
+
+
+void STDMETHODCALLTYPE ProxyBuffer::GetDevice(ID3D11Device** ppDevice) {
+    m_backing->GetDevice(ppDevice);
+}
+
+
+/* Private data would otherwise end up on the shared backing buffer,
+ * Unity only uses it for debug names so it is simply dropped. */
+HRESULT STDMETHODCALLTYPE ProxyBuffer::GetPrivateData(
+        [[maybe_unused]] REFGUID  guid,
+                         UINT*    pDataSize,
+        [[maybe_unused]] void*    pData) {
+    if (pDataSize)
+        *pDataSize = 0;
+
+    return DXGI_ERROR_NOT_FOUND;
+}
+
+
+HRESULT STDMETHODCALLTYPE ProxyBuffer::SetPrivateData(
+        [[maybe_unused]] REFGUID      guid,
+        [[maybe_unused]] UINT         DataSize,
+        [[maybe_unused]] const void*  pData) {
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE ProxyBuffer::SetPrivateDataInterface(
+        [[maybe_unused]] REFGUID          guid,
+        [[maybe_unused]] const IUnknown*  pData) {
+    return S_OK;
+}
+
+
+void STDMETHODCALLTYPE ProxyBuffer::GetType(D3D11_RESOURCE_DIMENSION* pResourceDimension) {
+    *pResourceDimension = D3D11_RESOURCE_DIMENSION_BUFFER;
+}
+
+
+void STDMETHODCALLTYPE ProxyBuffer::SetEvictionPriority([[maybe_unused]] UINT EvictionPriority) {
+
+}
+
+
+UINT STDMETHODCALLTYPE ProxyBuffer::GetEvictionPriority() {
+    return m_backing->GetEvictionPriority();
+}
+
+
+void STDMETHODCALLTYPE ProxyBuffer::GetDesc(D3D11_BUFFER_DESC* pDesc) {
+    *pDesc = m_desc;
+}
+
+
+HRESULT ProxyBuffer::map(D3D11_MAP MapType, D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    if (m_shadow.empty() || (MapType != D3D11_MAP_WRITE_DISCARD && MapType != D3D11_MAP_WRITE_NO_OVERWRITE))
+        return E_INVALIDARG;
+
+    if (pMappedResource) {
+        pMappedResource->pData = m_shadow.data();
+        pMappedResource->RowPitch = m_desc.ByteWidth;
+        pMappedResource->DepthPitch = m_desc.ByteWidth;
+    }
+
+    return S_OK;
+}
+
+
+void ProxyBuffer::unmap(ID3D11DeviceContext* pContext) {
+    if (m_shadow.empty())
+        return;
+
+    m_dirty.store(true, std::memory_order_release);
+    upload(pContext);
+}
+
+
+void ProxyBuffer::upload(ID3D11DeviceContext* pContext) {
+    if (!m_dirty.exchange(false, std::memory_order_acq_rel))
+        return;
+
+    D3D11_BOX box = { };
+    box.left = m_offset;
+    box.right = m_offset + m_desc.ByteWidth;
+    box.bottom = 1u;
+    box.back = 1u;
+
+    const uint8_t* pData = m_shadow.data();
+
+    if (g_deferredUpdateOffsetBug && pContext->GetType() == D3D11_DEVICE_CONTEXT_DEFERRED)
+        pData -= m_offset;
+
+    pContext->UpdateSubresource(m_backing, 0, &box, pData, 0, 0);
+}
+
+
+void ProxyBuffer::setNarrowed(std::vector<uint16_t>&& indices) {
+    m_size = UINT(indices.size() * sizeof(uint16_t));
+    m_indices = std::move(indices);
+}
+
+
+ID3D11Buffer* ProxyBuffer::wideBacking() {
+    std::lock_guard lock(m_wideMutex);
+
+    if (m_wide || m_wideFailed)
+        return m_wide;
+
+    std::vector<uint32_t> indices(m_indices.begin(),
+        m_indices.begin() + m_desc.ByteWidth / sizeof(uint32_t));
+
+    D3D11_BUFFER_DESC desc = m_desc;
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+
+    D3D11_SUBRESOURCE_DATA initialData = { };
+    initialData.pSysMem = indices.data();
+
+    ID3D11Device* device = nullptr;
+    m_backing->GetDevice(&device);
+
+    if (FAILED(getDeviceProcs(device)->CreateBuffer(device, &desc, &initialData, &m_wide))) {
+        /* Binds keep using the narrowed buffer from here on */
+        log("Index narrowing: Failed to rebuild 32-bit copy of ", m_indices.size(), " indices");
+        m_wide = nullptr;
+        m_wideFailed = true;
+
+        device->Release();
+        return nullptr;
+    }
+
+#ifndef NDEBUG
+    log("Index narrowing: Rebuilt 32-bit copy of ", m_indices.size(), " indices");
+#endif
+
+    device->Release();
+    return m_wide;
+}
+
+
+void ProxyBuffer::enableReordering(std::vector<uint8_t>&& data) {
+    m_reorderSource = std::move(data);
+    m_reorderState.store(ReorderState::Recording, std::memory_order_relaxed);
+}
+
+
+bool ProxyBuffer::recordDraw(
+        DXGI_FORMAT               Format,
+        UINT                      Offset,
+        D3D11_PRIMITIVE_TOPOLOGY  Topology,
+        UINT                      StartIndex,
+        UINT                      IndexCount) {
+    auto state = m_reorderState.load(std::memory_order_acquire);
+
+    if (state == ReorderState::None || state == ReorderState::Failed)
+        return false;
+
+    if (m_reorderFormat == DXGI_FORMAT_UNKNOWN)
+        m_reorderFormat = Format;
+
+    /* Reordering triangles breaks any other topology */
+    if (Topology != D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST || Offset || Format != m_reorderFormat) {
+        disableReordering();
+        return false;
+    }
+
+    IndexRange range = { StartIndex, StartIndex + IndexCount };
+
+    if (state == ReorderState::Ready) {
+        /* Triangles only move within the segments between recorded
+         * boundaries, so any draw starting and ending on one is fine */
+        if (std::binary_search(m_reorderBoundaries.begin(), m_reorderBoundaries.end(), range.begin)
+         && std::binary_search(m_reorderBoundaries.begin(), m_reorderBoundaries.end(), range.end))
+            return true;
+
+        disableReordering();
+        return false;
+    }
+
+    if (state == ReorderState::Recording) {
+        if (std::find(m_reorderRanges.begin(), m_reorderRanges.end(), range) == m_reorderRanges.end())
+            m_reorderRanges.push_back(range);
+
+        if (++m_reorderDraws >= g_config.reorderWarmupDraws)
+            submitReordering();
+    }
+
+    return false;
+}
+
+
+void ProxyBuffer::submitReordering() {
+    m_reorderState.store(ReorderState::Pending, std::memory_order_release);
+
+    /* Gather indices in units of the bound format */
+    std::vector<uint32_t> indices;
+
+    if (isNarrowed()) {
+        indices.assign(m_indices.begin(), m_indices.begin() + m_desc.ByteWidth / sizeof(uint32_t));
+    } else if (m_reorderFormat == DXGI_FORMAT_R16_UINT) {
+        const auto* src = reinterpret_cast<const uint16_t*>(m_reorderSource.data());
+        indices.assign(src, src + m_reorderSource.size() / sizeof(uint16_t));
+    } else {
+        const auto* src = reinterpret_cast<const uint32_t*>(m_reorderSource.data());
+        indices.assign(src, src + m_reorderSource.size() / sizeof(uint32_t));
+    }
+
+    m_reorderSource = std::vector<uint8_t>();
+
+    AddRef();
+
+    g_reorderWorker.submit([this, indices = std::move(indices), ranges = m_reorderRanges] () mutable {
+        std::vector<UINT> boundaries;
+
+        for (const auto& r : ranges) {
+            boundaries.push_back(r.begin);
+            boundaries.push_back(r.end);
+        }
+
+        std::sort(boundaries.begin(), boundaries.end());
+        boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+#ifndef NDEBUG
+        float acmrBefore = computeAcmr(indices.data(), indices.size(), 16u);
+#endif
+
+        for (size_t i = 1; i < boundaries.size(); i++) {
+            UINT begin = boundaries[i - 1u];
+            UINT end = boundaries[i];
+
+            bool covered = std::any_of(ranges.begin(), ranges.end(),
+                [begin, end] (const IndexRange& r) { return r.begin <= begin && end <= r.end; });
+
+            if (covered && end <= indices.size() && !((end - begin) % 3u))
+                optimizeVertexCache(&indices[begin], end - begin);
+        }
+
+#ifndef NDEBUG
+        log("Index reordering: ", indices.size(), " indices in ", ranges.size(), " ranges, ACMR ",
+            acmrBefore, " -> ", computeAcmr(indices.data(), indices.size(), 16u));
+#endif
+
+        /* Store in the same format as the backing buffer */
+        D3D11_BUFFER_DESC desc = m_desc;
+        desc.ByteWidth = m_size;
+
+        std::vector<uint8_t> data(m_size);
+
+        if (isNarrowed() || m_reorderFormat == DXGI_FORMAT_R16_UINT) {
+            auto* dst = reinterpret_cast<uint16_t*>(data.data());
+            std::copy(indices.begin(), indices.begin() + std::min<size_t>(indices.size(), m_size / 2u), dst);
+        } else {
+            auto* dst = reinterpret_cast<uint32_t*>(data.data());
+            std::copy(indices.begin(), indices.begin() + std::min<size_t>(indices.size(), m_size / 4u), dst);
+        }
+
+        ID3D11Device* device = nullptr;
+        m_backing->GetDevice(&device);
+
+        BufferAllocator* allocator = nullptr;
+        ID3D11Buffer* buffer = acquireImmutableBuffer(device, desc, data.data(), &allocator);
+
+        device->Release();
+
+        if (!buffer) {
+            disableReordering();
+        } else {
+            if (!finishReordering(buffer, std::move(boundaries)))
+                allocator->free(buffer, 0u, m_size);
+
+            buffer->Release();
+        }
+
+        Release();
+    });
+}
+
+
+bool ProxyBuffer::finishReordering(ID3D11Buffer* pBuffer, std::vector<UINT>&& boundaries) {
+    m_reordered = pBuffer;
+    m_reordered->AddRef();
+    m_reorderBoundaries = std::move(boundaries);
+
+    /* Reordering may have been disabled while the job was running */
+    auto expected = ReorderState::Pending;
+
+    if (m_reorderState.compare_exchange_strong(expected, ReorderState::Ready, std::memory_order_acq_rel))
+        return true;
+
+    m_reordered->Release();
+    m_reordered = nullptr;
+    return false;
+}
+
+
+void initBufferPool(ID3D11Device* pDevice) {
+    D3D11_FEATURE_DATA_THREADING threading = { };
+
+    if (SUCCEEDED(pDevice->CheckFeatureSupport(D3D11_FEATURE_THREADING, &threading, sizeof(threading))))
+        g_deferredUpdateOffsetBug = !threading.DriverCommandLists;
+}
+
+
+void endBufferFrame() {
+    if (++g_bufferFrame % BufferReportInterval)
+        return;
+
+    g_bufferCache.report();
+}
+
+bool tryCreatePooledBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult) {
+    constexpr UINT IaBindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_INDEX_BUFFER;
+
+    if (!g_config.poolDynamicBuffers || !pDesc || !ppBuffer)
+        return false;
+
+    if (pDesc->Usage != D3D11_USAGE_DYNAMIC
+     || pDesc->CPUAccessFlags != D3D11_CPU_ACCESS_WRITE
+     || pDesc->MiscFlags
+     || !pDesc->BindFlags
+     || (pDesc->BindFlags & ~IaBindFlags)
+     || !pDesc->ByteWidth
+     || pDesc->ByteWidth > g_config.poolMaxBufferSize)
+        return false;
+
+    ID3D11Buffer* backing = nullptr;
+    UINT offset = 0u;
+
+    if (!g_bufferPool.allocate(pDevice, pDesc->ByteWidth, &backing, &offset))
+        return false;
+
+    *ppBuffer = new ProxyBuffer(&g_bufferPool, backing, offset, *pDesc, pInitialData);
+    *pResult = S_OK;
+    return true;
+}
+
+
+
+bool tryCreateImmutableBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult) {
+    constexpr UINT IaBindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_INDEX_BUFFER;
+
+    if (!pDesc || !ppBuffer || !pInitialData || !pInitialData->pSysMem)
+        return false;
+
+    if (pDesc->Usage != D3D11_USAGE_IMMUTABLE
+     || pDesc->CPUAccessFlags
+     || pDesc->MiscFlags
+     || !pDesc->BindFlags
+     || (pDesc->BindFlags & ~IaBindFlags)
+     || !pDesc->ByteWidth)
+        return false;
+
+    bool reorder = g_config.reorderIndexBuffers
+        && pDesc->BindFlags == D3D11_BIND_INDEX_BUFFER;
+
+    if (!g_config.shareImmutableBuffers && !reorder)
+        return false;
+
+    BufferAllocator* allocator = nullptr;
+    ID3D11Buffer* backing = acquireImmutableBuffer(pDevice, *pDesc, pInitialData->pSysMem, &allocator);
+
+    if (!backing)
+        return false;
+
+    auto* proxy = new ProxyBuffer(allocator, backing, 0u, *pDesc, nullptr);
+    backing->Release();
+
+    if (reorder) {
+        const auto* data = static_cast<const uint8_t*>(pInitialData->pSysMem);
+        proxy->enableReordering(std::vector<uint8_t>(data, data + pDesc->ByteWidth));
+    }
+
+    *ppBuffer = proxy;
+    *pResult = S_OK;
+    return true;
+}
+
+
+namespace {
+
+    __attribute__((target("avx2")))
+    uint32_t maxIndexAvx2(const uint32_t* pIndices, size_t Count) {
+        __m256i max0 = _mm256_setzero_si256();
+        __m256i max1 = _mm256_setzero_si256();
+        size_t i = 0u;
+
+        for (; i + 16u <= Count; i += 16u) {
+            max0 = _mm256_max_epu32(max0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIndices + i)));
+            max1 = _mm256_max_epu32(max1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIndices + i + 8u)));
+        }
+
+        __m128i max = _mm_max_epu32(
+            _mm256_castsi256_si128(_mm256_max_epu32(max0, max1)),
+            _mm256_extracti128_si256(_mm256_max_epu32(max0, max1), 1));
+        max = _mm_max_epu32(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(1, 0, 3, 2)));
+        max = _mm_max_epu32(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        uint32_t result = uint32_t(_mm_cvtsi128_si32(max));
+
+        for (; i < Count; i++)
+            result = std::max(result, pIndices[i]);
+
+        return result;
+    }
+
+    uint32_t maxIndexScalar(const uint32_t* pIndices, size_t Count) {
+        uint32_t result = 0u;
+
+        for (size_t i = 0u; i < Count; i++)
+            result = std::max(result, pIndices[i]);
+
+        return result;
+    }
+
+    uint32_t maxIndex(const uint32_t* pIndices, size_t Count) {
+        static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+        return hasAvx2
+            ? maxIndexAvx2(pIndices, Count)
+            : maxIndexScalar(pIndices, Count);
+    }
+
+}
+
+
+bool tryCreateNarrowedIndexBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult) {
+    if (!g_config.narrowIndexBuffers || !pDesc || !ppBuffer || !pInitialData || !pInitialData->pSysMem)
+        return false;
+
+    /* Default-usage buffers may be updated with 32-bit data later */
+    if (pDesc->Usage != D3D11_USAGE_IMMUTABLE
+     || pDesc->BindFlags != D3D11_BIND_INDEX_BUFFER
+     || pDesc->CPUAccessFlags
+     || pDesc->MiscFlags
+     || !pDesc->ByteWidth
+     || (pDesc->ByteWidth % sizeof(uint32_t)))
+        return false;
+
+    const auto* indices = static_cast<const uint32_t*>(pInitialData->pSysMem);
+    size_t count = pDesc->ByteWidth / sizeof(uint32_t);
+
+    /* The format is only known at bind time, but 16-bit index data
+     * read as 32-bit words will almost never pass this test, and
+     * wideBacking covers the case where it does. */
+    if (maxIndex(indices, count) > 0xFFFFu)
+        return false;
+
+    /* Pad to keep the buffer size a multiple of four bytes */
+    std::vector<uint16_t> narrowed(count + (count & 1u));
+    std::copy(indices, indices + count, narrowed.begin());
+
+    D3D11_BUFFER_DESC desc = *pDesc;
+    desc.ByteWidth = UINT(narrowed.size() * sizeof(uint16_t));
+
+    BufferAllocator* allocator = nullptr;
+    ID3D11Buffer* backing = acquireImmutableBuffer(pDevice, desc, narrowed.data(), &allocator);
+
+    if (!backing)
+        return false;
+
+    auto* proxy = new ProxyBuffer(allocator, backing, 0u, *pDesc, nullptr);
+    proxy->setNarrowed(std::move(narrowed));
+    backing->Release();
+
+    if (g_config.reorderIndexBuffers)
+        proxy->enableReordering(std::vector<uint8_t>());
+
+#ifndef NDEBUG
+    log("Index narrowing: ", count, " indices, saving ", pDesc->ByteWidth - desc.ByteWidth, " bytes");
+#endif
+
+    *ppBuffer = proxy;
+    *pResult = S_OK;
+    return true;
+}
+
+}
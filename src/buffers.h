@@ -0,0 +1,286 @@
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <d3d11.h>
+
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Owner of the storage behind proxy buffers
+ */
+class BufferAllocator {
+
+public:
+
+    /** Called when the last reference to a proxy buffer goes away */
+    virtual void free(ID3D11Buffer* pBacking, UINT Offset, UINT Size) = 0;
+
+protected:
+
+    ~BufferAllocator() = default;
+
+};
+
+
+/**
+ * \brief Buffer handle backed by shared storage
+ *
+ * Stands in for a vertex or index buffer whose storage is a range
+ * of a buffer owned by an allocator, either a sub-allocation of a
+ * large \c DEFAULT pool buffer or a deduplicated immutable buffer.
+ *
+ * For dynamic buffers, CPU writes go to a shadow copy and are
+ * uploaded with \c UpdateSubresource on unmap, so the range never
+ * moves and binds only need their offset adjusted.
+ *
+ * Narrowed index buffers store 32-bit indices as 16-bit ones. Binds
+ * with \c DXGI_FORMAT_R32_UINT are redirected to the narrow storage,
+ * anything else falls back to a 32-bit copy rebuilt on demand.
+ *
+ * Immutable index buffers can additionally get a reordered copy for
+ * better vertex cache use. The index ranges drawn from the buffer are
+ * recorded first so that triangles never move between submeshes.
+ */
+class ProxyBuffer final : public ID3D11Buffer {
+
+public:
+
+    ProxyBuffer(
+            BufferAllocator*          pAllocator,
+            ID3D11Buffer*             pBacking,
+            UINT                      Offset,
+      const D3D11_BUFFER_DESC&        Desc,
+      const D3D11_SUBRESOURCE_DATA*   pInitialData);
+
+    ~ProxyBuffer();
+
+    ProxyBuffer(const ProxyBuffer&) = delete;
+    ProxyBuffer& operator = (const ProxyBuffer&) = delete;
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override;
+    ULONG   STDMETHODCALLTYPE AddRef() override;
+    ULONG   STDMETHODCALLTYPE Release() override;
+
+    void    STDMETHODCALLTYPE GetDevice(ID3D11Device** ppDevice) override;
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID guid, UINT* pDataSize, void* pData) override;
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID guid, UINT DataSize, const void* pData) override;
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID guid, const IUnknown* pData) override;
+
+    void    STDMETHODCALLTYPE GetType(D3D11_RESOURCE_DIMENSION* pResourceDimension) override;
+    void    STDMETHODCALLTYPE SetEvictionPriority(UINT EvictionPriority) override;
+    UINT    STDMETHODCALLTYPE GetEvictionPriority() override;
+
+    void    STDMETHODCALLTYPE GetDesc(D3D11_BUFFER_DESC* pDesc) override;
+
+    ID3D11Buffer* backing() const {
+        return m_backing;
+    }
+
+    UINT offset() const {
+        return m_offset;
+    }
+
+    bool isNarrowed() const {
+        return !m_indices.empty();
+    }
+
+    /**
+     * \brief Marks the backing storage as narrowed 16-bit indices
+     * \param [in] indices Narrowed indices, kept to rebuild the original
+     */
+    void setNarrowed(std::vector<uint16_t>&& indices);
+
+    /**
+     * \brief Returns a buffer holding the original 32-bit indices
+     *
+     * Creating the buffer is only attempted once.
+     * \returns The buffer, or \c nullptr if it could not be created
+     */
+    ID3D11Buffer* wideBacking();
+
+    /** Returns the buffer and offset that hold the original contents */
+    ID3D11Buffer* copySource(UINT* pOffset) {
+        ID3D11Buffer* wide = isNarrowed() ? wideBacking() : nullptr;
+
+        if (!wide) {
+            *pOffset = m_offset;
+            return m_backing;
+        }
+
+        *pOffset = 0u;
+        return wide;
+    }
+
+    /**
+     * \brief Enables vertex cache reordering for this index buffer
+     * \param [in] data Initial data, dropped once the reordering job is submitted
+     */
+    void enableReordering(std::vector<uint8_t>&& data);
+
+    /** Checks whether draws using this buffer need to be recorded */
+    bool tracksDraws() const {
+        auto state = m_reorderState.load(std::memory_order_relaxed);
+        return state != ReorderState::None && state != ReorderState::Failed;
+    }
+
+    /**
+     * \brief Returns the reordered index buffer if it is ready
+     *
+     * The reordered buffer uses the same storage format as the
+     * backing buffer and is never sub-allocated.
+     */
+    ID3D11Buffer* reorderedBacking(DXGI_FORMAT Format, UINT Offset) const {
+        if (m_reorderState.load(std::memory_order_acquire) != ReorderState::Ready)
+            return nullptr;
+
+        return Format == m_reorderFormat && !Offset ? m_reordered : nullptr;
+    }
+
+    /**
+     * \brief Records an indexed draw from this buffer
+     *
+     * Must only be called for draws on the immediate context.
+     * \returns \c true if the reordered buffer is valid for the draw
+     */
+    bool recordDraw(
+            DXGI_FORMAT               Format,
+            UINT                      Offset,
+            D3D11_PRIMITIVE_TOPOLOGY  Topology,
+            UINT                      StartIndex,
+            UINT                      IndexCount);
+
+    /** Permanently stops using the reordered buffer */
+    void disableReordering() {
+        m_reorderState.store(ReorderState::Failed, std::memory_order_release);
+    }
+
+    /** Returns the shadow copy for CPU writes */
+    HRESULT map(D3D11_MAP MapType, D3D11_MAPPED_SUBRESOURCE* pMappedResource);
+
+    /** Marks the shadow copy as modified and uploads it */
+    void unmap(ID3D11DeviceContext* pContext);
+
+    /** Uploads pending CPU writes, must be called before the range is read */
+    void flush(ID3D11DeviceContext* pContext) {
+        if (m_dirty.load(std::memory_order_acquire))
+            upload(pContext);
+    }
+
+    /**
+     * \brief Checks whether a resource is a proxy buffer
+     * \returns The proxy buffer, or \c nullptr for any other resource
+     */
+    static ProxyBuffer* fromResource(ID3D11Resource* pResource) {
+        if (!pResource || *reinterpret_cast<void**>(pResource) != s_vtable.load(std::memory_order_relaxed))
+            return nullptr;
+
+        return static_cast<ProxyBuffer*>(static_cast<ID3D11Buffer*>(pResource));
+    }
+
+private:
+
+    enum class ReorderState : uint32_t {
+        None, Recording, Pending, Ready, Failed,
+    };
+
+    struct IndexRange {
+        UINT begin;
+        UINT end;
+
+        bool operator == (const IndexRange&) const = default;
+    };
+
+    BufferAllocator*        m_allocator;
+    ID3D11Buffer*           m_backing;
+    UINT                    m_offset;
+    UINT                    m_size;
+    D3D11_BUFFER_DESC       m_desc;
+    std::vector<uint8_t>    m_shadow;
+    std::vector<uint16_t>   m_indices;
+    mutex                   m_wideMutex;
+    ID3D11Buffer*           m_wide = nullptr;
+    bool                    m_wideFailed = false;
+    std::atomic<ULONG>      m_refCount = { 1u };
+    std::atomic<bool>       m_dirty    = { false };
+
+    std::atomic<ReorderState> m_reorderState = { ReorderState::None };
+    DXGI_FORMAT             m_reorderFormat = DXGI_FORMAT_UNKNOWN;
+    uint32_t                m_reorderDraws = 0u;
+    std::vector<uint8_t>    m_reorderSource;
+    std::vector<IndexRange> m_reorderRanges;
+    std::vector<UINT>       m_reorderBoundaries;
+    ID3D11Buffer*           m_reordered = nullptr;
+
+    void upload(ID3D11DeviceContext* pContext);
+
+    void submitReordering();
+
+    bool finishReordering(ID3D11Buffer* pBuffer, std::vector<UINT>&& boundaries);
+
+    static inline std::atomic<void*> s_vtable = { nullptr };
+
+};
+
+
+/**
+ * \brief Serves small dynamic vertex and index buffers from the pool
+ *
+ * \returns \c true if the buffer was created by the pool, in which
+ *    case \c *pResult holds the result to return to the application
+ */
+bool tryCreatePooledBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult);
+
+/**
+ * \brief Creates immutable vertex and index buffers as proxies
+ *
+ * Shares buffers with identical contents and sets up vertex
+ * cache reordering for index buffers, depending on the config.
+ * \returns \c true if a proxy buffer was created, in which case
+ *    \c *pResult holds the result to return
+ */
+bool tryCreateImmutableBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult);
+
+/**
+ * \brief Stores immutable 32-bit index buffers with 16-bit indices
+ *
+ * Only applies if no index in the initial data exceeds 16 bits.
+ * \returns \c true if a narrowed buffer was created, in which case
+ *    \c *pResult holds the result to return
+ */
+bool tryCreateNarrowedIndexBuffer(
+        ID3D11Device*             pDevice,
+  const D3D11_BUFFER_DESC*        pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**            ppBuffer,
+        HRESULT*                  pResult);
+
+/** Queries whether deferred contexts need the UpdateSubresource workaround */
+void initBufferPool(ID3D11Device* pDevice);
+
+/**
+ * \brief Ends a frame for buffer statistics
+ *
+ * Logs the memory saved by shared immutable buffers
+ * every few hundred frames, in release builds too.
+ */
+void endBufferFrame();
+
+}
+
+#endif
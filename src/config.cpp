@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "config.h"
+#include "formats.h"
+#include "impl.h"
+
+namespace atfix {
+
+Config g_config;
+
+namespace {
+    constexpr const char* CONFIG_FILE = ".\\valfix.ini";
+
+    bool readBool(const char* section, const char* key, bool value) {
+        return GetPrivateProfileIntA(section, key, value ? 1 : 0, CONFIG_FILE) != 0;
+    }
+
+    uint32_t readUint(const char* section, const char* key, uint32_t value) {
+        return GetPrivateProfileIntA(section, key, static_cast<INT>(value), CONFIG_FILE);
+    }
+
+    std::string readString(const char* section, const char* key) {
+        std::array<char, 4096> str = { };
+        GetPrivateProfileStringA(section, key, "", str.data(), str.size(), CONFIG_FILE);
+        return str.data();
+    }
+
+    /** Parses a comma-separated list of \c hash:slot pairs */
+    std::vector<InstancingShaderConfig> parseInstancingShaders(const std::string& str) {
+        std::vector<InstancingShaderConfig> result;
+        size_t pos = 0u;
+
+        while (pos < str.size()) {
+            size_t end = std::min(str.find(',', pos), str.size());
+            std::string entry = str.substr(pos, end - pos);
+            pos = end + 1u;
+
+            entry.erase(0, entry.find_first_not_of(" \t"));
+
+            InstancingShaderConfig shader = { };
+
+            if (entry.size() < 34u || entry[32] != ':' || !parseHash(entry.c_str(), &shader.hash)) {
+#ifndef NDEBUG
+                log("Config: Invalid instancing shader entry '", entry, "'");
+#endif
+                continue;
+            }
+
+            shader.slot = uint32_t(std::strtoul(entry.c_str() + 33, nullptr, 10));
+            result.push_back(shader);
+        }
+
+        return result;
+    }
+
+    /** Parses a comma-separated list of numbers */
+    std::vector<uint32_t> parseUintList(const std::string& str) {
+        std::vector<uint32_t> result;
+        const char* p = str.c_str();
+
+        while (*p) {
+            char* end = nullptr;
+            uint32_t value = uint32_t(std::strtoul(p, &end, 10));
+
+            if (end == p)
+                break;
+
+            result.push_back(value);
+            p = end + std::strspn(end, " \t,");
+        }
+
+        return result;
+    }
+
+    /** Parses a comma-separated list of shader hashes */
+    std::vector<Hash128> parseHashList(const std::string& str) {
+        std::vector<Hash128> result;
+        size_t pos = 0u;
+
+        while (pos < str.size()) {
+            size_t end = std::min(str.find(',', pos), str.size());
+            std::string entry = str.substr(pos, end - pos);
+            pos = end + 1u;
+
+            entry.erase(0, entry.find_first_not_of(" \t"));
+
+            Hash128 hash;
+
+            if (!parseHash(entry.c_str(), &hash)) {
+#ifndef NDEBUG
+                log("Config: Invalid shader hash '", entry, "'");
+#endif
+                continue;
+            }
+
+            result.push_back(hash);
+        }
+
+        return result;
+    }
+
+    /** Parses a comma-separated list of format policy names */
+    uint32_t parseFormatPolicies(const std::string& str) {
+        uint32_t result = 0u;
+        size_t pos = 0u;
+
+        while (pos < str.size()) {
+            size_t end = std::min(str.find(',', pos), str.size());
+            std::string entry = str.substr(pos, end - pos);
+            pos = end + 1u;
+
+            entry.erase(0, entry.find_first_not_of(" \t"));
+            entry.erase(entry.find_last_not_of(" \t") + 1u);
+
+            uint32_t policy = findFormatPolicy(entry);
+
+#ifndef NDEBUG
+            if (!policy)
+                log("Config: Unknown format policy '", entry, "'");
+#endif
+
+            result |= policy;
+        }
+
+        return result;
+    }
+
+    bool parseDrawRuleAction(const std::string& str, DrawRuleAction* pAction) {
+        static const std::array<std::pair<const char*, DrawRuleAction>, 4> actions = {{
+            { "skip",               DrawRuleAction::Skip },
+            { "replace_ps",         DrawRuleAction::ReplacePixelShader },
+            { "replace_vs",         DrawRuleAction::ReplaceVertexShader },
+            { "clamp_instances",    DrawRuleAction::ClampInstances },
+        }};
+
+        for (const auto& a : actions) {
+            if (str == a.first) {
+                *pAction = a.second;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * \brief Reads a draw rule section
+     *
+     * Keys that are missing or empty do not constrain the match.
+     */
+    bool readDrawRule(const char* section, DrawRuleConfig* pRule) {
+        DrawRuleConfig& r = *pRule;
+        r.name = section;
+
+        std::string vs = readString(section, "VS");
+        std::string ps = readString(section, "PS");
+        std::string viewport = readString(section, "Viewport");
+
+        if (!vs.empty()) {
+            if (!parseHash(vs.c_str(), &r.vs))
+                return false;
+            r.fields |= DRAW_RULE_VS;
+        }
+
+        if (!ps.empty()) {
+            if (!parseHash(ps.c_str(), &r.ps))
+                return false;
+            r.fields |= DRAW_RULE_PS;
+        }
+
+        if ((r.count = readUint(section, "IndexCount", 0u)))
+            r.fields |= DRAW_RULE_COUNT;
+
+        if ((r.rtFormat = readUint(section, "RTFormat", 0u)))
+            r.fields |= DRAW_RULE_RT_FORMAT;
+
+        if (!viewport.empty()) {
+            if (std::sscanf(viewport.c_str(), "%ux%u", &r.viewportWidth, &r.viewportHeight) != 2)
+                return false;
+            r.fields |= DRAW_RULE_VIEWPORT;
+        }
+
+        if (!r.fields || !parseDrawRuleAction(readString(section, "Action"), &r.action))
+            return false;
+
+        r.shader = readString(section, "Shader");
+        r.maxInstances = readUint(section, "MaxInstances", r.maxInstances);
+
+        bool replace = r.action == DrawRuleAction::ReplacePixelShader
+                    || r.action == DrawRuleAction::ReplaceVertexShader;
+        return !replace || !r.shader.empty();
+    }
+
+    /** Lists the sections whose names start with the given prefix */
+    std::vector<std::string> readSectionNames(const char* prefix) {
+        std::vector<std::string> result;
+        std::vector<char> names(16384);
+
+        DWORD size = GetPrivateProfileSectionNamesA(names.data(), DWORD(names.size()), CONFIG_FILE);
+
+        for (DWORD pos = 0u; pos < size && names[pos]; ) {
+            const char* section = &names[pos];
+            pos += DWORD(std::strlen(section)) + 1u;
+
+            if (!std::strncmp(section, prefix, std::strlen(prefix)))
+                result.push_back(section);
+        }
+
+        return result;
+    }
+
+    std::vector<DrawRuleConfig> readDrawRules() {
+        std::vector<DrawRuleConfig> result;
+
+        for (const auto& section : readSectionNames("rule.")) {
+            DrawRuleConfig rule;
+
+            if (!readDrawRule(section.c_str(), &rule)) {
+#ifndef NDEBUG
+                log("Config: Invalid draw rule [", section, "]");
+#endif
+                continue;
+            }
+
+            result.push_back(std::move(rule));
+        }
+
+        return result;
+    }
+
+    bool parseShaderTier(const std::string& str, ShaderTier* pTier) {
+        static const std::array<std::pair<const char*, ShaderTier>, 4> tiers = {{
+            { "quality",            ShaderTier::Quality },
+            { "balanced",           ShaderTier::Balanced },
+            { "performance",        ShaderTier::Performance },
+            { "auto",               ShaderTier::Auto },
+        }};
+
+        for (const auto& t : tiers) {
+            if (str == t.first) {
+                *pTier = t.second;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /** Reads a shader pack section, which needs all of its keys */
+    bool readShaderPack(const char* section, ShaderPackConfig* pPack) {
+        ShaderPackConfig& p = *pPack;
+        p.name = section;
+        p.shader = readString(section, "Shader");
+
+        return parseHash(readString(section, "PS").c_str(), &p.ps)
+            && parseShaderTier(readString(section, "Tier"), &p.tier)
+            && p.tier != ShaderTier::Auto
+            && !p.shader.empty();
+    }
+
+    std::vector<ShaderPackConfig> readShaderPacks() {
+        std::vector<ShaderPackConfig> result;
+
+        for (const auto& section : readSectionNames("pack.")) {
+            ShaderPackConfig pack;
+
+            if (!readShaderPack(section.c_str(), &pack)) {
+#ifndef NDEBUG
+                log("Config: Invalid shader pack [", section, "]");
+#endif
+                continue;
+            }
+
+            result.push_back(std::move(pack));
+        }
+
+        return result;
+    }
+
+    ShaderTier readShaderTier() {
+        std::string str = readString("packs", "Tier");
+        ShaderTier tier = ShaderTier::Quality;
+
+        if (!str.empty() && !parseShaderTier(str, &tier)) {
+#ifndef NDEBUG
+            log("Config: Unknown shader tier '", str, "'");
+#endif
+        }
+
+        return tier;
+    }
+}
+
+void loadConfig() {
+    Config& c = g_config;
+
+    c.poolDynamicBuffers = readBool("buffers", "PoolDynamicBuffers", c.poolDynamicBuffers);
+    c.poolMaxBufferSize  = readUint("buffers", "PoolMaxBufferSize",  c.poolMaxBufferSize);
+    c.poolChunkSize      = readUint("buffers", "PoolChunkSize",      c.poolChunkSize);
+    c.shareImmutableBuffers = readBool("buffers", "ShareImmutableBuffers", c.shareImmutableBuffers);
+    c.narrowIndexBuffers = readBool("buffers", "NarrowIndexBuffers", c.narrowIndexBuffers);
+    c.reorderIndexBuffers = readBool("buffers", "ReorderIndexBuffers", c.reorderIndexBuffers);
+    c.reorderWarmupDraws = readUint("buffers", "ReorderWarmupDraws", c.reorderWarmupDraws);
+    c.mergeDrawCalls     = readBool("draws", "MergeDrawCalls", c.mergeDrawCalls);
+    c.nullDepthOnlyPixelShader = readBool("draws", "NullDepthOnlyPixelShader", c.nullDepthOnlyPixelShader);
+    c.autoInstancing     = readBool("instancing", "AutoInstancing", c.autoInstancing);
+    c.maxInstances       = readUint("instancing", "MaxInstances", c.maxInstances);
+    c.instancingShaders  = parseInstancingShaders(readString("instancing", "Shaders"));
+    c.builtinDrawRules   = readBool("rules", "BuiltinRules", c.builtinDrawRules);
+    c.drawRules          = readDrawRules();
+    c.cullSmallCasters   = readBool("shadows", "CullSmallCasters", c.cullSmallCasters);
+    c.casterMinIndexCounts = parseUintList(readString("shadows", "MinIndexCount"));
+    c.shadowCasterShaders = parseHashList(readString("shadows", "CasterShaders"));
+    c.shadowMapSize      = readUint("shadows", "MapSize", c.shadowMapSize);
+    c.shadowMapSizeOverride = readUint("shadows", "MapSizeOverride", c.shadowMapSizeOverride);
+    c.grassShaders       = parseHashList(readString("vegetation", "GrassShaders"));
+    c.grassDensity       = readUint("vegetation", "Density", c.grassDensity);
+    c.grassMinDensity    = readUint("vegetation", "MinDensity", c.grassMinDensity);
+    c.grassFrameBudgetUs = readUint("vegetation", "FrameBudgetUs", c.grassFrameBudgetUs);
+    c.formatPolicies     = parseFormatPolicies(readString("formats", "Remap"));
+    c.dynamicResolution  = readBool("dynres", "Enable", c.dynamicResolution);
+    c.dynresFrameTimeUs  = readUint("dynres", "TargetFrameTimeUs", c.dynresFrameTimeUs);
+    c.dynresMinScale     = readUint("dynres", "MinScale", c.dynresMinScale);
+    c.dynresMaxScale     = readUint("dynres", "MaxScale", c.dynresMaxScale);
+    c.dynresUpscaler     = readBool("dynres", "Upscaler", c.dynresUpscaler);
+    c.dynresSharpness    = readUint("dynres", "Sharpness", c.dynresSharpness);
+    c.halfResShaders     = parseHashList(readString("postfx", "HalfResShaders"));
+    c.particleShaders    = parseHashList(readString("postfx", "ParticleShaders"));
+    c.shaderTier         = readShaderTier();
+    c.shaderPacks        = readShaderPacks();
+    c.optimizeShaders    = readBool("optimizer", "Enable", c.optimizeShaders);
+    c.linkShaders        = readBool("optimizer", "LinkShaders", c.linkShaders);
+    c.specializeShaders  = readUint("optimizer", "SpecializeShaders", c.specializeShaders);
+    c.validateShaders    = readBool("optimizer", "Validate", c.validateShaders);
+
+    if (auto dir = readString("optimizer", "CacheDir"); !dir.empty())
+        c.shaderCacheDir = dir;
+
+    c.learnDraws         = readBool("learn", "DrawFingerprints", c.learnDraws);
+    c.learnMaxFingerprints = readUint("learn", "MaxFingerprints", c.learnMaxFingerprints);
+    c.learnDumpInterval  = readUint("learn", "DumpInterval", c.learnDumpInterval);
+
+    if (auto file = readString("learn", "File"); !file.empty())
+        c.learnFile = file;
+
+    c.shaderReport       = readBool("learn", "ShaderReport", c.shaderReport);
+
+    if (auto file = readString("learn", "ShaderReportFile"); !file.empty())
+        c.shaderReportFile = file;
+
+    c.dumpShaders        = readBool("learn", "DumpShaders", c.dumpShaders);
+
+    if (auto dir = readString("learn", "ShaderDumpDir"); !dir.empty())
+        c.shaderDumpDir = dir;
+
+    if (c.casterMinIndexCounts.empty())
+        c.cullSmallCasters = false;
+
+    if (!c.shadowMapSizeOverride || c.shadowMapSizeOverride >= c.shadowMapSize)
+        c.shadowMapSize = 0u;
+
+    c.dynresMaxScale = std::clamp(c.dynresMaxScale, 10u, 100u);
+    c.dynresMinScale = std::clamp(c.dynresMinScale, 10u, c.dynresMaxScale);
+    c.dynresSharpness = std::min(c.dynresSharpness, 100u);
+
+    if (!c.dynresFrameTimeUs)
+        c.dynamicResolution = false;
+
+    if (!c.learnDumpInterval)
+        c.learnDumpInterval = 1u;
+
+    if (c.maxInstances < 2u)
+        c.autoInstancing = false;
+
+    /* Pool allocations are aligned to 16 bytes, so that any
+     * buffer up to the maximum size fits into an empty chunk */
+    c.poolChunkSize &= ~15u;
+
+    if (c.poolMaxBufferSize > c.poolChunkSize)
+        c.poolMaxBufferSize = c.poolChunkSize;
+
+#ifndef NDEBUG
+    log("Config: PoolDynamicBuffers=", c.poolDynamicBuffers,
+        " PoolMaxBufferSize=", c.poolMaxBufferSize,
+        " PoolChunkSize=", c.poolChunkSize,
+        " ShareImmutableBuffers=", c.shareImmutableBuffers,
+        " NarrowIndexBuffers=", c.narrowIndexBuffers,
+        " ReorderIndexBuffers=", c.reorderIndexBuffers,
+        " ReorderWarmupDraws=", c.reorderWarmupDraws,
+        " MergeDrawCalls=", c.mergeDrawCalls,
+        " NullDepthOnlyPixelShader=", c.nullDepthOnlyPixelShader,
+        " AutoInstancing=", c.autoInstancing,
+        " MaxInstances=", c.maxInstances,
+        " InstancingShaders=", c.instancingShaders.size(),
+        " BuiltinRules=", c.builtinDrawRules,
+        " DrawRules=", c.drawRules.size(),
+        " CullSmallCasters=", c.cullSmallCasters,
+        " CasterShaders=", c.shadowCasterShaders.size(),
+        " ShadowMapSize=", c.shadowMapSize,
+        " ShadowMapSizeOverride=", c.shadowMapSizeOverride,
+        " GrassShaders=", c.grassShaders.size(),
+        " GrassDensity=", c.grassDensity,
+        " GrassMinDensity=", c.grassMinDensity,
+        " GrassFrameBudgetUs=", c.grassFrameBudgetUs,
+        " FormatPolicies=", c.formatPolicies,
+        " DynamicResolution=", c.dynamicResolution,
+        " DynresFrameTimeUs=", c.dynresFrameTimeUs,
+        " DynresMinScale=", c.dynresMinScale,
+        " DynresMaxScale=", c.dynresMaxScale,
+        " DynresUpscaler=", c.dynresUpscaler,
+        " DynresSharpness=", c.dynresSharpness,
+        " HalfResShaders=", c.halfResShaders.size(),
+        " ParticleShaders=", c.particleShaders.size(),
+        " ShaderTier=", uint32_t(c.shaderTier),
+        " ShaderPacks=", c.shaderPacks.size(),
+        " OptimizeShaders=", c.optimizeShaders,
+        " ShaderCacheDir=", c.shaderCacheDir,
+        " LinkShaders=", c.linkShaders,
+        " SpecializeShaders=", c.specializeShaders,
+        " ValidateShaders=", c.validateShaders,
+        " DrawFingerprints=", c.learnDraws,
+        " MaxFingerprints=", c.learnMaxFingerprints,
+        " DumpInterval=", c.learnDumpInterval,
+        " ShaderReport=", c.shaderReport,
+        " ShaderReportFile=", c.shaderReportFile,
+        " DumpShaders=", c.dumpShaders,
+        " ShaderDumpDir=", c.shaderDumpDir);
+#endif
+}
+
+}
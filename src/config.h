@@ -0,0 +1,158 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace atfix {
+
+/** Vertex shader to instance, with its per-object constant buffer slot */
+struct InstancingShaderConfig {
+    Hash128  hash;
+    uint32_t slot;
+};
+
+/** What a draw rule does to matching draws */
+enum class DrawRuleAction : uint32_t {
+    Skip,
+    ReplacePixelShader,
+    ReplaceVertexShader,
+    ClampInstances,
+};
+
+/* Draw state a rule can match on */
+constexpr uint32_t DRAW_RULE_VS           = (1u << 0);
+constexpr uint32_t DRAW_RULE_PS           = (1u << 1);
+constexpr uint32_t DRAW_RULE_COUNT        = (1u << 2);
+constexpr uint32_t DRAW_RULE_RT_FORMAT    = (1u << 3);
+constexpr uint32_t DRAW_RULE_VIEWPORT     = (1u << 4);
+
+/**
+ * \brief Draw rule as read from a \c [rule.*] section
+ *
+ * Only the fields selected by \c fields are matched.
+ */
+struct DrawRuleConfig {
+    std::string     name;
+    uint32_t        fields          = 0u;
+    Hash128         vs              = { };
+    Hash128         ps              = { };
+    uint32_t        count           = 0u;
+    uint32_t        rtFormat        = 0u;
+    uint32_t        viewportWidth   = 0u;
+    uint32_t        viewportHeight  = 0u;
+    DrawRuleAction  action          = DrawRuleAction::Skip;
+    std::string     shader;         /**< File or \c builtin: name for replace actions */
+    uint32_t        maxInstances    = 1u;
+};
+
+/** Cost tier that shader packs are selected for, cheapest last */
+enum class ShaderTier : uint32_t {
+    Quality,
+    Balanced,
+    Performance,
+    Auto,           /**< Picked from the adapter's video memory */
+};
+
+/**
+ * \brief Replacement pixel shader as read from a \c [pack.*] section
+ *
+ * Applies at its tier and any cheaper one, unless a pack for the same
+ * shader is closer to the selected tier.
+ */
+struct ShaderPackConfig {
+    std::string     name;
+    Hash128         ps              = { };
+    ShaderTier      tier            = ShaderTier::Performance;
+    std::string     shader;         /**< File or \c builtin: name */
+};
+
+/**
+ * \brief Runtime options
+ *
+ * Read once from \c valfix.ini in the game directory when the
+ * device is hooked. Missing keys keep the defaults below.
+ */
+struct Config {
+    /* [buffers] */
+    bool     poolDynamicBuffers     = false;
+    uint32_t poolMaxBufferSize      = 64u << 10;
+    uint32_t poolChunkSize          = 4u << 20;
+    bool     shareImmutableBuffers  = false;
+    bool     narrowIndexBuffers     = false;
+    bool     reorderIndexBuffers    = false;
+    uint32_t reorderWarmupDraws     = 16u;
+
+    /* [draws] */
+    bool     mergeDrawCalls         = false;  /**< Not for shaders reading SV_PrimitiveID */
+    bool     nullDepthOnlyPixelShader = false;
+
+    /* [instancing] */
+    bool     autoInstancing         = false;
+    uint32_t maxInstances           = 256u;
+    std::vector<InstancingShaderConfig> instancingShaders;
+
+    /* [rules], [rule.*] */
+    bool     builtinDrawRules       = true;
+    std::vector<DrawRuleConfig> drawRules;
+
+    /* [shadows] */
+    bool     cullSmallCasters       = false;
+    std::vector<uint32_t> casterMinIndexCounts;   /**< Per cascade, the last one applies to the rest */
+    std::vector<Hash128> shadowCasterShaders;     /**< Vertex shaders of shadow passes, any if empty */
+    uint32_t shadowMapSize          = 0u;     /**< Size of the game's shadow maps, 0 to keep them */
+    uint32_t shadowMapSizeOverride  = 0u;
+
+    /* [vegetation] */
+    std::vector<Hash128> grassShaders;
+    uint32_t grassDensity           = 100u;   /**< Percent of instances drawn */
+    uint32_t grassMinDensity        = 25u;    /**< Lower bound while adapting */
+    uint32_t grassFrameBudgetUs     = 0u;     /**< Frame time to adapt to, 0 to disable */
+
+    /* [formats] */
+    uint32_t formatPolicies         = 0u;     /**< Bit mask of enabled remapping policies */
+
+    /* [dynres] */
+    bool     dynamicResolution      = false;
+    uint32_t dynresFrameTimeUs      = 16667u; /**< Frame time to adapt the scale to */
+    uint32_t dynresMinScale         = 50u;    /**< Percent of the screen size per axis */
+    uint32_t dynresMaxScale         = 100u;
+    bool     dynresUpscaler         = true;   /**< Edge-adaptive upscale instead of bilinear */
+    uint32_t dynresSharpness        = 50u;    /**< Percent, 0 to skip sharpening */
+
+    /* [postfx] */
+    std::vector<Hash128> halfResShaders;      /**< Pixel shaders of full-screen passes to run at half resolution */
+    std::vector<Hash128> particleShaders;     /**< Pixel shaders of blended effects to batch at half resolution */
+
+    /* [packs], [pack.*] */
+    ShaderTier shaderTier           = ShaderTier::Quality;
+    std::vector<ShaderPackConfig> shaderPacks;
+
+    /* [optimizer] */
+    bool     optimizeShaders        = false;
+    std::string shaderCacheDir      = "valfix_shader_cache";
+    bool     linkShaders            = false;  /**< Specialize vertex shaders for the bound pixel shader */
+    uint32_t specializeShaders      = 0u;     /**< Pixel shaders to specialize for stable constant values, 0 to disable */
+    bool     validateShaders        = false;  /**< Compare optimized shaders with the original on the CPU */
+
+    /* [learn] */
+    bool     learnDraws             = false;
+    uint32_t learnMaxFingerprints   = 8192u;
+    uint32_t learnDumpInterval      = 600u;
+    std::string learnFile           = "valfix_draws.ini";
+    bool     shaderReport           = false;  /**< Rank the game's shaders by estimated cost */
+    std::string shaderReportFile    = "valfix_shaders.txt";
+    bool     dumpShaders            = false;  /**< Store every shader the game creates, named by hash */
+    std::string shaderDumpDir       = "valfix_shader_dump";
+};
+
+void loadConfig();
+
+extern Config g_config;
+
+}
+
+#endif
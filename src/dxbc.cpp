@@ -0,0 +1,454 @@
+#include <cstring>
+#include <utility>
+
+#include "dxbc.h"
+
+namespace atfix {
+
+namespace {
+
+    constexpr uint32_t DxbcHeaderSize = 32u;
+
+    template<typename T>
+    T readData(const uint8_t* pData) {
+        T value;
+        std::memcpy(&value, pData, sizeof(value));
+        return value;
+    }
+
+    template<typename T>
+    void writeData(std::vector<uint8_t>& data, size_t offset, T value) {
+        std::memcpy(&data[offset], &value, sizeof(value));
+    }
+
+    uint32_t rotl(uint32_t value, uint32_t shift) {
+        return (value << shift) | (value >> (32u - shift));
+    }
+
+    /* Standard MD5 block transform */
+    void md5Transform(uint32_t state[4], const uint8_t block[64]) {
+        static constexpr uint32_t K[64] = {
+            0xd76aa478u, 0xe8c7b756u, 0x242070dbu, 0xc1bdceeeu, 0xf57c0fafu, 0x4787c62au, 0xa8304613u, 0xfd469501u,
+            0x698098d8u, 0x8b44f7afu, 0xffff5bb1u, 0x895cd7beu, 0x6b901122u, 0xfd987193u, 0xa679438eu, 0x49b40821u,
+            0xf61e2562u, 0xc040b340u, 0x265e5a51u, 0xe9b6c7aau, 0xd62f105du, 0x02441453u, 0xd8a1e681u, 0xe7d3fbc8u,
+            0x21e1cde6u, 0xc33707d6u, 0xf4d50d87u, 0x455a14edu, 0xa9e3e905u, 0xfcefa3f8u, 0x676f02d9u, 0x8d2a4c8au,
+            0xfffa3942u, 0x8771f681u, 0x6d9d6122u, 0xfde5380cu, 0xa4beea44u, 0x4bdecfa9u, 0xf6bb4b60u, 0xbebfbc70u,
+            0x289b7ec6u, 0xeaa127fau, 0xd4ef3085u, 0x04881d05u, 0xd9d4d039u, 0xe6db99e5u, 0x1fa27cf8u, 0xc4ac5665u,
+            0xf4292244u, 0x432aff97u, 0xab9423a7u, 0xfc93a039u, 0x655b59c3u, 0x8f0ccc92u, 0xffeff47du, 0x85845dd1u,
+            0x6fa87e4fu, 0xfe2ce6e0u, 0xa3014314u, 0x4e0811a1u, 0xf7537e82u, 0xbd3af235u, 0x2ad7d2bbu, 0xeb86d391u,
+        };
+
+        static constexpr uint32_t S[16] = {
+            7u, 12u, 17u, 22u, 5u, 9u, 14u, 20u, 4u, 11u, 16u, 23u, 6u, 10u, 15u, 21u,
+        };
+
+        uint32_t m[16];
+        std::memcpy(m, block, sizeof(m));
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+        for (uint32_t i = 0; i < 64u; i++) {
+            uint32_t f, g;
+
+            switch (i / 16u) {
+                case 0:  f = (b & c) | (~b & d); g = i;                 break;
+                case 1:  f = (d & b) | (~d & c); g = (5u * i + 1u) % 16u; break;
+                case 2:  f = b ^ c ^ d;          g = (3u * i + 5u) % 16u; break;
+                default: f = c ^ (b | ~d);       g = (7u * i) % 16u;      break;
+            }
+
+            uint32_t t = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + K[i] + m[g], S[(i / 16u) * 4u + (i % 4u)]);
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+}
+
+
+void computeDxbcChecksum(const void* pData, size_t Size, uint32_t pChecksum[4]) {
+    /* Skip the magic and the checksum itself */
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(pData) + 20u;
+    uint32_t size = uint32_t(Size - 20u);
+
+    uint32_t state[4] = { 0x67452301u, 0xefcdab89u, 0x98badcfeu, 0x10325476u };
+
+    uint32_t fullSize = size & ~63u;
+    uint32_t leftover = size - fullSize;
+
+    for (uint32_t i = 0; i < fullSize; i += 64u)
+        md5Transform(state, data + i);
+
+    uint32_t numBits = size * 8u;
+    uint32_t numBitsPart2 = (numBits >> 2) | 1u;
+
+    uint8_t block[64] = { };
+
+    if (leftover >= 56u) {
+        std::memcpy(block, data + fullSize, leftover);
+        block[leftover] = 0x80u;
+        md5Transform(state, block);
+
+        std::memset(block, 0, sizeof(block));
+        std::memcpy(&block[0], &numBits, sizeof(numBits));
+        std::memcpy(&block[60], &numBitsPart2, sizeof(numBitsPart2));
+        md5Transform(state, block);
+    } else {
+        std::memcpy(&block[0], &numBits, sizeof(numBits));
+        std::memcpy(&block[4], data + fullSize, leftover);
+        block[4u + leftover] = 0x80u;
+        std::memcpy(&block[60], &numBitsPart2, sizeof(numBitsPart2));
+        md5Transform(state, block);
+    }
+
+    std::memcpy(pChecksum, state, sizeof(state));
+}
+
+
+Hash128 getDxbcHash(const void* pData, size_t Size) {
+    Hash128 hash;
+
+    if (Size >= 20u) {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(pData);
+        hash.lo = readData<uint64_t>(bytes + 4u);
+        hash.hi = readData<uint64_t>(bytes + 12u);
+    }
+
+    return hash;
+}
+
+
+bool DxbcContainer::parse(const void* pData, size_t Size) {
+    const auto* bytes = reinterpret_cast<const uint8_t*>(pData);
+
+    m_chunks.clear();
+
+    if (!pData || Size < DxbcHeaderSize || readData<uint32_t>(bytes) != DxbcTagContainer)
+        return false;
+
+    uint32_t totalSize = readData<uint32_t>(bytes + 24u);
+    uint32_t chunkCount = readData<uint32_t>(bytes + 28u);
+
+    if (totalSize > Size || DxbcHeaderSize + 4u * size_t(chunkCount) > totalSize)
+        return false;
+
+    for (uint32_t i = 0; i < chunkCount; i++) {
+        uint32_t offset = readData<uint32_t>(bytes + DxbcHeaderSize + 4u * i);
+
+        if (size_t(offset) + 8u > totalSize)
+            return false;
+
+        uint32_t tag = readData<uint32_t>(bytes + offset);
+        uint32_t size = readData<uint32_t>(bytes + offset + 4u);
+
+        if (size_t(offset) + 8u + size > totalSize)
+            return false;
+
+        const uint8_t* chunk = bytes + offset + 8u;
+        m_chunks.push_back({ tag, std::vector<uint8_t>(chunk, chunk + size) });
+    }
+
+    return true;
+}
+
+
+std::vector<uint8_t>* DxbcContainer::findChunk(uint32_t Tag) {
+    for (auto& chunk : m_chunks) {
+        if (chunk.tag == Tag)
+            return &chunk.data;
+    }
+
+    return nullptr;
+}
+
+
+const std::vector<uint8_t>* DxbcContainer::findChunk(uint32_t Tag) const {
+    for (const auto& chunk : m_chunks) {
+        if (chunk.tag == Tag)
+            return &chunk.data;
+    }
+
+    return nullptr;
+}
+
+
+std::vector<uint8_t>* DxbcContainer::findCodeChunk() {
+    auto* chunk = findChunk(DxbcTagShex);
+    return chunk ? chunk : findChunk(DxbcTagShdr);
+}
+
+
+std::vector<uint8_t> DxbcContainer::serialize() const {
+    size_t size = DxbcHeaderSize + 4u * m_chunks.size();
+
+    for (const auto& chunk : m_chunks)
+        size += 8u + chunk.data.size();
+
+    std::vector<uint8_t> data(size);
+    writeData<uint32_t>(data, 0u, DxbcTagContainer);
+    writeData<uint32_t>(data, 20u, 1u);
+    writeData<uint32_t>(data, 24u, uint32_t(size));
+    writeData<uint32_t>(data, 28u, uint32_t(m_chunks.size()));
+
+    size_t offset = DxbcHeaderSize + 4u * m_chunks.size();
+
+    for (size_t i = 0; i < m_chunks.size(); i++) {
+        const auto& chunk = m_chunks[i];
+
+        writeData<uint32_t>(data, DxbcHeaderSize + 4u * i, uint32_t(offset));
+        writeData<uint32_t>(data, offset, chunk.tag);
+        writeData<uint32_t>(data, offset + 4u, uint32_t(chunk.data.size()));
+
+        if (!chunk.data.empty())
+            std::memcpy(&data[offset + 8u], chunk.data.data(), chunk.data.size());
+
+        offset += 8u + chunk.data.size();
+    }
+
+    uint32_t checksum[4];
+    computeDxbcChecksum(data.data(), data.size(), checksum);
+    std::memcpy(&data[4], checksum, sizeof(checksum));
+    return data;
+}
+
+
+uint32_t getDxbcOpcodeTokenCount(const uint32_t* pTokens, const uint32_t* pEnd) {
+    uint32_t count = 1u;
+    bool extended = pTokens[0] >> 31;
+
+    while (extended) {
+        if (pTokens + count >= pEnd)
+            return 0u;
+
+        extended = pTokens[count++] >> 31;
+    }
+
+    return count;
+}
+
+
+uint32_t getDxbcOperandLength(const uint32_t* pTokens, const uint32_t* pEnd) {
+    if (pTokens >= pEnd)
+        return 0u;
+
+    uint32_t token = pTokens[0];
+    uint32_t length = getDxbcOpcodeTokenCount(pTokens, pEnd);
+
+    if (!length)
+        return 0u;
+
+    static constexpr uint32_t ComponentCounts[4] = { 0u, 1u, 4u, 0u };
+    uint32_t components = ComponentCounts[token & 0x3u];
+
+    switch (getDxbcOperandType(token)) {
+        case DxbcOperandType::Imm32: length += components;      break;
+        case DxbcOperandType::Imm64: length += 2u * components; break;
+        default: break;
+    }
+
+    for (uint32_t i = 0; i < getDxbcIndexDimension(token); i++) {
+        switch (getDxbcIndexType(token, i)) {
+            case DxbcIndexType::Imm32:
+                length += 1u;
+                break;
+
+            case DxbcIndexType::Imm64:
+                length += 2u;
+                break;
+
+            case DxbcIndexType::Relative:
+            case DxbcIndexType::Imm32Relative:
+            case DxbcIndexType::Imm64Relative: {
+                uint32_t immediate = getDxbcIndexType(token, i) == DxbcIndexType::Imm64Relative ? 2u
+                                   : getDxbcIndexType(token, i) == DxbcIndexType::Imm32Relative ? 1u : 0u;
+                uint32_t relative = getDxbcOperandLength(pTokens + length + immediate, pEnd);
+
+                if (!relative)
+                    return 0u;
+
+                length += immediate + relative;
+            } break;
+
+            default:
+                return 0u;
+        }
+    }
+
+    return pTokens + length <= pEnd ? length : 0u;
+}
+
+
+bool DxbcSignature::parse(const std::vector<uint8_t>& Chunk) {
+    m_elements.clear();
+
+    if (Chunk.size() < 8u)
+        return false;
+
+    uint32_t count = readData<uint32_t>(&Chunk[0]);
+    uint32_t offset = readData<uint32_t>(&Chunk[4]);
+
+    if (size_t(offset) + 24u * size_t(count) > Chunk.size())
+        return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* e = &Chunk[offset + 24u * i];
+        uint32_t nameOffset = readData<uint32_t>(e);
+
+        if (nameOffset >= Chunk.size())
+            return false;
+
+        const char* name = reinterpret_cast<const char*>(&Chunk[nameOffset]);
+        size_t nameLength = strnlen(name, Chunk.size() - nameOffset);
+
+        Element element;
+        element.name = std::string(name, nameLength);
+        element.semanticIndex = readData<uint32_t>(e + 4u);
+        element.systemValue = readData<uint32_t>(e + 8u);
+        element.componentType = readData<uint32_t>(e + 12u);
+        element.registerIndex = readData<uint32_t>(e + 16u);
+        element.mask = e[20u];
+        element.rwMask = e[21u];
+        m_elements.push_back(std::move(element));
+    }
+
+    return true;
+}
+
+
+std::vector<uint8_t> DxbcSignature::serialize() const {
+    /* Names are shared between elements, like the compiler does */
+    std::vector<std::pair<const std::string*, uint32_t>> names;
+    size_t size = 8u + 24u * m_elements.size();
+
+    for (const auto& e : m_elements) {
+        bool found = false;
+
+        for (const auto& n : names)
+            found |= *n.first == e.name;
+
+        if (!found) {
+            names.push_back({ &e.name, uint32_t(size) });
+            size += e.name.size() + 1u;
+        }
+    }
+
+    std::vector<uint8_t> data((size + 3u) & ~size_t(3u), 0xabu);
+    std::memset(data.data(), 0, size);
+
+    writeData<uint32_t>(data, 0u, uint32_t(m_elements.size()));
+    writeData<uint32_t>(data, 4u, 8u);
+
+    for (const auto& n : names)
+        std::memcpy(&data[n.second], n.first->c_str(), n.first->size() + 1u);
+
+    for (size_t i = 0; i < m_elements.size(); i++) {
+        const auto& e = m_elements[i];
+        size_t offset = 8u + 24u * i;
+        uint32_t nameOffset = 0u;
+
+        for (const auto& n : names) {
+            if (*n.first == e.name) {
+                nameOffset = n.second;
+                break;
+            }
+        }
+
+        writeData<uint32_t>(data, offset +  0u, nameOffset);
+        writeData<uint32_t>(data, offset +  4u, e.semanticIndex);
+        writeData<uint32_t>(data, offset +  8u, e.systemValue);
+        writeData<uint32_t>(data, offset + 12u, e.componentType);
+        writeData<uint32_t>(data, offset + 16u, e.registerIndex);
+        data[offset + 20u] = e.mask;
+        data[offset + 21u] = e.rwMask;
+    }
+
+    return data;
+}
+
+
+
+bool isDxbcColorOnlyPixelShader(const void* pData, size_t Size) {
+    DxbcContainer container;
+
+    if (!container.parse(pData, Size))
+        return false;
+
+    auto* code = container.findCodeChunk();
+    auto* osgn = container.findChunk(DxbcTagOsgn);
+
+    if (!code || !osgn || code->size() < 8u || code->size() % 4u)
+        return false;
+
+    std::vector<uint32_t> tokens(code->size() / 4u);
+    std::memcpy(tokens.data(), code->data(), code->size());
+
+    if ((tokens[0] >> 16) != 0u || tokens[1] > tokens.size())
+        return false;
+
+    DxbcSignature signature;
+
+    if (!signature.parse(*osgn))
+        return false;
+
+    /* Depth, coverage and stencil reference outputs */
+    for (const auto& e : signature.elements()) {
+        if (e.systemValue && e.systemValue != DxbcNameTarget)
+            return false;
+    }
+
+    const uint32_t* end = tokens.data() + tokens[1];
+
+    for (const uint32_t* p = tokens.data() + 2u; p < end; ) {
+        uint32_t length = getDxbcInstructionLength(p);
+
+        if (!length || p + length > end)
+            return false;
+
+        switch (getDxbcOpcode(p[0])) {
+            case DxbcOpcode::Discard:
+            case DxbcOpcode::DclUavTyped:
+            case DxbcOpcode::DclUavRaw:
+            case DxbcOpcode::DclUavStructured:
+            case DxbcOpcode::InterfaceCall:
+            case DxbcOpcode::DclInterface:
+                return false;
+
+            default:
+                break;
+        }
+
+        p += length;
+    }
+
+    return true;
+}
+
+
+bool isDxbcPrimitiveIdPixelShader(const void* pData, size_t Size) {
+    DxbcContainer container;
+
+    if (!container.parse(pData, Size))
+        return false;
+
+    auto* isgn = container.findChunk(DxbcTagIsgn);
+    DxbcSignature signature;
+
+    if (!isgn || !signature.parse(*isgn))
+        return false;
+
+    for (const auto& e : signature.elements()) {
+        if (e.systemValue == DxbcNamePrimitiveId)
+            return true;
+    }
+
+    return false;
+}
+
+}
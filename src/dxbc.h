@@ -0,0 +1,360 @@
+#ifndef DXBC_H
+#define DXBC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace atfix {
+
+constexpr uint32_t makeFourCC(char a, char b, char c, char d) {
+    return uint32_t(uint8_t(a))
+        | (uint32_t(uint8_t(b)) << 8)
+        | (uint32_t(uint8_t(c)) << 16)
+        | (uint32_t(uint8_t(d)) << 24);
+}
+
+constexpr uint32_t DxbcTagContainer = makeFourCC('D', 'X', 'B', 'C');
+constexpr uint32_t DxbcTagShdr      = makeFourCC('S', 'H', 'D', 'R');
+constexpr uint32_t DxbcTagShex      = makeFourCC('S', 'H', 'E', 'X');
+constexpr uint32_t DxbcTagIsgn      = makeFourCC('I', 'S', 'G', 'N');
+constexpr uint32_t DxbcTagOsgn      = makeFourCC('O', 'S', 'G', 'N');
+constexpr uint32_t DxbcTagRdef      = makeFourCC('R', 'D', 'E', 'F');
+
+
+/**
+ * \brief Computes the DXBC container checksum
+ *
+ * A variant of MD5 over everything after the checksum field,
+ * with a non-standard encoding of the message length.
+ * \param [in] pData Container data, starting with the magic
+ * \param [in] Size Total container size
+ * \param [out] pChecksum The four checksum words
+ */
+void computeDxbcChecksum(const void* pData, size_t Size, uint32_t pChecksum[4]);
+
+/**
+ * \brief Identifies a shader by its container checksum
+ *
+ * The compiler-generated checksum is already a content hash,
+ * so shaders do not need to be hashed again.
+ */
+Hash128 getDxbcHash(const void* pData, size_t Size);
+
+
+/**
+ * \brief DXBC container
+ *
+ * Holds copies of all chunks so that they can be replaced
+ * and the container rebuilt with a valid checksum.
+ */
+class DxbcContainer {
+
+public:
+
+    /**
+     * \brief Parses a container
+     * \returns \c false if the data is not a valid container
+     */
+    bool parse(const void* pData, size_t Size);
+
+    /** Returns the chunk with the given tag, or \c nullptr */
+    std::vector<uint8_t>* findChunk(uint32_t Tag);
+
+    const std::vector<uint8_t>* findChunk(uint32_t Tag) const;
+
+    /** Returns the shader code chunk, SHEX or SHDR */
+    std::vector<uint8_t>* findCodeChunk();
+
+    /** Builds the container and computes its checksum */
+    std::vector<uint8_t> serialize() const;
+
+private:
+
+    struct Chunk {
+        uint32_t              tag;
+        std::vector<uint8_t>  data;
+    };
+
+    std::vector<Chunk> m_chunks;
+
+};
+
+
+/** Shader token stream constants, see d3d11TokenizedProgramFormat.hpp */
+enum class DxbcOpcode : uint32_t {
+    Add                 = 0,
+    And                 = 1,
+    Break               = 2,
+    Breakc              = 3,
+    Call                = 4,
+    Callc               = 5,
+    Case                = 6,
+    Continue            = 7,
+    Continuec           = 8,
+    Default             = 10,
+    DerivRtx            = 11,
+    DerivRty            = 12,
+    Discard             = 13,
+    Div                 = 14,
+    Dp2                 = 15,
+    Dp3                 = 16,
+    Dp4                 = 17,
+    Else                = 18,
+    Endif               = 21,
+    Endloop             = 22,
+    Endswitch           = 23,
+    Eq                  = 24,
+    Exp                 = 25,
+    Frc                 = 26,
+    Ftoi                = 27,
+    Ftou                = 28,
+    Ge                  = 29,
+    Iadd                = 30,
+    If                  = 31,
+    Ieq                 = 32,
+    Ige                 = 33,
+    Ilt                 = 34,
+    Imad                = 35,
+    Imax                = 36,
+    Imin                = 37,
+    Imul                = 38,
+    Ine                 = 39,
+    Ineg                = 40,
+    Ishl                = 41,
+    Ishr                = 42,
+    Itof                = 43,
+    Label               = 44,
+    Ld                  = 45,
+    LdMs                = 46,
+    Log                 = 47,
+    Loop                = 48,
+    Lt                  = 49,
+    Mad                 = 50,
+    Min                 = 51,
+    Max                 = 52,
+    CustomData          = 53,
+    Mov                 = 54,
+    Movc                = 55,
+    Mul                 = 56,
+    Ne                  = 57,
+    Nop                 = 58,
+    Not                 = 59,
+    Or                  = 60,
+    Resinfo             = 61,
+    Ret                 = 62,
+    Retc                = 63,
+    RoundNe             = 64,
+    RoundNi             = 65,
+    RoundPi             = 66,
+    RoundZ              = 67,
+    Rsq                 = 68,
+    Sample              = 69,
+    SampleC             = 70,
+    SampleCLz           = 71,
+    SampleL             = 72,
+    SampleD             = 73,
+    SampleB             = 74,
+    Sqrt                = 75,
+    Switch              = 76,
+    Sincos              = 77,
+    Udiv                = 78,
+    Ult                 = 79,
+    Uge                 = 80,
+    Umul                = 81,
+    Umad                = 82,
+    Umax                = 83,
+    Umin                = 84,
+    Ushr                = 85,
+    Utof                = 86,
+    Xor                 = 87,
+    DclResource         = 88,
+    DclConstantBuffer   = 89,
+    DclInput            = 95,
+    DclInputSgv         = 96,
+    DclInputSiv         = 97,
+    DclInputPs          = 98,
+    DclInputPsSgv       = 99,
+    DclInputPsSiv       = 100,
+    DclOutput           = 101,
+    DclOutputSgv        = 102,
+    DclOutputSiv        = 103,
+    DclTemps            = 104,
+    DclIndexableTemp    = 105,
+    DclGlobalFlags      = 106,
+    Lod                 = 108,
+    Gather4             = 109,
+    SamplePos           = 110,
+    SampleInfo          = 111,
+    InterfaceCall       = 120,
+    Bufinfo             = 121,
+    DerivRtxCoarse      = 122,
+    DerivRtxFine        = 123,
+    DerivRtyCoarse      = 124,
+    DerivRtyFine        = 125,
+    Gather4C            = 126,
+    Gather4Po           = 127,
+    Gather4PoC          = 128,
+    Rcp                 = 129,
+    F32tof16            = 130,
+    F16tof32            = 131,
+    Countbits           = 134,
+    FirstbitHi          = 135,
+    FirstbitLo          = 136,
+    FirstbitShi         = 137,
+    Ubfe                = 138,
+    Ibfe                = 139,
+    Bfi                 = 140,
+    Bfrev               = 141,
+    Swapc               = 142,
+    DclStream           = 143,
+    DclFunctionBody     = 144,
+    DclFunctionTable    = 145,
+    DclInterface        = 146,
+    DclUavTyped         = 156,
+    DclUavRaw           = 157,
+    DclUavStructured    = 158,
+    DclResourceRaw      = 161,
+    DclResourceStructured = 162,
+    DclGsInstanceCount  = 206,
+};
+
+enum class DxbcOperandType : uint32_t {
+    Temp                = 0,
+    Input               = 1,
+    Output              = 2,
+    IndexableTemp       = 3,
+    Imm32               = 4,
+    Imm64               = 5,
+    Sampler             = 6,
+    Resource            = 7,
+    ConstantBuffer      = 8,
+    ImmediateConstantBuffer = 9,
+    OutputDepth         = 12,
+    Null                = 13,
+    OutputDepthGe       = 38,
+    OutputDepthLe       = 39,
+};
+
+enum class DxbcIndexType : uint32_t {
+    Imm32               = 0,
+    Imm64               = 1,
+    Relative            = 2,
+    Imm32Relative       = 3,
+    Imm64Relative       = 4,
+};
+
+constexpr uint32_t DxbcNamePrimitiveId  = 7u;
+constexpr uint32_t DxbcNameInstanceId   = 8u;
+constexpr uint32_t DxbcNameTarget       = 64u;
+constexpr uint32_t DxbcComponentUint32  = 1u;
+
+inline DxbcOpcode getDxbcOpcode(uint32_t Token) {
+    return DxbcOpcode(Token & 0x7ffu);
+}
+
+/** Instruction length in tokens, including the opcode token */
+inline uint32_t getDxbcInstructionLength(const uint32_t* pTokens) {
+    if (getDxbcOpcode(pTokens[0]) == DxbcOpcode::CustomData)
+        return pTokens[1];
+
+    return (pTokens[0] >> 24) & 0x7fu;
+}
+
+inline bool isDxbcDeclaration(DxbcOpcode Opcode) {
+    uint32_t op = uint32_t(Opcode);
+
+    return op == uint32_t(DxbcOpcode::CustomData)
+        || (op >= uint32_t(DxbcOpcode::DclResource) && op <= uint32_t(DxbcOpcode::DclGlobalFlags))
+        || (op >= uint32_t(DxbcOpcode::DclStream) && op <= uint32_t(DxbcOpcode::DclResourceStructured))
+        || op == uint32_t(DxbcOpcode::DclGsInstanceCount);
+}
+
+inline DxbcOperandType getDxbcOperandType(uint32_t Token) {
+    return DxbcOperandType((Token >> 12) & 0xffu);
+}
+
+inline uint32_t getDxbcIndexDimension(uint32_t Token) {
+    return (Token >> 20) & 0x3u;
+}
+
+inline DxbcIndexType getDxbcIndexType(uint32_t Token, uint32_t Dim) {
+    return DxbcIndexType((Token >> (22u + 3u * Dim)) & 0x7u);
+}
+
+/** Number of extended opcode tokens following an opcode token */
+uint32_t getDxbcOpcodeTokenCount(const uint32_t* pTokens, const uint32_t* pEnd);
+
+/**
+ * \brief Computes the length of an operand
+ * \returns Number of tokens, or 0 if the operand is malformed
+ */
+uint32_t getDxbcOperandLength(const uint32_t* pTokens, const uint32_t* pEnd);
+
+/**
+ * \brief Checks whether a pixel shader only produces color
+ *
+ * True if the shader has no effect besides its render target
+ * outputs: it does not discard, write depth, coverage or stencil
+ * reference, and declares no UAVs. Binding no pixel shader at all
+ * gives the same result for draws without render targets.
+ */
+bool isDxbcColorOnlyPixelShader(const void* pData, size_t Size);
+
+/**
+ * \brief Checks whether a pixel shader reads \c SV_PrimitiveID
+ *
+ * Primitive IDs count from the start of each draw, so such
+ * shaders tell apart draws that are otherwise identical.
+ */
+bool isDxbcPrimitiveIdPixelShader(const void* pData, size_t Size);
+
+/**
+ * \brief Input or output signature chunk
+ *
+ * Allows adding elements. Re-serializing an unmodified
+ * signature reproduces the compiler's layout.
+ */
+class DxbcSignature {
+
+public:
+
+    struct Element {
+        std::string name;
+        uint32_t semanticIndex;
+        uint32_t systemValue;
+        uint32_t componentType;
+        uint32_t registerIndex;
+        uint8_t  mask;
+        uint8_t  rwMask;
+    };
+
+    bool parse(const std::vector<uint8_t>& Chunk);
+
+    std::vector<uint8_t> serialize() const;
+
+    const std::vector<Element>& elements() const {
+        return m_elements;
+    }
+
+    void addElement(Element&& element) {
+        m_elements.push_back(std::move(element));
+    }
+
+    template<typename Pred>
+    void removeElements(const Pred& pred) {
+        std::erase_if(m_elements, pred);
+    }
+
+private:
+
+    std::vector<Element> m_elements;
+
+};
+
+}
+
+#endif
@@ -0,0 +1,646 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "blit.h"
+#include "config.h"
+#include "dynres.h"
+#include "formats.h"
+#include "impl.h"
+#include "shaders/upscale.hpp"
+
+namespace atfix {
+
+namespace {
+
+    /* {4f2c9a61-d83e-4b75-8a1c-6e0b93f7d245} */
+    const GUID DynamicResolutionTargetGuid = { 0x4f2c9a61, 0xd83e, 0x4b75, { 0x8a, 0x1c, 0x6e, 0x0b, 0x93, 0xf7, 0xd2, 0x45 } };
+
+    const char* g_colorRescaleShader = R"(
+cbuffer params : register(b0) { float2 uvScale; float2 uvMax; };
+Texture2D src : register(t0);
+SamplerState smp : register(s0);
+
+float4 main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+    return src.SampleLevel(smp, min(uv * uvScale, uvMax), 0.0f);
+}
+)";
+
+    const char* g_depthRescaleShader = R"(
+cbuffer params : register(b0) { float2 uvScale; float2 uvMax; };
+Texture2D<float> src : register(t0);
+SamplerState smp : register(s0);
+
+float main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Depth {
+    return src.SampleLevel(smp, min(uv * uvScale, uvMax), 0.0f);
+}
+)";
+
+    /** Number of tagged textures whose contents are not at full size */
+    std::atomic<uint32_t> g_scaledTargetCount = { 0u };
+
+    /**
+     * \brief Dynamic resolution state of a tagged texture
+     *
+     * Attached to the texture as private data, so that it lives as
+     * long as the texture does. Only used on the immediate context.
+     * Views are created when needed, since cached ones would keep
+     * the texture alive.
+     */
+    class DynamicResolutionTarget final : public IUnknown {
+
+    public:
+
+        DynamicResolutionTarget(const D3D11_TEXTURE2D_DESC& Desc)
+        : desc(Desc) {
+            isDepth = getDepthFormats(Desc.Format, &depthFormats);
+        }
+
+        ~DynamicResolutionTarget() {
+            if (contentScale != 1.0f)
+                g_scaledTargetCount -= 1u;
+        }
+
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) {
+            if (!ppvObject)
+                return E_POINTER;
+
+            *ppvObject = nullptr;
+
+            if (riid != __uuidof(IUnknown))
+                return E_NOINTERFACE;
+
+            AddRef();
+            *ppvObject = this;
+            return S_OK;
+        }
+
+        ULONG STDMETHODCALLTYPE AddRef() {
+            return ++m_refs;
+        }
+
+        ULONG STDMETHODCALLTYPE Release() {
+            ULONG refs = --m_refs;
+
+            if (!refs)
+                delete this;
+
+            return refs;
+        }
+
+        void setContentScale(float Scale) {
+            if ((contentScale != 1.0f) != (Scale != 1.0f)) {
+                if (Scale != 1.0f)
+                    g_scaledTargetCount += 1u;
+                else
+                    g_scaledTargetCount -= 1u;
+            }
+
+            contentScale = Scale;
+        }
+
+        D3D11_TEXTURE2D_DESC  desc;
+        bool                  isDepth       = false;
+        DepthFormats          depthFormats  = { };
+        DXGI_FORMAT           viewFormat    = DXGI_FORMAT_UNKNOWN;  /**< Render target view format */
+        float                 contentScale  = 1.0f;
+
+    private:
+
+        std::atomic<ULONG>    m_refs = { 1u };
+
+    };
+
+    /**
+     * \brief Copy of a target's contents to read from while rescaling
+     *
+     * Renderable ones hold the upscaled image before sharpening.
+     */
+    struct ScratchTexture {
+        ID3D11Texture2D*          texture = nullptr;
+        ID3D11ShaderResourceView* view    = nullptr;
+        ID3D11RenderTargetView*   rtv     = nullptr;
+        UINT                      width   = 0u;
+        UINT                      height  = 0u;
+        DXGI_FORMAT               format  = DXGI_FORMAT_UNKNOWN;
+        DXGI_FORMAT               viewFormat = DXGI_FORMAT_UNKNOWN;
+    };
+
+    /** Tagged texture of the current binding, with the scale it renders at */
+    struct BoundTarget {
+        ID3D11Texture2D*          texture;
+        DynamicResolutionTarget*  target;
+        float                     scale;
+    };
+
+    ID3D11Device*           g_device = nullptr;
+    bool                    g_enabled = false;
+    BlitPass                g_blit;
+    ID3D11PixelShader*      g_colorShader = nullptr;
+    ID3D11PixelShader*      g_depthShader = nullptr;
+    ID3D11PixelShader*      g_upscaleShader = nullptr;
+    ID3D11PixelShader*      g_sharpenShader = nullptr;
+
+    /** Shared between targets, rescales never overlap */
+    std::vector<ScratchTexture> g_scratchTextures;
+
+    /** Targets of the current binding, only touched on the immediate context */
+    std::vector<BoundTarget> g_boundTargets;
+
+    /** Whether any bound target's contents are at a different scale */
+    bool g_rescalePending = false;
+
+    /** Scale for the next binding of tagged targets, changes between frames */
+    float g_scale = 1.0f;
+
+    std::chrono::steady_clock::time_point g_lastPresent;
+    std::chrono::steady_clock::duration g_frameTime = { };
+    std::chrono::steady_clock::duration g_presentTime = { };
+    uint32_t g_frameCount = 0u;
+
+    /** Looks up the tag of a texture, without a reference */
+    DynamicResolutionTarget* getTarget(ID3D11Resource* pResource) {
+        IUnknown* data = nullptr;
+        UINT dataSize = sizeof(data);
+
+        if (!pResource || FAILED(pResource->GetPrivateData(DynamicResolutionTargetGuid, &dataSize, &data)) || !data)
+            return nullptr;
+
+        /* The texture holds on to it */
+        data->Release();
+        return static_cast<DynamicResolutionTarget*>(data);
+    }
+
+    /** Looks up the texture and tag of a view, without references */
+    DynamicResolutionTarget* getViewTarget(ID3D11View* pView, ID3D11Texture2D** ppTexture) {
+        if (!pView)
+            return nullptr;
+
+        ID3D11Resource* resource = nullptr;
+        pView->GetResource(&resource);
+
+        /* Bound views keep their resource alive */
+        resource->Release();
+
+        auto* target = getTarget(resource);
+
+        if (target && ppTexture)
+            *ppTexture = static_cast<ID3D11Texture2D*>(resource);
+
+        return target;
+    }
+
+    bool getScratchTexture(const DynamicResolutionTarget& Target, bool Renderable, ScratchTexture* pScratch) {
+        UINT width = Target.desc.Width;
+        UINT height = Target.desc.Height;
+        DXGI_FORMAT format = Target.isDepth ? Target.depthFormats.typeless : Target.desc.Format;
+        DXGI_FORMAT viewFormat = Target.isDepth ? Target.depthFormats.srv : Target.viewFormat;
+
+        for (const auto& s : g_scratchTextures) {
+            if (s.width == width && s.height == height && s.format == format
+             && s.viewFormat == viewFormat && (s.rtv != nullptr) == Renderable) {
+                *pScratch = s;
+                return true;
+            }
+        }
+
+        /* Textures for an old screen size are no longer needed */
+        auto end = std::remove_if(g_scratchTextures.begin(), g_scratchTextures.end(), [&] (const ScratchTexture& s) {
+            if (s.width == width && s.height == height)
+                return false;
+
+            if (s.rtv)
+                s.rtv->Release();
+
+            s.view->Release();
+            s.texture->Release();
+            return true;
+        });
+
+        g_scratchTextures.erase(end, g_scratchTextures.end());
+
+        ScratchTexture scratch;
+        scratch.width = width;
+        scratch.height = height;
+        scratch.format = format;
+        scratch.viewFormat = viewFormat;
+
+        D3D11_TEXTURE2D_DESC desc = Target.desc;
+        desc.Format = format;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | (Renderable ? UINT(D3D11_BIND_RENDER_TARGET) : 0u);
+        desc.CPUAccessFlags = 0u;
+        desc.MiscFlags = 0u;
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = { };
+        viewDesc.Format = viewFormat;
+        viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+        viewDesc.Texture2D.MipLevels = 1u;
+
+        D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = { };
+        rtvDesc.Format = viewFormat;
+        rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+
+        /* Skip the hook, these must not be tagged or remapped themselves */
+        if (FAILED(getDeviceProcs(g_device)->CreateTexture2D(g_device, &desc, nullptr, &scratch.texture)))
+            return false;
+
+        if (FAILED(g_device->CreateShaderResourceView(scratch.texture, &viewDesc, &scratch.view))) {
+            scratch.texture->Release();
+            return false;
+        }
+
+        if (Renderable && FAILED(g_device->CreateRenderTargetView(scratch.texture, &rtvDesc, &scratch.rtv))) {
+            scratch.view->Release();
+            scratch.texture->Release();
+            return false;
+        }
+
+        g_scratchTextures.push_back(scratch);
+        *pScratch = scratch;
+        return true;
+    }
+
+    /**
+     * \brief Scales the contents of a tagged texture
+     *
+     * Copies the valid region, then draws it to the new region.
+     * Colour is upscaled with the edge-adaptive pass and sharpened
+     * if those are enabled, otherwise filtered bilinearly.
+     * Stencil contents do not survive this.
+     */
+    void rescaleTarget(
+            ID3D11DeviceContext*        pContext,
+            ID3D11Texture2D*            pTexture,
+            DynamicResolutionTarget*    pTarget,
+            float                       Scale) {
+        const auto* procs = getContextProcs(pContext);
+        float from = pTarget->contentScale;
+
+        if (from == Scale)
+            return;
+
+        /* Contents are lost if this fails, but rendering goes on at the right scale */
+        pTarget->setContentScale(Scale);
+
+        if (!pTarget->isDepth && !pTarget->viewFormat)
+            return;
+
+        ScratchTexture scratch;
+
+        if (!getScratchTexture(*pTarget, false, &scratch))
+            return;
+
+        float w = float(pTarget->desc.Width);
+        float h = float(pTarget->desc.Height);
+
+        BlitArgs args;
+        args.ps = pTarget->isDepth ? g_depthShader : g_colorShader;
+        args.srv = scratch.view;
+        args.viewport = { 0.0f, 0.0f, w * Scale, h * Scale, 0.0f, 1.0f };
+        args.linear = !pTarget->isDepth;
+        args.constants[0] = from;
+        args.constants[1] = from;
+        args.constants[2] = (w * from - 0.5f) / w;
+        args.constants[3] = (h * from - 0.5f) / h;
+        args.constants[4] = w;
+        args.constants[5] = h;
+        args.constants[6] = float(g_config.dynresSharpness) / 100.0f;
+
+        bool upscale = !pTarget->isDepth && Scale > from && g_upscaleShader;
+
+        if (upscale)
+            args.ps = g_upscaleShader;
+
+        HRESULT hr;
+
+        if (pTarget->isDepth) {
+            /* Depth formats only allow whole-resource copies */
+            procs->CopyResource(pContext, scratch.texture, pTexture);
+
+            D3D11_DEPTH_STENCIL_VIEW_DESC viewDesc = { };
+            viewDesc.Format = pTarget->depthFormats.dsv;
+            viewDesc.ViewDimension = D3D11_DSV_DIMENSION_TEXTURE2D;
+
+            hr = g_device->CreateDepthStencilView(pTexture, &viewDesc, &args.dsv);
+        } else {
+            D3D11_BOX box = { 0u, 0u, 0u,
+                std::min(UINT(std::ceil(w * from)), pTarget->desc.Width),
+                std::min(UINT(std::ceil(h * from)), pTarget->desc.Height), 1u };
+
+            procs->CopySubresourceRegion(pContext, scratch.texture, 0u, 0u, 0u, 0u, pTexture, 0u, &box);
+
+            D3D11_RENDER_TARGET_VIEW_DESC viewDesc = { };
+            viewDesc.Format = pTarget->viewFormat;
+            viewDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+
+            hr = g_device->CreateRenderTargetView(pTexture, &viewDesc, &args.rtv);
+        }
+
+        if (FAILED(hr))
+            return;
+
+        ScratchTexture upscaled;
+
+        /* Sharpening reads neighbouring output pixels, so it needs a pass of its own */
+        if (upscale && g_sharpenShader && getScratchTexture(*pTarget, true, &upscaled)) {
+            BlitArgs upscaleArgs = args;
+            upscaleArgs.rtv = upscaled.rtv;
+            g_blit.run(pContext, upscaleArgs);
+
+            args.ps = g_sharpenShader;
+            args.srv = upscaled.view;
+            args.constants[4] = w * Scale;
+            args.constants[5] = h * Scale;
+        }
+
+        g_blit.run(pContext, args);
+
+        if (args.rtv)
+            args.rtv->Release();
+
+        if (args.dsv)
+            args.dsv->Release();
+    }
+
+    /** Scales a texture back to full size, to be read or copied */
+    void resolveTarget(
+            ID3D11DeviceContext*        pContext,
+            ID3D11Texture2D*            pTexture,
+            DynamicResolutionTarget*    pTarget) {
+        if (pTarget->contentScale == 1.0f)
+            return;
+
+        rescaleTarget(pContext, pTexture, pTarget, 1.0f);
+
+        /* Scaled passes still bound to it need the scaled contents back */
+        for (const auto& b : g_boundTargets)
+            g_rescalePending |= b.target == pTarget && b.scale != 1.0f;
+    }
+
+}
+
+
+void initDynamicResolution(ID3D11Device* pDevice) {
+    if (!g_config.dynamicResolution)
+        return;
+
+    g_device = pDevice;
+
+    if (!g_blit.init(pDevice)
+     || !(g_colorShader = g_blit.createPixelShader(g_colorRescaleShader))
+     || !(g_depthShader = g_blit.createPixelShader(g_depthRescaleShader))) {
+#ifndef NDEBUG
+        log("DynRes: Failed to create rescale passes, disabling");
+#endif
+        return;
+    }
+
+    if (g_config.dynresUpscaler) {
+        g_upscaleShader = g_blit.createPixelShader(upscaleShader);
+
+        if (g_upscaleShader && g_config.dynresSharpness)
+            g_sharpenShader = g_blit.createPixelShader(sharpenShader);
+
+#ifndef NDEBUG
+        if (!g_upscaleShader)
+            log("DynRes: Failed to create upscale pass, using bilinear filtering");
+#endif
+    }
+
+    g_scale = float(g_config.dynresMaxScale) / 100.0f;
+    g_enabled = true;
+}
+
+
+bool isDynamicResolutionEnabled() {
+    return g_enabled;
+}
+
+
+void registerDynamicResolutionTarget(ID3D11Texture2D* pTexture, const D3D11_TEXTURE2D_DESC* pDesc) {
+    if (!g_enabled || !pTexture || !pDesc
+     || pDesc->Usage != D3D11_USAGE_DEFAULT
+     || !(pDesc->BindFlags & (D3D11_BIND_RENDER_TARGET | D3D11_BIND_DEPTH_STENCIL))
+     || pDesc->MipLevels != 1u || pDesc->ArraySize != 1u || pDesc->SampleDesc.Count != 1u
+     || !isScreenSize(pDesc->Width, pDesc->Height))
+        return;
+
+    /* Use the actual format, the texture may have been remapped */
+    D3D11_TEXTURE2D_DESC desc;
+    pTexture->GetDesc(&desc);
+
+    DepthFormats depthFormats;
+
+    if ((desc.BindFlags & D3D11_BIND_DEPTH_STENCIL) && !getDepthFormats(desc.Format, &depthFormats))
+        return;
+
+    auto* target = new DynamicResolutionTarget(desc);
+    pTexture->SetPrivateDataInterface(DynamicResolutionTargetGuid, target);
+    target->Release();
+
+#ifndef NDEBUG
+    log("DynRes: Tagged ", desc.Width, "x", desc.Height, " texture, format ", desc.Format);
+#endif
+}
+
+
+float bindDynamicResolutionTargets(
+        UINT                        NumViews,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView*     pDepthStencilView) {
+    g_boundTargets.clear();
+    g_rescalePending = false;
+
+    if (!g_enabled)
+        return 1.0f;
+
+    std::array<BoundTarget, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT + 1u> targets;
+    uint32_t targetCount = 0u;
+
+    /* Passes without depth are usually post-processing, which stays at full size */
+    bool scaled = pDepthStencilView != nullptr;
+
+    for (uint32_t i = 0; i < NumViews && ppRenderTargetViews && i < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; i++) {
+        if (!ppRenderTargetViews[i])
+            continue;
+
+        ID3D11Texture2D* texture = nullptr;
+        auto* target = getViewTarget(ppRenderTargetViews[i], &texture);
+
+        if (!target) {
+            scaled = false;
+            continue;
+        }
+
+        if (!target->viewFormat) {
+            D3D11_RENDER_TARGET_VIEW_DESC desc = { };
+            ppRenderTargetViews[i]->GetDesc(&desc);
+            target->viewFormat = desc.Format;
+        }
+
+        targets[targetCount++] = { texture, target, 1.0f };
+    }
+
+    if (pDepthStencilView) {
+        ID3D11Texture2D* texture = nullptr;
+
+        if (auto* target = getViewTarget(pDepthStencilView, &texture))
+            targets[targetCount++] = { texture, target, 1.0f };
+        else
+            scaled = false;
+    }
+
+    float scale = scaled ? g_scale : 1.0f;
+
+    for (uint32_t i = 0; i < targetCount; i++) {
+        targets[i].scale = scale;
+        g_rescalePending |= targets[i].target->contentScale != scale;
+        g_boundTargets.push_back(targets[i]);
+    }
+
+    return scale;
+}
+
+
+bool hasPendingRescales() {
+    return g_rescalePending;
+}
+
+
+void applyPendingRescales(ID3D11DeviceContext* pContext) {
+    for (const auto& b : g_boundTargets)
+        rescaleTarget(pContext, b.texture, b.target, b.scale);
+
+    g_rescalePending = false;
+}
+
+
+void clearDynamicResolutionView(ID3D11View* pView, UINT ClearFlags) {
+    if (!g_rescalePending)
+        return;
+
+    auto* target = getViewTarget(pView, nullptr);
+
+    auto entry = std::find_if(g_boundTargets.begin(), g_boundTargets.end(),
+        [target] (const BoundTarget& b) { return b.target == target; });
+
+    if (!target || entry == g_boundTargets.end())
+        return;
+
+    /* Only a clear that overwrites everything makes the old contents irrelevant */
+    if (target->isDepth) {
+        bool stencil = target->depthFormats.dsv != DXGI_FORMAT_D32_FLOAT
+                    && target->depthFormats.dsv != DXGI_FORMAT_D16_UNORM;
+
+        if (!(ClearFlags & D3D11_CLEAR_DEPTH) || (stencil && !(ClearFlags & D3D11_CLEAR_STENCIL)))
+            return;
+    }
+
+    target->setContentScale(entry->scale);
+
+    g_rescalePending = std::any_of(g_boundTargets.begin(), g_boundTargets.end(),
+        [] (const BoundTarget& b) { return b.target->contentScale != b.scale; });
+}
+
+
+void resolveDynamicResolutionViews(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    if (!g_scaledTargetCount || !ppShaderResourceViews)
+        return;
+
+    for (uint32_t i = 0; i < NumViews; i++) {
+        ID3D11Texture2D* texture = nullptr;
+
+        if (auto* target = getViewTarget(ppShaderResourceViews[i], &texture))
+            resolveTarget(pContext, texture, target);
+    }
+}
+
+
+void resolveDynamicResolutionResource(ID3D11DeviceContext* pContext, ID3D11Resource* pResource) {
+    if (!g_scaledTargetCount)
+        return;
+
+    D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+
+    if (pResource)
+        pResource->GetType(&dimension);
+
+    if (dimension != D3D11_RESOURCE_DIMENSION_TEXTURE2D)
+        return;
+
+    if (auto* target = getTarget(pResource))
+        resolveTarget(pContext, static_cast<ID3D11Texture2D*>(pResource), target);
+}
+
+
+void resetDynamicResolutionBindings() {
+    g_boundTargets.clear();
+    g_rescalePending = false;
+}
+
+
+void endDynamicResolutionFrame(std::chrono::steady_clock::duration PresentTime) {
+    /* Adapt over a few frames, single frames are too noisy */
+    constexpr uint32_t Interval = 8u;
+    constexpr float MaxStepDown = 0.1f;
+    constexpr float MaxStepUp = 0.05f;
+    constexpr float Hysteresis = 0.02f;
+
+    auto now = std::chrono::steady_clock::now();
+    auto last = std::exchange(g_lastPresent, now);
+
+    if (last == std::chrono::steady_clock::time_point())
+        return;
+
+    g_frameTime += now - last;
+    g_presentTime += PresentTime;
+
+    if (++g_frameCount < Interval)
+        return;
+
+    float frameUs = float(std::chrono::duration_cast<std::chrono::microseconds>(g_frameTime).count()) / float(Interval);
+    float presentUs = float(std::chrono::duration_cast<std::chrono::microseconds>(g_presentTime).count()) / float(Interval);
+
+    g_frameTime = { };
+    g_presentTime = { };
+    g_frameCount = 0u;
+
+    if (frameUs <= 0.0f)
+        return;
+
+    /* Pixel cost goes with the area, so correct the scale by the root */
+    float desired = g_scale * std::sqrt(float(g_config.dynresFrameTimeUs) / frameUs);
+
+    /* Fewer pixels only help if the CPU waits for the GPU in Present */
+    bool gpuBound = presentUs * 4.0f >= frameUs;
+
+    if (!gpuBound)
+        desired = std::max(desired, g_scale);
+
+    float step = std::clamp(desired - g_scale, -MaxStepDown, MaxStepUp);
+
+    if (std::abs(step) < Hysteresis)
+        return;
+
+    float minScale = float(g_config.dynresMinScale) / 100.0f;
+    float maxScale = float(g_config.dynresMaxScale) / 100.0f;
+    float scale = std::clamp(std::round((g_scale + step) * 100.0f) / 100.0f, minScale, maxScale);
+
+    if (scale == g_scale)
+        return;
+
+#ifndef NDEBUG
+    log("DynRes: Scale ", g_scale, " -> ", scale, ", frame ", frameUs, " us, present ", presentUs, " us");
+#endif
+
+    g_scale = scale;
+}
+
+}
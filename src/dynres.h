@@ -0,0 +1,78 @@
+#ifndef DYNRES_H
+#define DYNRES_H
+
+#include <chrono>
+#include <cstdint>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Sets up dynamic resolution
+ *
+ * Disables the feature if the full-screen passes it relies
+ * on cannot be created.
+ */
+void initDynamicResolution(ID3D11Device* pDevice);
+
+/** Checks whether dynamic resolution is active */
+bool isDynamicResolutionEnabled();
+
+/**
+ * \brief Tags a new screen-sized render target or depth buffer
+ *
+ * Tagged textures keep their full size. Scene passes render to a
+ * scaled region of them, which is scaled back to full size before
+ * anything reads the texture.
+ */
+void registerDynamicResolutionTarget(ID3D11Texture2D* pTexture, const D3D11_TEXTURE2D_DESC* pDesc);
+
+/**
+ * \brief Handles a render target binding
+ *
+ * Passes binding a tagged depth buffer, and only tagged render
+ * targets, render at the current scale. Targets whose contents
+ * are at a different scale get rescaled before the next draw.
+ * \returns Factor to scale viewports and scissor rects with
+ */
+float bindDynamicResolutionTargets(
+        UINT                        NumViews,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView*     pDepthStencilView);
+
+/** Checks whether targets need rescaling before the next draw */
+bool hasPendingRescales();
+
+/** Rescales the bound targets, called before a draw */
+void applyPendingRescales(ID3D11DeviceContext* pContext);
+
+/**
+ * \brief Drops the pending rescale of a target that gets cleared
+ * \param [in] ClearFlags Depth and stencil flags, ignored for
+ *    render target views
+ */
+void clearDynamicResolutionView(ID3D11View* pView, UINT ClearFlags);
+
+/** Scales views of tagged textures back to full size before they are read */
+void resolveDynamicResolutionViews(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews);
+
+/** Scales a tagged texture back to full size before it is copied */
+void resolveDynamicResolutionResource(ID3D11DeviceContext* pContext, ID3D11Resource* pResource);
+
+/** Forgets the current binding after the context state was reset */
+void resetDynamicResolutionBindings();
+
+/**
+ * \brief Updates the scale from the last frame's timing
+ * \param [in] PresentTime Time spent in Present, which is
+ *    long when the GPU is the bottleneck
+ */
+void endDynamicResolutionFrame(std::chrono::steady_clock::duration PresentTime);
+
+}
+
+#endif
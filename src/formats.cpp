@@ -0,0 +1,174 @@
+#include <array>
+#include <atomic>
+
+#include "config.h"
+#include "formats.h"
+#include "impl.h"
+
+namespace atfix {
+
+namespace {
+
+    struct FormatMapping {
+        DXGI_FORMAT   from;
+        DXGI_FORMAT   to;
+    };
+
+    /**
+     * \brief Set of formats replaced together
+     *
+     * Textures must have one of the texture formats and all of the
+     * required bind flags. Views of them use the view formats.
+     */
+    struct FormatPolicy {
+        const char*                   name;
+        UINT                          bindFlags;
+        std::array<FormatMapping, 2>  textureFormats;
+        std::array<FormatMapping, 3>  viewFormats;
+    };
+
+    const std::array<FormatPolicy, 2> g_formatPolicies = {{
+        /* Drops alpha and the sign bit, only for targets that need neither */
+        { "hdr", D3D11_BIND_RENDER_TARGET,
+          {{ { DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_R11G11B10_FLOAT } }},
+          {{ { DXGI_FORMAT_R16G16B16A16_FLOAT, DXGI_FORMAT_R11G11B10_FLOAT } }} },
+
+        /* Drops depth precision, from 32-bit float to 24-bit unorm */
+        { "depth", D3D11_BIND_DEPTH_STENCIL,
+          {{ { DXGI_FORMAT_R32G8X24_TYPELESS,         DXGI_FORMAT_R24G8_TYPELESS },
+             { DXGI_FORMAT_D32_FLOAT_S8X24_UINT,      DXGI_FORMAT_D24_UNORM_S8_UINT } }},
+          {{ { DXGI_FORMAT_D32_FLOAT_S8X24_UINT,      DXGI_FORMAT_D24_UNORM_S8_UINT },
+             { DXGI_FORMAT_R32_FLOAT_X8X24_TYPELESS,  DXGI_FORMAT_R24_UNORM_X8_TYPELESS },
+             { DXGI_FORMAT_X32_TYPELESS_G8X24_UINT,   DXGI_FORMAT_X24_TYPELESS_G8_UINT } }} },
+    }};
+
+    /* {0b8e5f2a-93c4-4d1e-a6b7-51c2d8e4f903} */
+    const GUID RemappedTextureGuid = { 0x0b8e5f2a, 0x93c4, 0x4d1e, { 0xa6, 0xb7, 0x51, 0xc2, 0xd8, 0xe4, 0xf9, 0x03 } };
+
+    std::atomic<uint64_t> g_screenSize = { 0u };
+
+    DXGI_FORMAT findMapping(const FormatMapping* pBegin, const FormatMapping* pEnd, DXGI_FORMAT Format) {
+        for (auto* m = pBegin; m != pEnd; m++) {
+            if (m->from == Format && m->from != DXGI_FORMAT_UNKNOWN)
+                return m->to;
+        }
+
+        return DXGI_FORMAT_UNKNOWN;
+    }
+
+}
+
+
+bool getDepthFormats(DXGI_FORMAT Format, DepthFormats* pFormats) {
+    switch (Format) {
+        case DXGI_FORMAT_R32_TYPELESS:
+        case DXGI_FORMAT_D32_FLOAT:
+            *pFormats = { DXGI_FORMAT_R32_TYPELESS, DXGI_FORMAT_R32_FLOAT, DXGI_FORMAT_D32_FLOAT };
+            return true;
+
+        case DXGI_FORMAT_R24G8_TYPELESS:
+        case DXGI_FORMAT_D24_UNORM_S8_UINT:
+            *pFormats = { DXGI_FORMAT_R24G8_TYPELESS, DXGI_FORMAT_R24_UNORM_X8_TYPELESS, DXGI_FORMAT_D24_UNORM_S8_UINT };
+            return true;
+
+        case DXGI_FORMAT_R32G8X24_TYPELESS:
+        case DXGI_FORMAT_D32_FLOAT_S8X24_UINT:
+            *pFormats = { DXGI_FORMAT_R32G8X24_TYPELESS, DXGI_FORMAT_R32_FLOAT_X8X24_TYPELESS, DXGI_FORMAT_D32_FLOAT_S8X24_UINT };
+            return true;
+
+        case DXGI_FORMAT_R16_TYPELESS:
+        case DXGI_FORMAT_D16_UNORM:
+            *pFormats = { DXGI_FORMAT_R16_TYPELESS, DXGI_FORMAT_R16_UNORM, DXGI_FORMAT_D16_UNORM };
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+uint32_t findFormatPolicy(const std::string& Name) {
+    for (uint32_t i = 0; i < g_formatPolicies.size(); i++) {
+        if (Name == g_formatPolicies[i].name)
+            return 1u << i;
+    }
+
+    return 0u;
+}
+
+
+void setScreenSize(UINT Width, UINT Height) {
+    g_screenSize = (uint64_t(Width) << 32) | Height;
+
+#ifndef NDEBUG
+    log("Formats: Screen size ", Width, "x", Height);
+#endif
+}
+
+
+bool isScreenSize(UINT Width, UINT Height) {
+    return ((uint64_t(Width) << 32) | Height) == g_screenSize;
+}
+
+
+bool tryCreateRemappedTexture(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Texture2D**         ppTexture,
+        HRESULT*                  pResult) {
+    const auto* procs = getDeviceProcs(pDevice);
+
+    if (!g_config.formatPolicies || !pDesc || pInitialData
+     || pDesc->Usage != D3D11_USAGE_DEFAULT
+     || (pDesc->BindFlags & D3D11_BIND_UNORDERED_ACCESS)
+     || !isScreenSize(pDesc->Width, pDesc->Height))
+        return false;
+
+    for (uint32_t i = 0; i < g_formatPolicies.size(); i++) {
+        const auto& policy = g_formatPolicies[i];
+
+        if (!(g_config.formatPolicies & (1u << i)) || (pDesc->BindFlags & policy.bindFlags) != policy.bindFlags)
+            continue;
+
+        DXGI_FORMAT format = findMapping(policy.textureFormats.data(),
+            policy.textureFormats.data() + policy.textureFormats.size(), pDesc->Format);
+
+        if (!format)
+            continue;
+
+        D3D11_TEXTURE2D_DESC desc = *pDesc;
+        desc.Format = format;
+
+        *pResult = procs->CreateTexture2D(pDevice, &desc, nullptr, ppTexture);
+
+        if (SUCCEEDED(*pResult) && ppTexture && *ppTexture) {
+            uint32_t index = i;
+            (*ppTexture)->SetPrivateData(RemappedTextureGuid, sizeof(index), &index);
+
+#ifndef NDEBUG
+            log("Formats: Created ", desc.Width, "x", desc.Height, " texture as ", desc.Format, " instead of ", pDesc->Format);
+#endif
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+
+DXGI_FORMAT getRemappedViewFormat(ID3D11Resource* pResource, DXGI_FORMAT Format) {
+    uint32_t index = 0u;
+    UINT dataSize = sizeof(index);
+
+    if (!pResource || !Format || FAILED(pResource->GetPrivateData(RemappedTextureGuid, &dataSize, &index))
+     || index >= g_formatPolicies.size())
+        return Format;
+
+    const auto& views = g_formatPolicies[index].viewFormats;
+    DXGI_FORMAT format = findMapping(views.data(), views.data() + views.size(), Format);
+    return format ? format : Format;
+}
+
+}
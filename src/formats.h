@@ -0,0 +1,59 @@
+#ifndef FORMATS_H
+#define FORMATS_H
+
+#include <cstdint>
+#include <string>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/** Formats to copy, read and write a depth buffer with */
+struct DepthFormats {
+    DXGI_FORMAT   typeless;
+    DXGI_FORMAT   srv;
+    DXGI_FORMAT   dsv;
+};
+
+/**
+ * \brief Looks up the related formats of a depth format
+ * \returns \c false if the format is not a depth format
+ */
+bool getDepthFormats(DXGI_FORMAT Format, DepthFormats* pFormats);
+
+/**
+ * \brief Looks up a format remapping policy by name
+ * \returns Policy bit, or 0 if the name is unknown
+ */
+uint32_t findFormatPolicy(const std::string& Name);
+
+/** Sets the back buffer size that remapped render targets must match */
+void setScreenSize(UINT Width, UINT Height);
+
+/** Checks whether a texture matches the back buffer size */
+bool isScreenSize(UINT Width, UINT Height);
+
+/**
+ * \brief Creates screen-sized render targets in a cheaper format
+ *
+ * Only applies to formats covered by an enabled policy. The texture
+ * remembers its policy so that view formats can be fixed up.
+ * \returns \c true if the texture was handled, with the
+ *    result in \c pResult
+ */
+bool tryCreateRemappedTexture(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Texture2D**         ppTexture,
+        HRESULT*                  pResult);
+
+/**
+ * \brief Translates a view format for a remapped texture
+ * \returns The format to create the view with
+ */
+DXGI_FORMAT getRemappedViewFormat(ID3D11Resource* pResource, DXGI_FORMAT Format);
+
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <immintrin.h>
+
+namespace atfix {
+
+/**
+ * \brief 128-bit content hash
+ */
+struct Hash128 {
+    uint64_t lo = 0u;
+    uint64_t hi = 0u;
+
+    bool operator == (const Hash128&) const = default;
+};
+
+struct Hash128Hasher {
+    size_t operator () (const Hash128& h) const {
+        return size_t(h.lo);
+    }
+};
+
+namespace detail {
+
+    constexpr uint64_t HashPrime64_1 = 0x9E3779B185EBCA87ull;
+    constexpr uint64_t HashPrime64_2 = 0xC2B2AE3D27D4EB4Full;
+    constexpr uint32_t HashPrime32_1 = 0x9E3779B1u;
+
+    alignas(16) constexpr uint32_t HashSecret[24] = {
+        0xbe4ba423u, 0x396cfeb8u, 0x1cad21f7u, 0x2e92d10cu,
+        0xf9b72e9fu, 0x4ae3c53du, 0xcf1f7d7eu, 0x47a9a7dfu,
+        0xa7c1f5b2u, 0x0ab8ed21u, 0x62a94c0cu, 0x63c1e35du,
+        0xd0a9b6e1u, 0x7c3e14a6u, 0x5a6e0e01u, 0xb1f4e50bu,
+        0x8d0a3b9eu, 0x29c6ac9fu, 0xe4a5f7b3u, 0x1d5f3c27u,
+        0x3a07bd4fu, 0xf2d1c853u, 0x6e4b90c5u, 0x954f26a1u,
+    };
+
+    /* Accumulates one 64-byte stripe into eight 64-bit lanes */
+    inline void hashStripe(__m128i acc[4], const uint8_t* pData, const uint32_t* pSecret) {
+        for (uint32_t i = 0; i < 4; i++) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData) + i);
+            __m128i key  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSecret) + i);
+            __m128i dk   = _mm_xor_si128(data, key);
+            __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(2, 3, 0, 1)));
+            acc[i] = _mm_add_epi64(acc[i], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc[i] = _mm_add_epi64(acc[i], prod);
+        }
+    }
+
+    inline void hashScramble(__m128i acc[4]) {
+        const __m128i prime = _mm_set1_epi32(int32_t(HashPrime32_1));
+
+        for (uint32_t i = 0; i < 4; i++) {
+            __m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(HashSecret + 8) + i);
+            __m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+            a = _mm_xor_si128(a, key);
+
+            __m128i lo = _mm_mul_epu32(a, prime);
+            __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+            acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+    }
+
+    inline uint64_t hashMix(uint64_t a, uint64_t b) {
+        unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+        return uint64_t(p) ^ uint64_t(p >> 64);
+    }
+
+    inline uint64_t hashAvalanche(uint64_t h) {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ull;
+        return h ^ (h >> 32);
+    }
+
+}
+
+/**
+ * \brief Hashes a block of memory
+ *
+ * SSE2 stripe hash in the spirit of XXH3: eight 64-bit lanes
+ * consume 64 bytes per iteration and are scrambled every kilobyte.
+ * Fast enough to run over every immutable buffer and shader blob
+ * at creation time, and wide enough that accidental collisions
+ * are not a concern.
+ */
+inline Hash128 hashData(const void* pData, size_t Size) {
+    using namespace detail;
+
+    const auto* bytes = static_cast<const uint8_t*>(pData);
+
+    __m128i acc[4] = {
+        _mm_set_epi64x(int64_t(HashPrime64_1), int64_t(Size)),
+        _mm_set_epi64x(int64_t(HashPrime64_2), int64_t(~Size)),
+        _mm_set_epi64x(int64_t(HashPrime64_1 ^ HashPrime64_2), 0),
+        _mm_set_epi64x(int64_t(HashPrime32_1), int64_t(HashPrime64_1 + Size)),
+    };
+
+    size_t offset = 0u;
+    uint32_t stripe = 0u;
+
+    while (offset + 64u <= Size) {
+        hashStripe(acc, bytes + offset, HashSecret + (stripe & 7u));
+        offset += 64u;
+
+        if (!(++stripe & 15u))
+            hashScramble(acc);
+    }
+
+    if (offset < Size) {
+        alignas(16) uint8_t tail[64] = { };
+        std::memcpy(tail, bytes + offset, Size - offset);
+        hashStripe(acc, tail, HashSecret + 1u);
+    }
+
+    hashScramble(acc);
+
+    alignas(16) uint64_t lanes[8];
+
+    for (uint32_t i = 0; i < 4; i++)
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes) + i, acc[i]);
+
+    Hash128 result;
+    result.lo = hashAvalanche(hashMix(lanes[0], lanes[1]) + hashMix(lanes[2], lanes[3]) + Size * HashPrime64_1);
+    result.hi = hashAvalanche(hashMix(lanes[4], lanes[5]) + hashMix(lanes[6], lanes[7]) + ~Size * HashPrime64_2);
+    return result;
+}
+
+/** Formats a hash as 32 hex digits, as used in config files and logs */
+inline std::string formatHash(const Hash128& Hash) {
+    char str[33];
+    std::snprintf(str, sizeof(str), "%016llx%016llx",
+        static_cast<unsigned long long>(Hash.hi),
+        static_cast<unsigned long long>(Hash.lo));
+    return str;
+}
+
+/**
+ * \brief Parses a hash formatted with \c formatHash
+ * \returns \c false if the string is not 32 hex digits
+ */
+inline bool parseHash(const char* pString, Hash128* pHash) {
+    uint64_t parts[2] = { };
+
+    for (uint32_t i = 0; i < 32u; i++) {
+        char c = pString[i];
+        uint64_t digit;
+
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+
+        parts[i / 16u] = (parts[i / 16u] << 4) | digit;
+    }
+
+    pHash->hi = parts[0];
+    pHash->lo = parts[1];
+    return true;
+}
+
+}
+
+#endif
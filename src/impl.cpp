@@ -1,7 +1,9 @@
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstdint>
 #include <mutex>
+#include <unordered_set>
 
 #include <basetsd.h>
 #include <d3d11.h>
@@ -10,127 +12,2189 @@
 #include <winnt.h>
 #include <immintrin.h>
 
+#include "buffers.h"
+#include "config.h"
+#include "dxbc.h"
+#include "dynres.h"
+#include "formats.h"
 #include "impl.h"
+#include "instancing.h"
+#include "learn.h"
+#include "link.h"
 #include "MinHook.h"
+#include "packs.h"
+#include "postfx.h"
+#include "rules.h"
 #include "shaderbool.h"
+#include "shadercost.h"
+#include "shaderdump.h"
+#include "shadercache.h"
+#include "shaderopt.h"
+#include "shadows.h"
+#include "specialize.h"
+#include "vegetation.h"
 
 #include "util.h"
-#include "shaders/snow.hpp"
 
 
 namespace atfix {
 
-/** Hooking-related stuff */
-using PFN_ID3D11Device_CreateVertexShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11VertexShader**);
-using PFN_ID3D11Device_CreatePixelShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11PixelShader**);
-using PFN_ID3D11Device_CreateBuffer = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_BUFFER_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Buffer**);
+namespace {
+    mutex  g_hookMutex;
+    mutex  g_hookMutex2;
+    uint32_t g_installedHooks = 0U;
+}
+
+inline bool simd_equal(const std::array<uint32_t, 4>& arr1, const uint32_t* ptr) {
+    const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(arr1.data()));
+    const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+
+    return (_mm_movemask_epi8(_mm_cmpeq_epi32(v1, v2)) == 0xFFFF);
+}
+DeviceProcs   g_deviceProcs;
+ContextProcs  g_immContextProcs;
+ContextProcs  g_defContextProcs;
+DxgiProcs     g_dxgiProcs;
+
+constexpr uint32_t HOOK_DEVICE  = (1u << 0);
+constexpr uint32_t HOOK_IMM_CTX = (1u << 1);
+constexpr uint32_t HOOK_DEF_CTX = (1u << 2);
+constexpr uint32_t HOOK_SWAPCHAIN = (1u << 3);
+
+inline bool isImmediatecontext(
+        ID3D11DeviceContext*      pContext) {
+  return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE;
+}
+std::unordered_map<ID3D11PixelShader*, std::vector<uint8_t>> g_PixelShaderBlobs;
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateBuffer(
+        ID3D11Device*                   pDevice,
+        const D3D11_BUFFER_DESC*        pDesc,
+        const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Buffer**                  ppBuffer) {
+    const auto* procs = getDeviceProcs(pDevice);
+    HRESULT hr = S_OK;
+
+    if (tryCreatePooledBuffer(pDevice, pDesc, pInitialData, ppBuffer, &hr))
+        return hr;
+
+    if (tryCreateNarrowedIndexBuffer(pDevice, pDesc, pInitialData, ppBuffer, &hr))
+        return hr;
+
+    if (tryCreateImmutableBuffer(pDevice, pDesc, pInitialData, ppBuffer, &hr))
+        return hr;
+
+    hr = procs->CreateBuffer(pDevice, pDesc, pInitialData, ppBuffer);
+
+    /* A new buffer may reuse the address of one with known values */
+    if (SUCCEEDED(hr) && pDesc && ppBuffer && *ppBuffer && (pDesc->BindFlags & D3D11_BIND_CONSTANT_BUFFER))
+        invalidateSpecializationBuffer(*ppBuffer);
+
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateTexture2D(
+        ID3D11Device*                   pDevice,
+  const D3D11_TEXTURE2D_DESC*           pDesc,
+  const D3D11_SUBRESOURCE_DATA*         pInitialData,
+        ID3D11Texture2D**               ppTexture2D) {
+    const auto* procs = getDeviceProcs(pDevice);
+    HRESULT hr = S_OK;
+
+    if (tryCreateScaledShadowMap(pDevice, pDesc, pInitialData, ppTexture2D, &hr))
+        return hr;
+
+    if (!tryCreateRemappedTexture(pDevice, pDesc, pInitialData, ppTexture2D, &hr))
+        hr = procs->CreateTexture2D(pDevice, pDesc, pInitialData, ppTexture2D);
+
+    if (SUCCEEDED(hr) && ppTexture2D && *ppTexture2D && !pInitialData)
+        registerDynamicResolutionTarget(*ppTexture2D, pDesc);
+
+    return hr;
+}
+
+/**
+ * \brief Creates a view with the format fixed up for remapped textures
+ *
+ * Views without a description take the texture's format and
+ * need no fixup.
+ */
+template<typename Desc, typename View, typename Proc>
+HRESULT createRemappedView(
+        ID3D11Device*                   pDevice,
+        Proc                            pfnCreateView,
+        ID3D11Resource*                 pResource,
+  const Desc*                           pDesc,
+        View**                          ppView) {
+    if (!pDesc)
+        return pfnCreateView(pDevice, pResource, pDesc, ppView);
+
+    Desc desc = *pDesc;
+    desc.Format = getRemappedViewFormat(pResource, pDesc->Format);
+    return pfnCreateView(pDevice, pResource, &desc, ppView);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateShaderResourceView(
+        ID3D11Device*                   pDevice,
+        ID3D11Resource*                 pResource,
+  const D3D11_SHADER_RESOURCE_VIEW_DESC* pDesc,
+        ID3D11ShaderResourceView**      ppSRView) {
+    const auto* procs = getDeviceProcs(pDevice);
+    return createRemappedView(pDevice, procs->CreateShaderResourceView, pResource, pDesc, ppSRView);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateRenderTargetView(
+        ID3D11Device*                   pDevice,
+        ID3D11Resource*                 pResource,
+  const D3D11_RENDER_TARGET_VIEW_DESC*  pDesc,
+        ID3D11RenderTargetView**        ppRTView) {
+    const auto* procs = getDeviceProcs(pDevice);
+    return createRemappedView(pDevice, procs->CreateRenderTargetView, pResource, pDesc, ppRTView);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateDepthStencilView(
+        ID3D11Device*                   pDevice,
+        ID3D11Resource*                 pResource,
+  const D3D11_DEPTH_STENCIL_VIEW_DESC*  pDesc,
+        ID3D11DepthStencilView**        ppDepthStencilView) {
+    const auto* procs = getDeviceProcs(pDevice);
+    return createRemappedView(pDevice, procs->CreateDepthStencilView, pResource, pDesc, ppDepthStencilView);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
+        ID3D11Device*           pDevice,
+        const void*             pShaderBytecode,
+        SIZE_T                  BytecodeLength,
+        ID3D11ClassLinkage*     pClassLinkage,
+        ID3D11VertexShader**    ppVertexShader) {
+    const auto* procs = getDeviceProcs(pDevice);
+    dumpShader(pShaderBytecode, BytecodeLength);
+
+    std::vector<uint8_t> optimized;
+    HRESULT hr = E_FAIL;
+
+    if (!pClassLinkage && getOptimizedShader(pShaderBytecode, BytecodeLength, &optimized))
+        hr = procs->CreateVertexShader(pDevice, optimized.data(), optimized.size(), nullptr, ppVertexShader);
+
+    if (FAILED(hr)) {
+#ifndef NDEBUG
+        if (!optimized.empty())
+            log("ShaderOpt: Failed to create optimized vertex shader: ", hr);
+#endif
+        hr = procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
+    }
+
+    if (SUCCEEDED(hr) && ppVertexShader && *ppVertexShader) {
+        registerRuleShader(*ppVertexShader, pShaderBytecode, BytecodeLength);
+        registerLinkVertexShader(pDevice, pShaderBytecode, BytecodeLength, *ppVertexShader);
+        registerShaderCost(*ppVertexShader, pShaderBytecode, BytecodeLength);
+
+        if (!pClassLinkage)
+            registerInstancingShader(pDevice, pShaderBytecode, BytecodeLength, *ppVertexShader);
+    }
+
+    return hr;
+}
+
+/** Index buffer binding of the immediate context as seen by the application */
+struct IndexBufferBinding {
+    ProxyBuffer*  proxy     = nullptr;
+    DXGI_FORMAT   format    = DXGI_FORMAT_UNKNOWN;
+    UINT          offset    = 0u;
+    bool          reordered = false;
+};
+
+IndexBufferBinding        g_immIndexBuffer;
+ImmediateState            g_immState;
+
+/** Viewports and scissor rects as set by the application */
+struct ViewportBinding {
+    std::array<D3D11_VIEWPORT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> viewports = { };
+    std::array<D3D11_RECT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> scissors = { };
+    UINT viewportCount = 0u;
+    UINT scissorCount = 0u;
+};
+
+/** Only tracked while shadow maps or screen targets are scaled */
+ViewportBinding           g_immViewports;
+
+/** Indexed draw held back so that it can be merged with the next one */
+struct PendingDraw {
+    UINT  indexCount = 0u;
+    UINT  startIndex = 0u;
+    INT   baseVertex = 0;
+};
+
+ID3D11DeviceContext*  g_immContext = nullptr;
+PendingDraw           g_pendingDraw;
+
+/** Number of indices per primitive for list topologies, 0 otherwise */
+inline UINT getListPrimitiveSize(D3D11_PRIMITIVE_TOPOLOGY Topology) {
+    switch (Topology) {
+        case D3D11_PRIMITIVE_TOPOLOGY_POINTLIST:        return 1u;
+        case D3D11_PRIMITIVE_TOPOLOGY_LINELIST:         return 2u;
+        case D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST:     return 3u;
+        case D3D11_PRIMITIVE_TOPOLOGY_LINELIST_ADJ:     return 4u;
+        case D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST_ADJ: return 6u;
+        default:                                        return 0u;
+    }
+}
+
+void flushPendingDraw(ID3D11DeviceContext* pContext) {
+    if (pContext != g_immContext)
+        return;
+
+    if (hasPendingInstances())
+        flushInstances(pContext);
+
+    if (!g_pendingDraw.indexCount)
+        return;
+
+    PendingDraw draw = g_pendingDraw;
+    g_pendingDraw.indexCount = 0u;
+
+    g_immContextProcs.DrawIndexed(pContext, draw.indexCount, draw.startIndex, draw.baseVertex);
+}
+
+/**
+ * \brief Checks whether draws with the bound shaders can be merged
+ *
+ * Merged draws number their primitives from the start of the first
+ * one, which changes \c SV_PrimitiveID for the others. Geometry and
+ * tessellation shaders are not inspected, so they never merge.
+ */
+inline bool canMergeDraws(const ImmediateState& State) {
+    return !State.psPrimitiveId && !State.extraStages;
+}
+
+/**
+ * \brief Merges an indexed draw into the pending draw
+ *
+ * Any state change flushes the pending draw, so the two draws only
+ * differ in their index range. A draw continuing the pending range
+ * is appended to it, anything else replaces it. Only called if
+ * \c canMergeDraws allows it for the bound shaders.
+ */
+inline void mergeIndexedDraw(
+        ID3D11DeviceContext*        pContext,
+        UINT                        IndexCount,
+        UINT                        StartIndexLocation,
+        INT                         BaseVertexLocation) {
+    auto& draw = g_pendingDraw;
+    UINT primitiveSize = getListPrimitiveSize(g_immState.topology);
+
+    if (draw.indexCount && primitiveSize
+     && !(draw.indexCount % primitiveSize)
+     && StartIndexLocation == draw.startIndex + draw.indexCount
+     && BaseVertexLocation == draw.baseVertex) {
+        draw.indexCount += IndexCount;
+        return;
+    }
+
+    flushPendingDraw(pContext);
+
+    if (!primitiveSize || !IndexCount) {
+        g_immContextProcs.DrawIndexed(pContext, IndexCount, StartIndexLocation, BaseVertexLocation);
+        return;
+    }
+
+    draw.indexCount = IndexCount;
+    draw.startIndex = StartIndexLocation;
+    draw.baseVertex = BaseVertexLocation;
+}
+
+/**
+ * \brief Checks whether a call leaves constant buffer bindings unchanged
+ *
+ * Redundant calls do not need to flush the pending draw.
+ */
+inline bool isRedundantBinding(
+  const ConstantBufferBindings&     Bindings,
+        uint32_t                    Ranges,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers,
+        bool                        Ranged) {
+    if (Ranged || !ppConstantBuffers || StartSlot + NumBuffers > Bindings.size())
+        return false;
+
+    uint32_t mask = ((1u << NumBuffers) - 1u) << StartSlot;
+
+    if (Ranges & mask)
+        return false;
+
+    for (UINT i = 0; i < NumBuffers; i++) {
+        if (Bindings[StartSlot + i] != ppConstantBuffers[i])
+            return false;
+    }
+
+    return true;
+}
+
+inline void trackConstantBuffers(
+        ConstantBufferBindings&     Bindings,
+        uint32_t&                   Ranges,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers,
+        bool                        Ranged) {
+    if (!ppConstantBuffers || StartSlot + NumBuffers > Bindings.size())
+        return;
+
+    uint32_t mask = ((1u << NumBuffers) - 1u) << StartSlot;
+
+    for (UINT i = 0; i < NumBuffers; i++)
+        Bindings[StartSlot + i] = ppConstantBuffers[i];
+
+    Ranges = Ranged ? (Ranges | mask) : (Ranges & ~mask);
+}
+
+/** Forgets all tracked immediate context state after it was reset */
+void resetImmediateState() {
+    auto& ib = g_immIndexBuffer;
+
+    if (ib.proxy)
+        ib.proxy->Release();
+
+    ib = IndexBufferBinding();
+    g_immState = ImmediateState();
+    g_immViewports = ViewportBinding();
+
+    resetDynamicResolutionBindings();
+    setInstancingVertexShader(nullptr);
+    invalidateInstancingBuffer(nullptr);
+
+    bindShaderCostVertexShader(nullptr);
+    bindShaderCostPixelShader(nullptr);
+}
+
+/**
+ * \brief Binds an index buffer, translating proxy buffers
+ * \returns \c true if the reordered copy of a proxy buffer was bound
+ */
+bool bindIndexBuffer(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+        ID3D11Buffer*               pIndexBuffer,
+        DXGI_FORMAT                 Format,
+        UINT                        Offset,
+        bool                        AllowReordered) {
+    auto* proxy = ProxyBuffer::fromResource(pIndexBuffer);
+
+    if (!proxy) {
+        procs->IASetIndexBuffer(pContext, pIndexBuffer, Format, Offset);
+        return false;
+    }
+
+    proxy->flush(pContext);
+
+    if (proxy->isNarrowed() && Format != DXGI_FORMAT_R32_UINT) {
+        if (ID3D11Buffer* wide = proxy->wideBacking()) {
+            procs->IASetIndexBuffer(pContext, wide, Format, Offset);
+            return false;
+        }
+    }
+
+    ID3D11Buffer* reordered = AllowReordered
+        ? proxy->reorderedBacking(Format, Offset)
+        : nullptr;
+
+    if (proxy->isNarrowed()) {
+        Format = DXGI_FORMAT_R16_UINT;
+        Offset /= 2u;
+    }
+
+    pIndexBuffer = reordered ? reordered : proxy->backing();
+    Offset += reordered ? 0u : proxy->offset();
+
+    procs->IASetIndexBuffer(pContext, pIndexBuffer, Format, Offset);
+    return reordered != nullptr;
+}
+
+/**
+ * \brief Records an indexed draw for vertex cache reordering
+ *
+ * Falls back to the original index buffer if the bound
+ * reordered copy cannot be used for the given range.
+ */
+inline void recordIndexedDraw(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+        UINT                        StartIndexLocation,
+        UINT                        IndexCount) {
+    auto& ib = g_immIndexBuffer;
+
+    if (!ib.proxy || (!ib.reordered && !ib.proxy->tracksDraws()))
+        return;
+
+    bool valid = ib.proxy->recordDraw(ib.format, ib.offset, g_immState.topology, StartIndexLocation, IndexCount);
+
+    if (ib.reordered && !valid) {
+        flushPendingDraw(pContext);
+        ib.reordered = bindIndexBuffer(pContext, procs, ib.proxy, ib.format, ib.offset, false);
+    }
+}
+
+namespace {
+    /* Pixel shaders that can be dropped for draws without render targets */
+    mutex g_colorOnlyShaderMutex;
+    std::unordered_set<const void*> g_colorOnlyShaders;
+}
+
+/** Analyzes a new pixel shader for depth-only draws */
+void registerColorOnlyShader(const void* pShader, const void* pBytecode, size_t BytecodeLength) {
+    bool colorOnly = isDxbcColorOnlyPixelShader(pBytecode, BytecodeLength);
+
+    /* Shaders may be created on any thread, and addresses get reused */
+    std::lock_guard lock(g_colorOnlyShaderMutex);
+
+    if (colorOnly)
+        g_colorOnlyShaders.insert(pShader);
+    else
+        g_colorOnlyShaders.erase(pShader);
+}
+
+bool isColorOnlyShader(const void* pShader) {
+    std::lock_guard lock(g_colorOnlyShaderMutex);
+    return g_colorOnlyShaders.find(pShader) != g_colorOnlyShaders.end();
+}
+
+namespace {
+    /* Pixel shaders whose draws must not be merged */
+    mutex g_primitiveIdShaderMutex;
+    std::unordered_set<const void*> g_primitiveIdShaders;
+}
+
+/** Analyzes a new pixel shader for draw merging */
+void registerPrimitiveIdShader(const void* pShader, const void* pBytecode, size_t BytecodeLength) {
+    bool primitiveId = isDxbcPrimitiveIdPixelShader(pBytecode, BytecodeLength);
+
+    std::lock_guard lock(g_primitiveIdShaderMutex);
+
+    if (primitiveId)
+        g_primitiveIdShaders.insert(pShader);
+    else
+        g_primitiveIdShaders.erase(pShader);
+}
+
+bool isPrimitiveIdShader(const void* pShader) {
+    std::lock_guard lock(g_primitiveIdShaderMutex);
+    return g_primitiveIdShaders.find(pShader) != g_primitiveIdShaders.end();
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
+    ID3D11Device* pDevice,
+    const void* pShaderBytecode,
+    SIZE_T                  BytecodeLength,
+    ID3D11ClassLinkage* pClassLinkage,
+    ID3D11PixelShader** ppPixelShader) {
+    const auto* procs = getDeviceProcs(pDevice);
+    dumpShader(pShaderBytecode, BytecodeLength);
+
+    const std::vector<uint8_t>* replacement = hasShaderPacks() && !pClassLinkage
+        ? findShaderPackReplacement(pShaderBytecode, BytecodeLength)
+        : nullptr;
+
+    /* Packs are written by hand, so only the game's own shaders are optimized */
+    std::vector<uint8_t> optimized;
+
+    if (!replacement && !pClassLinkage && getOptimizedShader(pShaderBytecode, BytecodeLength, &optimized))
+        replacement = &optimized;
+
+    HRESULT hr = E_FAIL;
+
+    if (replacement)
+        hr = procs->CreatePixelShader(pDevice, replacement->data(), replacement->size(), nullptr, ppPixelShader);
+
+    /* Keep the game's shader if the replacement is rejected */
+    if (FAILED(hr)) {
+#ifndef NDEBUG
+        if (replacement)
+            log("Shaders: Failed to create replacement pixel shader: ", hr);
+#endif
+        replacement = nullptr;
+        hr = procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
+    }
+
+    if (SUCCEEDED(hr) && ppPixelShader && *ppPixelShader) {
+        /* Rules and other features match the game's shader, not the replacement */
+        registerRuleShader(*ppPixelShader, pShaderBytecode, BytecodeLength);
+        registerShaderCost(*ppPixelShader, pShaderBytecode, BytecodeLength);
+
+        /* Linking depends on what the created shader reads */
+        registerLinkPixelShader(
+            replacement ? replacement->data() : pShaderBytecode,
+            replacement ? replacement->size() : BytecodeLength,
+            *ppPixelShader);
+
+        if (!pClassLinkage) {
+            registerSpecializePixelShader(pDevice,
+                replacement ? replacement->data() : pShaderBytecode,
+                replacement ? replacement->size() : BytecodeLength,
+                *ppPixelShader);
+        }
+
+        if (g_config.nullDepthOnlyPixelShader && !pClassLinkage) {
+            registerColorOnlyShader(*ppPixelShader,
+                replacement ? replacement->data() : pShaderBytecode,
+                replacement ? replacement->size() : BytecodeLength);
+        }
+
+        if (g_config.mergeDrawCalls) {
+            registerPrimitiveIdShader(*ppPixelShader,
+                replacement ? replacement->data() : pShaderBytecode,
+                replacement ? replacement->size() : BytecodeLength);
+        }
+    }
+
+    return hr;
+}
+
+/** Draw and dispatch methods sharing the per-draw features */
+enum class DrawType : uint32_t {
+    Draw,
+    DrawIndexed,
+    DrawInstanced,
+    DrawIndexedInstanced,
+    DrawAuto,
+    DrawInstancedIndirect,
+    DrawIndexedInstancedIndirect,
+    Dispatch,
+    DispatchIndirect,
+};
+
+/** Per-draw features, chosen once when the immediate context is hooked */
+constexpr uint32_t DRAW_FEATURE_FLUSH       = (1u << 0);
+constexpr uint32_t DRAW_FEATURE_REORDER     = (1u << 1);
+constexpr uint32_t DRAW_FEATURE_INSTANCING  = (1u << 2);
+constexpr uint32_t DRAW_FEATURE_MERGE       = (1u << 3);
+constexpr uint32_t DRAW_FEATURE_RULES       = (1u << 4);
+constexpr uint32_t DRAW_FEATURE_LEARN       = (1u << 5);
+constexpr uint32_t DRAW_FEATURE_SHADOW_CULL = (1u << 6);
+constexpr uint32_t DRAW_FEATURE_GRASS       = (1u << 7);
+constexpr uint32_t DRAW_FEATURE_DYNRES      = (1u << 8);
+constexpr uint32_t DRAW_FEATURE_HALF_RES    = (1u << 9);
+constexpr uint32_t DRAW_FEATURE_SPECIALIZE  = (1u << 10);
+constexpr uint32_t DRAW_FEATURE_SHADER_COST = (1u << 11);
+
+uint32_t g_drawFeatures = 0u;
+
+/** Depth state, tracked in addition to the DRAW_RULE_* fields */
+constexpr uint32_t DRAW_STATE_DEPTH = (1u << 31);
+/** State deciding whether the pixel shader can be dropped */
+constexpr uint32_t DRAW_STATE_DEPTH_ONLY = (1u << 30);
+/** State identifying shadow passes and their cascade */
+constexpr uint32_t DRAW_STATE_SHADOW = (1u << 29);
+/** Scale of the bound render targets, and the viewports to scale */
+constexpr uint32_t DRAW_STATE_VIEWPORT_SCALE = (1u << 27);
+/** Whether the bound vertex shader draws grass */
+constexpr uint32_t DRAW_STATE_GRASS = (1u << 28);
+/** Whether the bound pixel shader runs at half resolution */
+constexpr uint32_t DRAW_STATE_HALF_RES = (1u << 26);
+/** Shader stages deciding which vertex shader outputs are needed */
+constexpr uint32_t DRAW_STATE_LINK = (1u << 25);
+/** Whether the bound pixel shader has constant-specialized variants */
+constexpr uint32_t DRAW_STATE_SPECIALIZE = (1u << 24);
+/** Shader changes counted for the shader report */
+constexpr uint32_t DRAW_STATE_SHADER_COST = (1u << 23);
+/** Shaders that tell merged draws apart */
+constexpr uint32_t DRAW_STATE_MERGE = (1u << 22);
+
+/* Stages that consume vertex shader outputs before the pixel shader */
+constexpr uint8_t PIPELINE_STAGE_GS = (1u << 0);
+constexpr uint8_t PIPELINE_STAGE_HS = (1u << 1);
+constexpr uint8_t PIPELINE_STAGE_DS = (1u << 2);
+
+/** Draw state tracked on the immediate context */
+uint32_t g_trackedState = 0u;
+
+/** Whether state setters on the immediate context are hooked */
+bool g_stateHooked = false;
+
+/**
+ * \brief Looks up the vertex shader variant for a pixel shader
+ *
+ * Outputs are only pruned if they go straight to the pixel shader.
+ * \returns Linked variant of the bound vertex shader, or \c nullptr
+ */
+ID3D11VertexShader* findLinkedVertexShader(const ImmediateState& State, ID3D11PixelShader* pPixelShader) {
+    if (!(g_trackedState & DRAW_STATE_LINK) || State.extraStages)
+        return nullptr;
+
+    return getLinkedVertexShader(State.vs, pPixelShader);
+}
+
+/**
+ * \brief Binds the vertex shader linked to the bound pixel shader
+ *
+ * Must be called after the pixel shader or the stages in between changed.
+ */
+void updateLinkedVertexShader(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs) {
+    auto& state = g_immState;
+    auto* linked = findLinkedVertexShader(state, state.ps);
+
+    if (linked == state.vsLinked)
+        return;
+
+    state.vsLinked = linked;
+    procs->VSSetShader(pContext, getBoundVertexShader(), nullptr, 0);
+}
+
+/**
+ * \brief Binds the pixel shader variant matching the current constants
+ *
+ * Values may change with any buffer update, so this runs per draw.
+ */
+void updateSpecializedPixelShader(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs) {
+    auto& state = g_immState;
+    auto* variant = state.psSpecializable && !state.psNulled
+        ? getSpecializedPixelShader(state.ps, state.psConstantBuffers.data(), state.psConstantBufferRanges)
+        : nullptr;
+
+    if (variant == state.psSpecialized)
+        return;
+
+    flushPendingDraw(pContext);
+    state.psSpecialized = variant;
+    procs->PSSetShader(pContext, getBoundPixelShader(), nullptr, 0);
+}
+
+/** Arguments of any draw or dispatch, unused ones are ignored */
+struct DrawArgs {
+    UINT          count         = 0u;   /**< Vertex or index count per instance */
+    UINT          instanceCount = 1u;
+    UINT          start         = 0u;   /**< First vertex or index */
+    INT           baseVertex    = 0;
+    UINT          startInstance = 0u;
+    UINT          groupCount[3] = { };
+    ID3D11Buffer* argBuffer     = nullptr;
+    UINT          argOffset     = 0u;
+};
+
+constexpr bool isDirectIndexedDraw(DrawType Type) {
+    return Type == DrawType::DrawIndexed
+        || Type == DrawType::DrawIndexedInstanced;
+}
+
+/** Draws whose vertex and instance counts are known */
+constexpr bool isDirectDraw(DrawType Type) {
+    return Type == DrawType::Draw
+        || Type == DrawType::DrawInstanced
+        || isDirectIndexedDraw(Type);
+}
+
+template<DrawType Type>
+inline void issueDraw(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+  const DrawArgs&                   args) {
+    if constexpr (Type == DrawType::Draw)
+        procs->Draw(pContext, args.count, args.start);
+    else if constexpr (Type == DrawType::DrawIndexed)
+        procs->DrawIndexed(pContext, args.count, args.start, args.baseVertex);
+    else if constexpr (Type == DrawType::DrawInstanced)
+        procs->DrawInstanced(pContext, args.count, args.instanceCount, args.start, args.startInstance);
+    else if constexpr (Type == DrawType::DrawIndexedInstanced)
+        procs->DrawIndexedInstanced(pContext, args.count, args.instanceCount, args.start, args.baseVertex, args.startInstance);
+    else if constexpr (Type == DrawType::DrawAuto)
+        procs->DrawAuto(pContext);
+    else if constexpr (Type == DrawType::DrawInstancedIndirect)
+        procs->DrawInstancedIndirect(pContext, args.argBuffer, args.argOffset);
+    else if constexpr (Type == DrawType::DrawIndexedInstancedIndirect)
+        procs->DrawIndexedInstancedIndirect(pContext, args.argBuffer, args.argOffset);
+    else if constexpr (Type == DrawType::Dispatch)
+        procs->Dispatch(pContext, args.groupCount[0], args.groupCount[1], args.groupCount[2]);
+    else if constexpr (Type == DrawType::DispatchIndirect)
+        procs->DispatchIndirect(pContext, args.argBuffer, args.argOffset);
+}
+
+/**
+ * \brief Applies a matching draw rule
+ *
+ * Replacement shaders are bound around the draw only, and the
+ * application's shaders restored from the tracked state.
+ */
+template<DrawType Type>
+inline void applyDrawRule(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+  const DrawRule&                   rule,
+        DrawArgs                    args) {
+    flushPendingDraw(pContext);
+
+    switch (rule.action) {
+        case DrawRuleAction::Skip:
+            break;
+
+        case DrawRuleAction::ReplacePixelShader: {
+            /* The bound vertex shader may be linked to the application's pixel shader */
+            auto* linked = findLinkedVertexShader(g_immState, rule.ps);
+            auto* vs = linked ? linked : g_immState.vs;
+
+            if (vs != getBoundVertexShader())
+                procs->VSSetShader(pContext, vs, nullptr, 0);
+
+            procs->PSSetShader(pContext, rule.ps, nullptr, 0);
+            issueDraw<Type>(pContext, procs, args);
+            procs->PSSetShader(pContext, getBoundPixelShader(), nullptr, 0);
+
+            if (vs != getBoundVertexShader())
+                procs->VSSetShader(pContext, getBoundVertexShader(), nullptr, 0);
+        } break;
+
+        case DrawRuleAction::ReplaceVertexShader:
+            procs->VSSetShader(pContext, rule.vs, nullptr, 0);
+            issueDraw<Type>(pContext, procs, args);
+            procs->VSSetShader(pContext, getBoundVertexShader(), nullptr, 0);
+            break;
+
+        case DrawRuleAction::ClampInstances:
+            args.instanceCount = std::min(args.instanceCount, rule.maxInstances);
+            issueDraw<Type>(pContext, procs, args);
+            break;
+    }
+}
+
+template<DrawType Type>
+inline void runDraw(
+        ID3D11DeviceContext*        pContext,
+        DrawArgs                    args,
+        uint32_t                    features) {
+    const auto* procs = getContextProcs(pContext);
+
+    if constexpr (Type != DrawType::Dispatch && Type != DrawType::DispatchIndirect) {
+        if (features & DRAW_FEATURE_SHADER_COST) {
+            const auto& state = g_immState;
+            uint64_t vertices = isDirectDraw(Type) ? uint64_t(args.count) * args.instanceCount : 0u;
+            recordShaderCostDraw(vertices, uint64_t(state.viewportWidth) * state.viewportHeight);
+        }
+
+        if (features & DRAW_FEATURE_SPECIALIZE)
+            updateSpecializedPixelShader(pContext, procs);
+    }
+
+    /* Particles are composited before any other draw, which may depend on them */
+    if ((features & DRAW_FEATURE_HALF_RES) && !(isDirectDraw(Type) && g_immState.psParticle))
+        flushParticleBatch(pContext);
+
+    /* Bound targets take the binding's scale before anything draws to them */
+    if constexpr (Type != DrawType::Dispatch && Type != DrawType::DispatchIndirect) {
+        if ((features & DRAW_FEATURE_DYNRES) && hasPendingRescales())
+            applyPendingRescales(pContext);
+    }
+
+    if constexpr (Type == DrawType::DrawIndexedInstanced) {
+        if ((features & DRAW_FEATURE_GRASS) && g_immState.vsGrass)
+            args.instanceCount = scaleGrassInstances(args.instanceCount);
+    }
+
+    if (features) {
+        if constexpr (isDirectIndexedDraw(Type)) {
+            if (features & DRAW_FEATURE_REORDER)
+                recordIndexedDraw(pContext, procs, args.start, args.count);
+        }
+
+        if constexpr (Type == DrawType::DrawIndexedInstancedIndirect) {
+            auto& ib = g_immIndexBuffer;
+
+            /* The index range is unknown, so reordered buffers cannot be used */
+            if ((features & DRAW_FEATURE_REORDER) && ib.proxy) {
+                flushPendingDraw(pContext);
+                ib.proxy->disableReordering();
+
+                if (ib.reordered)
+                    ib.reordered = bindIndexBuffer(pContext, procs, ib.proxy, ib.format, ib.offset, false);
+            }
+        }
+    }
+
+    if constexpr (isDirectDraw(Type)) {
+        const auto& state = g_immState;
+
+        /* Dropping depth-only draws needs no flush, the result does not depend on order */
+        if ((features & DRAW_FEATURE_SHADOW_CULL)
+         && state.vsShadowCaster && state.depthTarget && !state.colorTargets
+         && cullShadowDraw(state.cascade, args.count, args.instanceCount, getListPrimitiveSize(state.topology)))
+            return;
+
+        /* Full-screen passes are a triangle or a quad */
+        if ((features & DRAW_FEATURE_HALF_RES) && state.psHalfRes
+         && args.count * args.instanceCount <= 6u && beginHalfResPass(pContext)) {
+            issueDraw<Type>(pContext, procs, args);
+            endHalfResPass(pContext);
+            return;
+        }
+
+        if ((features & DRAW_FEATURE_HALF_RES) && state.psParticle && beginParticleDraw(pContext)) {
+            issueDraw<Type>(pContext, procs, args);
+            endParticleDraw(pContext);
+            return;
+        }
+    }
+
+    if constexpr (Type != DrawType::Dispatch && Type != DrawType::DispatchIndirect) {
+        if (features & DRAW_FEATURE_RULES) {
+            const auto& state = g_immState;
+
+            DrawRuleKey key;
+            key.vs = state.vsId;
+            key.ps = state.psId;
+            key.count = args.count;
+            key.rtFormat = state.rtFormat;
+            key.viewportWidth = state.viewportWidth;
+            key.viewportHeight = state.viewportHeight;
+
+            /* Count rules match index counts, which only indexed draws have */
+            uint32_t fields = isDirectIndexedDraw(Type) ? ~0u : ~DRAW_RULE_COUNT;
+
+            if (const auto* rule = matchDrawRule(key, fields)) {
+                applyDrawRule<Type>(pContext, procs, *rule, args);
+                return;
+            }
+        }
+    }
+
+    if constexpr (Type == DrawType::DrawIndexed) {
+        if ((features & DRAW_FEATURE_INSTANCING)
+         && batchInstancedDraw(pContext, args.count, args.start, args.baseVertex))
+            return;
+
+        if ((features & DRAW_FEATURE_MERGE) && canMergeDraws(g_immState)) {
+            mergeIndexedDraw(pContext, args.count, args.start, args.baseVertex);
+            return;
+        }
+    }
+
+    if (features & DRAW_FEATURE_FLUSH)
+        flushPendingDraw(pContext);
+
+    issueDraw<Type>(pContext, procs, args);
+}
+
+/**
+ * \brief Records a draw and the time spent processing it
+ *
+ * Draws that are merged or batched only account for the time
+ * to queue them; the draw that flushes them pays for the rest.
+ */
+template<DrawType Type>
+inline void learnDraw(
+        ID3D11DeviceContext*        pContext,
+  const DrawArgs&                   args,
+        uint32_t                    features) {
+    const auto& state = g_immState;
+
+    DrawFingerprint fingerprint;
+    fingerprint.vs = state.vsId;
+    fingerprint.ps = state.psId;
+    fingerprint.count = args.count;
+    fingerprint.instanceCount = args.instanceCount;
+    fingerprint.rtFormat = uint16_t(state.rtFormat);
+    fingerprint.dsvFormat = uint16_t(state.dsvFormat);
+    fingerprint.viewportWidth = uint16_t(state.viewportWidth);
+    fingerprint.viewportHeight = uint16_t(state.viewportHeight);
+    fingerprint.type = uint8_t(Type);
+    fingerprint.depthFlags = state.depthFlags;
+
+    /* The bound shaders may change while the draw is processed */
+    ID3D11VertexShader* vs = state.vs;
+    ID3D11PixelShader* ps = state.ps;
+
+    auto start = std::chrono::steady_clock::now();
+    runDraw<Type>(pContext, args, features);
+    auto ticks = (std::chrono::steady_clock::now() - start).count();
+
+    recordDrawFingerprint(fingerprint, vs, ps, uint64_t(ticks));
+}
+
+/**
+ * \brief Applies a draw rule on a context without tracked state
+ *
+ * Covers deferred contexts, and the immediate context when only
+ * index count rules are set and its state setters are not hooked.
+ * Only rules matching the index count alone apply, and the
+ * application's shaders are queried from the context to restore them.
+ * \returns \c true if a rule was applied
+ */
+template<DrawType Type>
+bool applyUntrackedDrawRule(
+        ID3D11DeviceContext*        pContext,
+        DrawArgs                    args) {
+    DrawRuleKey key;
+    key.count = args.count;
+
+    const auto* rule = matchDrawRule(key, DRAW_RULE_COUNT);
+
+    if (!rule)
+        return false;
+
+    const auto* procs = getContextProcs(pContext);
+
+    switch (rule->action) {
+        case DrawRuleAction::Skip:
+            break;
+
+        case DrawRuleAction::ReplacePixelShader: {
+            ID3D11PixelShader* ps = nullptr;
+            pContext->PSGetShader(&ps, nullptr, nullptr);
+
+            procs->PSSetShader(pContext, rule->ps, nullptr, 0);
+            issueDraw<Type>(pContext, procs, args);
+            procs->PSSetShader(pContext, ps, nullptr, 0);
+
+            if (ps)
+                ps->Release();
+        } break;
+
+        case DrawRuleAction::ReplaceVertexShader: {
+            ID3D11VertexShader* vs = nullptr;
+            pContext->VSGetShader(&vs, nullptr, nullptr);
+
+            procs->VSSetShader(pContext, rule->vs, nullptr, 0);
+            issueDraw<Type>(pContext, procs, args);
+            procs->VSSetShader(pContext, vs, nullptr, 0);
+
+            if (vs)
+                vs->Release();
+        } break;
+
+        case DrawRuleAction::ClampInstances:
+            args.instanceCount = std::min(args.instanceCount, rule->maxInstances);
+            issueDraw<Type>(pContext, procs, args);
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Common path of all draw and dispatch hooks
+ *
+ * Contexts without tracked state only apply index count rules, and
+ * configurations without per-draw features go straight to the
+ * original method.
+ */
+template<DrawType Type>
+inline void dispatchDraw(
+        ID3D11DeviceContext*        pContext,
+  const DrawArgs&                   args) {
+    if constexpr (isDirectIndexedDraw(Type)) {
+        if ((pContext != g_immContext || !g_stateHooked) && (getDrawRuleFields() & DRAW_RULE_COUNT)
+         && applyUntrackedDrawRule<Type>(pContext, args))
+            return;
+    }
+
+    uint32_t features = pContext == g_immContext ? g_drawFeatures : 0u;
+
+    if (features & DRAW_FEATURE_LEARN) {
+        learnDraw<Type>(pContext, args, features);
+        return;
+    }
+
+    runDraw<Type>(pContext, args, features);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Draw(
+        ID3D11DeviceContext*        pContext,
+        UINT                        VertexCount,
+        UINT                        StartVertexLocation) {
+    DrawArgs args;
+    args.count = VertexCount;
+    args.start = StartVertexLocation;
+
+    dispatchDraw<DrawType::Draw>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexed(
+        ID3D11DeviceContext*        pContext,
+        UINT                        IndexCount,
+        UINT                        StartIndexLocation,
+        INT                         BaseVertexLocation) {
+    DrawArgs args;
+    args.count = IndexCount;
+    args.start = StartIndexLocation;
+    args.baseVertex = BaseVertexLocation;
+
+    dispatchDraw<DrawType::DrawIndexed>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawInstanced(
+        ID3D11DeviceContext*        pContext,
+        UINT                        VertexCountPerInstance,
+        UINT                        InstanceCount,
+        UINT                        StartVertexLocation,
+        UINT                        StartInstanceLocation) {
+    DrawArgs args;
+    args.count = VertexCountPerInstance;
+    args.instanceCount = InstanceCount;
+    args.start = StartVertexLocation;
+    args.startInstance = StartInstanceLocation;
+
+    dispatchDraw<DrawType::DrawInstanced>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexedInstanced(
+        ID3D11DeviceContext*        pContext,
+        UINT                        IndexCountPerInstance,
+        UINT                        InstanceCount,
+        UINT                        StartIndexLocation,
+        INT                         BaseVertexLocation,
+        UINT                        StartInstanceLocation) {
+    DrawArgs args;
+    args.count = IndexCountPerInstance;
+    args.instanceCount = InstanceCount;
+    args.start = StartIndexLocation;
+    args.baseVertex = BaseVertexLocation;
+    args.startInstance = StartInstanceLocation;
+
+    dispatchDraw<DrawType::DrawIndexedInstanced>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawAuto(
+        ID3D11DeviceContext*        pContext) {
+    dispatchDraw<DrawType::DrawAuto>(pContext, DrawArgs());
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawInstancedIndirect(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Buffer*               pBufferForArgs,
+        UINT                        AlignedByteOffsetForArgs) {
+    DrawArgs args;
+    args.argBuffer = pBufferForArgs;
+    args.argOffset = AlignedByteOffsetForArgs;
+
+    dispatchDraw<DrawType::DrawInstancedIndirect>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexedInstancedIndirect(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Buffer*               pBufferForArgs,
+        UINT                        AlignedByteOffsetForArgs) {
+    DrawArgs args;
+    args.argBuffer = pBufferForArgs;
+    args.argOffset = AlignedByteOffsetForArgs;
+
+    dispatchDraw<DrawType::DrawIndexedInstancedIndirect>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Dispatch(
+        ID3D11DeviceContext*        pContext,
+        UINT                        ThreadGroupCountX,
+        UINT                        ThreadGroupCountY,
+        UINT                        ThreadGroupCountZ) {
+    DrawArgs args;
+    args.groupCount[0] = ThreadGroupCountX;
+    args.groupCount[1] = ThreadGroupCountY;
+    args.groupCount[2] = ThreadGroupCountZ;
+
+    dispatchDraw<DrawType::Dispatch>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DispatchIndirect(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Buffer*               pBufferForArgs,
+        UINT                        AlignedByteOffsetForArgs) {
+    DrawArgs args;
+    args.argBuffer = pBufferForArgs;
+    args.argOffset = AlignedByteOffsetForArgs;
+
+    dispatchDraw<DrawType::DispatchIndirect>(pContext, args);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_IASetPrimitiveTopology(
+        ID3D11DeviceContext*        pContext,
+        D3D11_PRIMITIVE_TOPOLOGY    Topology) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (isImmediatecontext(pContext))
+        g_immState.topology = Topology;
+
+    procs->IASetPrimitiveTopology(pContext, Topology);
+}
+
+HRESULT STDMETHODCALLTYPE ID3D11DeviceContext_Map(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource*             pResource,
+        UINT                        Subresource,
+        D3D11_MAP                   MapType,
+        UINT                        MapFlags,
+        D3D11_MAPPED_SUBRESOURCE*   pMappedResource) {
+    const auto* procs = getContextProcs(pContext);
+    HRESULT hr;
+
+    if (pContext == g_immContext && isInstancingBuffer(pResource)
+     && mapInstancingBuffer(pResource, Subresource, MapType, pMappedResource)) {
+        hr = S_OK;
+    } else {
+        flushPendingDraw(pContext);
+
+        if (pContext == g_immContext)
+            invalidateInstancingBuffer(pResource);
+
+        if (auto* proxy = ProxyBuffer::fromResource(pResource))
+            return proxy->map(MapType, pMappedResource);
+
+        hr = procs->Map(pContext, pResource, Subresource, MapType, MapFlags, pMappedResource);
+    }
+
+    if ((g_trackedState & DRAW_STATE_SPECIALIZE) && pContext == g_immContext && SUCCEEDED(hr))
+        trackSpecializationMap(pResource, Subresource, pMappedResource);
+
+    return hr;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_Unmap(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource*             pResource,
+        UINT                        Subresource) {
+    const auto* procs = getContextProcs(pContext);
+
+    /* Written values are only readable until the buffer is unmapped */
+    if ((g_trackedState & DRAW_STATE_SPECIALIZE) && pContext == g_immContext)
+        trackSpecializationUnmap(pResource, Subresource);
+
+    if (pContext == g_immContext && unmapInstancingBuffer(pContext, pResource, Subresource))
+        return;
+
+    flushPendingDraw(pContext);
+
+    if (auto* proxy = ProxyBuffer::fromResource(pResource)) {
+        proxy->unmap(pContext);
+        return;
+    }
+
+    procs->Unmap(pContext, pResource, Subresource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_IASetVertexBuffers(
+        ID3D11DeviceContext*        pContext,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppVertexBuffers,
+        const UINT*                 pStrides,
+        const UINT*                 pOffsets) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (!ppVertexBuffers || !pOffsets || NumBuffers > D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT) {
+        procs->IASetVertexBuffers(pContext, StartSlot, NumBuffers, ppVertexBuffers, pStrides, pOffsets);
+        return;
+    }
+
+    std::array<ID3D11Buffer*, D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> buffers;
+    std::array<UINT, D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT> offsets;
+    bool remapped = false;
+
+    for (UINT i = 0; i < NumBuffers; i++) {
+        buffers[i] = ppVertexBuffers[i];
+        offsets[i] = pOffsets[i];
+
+        if (auto* proxy = ProxyBuffer::fromResource(buffers[i])) {
+            proxy->flush(pContext);
+            buffers[i] = proxy->backing();
+            offsets[i] += proxy->offset();
+            remapped = true;
+        }
+    }
+
+    if (remapped) {
+        ppVertexBuffers = buffers.data();
+        pOffsets = offsets.data();
+    }
+
+    procs->IASetVertexBuffers(pContext, StartSlot, NumBuffers, ppVertexBuffers, pStrides, pOffsets);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_IASetIndexBuffer(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Buffer*               pIndexBuffer,
+        DXGI_FORMAT                 Format,
+        UINT                        Offset) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (!isImmediatecontext(pContext)) {
+        bindIndexBuffer(pContext, procs, pIndexBuffer, Format, Offset, false);
+        return;
+    }
+
+    auto& ib = g_immIndexBuffer;
+    auto* proxy = ProxyBuffer::fromResource(pIndexBuffer);
+
+    if (proxy && !proxy->tracksDraws())
+        proxy = nullptr;
+
+    if (proxy)
+        proxy->AddRef();
+
+    if (ib.proxy)
+        ib.proxy->Release();
+
+    ib.proxy = proxy;
+    ib.format = Format;
+    ib.offset = Offset;
+    ib.reordered = bindIndexBuffer(pContext, procs, pIndexBuffer, Format, Offset, true);
+}
+
+/**
+ * \brief Redirects a buffer copy from or to proxy buffers to their storage
+ *
+ * \param [out] pBox Source box within the storage
+ * \returns \c true if either resource is a proxy, in which case
+ *    the copy must use \c *pBox as its source box
+ */
+bool translateProxyCopy(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource**            ppDstResource,
+        UINT*                       pDstX,
+        ID3D11Resource**            ppSrcResource,
+  const D3D11_BOX*                  pSrcBox,
+        D3D11_BOX*                  pBox) {
+    auto* dstProxy = ProxyBuffer::fromResource(*ppDstResource);
+    auto* srcProxy = ProxyBuffer::fromResource(*ppSrcResource);
+
+    if (!dstProxy && !srcProxy)
+        return false;
+
+    *pBox = { 0u, 0u, 0u, 0u, 1u, 1u };
+
+    if (pSrcBox) {
+        *pBox = *pSrcBox;
+    } else {
+        D3D11_BUFFER_DESC desc = { };
+        static_cast<ID3D11Buffer*>(*ppSrcResource)->GetDesc(&desc);
+        pBox->right = desc.ByteWidth;
+    }
+
+    if (dstProxy) {
+        *ppDstResource = dstProxy->backing();
+        *pDstX += dstProxy->offset();
+    }
+
+    if (srcProxy) {
+        UINT srcOffset = 0u;
+
+        srcProxy->flush(pContext);
+        *ppSrcResource = srcProxy->copySource(&srcOffset);
+        pBox->left += srcOffset;
+        pBox->right += srcOffset;
+    }
+
+    return true;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopySubresourceRegion(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource*             pDstResource,
+        UINT                        DstSubresource,
+        UINT                        DstX,
+        UINT                        DstY,
+        UINT                        DstZ,
+        ID3D11Resource*             pSrcResource,
+        UINT                        SrcSubresource,
+        const D3D11_BOX*            pSrcBox) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (pContext == g_immContext) {
+        flushParticleBatch(pContext);
+        invalidateInstancingBuffer(pDstResource);
+        invalidateSpecializationBuffer(pDstResource);
+        resolveDynamicResolutionResource(pContext, pDstResource);
+        resolveDynamicResolutionResource(pContext, pSrcResource);
+    }
+
+    D3D11_BOX box;
+
+    if (translateProxyCopy(pContext, &pDstResource, &DstX, &pSrcResource, pSrcBox, &box))
+        pSrcBox = &box;
+
+    procs->CopySubresourceRegion(pContext, pDstResource, DstSubresource,
+        DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CopyResource(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource*             pDstResource,
+        ID3D11Resource*             pSrcResource) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (pContext == g_immContext) {
+        flushParticleBatch(pContext);
+        invalidateInstancingBuffer(pDstResource);
+        invalidateSpecializationBuffer(pDstResource);
+        resolveDynamicResolutionResource(pContext, pDstResource);
+        resolveDynamicResolutionResource(pContext, pSrcResource);
+    }
+
+    if (ProxyBuffer::fromResource(pDstResource) || ProxyBuffer::fromResource(pSrcResource)) {
+        ID3D11DeviceContext_CopySubresourceRegion(pContext,
+            pDstResource, 0, 0, 0, 0, pSrcResource, 0, nullptr);
+        return;
+    }
+
+    procs->CopyResource(pContext, pDstResource, pSrcResource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearState(
+        ID3D11DeviceContext*        pContext) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (pContext == g_immContext) {
+        flushParticleBatch(pContext);
+        resetImmediateState();
+    }
+
+    procs->ClearState(pContext);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetShaderResources(
+        ID3D11DeviceContext*        pContext,
+        UINT                        StartSlot,
+        UINT                        NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        resolveDynamicResolutionViews(pContext, NumViews, ppShaderResourceViews);
+    }
+
+    procs->PSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_CSSetShaderResources(
+        ID3D11DeviceContext*        pContext,
+        UINT                        StartSlot,
+        UINT                        NumViews,
+        ID3D11ShaderResourceView* const* ppShaderResourceViews) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        resolveDynamicResolutionViews(pContext, NumViews, ppShaderResourceViews);
+    }
+
+    procs->CSSetShaderResources(pContext, StartSlot, NumViews, ppShaderResourceViews);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearRenderTargetView(
+        ID3D11DeviceContext*        pContext,
+        ID3D11RenderTargetView*     pRenderTargetView,
+  const FLOAT                       ColorRGBA[4]) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        flushParticleBatch(pContext);
+        clearDynamicResolutionView(pRenderTargetView, 0u);
+    }
+
+    procs->ClearRenderTargetView(pContext, pRenderTargetView, ColorRGBA);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ClearDepthStencilView(
+        ID3D11DeviceContext*        pContext,
+        ID3D11DepthStencilView*     pDepthStencilView,
+        UINT                        ClearFlags,
+        FLOAT                       Depth,
+        UINT8                       Stencil) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        flushParticleBatch(pContext);
+        clearDynamicResolutionView(pDepthStencilView, ClearFlags);
+    }
+
+    procs->ClearDepthStencilView(pContext, pDepthStencilView, ClearFlags, Depth, Stencil);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_ExecuteCommandList(
+        ID3D11DeviceContext*        pContext,
+        ID3D11CommandList*          pCommandList,
+        BOOL                        RestoreContextState) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    /* Command lists may write any buffer, and reset the
+     * context state unless it is restored afterwards */
+    if (pContext == g_immContext) {
+        flushParticleBatch(pContext);
+        invalidateInstancingBuffer(nullptr);
+        invalidateSpecializationBuffer(nullptr);
+
+        if (!RestoreContextState)
+            resetImmediateState();
+    }
+
+    procs->ExecuteCommandList(pContext, pCommandList, RestoreContextState);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_UpdateSubresource(
+        ID3D11DeviceContext*        pContext,
+        ID3D11Resource*             pDstResource,
+        UINT                        DstSubresource,
+  const D3D11_BOX*                  pDstBox,
+  const void*                       pSrcData,
+        UINT                        SrcRowPitch,
+        UINT                        SrcDepthPitch) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        if (g_trackedState & DRAW_STATE_SPECIALIZE)
+            trackSpecializationUpdate(pDstResource, DstSubresource, pDstBox, pSrcData);
+
+        if (isInstancingBuffer(pDstResource)
+         && updateInstancingBuffer(pContext, pDstResource, DstSubresource, pDstBox, pSrcData))
+            return;
+
+        flushPendingDraw(pContext);
+        invalidateInstancingBuffer(pDstResource);
+    }
+
+    procs->UpdateSubresource(pContext, pDstResource, DstSubresource,
+        pDstBox, pSrcData, SrcRowPitch, SrcDepthPitch);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_UpdateSubresource1(
+        ID3D11DeviceContext1*       pContext,
+        ID3D11Resource*             pDstResource,
+        UINT                        DstSubresource,
+  const D3D11_BOX*                  pDstBox,
+  const void*                       pSrcData,
+        UINT                        SrcRowPitch,
+        UINT                        SrcDepthPitch,
+        UINT                        CopyFlags) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        if (g_trackedState & DRAW_STATE_SPECIALIZE) {
+            if (CopyFlags & D3D11_COPY_DISCARD)
+                invalidateSpecializationBuffer(pDstResource);
+
+            trackSpecializationUpdate(pDstResource, DstSubresource, pDstBox, pSrcData);
+        }
+
+        if (!CopyFlags && isInstancingBuffer(pDstResource)
+         && updateInstancingBuffer(pContext, pDstResource, DstSubresource, pDstBox, pSrcData))
+            return;
+
+        flushPendingDraw(pContext);
+        invalidateInstancingBuffer(pDstResource);
+    }
+
+    procs->UpdateSubresource1(pContext, pDstResource, DstSubresource,
+        pDstBox, pSrcData, SrcRowPitch, SrcDepthPitch, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_CopySubresourceRegion1(
+        ID3D11DeviceContext1*       pContext,
+        ID3D11Resource*             pDstResource,
+        UINT                        DstSubresource,
+        UINT                        DstX,
+        UINT                        DstY,
+        UINT                        DstZ,
+        ID3D11Resource*             pSrcResource,
+        UINT                        SrcSubresource,
+  const D3D11_BOX*                  pSrcBox,
+        UINT                        CopyFlags) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    if (pContext == g_immContext) {
+        flushParticleBatch(pContext);
+        invalidateInstancingBuffer(pDstResource);
+        invalidateSpecializationBuffer(pDstResource);
+        resolveDynamicResolutionResource(pContext, pDstResource);
+        resolveDynamicResolutionResource(pContext, pSrcResource);
+    }
+
+    D3D11_BOX box;
+
+    if (translateProxyCopy(pContext, &pDstResource, &DstX, &pSrcResource, pSrcBox, &box))
+        pSrcBox = &box;
+
+    procs->CopySubresourceRegion1(pContext, pDstResource, DstSubresource,
+        DstX, DstY, DstZ, pSrcResource, SrcSubresource, pSrcBox, CopyFlags);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_DiscardResource(
+        ID3D11DeviceContext1*       pContext,
+        ID3D11Resource*             pResource) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+
+    /* Proxies share their storage with other buffers, and discarding
+     * only makes the contents undefined, so there is nothing to do */
+    if (ProxyBuffer::fromResource(pResource))
+        return;
+
+    procs->DiscardResource(pContext, pResource);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_VSSetShader(
+        ID3D11DeviceContext*        pContext,
+        ID3D11VertexShader*         pVertexShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT                        NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext && (pVertexShader != g_immState.vs || NumClassInstances)) {
+        flushPendingDraw(pContext);
+
+        g_immState.vs = pVertexShader;
+        setInstancingVertexShader(NumClassInstances ? nullptr : pVertexShader);
+
+        if (g_trackedState & DRAW_RULE_VS)
+            g_immState.vsId = getRuleShaderId(pVertexShader);
+
+        if (g_trackedState & DRAW_STATE_SHADOW)
+            g_immState.vsShadowCaster = !NumClassInstances && isShadowCasterShader(pVertexShader);
+
+        if (g_trackedState & DRAW_STATE_GRASS)
+            g_immState.vsGrass = isGrassShader(pVertexShader);
+
+        if (g_trackedState & DRAW_STATE_SHADER_COST)
+            bindShaderCostVertexShader(pVertexShader);
+
+        if (g_trackedState & DRAW_STATE_LINK)
+            g_immState.vsLinked = NumClassInstances ? nullptr : findLinkedVertexShader(g_immState, g_immState.ps);
+    }
+
+    if (pContext == g_immContext && g_immState.vsLinked)
+        pVertexShader = g_immState.vsLinked;
+
+    procs->VSSetShader(pContext, pVertexShader, ppClassInstances, NumClassInstances);
+}
+
+/**
+ * \brief Tracks a stage between the vertex and pixel shaders
+ *
+ * Such stages may read any vertex shader output, so that the
+ * application's vertex shader is bound while they are.
+ */
+void setExtraStage(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+        uint8_t                     Stage,
+        bool                        Bound) {
+    auto& state = g_immState;
+
+    if (!(g_trackedState & (DRAW_STATE_LINK | DRAW_STATE_MERGE)) || pContext != g_immContext)
+        return;
+
+    state.extraStages = Bound ? (state.extraStages | Stage) : (state.extraStages & ~Stage);
+
+    if (g_trackedState & DRAW_STATE_LINK)
+        updateLinkedVertexShader(pContext, procs);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_GSSetShader(
+        ID3D11DeviceContext*        pContext,
+        ID3D11GeometryShader*       pShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT                        NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+    procs->GSSetShader(pContext, pShader, ppClassInstances, NumClassInstances);
+    setExtraStage(pContext, procs, PIPELINE_STAGE_GS, pShader != nullptr);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_HSSetShader(
+        ID3D11DeviceContext*        pContext,
+        ID3D11HullShader*           pShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT                        NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+    procs->HSSetShader(pContext, pShader, ppClassInstances, NumClassInstances);
+    setExtraStage(pContext, procs, PIPELINE_STAGE_HS, pShader != nullptr);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_DSSetShader(
+        ID3D11DeviceContext*        pContext,
+        ID3D11DomainShader*         pShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT                        NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+
+    flushPendingDraw(pContext);
+    procs->DSSetShader(pContext, pShader, ppClassInstances, NumClassInstances);
+    setExtraStage(pContext, procs, PIPELINE_STAGE_DS, pShader != nullptr);
+}
+
+/** Checks whether draws would not produce anything but depth */
+inline bool isDepthOnlyDraw(const ImmediateState& State) {
+    return State.psColorOnly && !State.colorTargets && !State.alphaToCoverage;
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetShader(
+        ID3D11DeviceContext*        pContext,
+        ID3D11PixelShader*          pPixelShader,
+        ID3D11ClassInstance* const* ppClassInstances,
+        UINT                        NumClassInstances) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext && (pPixelShader != g_immState.ps || NumClassInstances)) {
+        auto& state = g_immState;
+
+        flushPendingDraw(pContext);
+        state.ps = pPixelShader;
+
+        if (g_trackedState & DRAW_RULE_PS)
+            state.psId = getRuleShaderId(pPixelShader);
+
+        if (g_trackedState & DRAW_STATE_SHADER_COST)
+            bindShaderCostPixelShader(pPixelShader);
+
+        if (g_trackedState & DRAW_STATE_DEPTH_ONLY) {
+            state.psColorOnly = pPixelShader && !NumClassInstances && isColorOnlyShader(pPixelShader);
+            state.psNulled = isDepthOnlyDraw(state);
+        }
 
-struct DeviceProcs {
-    PFN_ID3D11Device_CreateBuffer CreateBuffer = nullptr;
-    PFN_ID3D11Device_CreateVertexShader CreateVertexShader = nullptr;
-    PFN_ID3D11Device_CreatePixelShader CreatePixelShader = nullptr;
-};
+        if (g_trackedState & DRAW_STATE_MERGE)
+            state.psPrimitiveId = pPixelShader && isPrimitiveIdShader(pPixelShader);
 
-using PFN_ID3D11DeviceContext_IASetIndexBuffer = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, DXGI_FORMAT, UINT);
-using PFN_ID3D11DeviceContext_Map = HRESULT(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, D3D11_MAP, UINT, D3D11_MAPPED_SUBRESOURCE*);
-using PFN_ID3D11DeviceContext_DrawIndexed = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, INT);
-using PFN_ID3D11DeviceContext_PSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11PixelShader*,ID3D11ClassInstance* const*, UINT);
-struct ContextProcs {
-    PFN_ID3D11DeviceContext_Map Map = nullptr;
-    PFN_ID3D11DeviceContext_IASetIndexBuffer IASetIndexBuffer = nullptr;
-    PFN_ID3D11DeviceContext_DrawIndexed DrawIndexed = nullptr;
-    PFN_ID3D11DeviceContext_PSSetShader                     PSSetShader                     = nullptr;
-};
+        if (g_trackedState & DRAW_STATE_HALF_RES) {
+            state.psHalfRes = !NumClassInstances && isHalfResShader(pPixelShader);
+            state.psParticle = !NumClassInstances && isHalfResParticleShader(pPixelShader);
+        }
 
-namespace {
-    mutex  g_hookMutex;
-    mutex  g_hookMutex2;
-    uint32_t g_installedHooks = 0U;
+        if (g_trackedState & DRAW_STATE_LINK)
+            updateLinkedVertexShader(pContext, procs);
+
+        /* The next draw picks the variant for the values it uses */
+        if (g_trackedState & DRAW_STATE_SPECIALIZE) {
+            state.psSpecialized = nullptr;
+            state.psSpecializable = !NumClassInstances && isSpecializablePixelShader(pPixelShader);
+        }
+    }
+
+    if (pContext == g_immContext && (g_immState.psNulled || g_immState.psSpecialized))
+        pPixelShader = getBoundPixelShader();
+
+    procs->PSSetShader(pContext, pPixelShader, ppClassInstances, NumClassInstances);
 }
 
-inline bool simd_equal(const std::array<uint32_t, 4>& arr1, const uint32_t* ptr) {
-    const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(arr1.data()));
-    const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+/**
+ * \brief Binds the pixel shader that depth-only draws should use
+ *
+ * Must be called after the state deciding this has changed.
+ */
+void updateDepthOnlyPixelShader(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs) {
+    auto& state = g_immState;
 
-    return (_mm_movemask_epi8(_mm_cmpeq_epi32(v1, v2)) == 0xFFFF);
+    if (!(g_trackedState & DRAW_STATE_DEPTH_ONLY) || state.psNulled == isDepthOnlyDraw(state))
+        return;
+
+    state.psNulled = !state.psNulled;
+    procs->PSSetShader(pContext, getBoundPixelShader(), nullptr, 0);
 }
-DeviceProcs   g_deviceProcs;
-ContextProcs  g_immContextProcs;
-ContextProcs  g_defContextProcs;
 
-constexpr uint32_t HOOK_DEVICE  = (1u << 0);
-constexpr uint32_t HOOK_IMM_CTX = (1u << 1);
-constexpr uint32_t HOOK_DEF_CTX = (1u << 2);
+/** Binds viewports, scaled down if scaled render targets are bound */
+void setViewports(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+        UINT                        NumViewports,
+  const D3D11_VIEWPORT*             pViewports) {
+    float scale = g_immState.viewportScale;
+
+    if (scale == 1.0f || !pViewports || NumViewports > D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE) {
+        procs->RSSetViewports(pContext, NumViewports, pViewports);
+        return;
+    }
 
-inline const DeviceProcs* getDeviceProcs([[maybe_unused]] ID3D11Device* pDevice) {
-    return &g_deviceProcs;
+    std::array<D3D11_VIEWPORT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> viewports;
+
+    for (uint32_t i = 0; i < NumViewports; i++) {
+        viewports[i] = pViewports[i];
+        viewports[i].TopLeftX *= scale;
+        viewports[i].TopLeftY *= scale;
+        viewports[i].Width *= scale;
+        viewports[i].Height *= scale;
+    }
+
+    procs->RSSetViewports(pContext, NumViewports, viewports.data());
 }
-inline const ContextProcs* getContextProcs(ID3D11DeviceContext* pContext) {
-    return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE
-        ? &g_immContextProcs
-        : &g_defContextProcs;
+
+/** Binds scissor rects, scaled down if scaled render targets are bound */
+void setScissorRects(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs,
+        UINT                        NumRects,
+  const D3D11_RECT*                 pRects) {
+    float scale = g_immState.viewportScale;
+
+    if (scale == 1.0f || !pRects || NumRects > D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE) {
+        procs->RSSetScissorRects(pContext, NumRects, pRects);
+        return;
+    }
+
+    std::array<D3D11_RECT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> rects;
+
+    for (uint32_t i = 0; i < NumRects; i++) {
+        rects[i].left = LONG(float(pRects[i].left) * scale);
+        rects[i].top = LONG(float(pRects[i].top) * scale);
+        rects[i].right = LONG(float(pRects[i].right) * scale);
+        rects[i].bottom = LONG(float(pRects[i].bottom) * scale);
+    }
+
+    procs->RSSetScissorRects(pContext, NumRects, rects.data());
 }
 
-inline bool isImmediatecontext(
-        ID3D11DeviceContext*      pContext) {
-  return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE;
+/**
+ * \brief Rebinds viewports and scissors for the bound render targets
+ *
+ * The application may set them before binding a scaled target,
+ * or keep them when switching back to a full-size target.
+ */
+void updateScaledViewports(
+        ID3D11DeviceContext*        pContext,
+        const ContextProcs*         procs) {
+    auto& state = g_immState;
+
+    if (!(g_trackedState & DRAW_STATE_VIEWPORT_SCALE) || state.appliedViewportScale == state.viewportScale)
+        return;
+
+    const auto& vp = g_immViewports;
+    setViewports(pContext, procs, vp.viewportCount, vp.viewports.data());
+    setScissorRects(pContext, procs, vp.scissorCount, vp.scissors.data());
+
+    state.appliedViewportScale = state.viewportScale;
 }
-std::unordered_map<ID3D11PixelShader*, std::vector<uint8_t>> g_PixelShaderBlobs;
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreateVertexShader(
-        ID3D11Device*           pDevice,
-        const void*             pShaderBytecode,
-        SIZE_T                  BytecodeLength,
-        ID3D11ClassLinkage*     pClassLinkage,
-        ID3D11VertexShader**    ppVertexShader) {
-    const auto* procs = getDeviceProcs(pDevice);
 
-    return procs->CreateVertexShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppVertexShader);
+/** Tracks the formats of the first render target and the depth buffer */
+inline void trackRenderTargets(
+        UINT                        NumViews,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView*     pDepthStencilView) {
+    if (g_trackedState & (DRAW_STATE_DEPTH_ONLY | DRAW_STATE_SHADOW)) {
+        bool colorTargets = false;
+
+        for (uint32_t i = 0; i < NumViews && ppRenderTargetViews && !colorTargets; i++)
+            colorTargets = ppRenderTargetViews[i] != nullptr;
+
+        g_immState.colorTargets = colorTargets;
+        g_immState.depthTarget = pDepthStencilView != nullptr;
+    }
+
+    if (g_trackedState & DRAW_STATE_VIEWPORT_SCALE) {
+        float scale = bindDynamicResolutionTargets(NumViews, ppRenderTargetViews, pDepthStencilView);
+
+        if (g_config.shadowMapSize && isScaledShadowMap(pDepthStencilView))
+            scale = getShadowMapScale();
+
+        g_immState.viewportScale = scale;
+    }
+
+    if (g_trackedState & DRAW_RULE_RT_FORMAT) {
+        D3D11_RENDER_TARGET_VIEW_DESC desc = { };
+
+        if (NumViews && ppRenderTargetViews && ppRenderTargetViews[0])
+            ppRenderTargetViews[0]->GetDesc(&desc);
+
+        g_immState.rtFormat = desc.Format;
+    }
+
+    if (g_trackedState & DRAW_STATE_DEPTH) {
+        D3D11_DEPTH_STENCIL_VIEW_DESC desc = { };
+
+        if (pDepthStencilView)
+            pDepthStencilView->GetDesc(&desc);
+
+        g_immState.dsvFormat = desc.Format;
+    }
 }
 
-ID3D11PixelShader* DefPS = nullptr;
-ID3D11PixelShader* OriginalDefPS = nullptr;
-ID3D11VertexShader* DefVS = nullptr;
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargets(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumViews,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView*     pDepthStencilView) {
+    const auto* procs = getContextProcs(pContext);
 
-HRESULT STDMETHODCALLTYPE ID3D11Device_CreatePixelShader(
-    ID3D11Device* pDevice,
-    const void* pShaderBytecode,
-    SIZE_T                  BytecodeLength,
-    ID3D11ClassLinkage* pClassLinkage,
-    ID3D11PixelShader** ppPixelShader) {
-    const auto* procs = getDeviceProcs(pDevice);
-	
-	if (!DefPS) {
-		procs->CreatePixelShader(pDevice, data.data(), data.size(), pClassLinkage, &DefPS);
-		*ppPixelShader = DefPS;
-		DefPS->AddRef();
-        return procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
-	}
-	if (!OriginalDefPS) {
-		procs->CreatePixelShader(pDevice, original.data(), original.size(), pClassLinkage, &OriginalDefPS);
-		*ppPixelShader = OriginalDefPS;
-		OriginalDefPS->AddRef();
-        return procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
-	}
-    return procs->CreatePixelShader(pDevice, pShaderBytecode, BytecodeLength, pClassLinkage, ppPixelShader);
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        trackRenderTargets(NumViews, ppRenderTargetViews, pDepthStencilView);
+    }
+
+    procs->OMSetRenderTargets(pContext, NumViews, ppRenderTargetViews, pDepthStencilView);
+
+    if (pContext == g_immContext) {
+        updateDepthOnlyPixelShader(pContext, procs);
+        updateScaledViewports(pContext, procs);
+    }
 }
 
-void STDMETHODCALLTYPE ID3D11DeviceContext_DrawIndexed(
-        ID3D11DeviceContext* pContext,
-        UINT IndexCount,
-        UINT StartIndexLocation,
-        INT BaseVertexLocation) {
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumRTVs,
+        ID3D11RenderTargetView* const* ppRenderTargetViews,
+        ID3D11DepthStencilView*     pDepthStencilView,
+        UINT                        UAVStartSlot,
+        UINT                        NumUAVs,
+        ID3D11UnorderedAccessView* const* ppUnorderedAccessViews,
+  const UINT*                       pUAVInitialCounts) {
     const auto* procs = getContextProcs(pContext);
-    if (IndexCount == 9000 || IndexCount == 3942) {                
-        pContext->PSSetShader(DefPS, nullptr, 0);
-        procs->DrawIndexed(pContext, IndexCount, StartIndexLocation, BaseVertexLocation);
-        pContext->PSSetShader(nullptr, nullptr, 0);
-        return;
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+
+        if (NumRTVs != D3D11_KEEP_RENDER_TARGETS_AND_DEPTH_STENCIL)
+            trackRenderTargets(NumRTVs, ppRenderTargetViews, pDepthStencilView);
+    }
+
+    procs->OMSetRenderTargetsAndUnorderedAccessViews(pContext, NumRTVs, ppRenderTargetViews,
+        pDepthStencilView, UAVStartSlot, NumUAVs, ppUnorderedAccessViews, pUAVInitialCounts);
+
+    if (pContext == g_immContext) {
+        updateDepthOnlyPixelShader(pContext, procs);
+        updateScaledViewports(pContext, procs);
+    }
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetBlendState(
+        ID3D11DeviceContext*        pContext,
+        ID3D11BlendState*           pBlendState,
+  const FLOAT                       BlendFactor[4],
+        UINT                        SampleMask) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+
+        /* Alpha to coverage takes the shader's output even without render targets */
+        if (g_trackedState & DRAW_STATE_DEPTH_ONLY) {
+            D3D11_BLEND_DESC desc = { };
+
+            if (pBlendState)
+                pBlendState->GetDesc(&desc);
+
+            g_immState.alphaToCoverage = desc.AlphaToCoverageEnable;
+        }
+    }
+
+    procs->OMSetBlendState(pContext, pBlendState, BlendFactor, SampleMask);
+
+    if (pContext == g_immContext)
+        updateDepthOnlyPixelShader(pContext, procs);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_OMSetDepthStencilState(
+        ID3D11DeviceContext*        pContext,
+        ID3D11DepthStencilState*    pDepthStencilState,
+        UINT                        StencilRef) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+
+        if (g_trackedState & DRAW_STATE_DEPTH) {
+            uint8_t flags = DRAW_DEPTH_TEST | DRAW_DEPTH_WRITE;
+
+            if (pDepthStencilState) {
+                D3D11_DEPTH_STENCIL_DESC desc = { };
+                pDepthStencilState->GetDesc(&desc);
+
+                flags = (desc.DepthEnable ? DRAW_DEPTH_TEST : 0u)
+                      | (desc.DepthEnable && desc.DepthWriteMask ? DRAW_DEPTH_WRITE : 0u);
+            }
+
+            g_immState.depthFlags = flags;
+        }
+    }
+
+    procs->OMSetDepthStencilState(pContext, pDepthStencilState, StencilRef);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSSetViewports(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumViewports,
+  const D3D11_VIEWPORT*             pViewports) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+
+        if (g_trackedState & DRAW_RULE_VIEWPORT) {
+            bool valid = NumViewports && pViewports;
+            g_immState.viewportWidth = valid ? uint32_t(pViewports[0].Width) : 0u;
+            g_immState.viewportHeight = valid ? uint32_t(pViewports[0].Height) : 0u;
+        }
+
+        /* Cascades are laid out in a 2x2 atlas, or side by side for two */
+        if ((g_trackedState & DRAW_STATE_SHADOW) && NumViewports && pViewports) {
+            const auto& vp = pViewports[0];
+            g_immState.cascade = (vp.TopLeftX >= vp.Width ? 1u : 0u) + (vp.TopLeftY >= vp.Height ? 2u : 0u);
+        }
+
+        if (g_trackedState & DRAW_STATE_VIEWPORT_SCALE) {
+            auto& vp = g_immViewports;
+            vp.viewportCount = pViewports ? std::min<UINT>(NumViewports, vp.viewports.size()) : 0u;
+
+            for (uint32_t i = 0; i < vp.viewportCount; i++)
+                vp.viewports[i] = pViewports[i];
+
+            setViewports(pContext, procs, NumViewports, pViewports);
+            return;
+        }
+    }
+
+    procs->RSSetViewports(pContext, NumViewports, pViewports);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_RSSetScissorRects(
+        ID3D11DeviceContext*        pContext,
+        UINT                        NumRects,
+  const D3D11_RECT*                 pRects) {
+    const auto* procs = getContextProcs(pContext);
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+
+        if (g_trackedState & DRAW_STATE_VIEWPORT_SCALE) {
+            auto& vp = g_immViewports;
+            vp.scissorCount = pRects ? std::min<UINT>(NumRects, vp.scissors.size()) : 0u;
+
+            for (uint32_t i = 0; i < vp.scissorCount; i++)
+                vp.scissors[i] = pRects[i];
+
+            setScissorRects(pContext, procs, NumRects, pRects);
+            return;
+        }
+    }
+
+    procs->RSSetScissorRects(pContext, NumRects, pRects);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_VSSetConstantBuffers(
+        ID3D11DeviceContext*        pContext,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers) {
+    const auto* procs = getContextProcs(pContext);
+    auto& state = g_immState;
+
+    if (pContext == g_immContext && !isRedundantBinding(state.vsConstantBuffers,
+            state.vsConstantBufferRanges, StartSlot, NumBuffers, ppConstantBuffers, false)) {
+        flushPendingDraw(pContext);
+        trackConstantBuffers(state.vsConstantBuffers, state.vsConstantBufferRanges,
+            StartSlot, NumBuffers, ppConstantBuffers, false);
+    }
+
+    procs->VSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext_PSSetConstantBuffers(
+        ID3D11DeviceContext*        pContext,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers) {
+    const auto* procs = getContextProcs(pContext);
+    auto& state = g_immState;
+
+    if (pContext == g_immContext && !isRedundantBinding(state.psConstantBuffers,
+            state.psConstantBufferRanges, StartSlot, NumBuffers, ppConstantBuffers, false)) {
+        flushPendingDraw(pContext);
+        trackConstantBuffers(state.psConstantBuffers, state.psConstantBufferRanges,
+            StartSlot, NumBuffers, ppConstantBuffers, false);
+    }
+
+    procs->PSSetConstantBuffers(pContext, StartSlot, NumBuffers, ppConstantBuffers);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_VSSetConstantBuffers1(
+        ID3D11DeviceContext1*       pContext,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers,
+  const UINT*                       pFirstConstant,
+  const UINT*                       pNumConstants) {
+    const auto* procs = getContextProcs(pContext);
+    auto& state = g_immState;
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        trackConstantBuffers(state.vsConstantBuffers, state.vsConstantBufferRanges,
+            StartSlot, NumBuffers, ppConstantBuffers, pFirstConstant != nullptr);
+    }
+
+    procs->VSSetConstantBuffers1(pContext, StartSlot, NumBuffers, ppConstantBuffers, pFirstConstant, pNumConstants);
+}
+
+void STDMETHODCALLTYPE ID3D11DeviceContext1_PSSetConstantBuffers1(
+        ID3D11DeviceContext1*       pContext,
+        UINT                        StartSlot,
+        UINT                        NumBuffers,
+        ID3D11Buffer* const*        ppConstantBuffers,
+  const UINT*                       pFirstConstant,
+  const UINT*                       pNumConstants) {
+    const auto* procs = getContextProcs(pContext);
+    auto& state = g_immState;
+
+    if (pContext == g_immContext) {
+        flushPendingDraw(pContext);
+        trackConstantBuffers(state.psConstantBuffers, state.psConstantBufferRanges,
+            StartSlot, NumBuffers, ppConstantBuffers, pFirstConstant != nullptr);
     }
 
-    procs->DrawIndexed(pContext, IndexCount, StartIndexLocation, BaseVertexLocation);
+    procs->PSSetConstantBuffers1(pContext, StartSlot, NumBuffers, ppConstantBuffers, pFirstConstant, pNumConstants);
+}
+
+/** Frame boundary work before the swap chain presents */
+void beginPresent() {
+    flushPendingDraw(g_immContext);
+
+    if (g_config.shareImmutableBuffers)
+        endBufferFrame();
+
+    if (g_config.learnDraws)
+        endLearningFrame();
+
+    if (g_config.shaderReport)
+        endShaderCostFrame();
+
+    if (g_config.cullSmallCasters)
+        endShadowFrame();
+
+    if (!g_config.grassShaders.empty())
+        endVegetationFrame();
+
+    if (isHalfResEnabled())
+        endPostFxFrame(g_immContext);
+}
+
+/** Frame boundary work after presenting, given when Present was entered */
+void endPresent(std::chrono::steady_clock::time_point Start) {
+    if (isDynamicResolutionEnabled())
+        endDynamicResolutionFrame(std::chrono::steady_clock::now() - Start);
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_Present(
+        IDXGISwapChain*             pSwapChain,
+        UINT                        SyncInterval,
+        UINT                        Flags) {
+    beginPresent();
+
+    auto start = std::chrono::steady_clock::now();
+    HRESULT hr = g_dxgiProcs.Present(pSwapChain, SyncInterval, Flags);
+
+    endPresent(start);
+    return hr;
+}
+
+/** Queries the back buffer size for render target matching */
+void updateScreenSize(IDXGISwapChain* pSwapChain) {
+    DXGI_SWAP_CHAIN_DESC desc = { };
+
+    if (SUCCEEDED(pSwapChain->GetDesc(&desc)))
+        setScreenSize(desc.BufferDesc.Width, desc.BufferDesc.Height);
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain_ResizeBuffers(
+        IDXGISwapChain*             pSwapChain,
+        UINT                        BufferCount,
+        UINT                        Width,
+        UINT                        Height,
+        DXGI_FORMAT                 NewFormat,
+        UINT                        SwapChainFlags) {
+    HRESULT hr = g_dxgiProcs.ResizeBuffers(pSwapChain, BufferCount, Width, Height, NewFormat, SwapChainFlags);
+
+    /* A size of 0 means the window size, so ask the swap chain */
+    if (SUCCEEDED(hr))
+        updateScreenSize(pSwapChain);
+
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGISwapChain1_Present1(
+        IDXGISwapChain1*            pSwapChain,
+        UINT                        SyncInterval,
+        UINT                        Flags,
+  const DXGI_PRESENT_PARAMETERS*    pPresentParameters) {
+    beginPresent();
+
+    auto start = std::chrono::steady_clock::now();
+    HRESULT hr = g_dxgiProcs.Present1(pSwapChain, SyncInterval, Flags, pPresentParameters);
+
+    endPresent(start);
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory_CreateSwapChain(
+        IDXGIFactory*               pFactory,
+        IUnknown*                   pDevice,
+        DXGI_SWAP_CHAIN_DESC*       pDesc,
+        IDXGISwapChain**            ppSwapChain) {
+    HRESULT hr = g_dxgiProcs.CreateSwapChain(pFactory, pDevice, pDesc, ppSwapChain);
+
+    if (SUCCEEDED(hr) && ppSwapChain && *ppSwapChain)
+        hookSwapChain(*ppSwapChain);
+
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE IDXGIFactory2_CreateSwapChainForHwnd(
+        IDXGIFactory2*              pFactory,
+        IUnknown*                   pDevice,
+        HWND                        hWnd,
+  const DXGI_SWAP_CHAIN_DESC1*      pDesc,
+  const DXGI_SWAP_CHAIN_FULLSCREEN_DESC* pFullscreenDesc,
+        IDXGIOutput*                pRestrictToOutput,
+        IDXGISwapChain1**           ppSwapChain) {
+    HRESULT hr = g_dxgiProcs.CreateSwapChainForHwnd(pFactory, pDevice, hWnd,
+        pDesc, pFullscreenDesc, pRestrictToOutput, ppSwapChain);
+
+    if (SUCCEEDED(hr) && ppSwapChain && *ppSwapChain)
+        hookSwapChain(*ppSwapChain);
+
+    return hr;
 }
 
 
+/**
+ * \brief Hook that issues the pending draw before forwarding the call
+ *
+ * Used for context methods that change state or consume the results
+ * of previous draws but need no other processing. Only installed on
+ * the immediate context, which shares its code with deferred contexts.
+ */
+template<uint32_t Index, typename Iface, typename Method>
+struct FlushHook;
+
+template<uint32_t Index, typename Iface, typename Ret, typename... Args>
+struct FlushHook<Index, Iface, Ret (STDMETHODCALLTYPE Iface::*)(Args...)> {
+    using Proc = Ret STDMETHODCALLTYPE (Iface*, Args...);
+
+    static inline Proc* orig = nullptr;
+
+    static Ret STDMETHODCALLTYPE hook(Iface* pContext, Args... args) {
+        flushPendingDraw(pContext);
+        return orig(pContext, args...);
+    }
+};
+
+
 #define HOOK_PROC(iface, object, table, index, proc) \
   hookProc(object, #iface "::" #proc, &table->proc, &iface ## _ ## proc, index)
 
@@ -162,6 +2226,73 @@ void hookProc(void* pObject,[[maybe_unused]] const char* pName, T** ppOrig, T* p
         log("Created hook for ", pName, " @ ", reinterpret_cast<void*>(pHook));
     #endif
 }
+#define HOOK_FLUSH(iface, object, index, method) \
+  hookProc(object, #iface "::" #method, \
+    &FlushHook<index, iface, decltype(&iface::method)>::orig, \
+    &FlushHook<index, iface, decltype(&iface::method)>::hook, index)
+
+/** Hooks swap chain creation on the factory that owns the device */
+void hookFactory(ID3D11Device* pDevice) {
+    IDXGIDevice* dxgiDevice = nullptr;
+    IDXGIAdapter* adapter = nullptr;
+    IDXGIFactory* factory = nullptr;
+
+    if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(&dxgiDevice)))) {
+        if (SUCCEEDED(dxgiDevice->GetAdapter(&adapter))) {
+            adapter->GetParent(IID_PPV_ARGS(&factory));
+            adapter->Release();
+        }
+
+        dxgiDevice->Release();
+    }
+
+    if (!factory) {
+#ifndef NDEBUG
+        log("Failed to query DXGI factory");
+#endif
+        return;
+    }
+
+    DxgiProcs* procs = &g_dxgiProcs;
+    HOOK_PROC(IDXGIFactory, factory, procs, 10, CreateSwapChain);
+
+    IDXGIFactory2* factory2 = nullptr;
+
+    if (SUCCEEDED(factory->QueryInterface(IID_PPV_ARGS(&factory2)))) {
+        HOOK_PROC(IDXGIFactory2, factory2, procs, 15, CreateSwapChainForHwnd);
+        factory2->Release();
+    }
+
+    factory->Release();
+}
+
+void hookSwapChain(IDXGISwapChain* pSwapChain) {
+    const std::lock_guard lock(g_hookMutex);
+
+    if (g_installedHooks & HOOK_SWAPCHAIN)
+        return;
+
+#ifndef NDEBUG
+    log("Hooking swap chain ", pSwapChain);
+#endif
+
+    DxgiProcs* procs = &g_dxgiProcs;
+    HOOK_PROC(IDXGISwapChain, pSwapChain, procs, 8, Present);
+
+    if (g_config.formatPolicies || g_config.dynamicResolution) {
+      HOOK_PROC(IDXGISwapChain, pSwapChain, procs, 13, ResizeBuffers);
+      updateScreenSize(pSwapChain);
+    }
+
+    IDXGISwapChain1* swapChain1 = nullptr;
+
+    if (SUCCEEDED(pSwapChain->QueryInterface(IID_PPV_ARGS(&swapChain1)))) {
+        HOOK_PROC(IDXGISwapChain1, swapChain1, procs, 22, Present1);
+        swapChain1->Release();
+    }
+
+    g_installedHooks |= HOOK_SWAPCHAIN;
+}
 
 void hookDevice(ID3D11Device* pDevice) {
     const std::lock_guard lock(g_hookMutex);
@@ -174,10 +2305,33 @@ void hookDevice(ID3D11Device* pDevice) {
     log("Hooking device ", pDevice);
 #endif
 
+    loadConfig();
+    initBufferPool(pDevice);
+
     DeviceProcs* procs = &g_deviceProcs;
-    // HOOK_PROC(ID3D11Device, pDevice, procs, 12,  CreateVertexShader);
+    HOOK_PROC(ID3D11Device, pDevice, procs, 3,   CreateBuffer);
+
+    if (g_config.shadowMapSize || g_config.formatPolicies || g_config.dynamicResolution)
+      HOOK_PROC(ID3D11Device, pDevice, procs, 5,   CreateTexture2D);
+
+    if (g_config.formatPolicies) {
+      HOOK_PROC(ID3D11Device, pDevice, procs, 7,   CreateShaderResourceView);
+      HOOK_PROC(ID3D11Device, pDevice, procs, 9,   CreateRenderTargetView);
+      HOOK_PROC(ID3D11Device, pDevice, procs, 10,  CreateDepthStencilView);
+    }
+
+    if (g_config.autoInstancing || g_config.optimizeShaders || g_config.linkShaders
+     || g_config.shaderReport || g_config.dumpShaders || !g_config.drawRules.empty() || needsShaderHashes())
+      HOOK_PROC(ID3D11Device, pDevice, procs, 12,  CreateVertexShader);
+
     HOOK_PROC(ID3D11Device, pDevice, procs, 15,  CreatePixelShader);
 
+    hookFactory(pDevice);
+    initShaderPacks(pDevice);
+    compileDrawRules(pDevice);
+    initDynamicResolution(pDevice);
+    initPostFx(pDevice);
+
     g_installedHooks |= HOOK_DEVICE;
 }
 void hookContext(ID3D11DeviceContext* pContext) {
@@ -195,6 +2349,146 @@ void hookContext(ID3D11DeviceContext* pContext) {
     return;
 
    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 12, DrawIndexed);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 13, Draw);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 14, Map);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 15, Unmap);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 18, IASetVertexBuffers);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 19, IASetIndexBuffer);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 20, DrawIndexedInstanced);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 21, DrawInstanced);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 24, IASetPrimitiveTopology);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 38, DrawAuto);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 39, DrawIndexedInstancedIndirect);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 40, DrawInstancedIndirect);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 41, Dispatch);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 42, DispatchIndirect);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 46, CopySubresourceRegion);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 47, CopyResource);
+   HOOK_PROC(ID3D11DeviceContext, pContext, procs, 110, ClearState);
+
+  if (flag & HOOK_IMM_CTX) {
+    g_immContext = pContext;
+
+    g_drawFeatures = (g_config.mergeDrawCalls || g_config.autoInstancing ? DRAW_FEATURE_FLUSH : 0u)
+                   | (g_config.reorderIndexBuffers ? DRAW_FEATURE_REORDER : 0u)
+                   | (g_config.autoInstancing ? DRAW_FEATURE_INSTANCING : 0u)
+                   | (g_config.mergeDrawCalls ? DRAW_FEATURE_MERGE : 0u)
+                   | (getDrawRuleFields() ? DRAW_FEATURE_RULES : 0u)
+                   | (g_config.learnDraws ? DRAW_FEATURE_LEARN : 0u)
+                   | (g_config.cullSmallCasters ? DRAW_FEATURE_SHADOW_CULL : 0u)
+                   | (g_config.grassShaders.empty() ? 0u : DRAW_FEATURE_GRASS)
+                   | (isDynamicResolutionEnabled() ? DRAW_FEATURE_DYNRES : 0u)
+                   | (isHalfResEnabled() ? DRAW_FEATURE_HALF_RES : 0u)
+                   | (g_config.specializeShaders ? DRAW_FEATURE_SPECIALIZE : 0u)
+                   | (g_config.shaderReport ? DRAW_FEATURE_SHADER_COST : 0u);
+
+    /* Index count rules need no bound state, see applyUntrackedDrawRule */
+    g_trackedState = getDrawRuleFields() & ~DRAW_RULE_COUNT;
+
+    if (g_config.nullDepthOnlyPixelShader)
+      g_trackedState |= DRAW_STATE_DEPTH_ONLY;
+
+    if (g_config.cullSmallCasters)
+      g_trackedState |= DRAW_STATE_SHADOW;
+
+    if (!g_config.grassShaders.empty())
+      g_trackedState |= DRAW_STATE_GRASS;
+
+    if (g_config.shadowMapSize || isDynamicResolutionEnabled())
+      g_trackedState |= DRAW_STATE_VIEWPORT_SCALE;
+
+    if (isHalfResEnabled())
+      g_trackedState |= DRAW_STATE_HALF_RES;
+
+    if (g_config.mergeDrawCalls)
+      g_trackedState |= DRAW_STATE_MERGE;
+
+    if (g_config.linkShaders)
+      g_trackedState |= DRAW_STATE_LINK;
+
+    if (g_config.specializeShaders)
+      g_trackedState |= DRAW_STATE_SPECIALIZE;
+
+    if (g_config.shaderReport)
+      g_trackedState |= DRAW_STATE_SHADER_COST | DRAW_RULE_VIEWPORT;
+
+    if (g_config.learnDraws) {
+      g_trackedState |= DRAW_RULE_VS | DRAW_RULE_PS | DRAW_RULE_RT_FORMAT
+                      | DRAW_RULE_VIEWPORT | DRAW_STATE_DEPTH;
+    }
+  }
+
+  if ((flag & HOOK_IMM_CTX) && (g_config.mergeDrawCalls || g_config.autoInstancing || g_trackedState)) {
+    g_stateHooked = true;
+
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 7,   VSSetConstantBuffers);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 8,   PSSetShaderResources);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 9,   PSSetShader);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 10,  PSSetSamplers);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 11,  VSSetShader);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 16,  PSSetConstantBuffers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 17,  IASetInputLayout);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 22,  GSSetConstantBuffers);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 23,  GSSetShader);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 25,  VSSetShaderResources);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 26,  VSSetSamplers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 27,  Begin);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 28,  End);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 30,  SetPredication);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 31,  GSSetShaderResources);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 32,  GSSetSamplers);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 33,  OMSetRenderTargets);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 34,  OMSetRenderTargetsAndUnorderedAccessViews);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 35,  OMSetBlendState);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 36,  OMSetDepthStencilState);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 37,  SOSetTargets);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 43,  RSSetState);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 44,  RSSetViewports);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 45,  RSSetScissorRects);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 48,  UpdateSubresource);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 49,  CopyStructureCount);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 50,  ClearRenderTargetView);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 51,  ClearUnorderedAccessViewUint);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 52,  ClearUnorderedAccessViewFloat);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 53,  ClearDepthStencilView);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 54,  GenerateMips);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 55,  SetResourceMinLOD);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 57,  ResolveSubresource);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 58,  ExecuteCommandList);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 59,  HSSetShaderResources);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 60,  HSSetShader);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 61,  HSSetSamplers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 62,  HSSetConstantBuffers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 63,  DSSetShaderResources);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 64,  DSSetShader);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 65,  DSSetSamplers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 66,  DSSetConstantBuffers);
+    HOOK_PROC(ID3D11DeviceContext, pContext, procs, 67,  CSSetShaderResources);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 68,  CSSetUnorderedAccessViews);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 69,  CSSetShader);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 70,  CSSetSamplers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 71,  CSSetConstantBuffers);
+    HOOK_FLUSH(ID3D11DeviceContext, pContext, 111, Flush);
+
+    ID3D11DeviceContext1* context1 = nullptr;
+
+    if (SUCCEEDED(pContext->QueryInterface(IID_PPV_ARGS(&context1)))) {
+      HOOK_PROC(ID3D11DeviceContext1, context1, procs, 115, CopySubresourceRegion1);
+      HOOK_PROC(ID3D11DeviceContext1, context1, procs, 116, UpdateSubresource1);
+      HOOK_PROC(ID3D11DeviceContext1, context1, procs, 117, DiscardResource);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 118, DiscardView);
+      HOOK_PROC(ID3D11DeviceContext1, context1, procs, 119, VSSetConstantBuffers1);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 120, HSSetConstantBuffers1);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 121, DSSetConstantBuffers1);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 122, GSSetConstantBuffers1);
+      HOOK_PROC(ID3D11DeviceContext1, context1, procs, 123, PSSetConstantBuffers1);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 124, CSSetConstantBuffers1);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 131, SwapDeviceContextState);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 132, ClearView);
+      HOOK_FLUSH(ID3D11DeviceContext1, context1, 133, DiscardView1);
+      context1->Release();
+    }
+  }
 
   g_installedHooks |= flag;
 
@@ -1,16 +1,237 @@
 #ifndef IMPL_H
 #define IMPL_H
 
+#include <array>
 #include <bit>
 #include <cstdint>
 #include <d3d11.h>
+#include <d3d11_1.h>
+#include <dxgi1_2.h>
 
 #include "log.h"
 
 namespace atfix {
 
+/** Hooking-related stuff */
+using PFN_ID3D11Device_CreateVertexShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11VertexShader**);
+using PFN_ID3D11Device_CreatePixelShader = HRESULT(STDMETHODCALLTYPE*) (ID3D11Device*, const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11PixelShader**);
+using PFN_ID3D11Device_CreateBuffer = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_BUFFER_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Buffer**);
+using PFN_ID3D11Device_CreateTexture2D = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, const D3D11_TEXTURE2D_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Texture2D**);
+using PFN_ID3D11Device_CreateShaderResourceView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_SHADER_RESOURCE_VIEW_DESC*, ID3D11ShaderResourceView**);
+using PFN_ID3D11Device_CreateRenderTargetView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_RENDER_TARGET_VIEW_DESC*, ID3D11RenderTargetView**);
+using PFN_ID3D11Device_CreateDepthStencilView = HRESULT(STDMETHODCALLTYPE*)(ID3D11Device*, ID3D11Resource*, const D3D11_DEPTH_STENCIL_VIEW_DESC*, ID3D11DepthStencilView**);
+
+struct DeviceProcs {
+    PFN_ID3D11Device_CreateBuffer CreateBuffer = nullptr;
+    PFN_ID3D11Device_CreateTexture2D CreateTexture2D = nullptr;
+    PFN_ID3D11Device_CreateShaderResourceView CreateShaderResourceView = nullptr;
+    PFN_ID3D11Device_CreateRenderTargetView CreateRenderTargetView = nullptr;
+    PFN_ID3D11Device_CreateDepthStencilView CreateDepthStencilView = nullptr;
+    PFN_ID3D11Device_CreateVertexShader CreateVertexShader = nullptr;
+    PFN_ID3D11Device_CreatePixelShader CreatePixelShader = nullptr;
+};
+
+using PFN_ID3D11DeviceContext_IASetVertexBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*, const UINT*, const UINT*);
+using PFN_ID3D11DeviceContext_IASetIndexBuffer = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, DXGI_FORMAT, UINT);
+using PFN_ID3D11DeviceContext_Map = HRESULT(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, D3D11_MAP, UINT, D3D11_MAPPED_SUBRESOURCE*);
+using PFN_ID3D11DeviceContext_Unmap = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT);
+using PFN_ID3D11DeviceContext_CopyResource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, ID3D11Resource*);
+using PFN_ID3D11DeviceContext_CopySubresourceRegion = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, UINT, UINT, UINT, ID3D11Resource*, UINT, const D3D11_BOX*);
+using PFN_ID3D11DeviceContext_DrawIndexed = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, INT);
+using PFN_ID3D11DeviceContext_DrawIndexedInstanced = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, UINT, INT, UINT);
+using PFN_ID3D11DeviceContext_DrawIndexedInstancedIndirect = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_Draw = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT);
+using PFN_ID3D11DeviceContext_DrawInstanced = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext_DrawAuto = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_DrawInstancedIndirect = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_Dispatch = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext_DispatchIndirect = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Buffer*, UINT);
+using PFN_ID3D11DeviceContext_IASetPrimitiveTopology = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, D3D11_PRIMITIVE_TOPOLOGY);
+using PFN_ID3D11DeviceContext_ClearState = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*);
+using PFN_ID3D11DeviceContext_PSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11PixelShader*,ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_VSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11VertexShader*, ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_GSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11GeometryShader*, ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_HSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11HullShader*, ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_DSSetShader = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11DomainShader*, ID3D11ClassInstance* const*, UINT);
+using PFN_ID3D11DeviceContext_VSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_PSSetConstantBuffers = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11Buffer* const*);
+using PFN_ID3D11DeviceContext_PSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_CSSetShaderResources = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, UINT, ID3D11ShaderResourceView* const*);
+using PFN_ID3D11DeviceContext_ClearRenderTargetView = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11RenderTargetView*, const FLOAT[4]);
+using PFN_ID3D11DeviceContext_ClearDepthStencilView = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11DepthStencilView*, UINT, FLOAT, UINT8);
+using PFN_ID3D11DeviceContext_UpdateSubresource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT);
+using PFN_ID3D11DeviceContext_OMSetRenderTargets = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*);
+using PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, ID3D11RenderTargetView* const*, ID3D11DepthStencilView*, UINT, UINT, ID3D11UnorderedAccessView* const*, const UINT*);
+using PFN_ID3D11DeviceContext_OMSetBlendState = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11BlendState*, const FLOAT[4], UINT);
+using PFN_ID3D11DeviceContext_OMSetDepthStencilState = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11DepthStencilState*, UINT);
+using PFN_ID3D11DeviceContext_RSSetViewports = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, const D3D11_VIEWPORT*);
+using PFN_ID3D11DeviceContext_RSSetScissorRects = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, UINT, const D3D11_RECT*);
+using PFN_ID3D11DeviceContext_ExecuteCommandList = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext*, ID3D11CommandList*, BOOL);
+using PFN_ID3D11DeviceContext1_CopySubresourceRegion1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*, UINT, UINT, UINT, UINT, ID3D11Resource*, UINT, const D3D11_BOX*, UINT);
+using PFN_ID3D11DeviceContext1_UpdateSubresource1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*, UINT, const D3D11_BOX*, const void*, UINT, UINT, UINT);
+using PFN_ID3D11DeviceContext1_DiscardResource = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, ID3D11Resource*);
+using PFN_ID3D11DeviceContext1_VSSetConstantBuffers1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, UINT, UINT, ID3D11Buffer* const*, const UINT*, const UINT*);
+using PFN_ID3D11DeviceContext1_PSSetConstantBuffers1 = void(STDMETHODCALLTYPE*)(ID3D11DeviceContext1*, UINT, UINT, ID3D11Buffer* const*, const UINT*, const UINT*);
+struct ContextProcs {
+    PFN_ID3D11DeviceContext_Map Map = nullptr;
+    PFN_ID3D11DeviceContext_Unmap Unmap = nullptr;
+    PFN_ID3D11DeviceContext_IASetVertexBuffers IASetVertexBuffers = nullptr;
+    PFN_ID3D11DeviceContext_IASetIndexBuffer IASetIndexBuffer = nullptr;
+    PFN_ID3D11DeviceContext_CopyResource CopyResource = nullptr;
+    PFN_ID3D11DeviceContext_CopySubresourceRegion CopySubresourceRegion = nullptr;
+    PFN_ID3D11DeviceContext_IASetPrimitiveTopology IASetPrimitiveTopology = nullptr;
+    PFN_ID3D11DeviceContext_DrawIndexed DrawIndexed = nullptr;
+    PFN_ID3D11DeviceContext_DrawIndexedInstanced DrawIndexedInstanced = nullptr;
+    PFN_ID3D11DeviceContext_DrawIndexedInstancedIndirect DrawIndexedInstancedIndirect = nullptr;
+    PFN_ID3D11DeviceContext_Draw Draw = nullptr;
+    PFN_ID3D11DeviceContext_DrawInstanced DrawInstanced = nullptr;
+    PFN_ID3D11DeviceContext_DrawAuto DrawAuto = nullptr;
+    PFN_ID3D11DeviceContext_DrawInstancedIndirect DrawInstancedIndirect = nullptr;
+    PFN_ID3D11DeviceContext_Dispatch Dispatch = nullptr;
+    PFN_ID3D11DeviceContext_DispatchIndirect DispatchIndirect = nullptr;
+    PFN_ID3D11DeviceContext_ClearState ClearState = nullptr;
+    PFN_ID3D11DeviceContext_PSSetShader                     PSSetShader                     = nullptr;
+    PFN_ID3D11DeviceContext_VSSetShader VSSetShader = nullptr;
+    PFN_ID3D11DeviceContext_GSSetShader GSSetShader = nullptr;
+    PFN_ID3D11DeviceContext_HSSetShader HSSetShader = nullptr;
+    PFN_ID3D11DeviceContext_DSSetShader DSSetShader = nullptr;
+    PFN_ID3D11DeviceContext_VSSetConstantBuffers VSSetConstantBuffers = nullptr;
+    PFN_ID3D11DeviceContext_PSSetConstantBuffers PSSetConstantBuffers = nullptr;
+    PFN_ID3D11DeviceContext_PSSetShaderResources PSSetShaderResources = nullptr;
+    PFN_ID3D11DeviceContext_CSSetShaderResources CSSetShaderResources = nullptr;
+    PFN_ID3D11DeviceContext_ClearRenderTargetView ClearRenderTargetView = nullptr;
+    PFN_ID3D11DeviceContext_ClearDepthStencilView ClearDepthStencilView = nullptr;
+    PFN_ID3D11DeviceContext_UpdateSubresource UpdateSubresource = nullptr;
+    PFN_ID3D11DeviceContext_OMSetRenderTargets OMSetRenderTargets = nullptr;
+    PFN_ID3D11DeviceContext_OMSetRenderTargetsAndUnorderedAccessViews OMSetRenderTargetsAndUnorderedAccessViews = nullptr;
+    PFN_ID3D11DeviceContext_OMSetBlendState OMSetBlendState = nullptr;
+    PFN_ID3D11DeviceContext_OMSetDepthStencilState OMSetDepthStencilState = nullptr;
+    PFN_ID3D11DeviceContext_RSSetViewports RSSetViewports = nullptr;
+    PFN_ID3D11DeviceContext_RSSetScissorRects RSSetScissorRects = nullptr;
+    PFN_ID3D11DeviceContext_ExecuteCommandList ExecuteCommandList = nullptr;
+    PFN_ID3D11DeviceContext1_CopySubresourceRegion1 CopySubresourceRegion1 = nullptr;
+    PFN_ID3D11DeviceContext1_UpdateSubresource1 UpdateSubresource1 = nullptr;
+    PFN_ID3D11DeviceContext1_DiscardResource DiscardResource = nullptr;
+    PFN_ID3D11DeviceContext1_VSSetConstantBuffers1 VSSetConstantBuffers1 = nullptr;
+    PFN_ID3D11DeviceContext1_PSSetConstantBuffers1 PSSetConstantBuffers1 = nullptr;
+};
+
+using PFN_IDXGIFactory_CreateSwapChain = HRESULT(STDMETHODCALLTYPE*)(IDXGIFactory*, IUnknown*, DXGI_SWAP_CHAIN_DESC*, IDXGISwapChain**);
+using PFN_IDXGIFactory2_CreateSwapChainForHwnd = HRESULT(STDMETHODCALLTYPE*)(IDXGIFactory2*, IUnknown*, HWND, const DXGI_SWAP_CHAIN_DESC1*, const DXGI_SWAP_CHAIN_FULLSCREEN_DESC*, IDXGIOutput*, IDXGISwapChain1**);
+using PFN_IDXGISwapChain_Present = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain*, UINT, UINT);
+using PFN_IDXGISwapChain1_Present1 = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain1*, UINT, UINT, const DXGI_PRESENT_PARAMETERS*);
+using PFN_IDXGISwapChain_ResizeBuffers = HRESULT(STDMETHODCALLTYPE*)(IDXGISwapChain*, UINT, UINT, UINT, DXGI_FORMAT, UINT);
+struct DxgiProcs {
+    PFN_IDXGIFactory_CreateSwapChain CreateSwapChain = nullptr;
+    PFN_IDXGIFactory2_CreateSwapChainForHwnd CreateSwapChainForHwnd = nullptr;
+    PFN_IDXGISwapChain_Present Present = nullptr;
+    PFN_IDXGISwapChain1_Present1 Present1 = nullptr;
+    PFN_IDXGISwapChain_ResizeBuffers ResizeBuffers = nullptr;
+};
+
+using ConstantBufferBindings = std::array<ID3D11Buffer*, D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT>;
+
+/**
+ * \brief Shader state of the immediate context
+ *
+ * Only tracked while draws can be held back or draw rules
+ * are active. Objects are not
+ * reference-counted, the context keeps them alive while bound.
+ */
+struct ImmediateState {
+    ID3D11VertexShader*       vs = nullptr;
+    ID3D11PixelShader*        ps = nullptr;
+    ConstantBufferBindings    vsConstantBuffers = { };
+    ConstantBufferBindings    psConstantBuffers = { };
+    uint32_t                  vsConstantBufferRanges = 0u;  /**< Slots bound with an offset */
+    uint32_t                  psConstantBufferRanges = 0u;
+    D3D11_PRIMITIVE_TOPOLOGY  topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+
+    /* Only tracked while draw rules or learning mode use them */
+    uint64_t                  vsId = 0u;
+    uint64_t                  psId = 0u;
+    DXGI_FORMAT               rtFormat = DXGI_FORMAT_UNKNOWN;
+    uint32_t                  viewportWidth = 0u;
+    uint32_t                  viewportHeight = 0u;
+    DXGI_FORMAT               dsvFormat = DXGI_FORMAT_UNKNOWN;
+    uint8_t                   depthFlags = 0x3u;  /**< Test and write, as in the default state */
+
+    /* Only tracked while depth-only draws get a null pixel shader */
+    bool                      psColorOnly = false;      /**< Bound shader has no effect without render targets */
+    bool                      colorTargets = false;     /**< Any render target is bound */
+    bool                      alphaToCoverage = false;
+    bool                      psNulled = false;         /**< Null shader bound in place of \c ps */
+
+    /* Only tracked while small shadow casters are culled */
+    bool                      depthTarget = false;
+    bool                      vsShadowCaster = false;
+    uint32_t                  cascade = 0u;
+
+    /* Only tracked while shadow maps or screen targets are scaled */
+    float                     viewportScale = 1.0f;     /**< Scale of the bound render targets' contents */
+    float                     appliedViewportScale = 1.0f;  /**< Scale of the bound viewports */
+
+    /* Only tracked while grass density is scaled */
+    bool                      vsGrass = false;
+
+    /* Only tracked while post-processing runs at half resolution */
+    bool                      psHalfRes = false;
+    bool                      psParticle = false;
+
+    /* Only tracked while draws are merged */
+    bool                      psPrimitiveId = false;    /**< Bound shader reads \c SV_PrimitiveID */
+
+    /* Only tracked while vertex shaders are linked to pixel shaders or draws are merged */
+    ID3D11VertexShader*       vsLinked = nullptr;       /**< Bound in place of \c vs */
+    uint8_t                   extraStages = 0u;         /**< Geometry and tessellation stages bound */
+
+    /* Only tracked while pixel shaders are specialized for constant values */
+    ID3D11PixelShader*        psSpecialized = nullptr;  /**< Bound in place of \c ps */
+    bool                      psSpecializable = false;
+};
+
+/* live in impl.cpp */
+extern DeviceProcs   g_deviceProcs;
+extern ContextProcs  g_immContextProcs;
+extern ContextProcs  g_defContextProcs;
+extern DxgiProcs     g_dxgiProcs;
+
+extern ID3D11DeviceContext* g_immContext;
+extern ImmediateState       g_immState;
+
+/** Vertex shader bound for the application's draws, which may be a linked variant */
+inline ID3D11VertexShader* getBoundVertexShader() {
+    return g_immState.vsLinked ? g_immState.vsLinked : g_immState.vs;
+}
+
+/** Pixel shader bound for the application's draws, which may be null or a specialized variant */
+inline ID3D11PixelShader* getBoundPixelShader() {
+    if (g_immState.psNulled)
+        return nullptr;
+
+    return g_immState.psSpecialized ? g_immState.psSpecialized : g_immState.ps;
+}
+
+inline const DeviceProcs* getDeviceProcs([[maybe_unused]] ID3D11Device* pDevice) {
+    return &g_deviceProcs;
+}
+inline const ContextProcs* getContextProcs(ID3D11DeviceContext* pContext) {
+    return pContext->GetType() == D3D11_DEVICE_CONTEXT_IMMEDIATE
+        ? &g_immContextProcs
+        : &g_defContextProcs;
+}
+
 void hookDevice(ID3D11Device* pDevice);
 void hookContext(ID3D11DeviceContext* pContext);
+void hookSwapChain(IDXGISwapChain* pSwapChain);
+
+/**
+ * \brief Issues draws held back on the immediate context
+ *
+ * Must be called before anything that changes state or consumes
+ * the results of previous draws on the immediate context.
+ */
+void flushPendingDraw(ID3D11DeviceContext* pContext);
 void CreateShaderOnStart(ID3D11Device* pDevice);
 /* lives in main.cpp */
 extern Log log;
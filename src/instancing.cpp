@@ -0,0 +1,729 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "instancing.h"
+#include "util.h"
+
+namespace atfix {
+
+UINT g_pendingInstanceCount = 0u;
+
+namespace {
+
+    constexpr uint32_t InstanceDataSlot = D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT - 1u;
+
+    /* Constant buffer operands per instruction that can be redirected */
+    constexpr uint32_t MaxBufferOperands = 4u;
+
+    constexpr uint32_t MaxInputRegisters = 32u;
+    constexpr uint32_t MaxTemps = 4096u;
+
+    constexpr uint32_t makeOpcodeToken(DxbcOpcode Opcode, uint32_t Length) {
+        return uint32_t(Opcode) | (Length << 24);
+    }
+
+    constexpr uint32_t makeMaskOperand(DxbcOperandType Type, uint32_t Mask) {
+        return 2u | (Mask << 4) | (uint32_t(Type) << 12) | (1u << 20);
+    }
+
+    constexpr uint32_t makeSwizzleOperand(DxbcOperandType Type, uint32_t Swizzle) {
+        return 2u | (1u << 2) | (Swizzle << 4) | (uint32_t(Type) << 12) | (1u << 20);
+    }
+
+    constexpr uint32_t makeSelectOperand(DxbcOperandType Type, uint32_t Component) {
+        return 2u | (2u << 2) | (Component << 4) | (uint32_t(Type) << 12) | (1u << 20);
+    }
+
+    constexpr uint32_t Imm32Operand = 1u | (uint32_t(DxbcOperandType::Imm32) << 12);
+
+    constexpr uint32_t SwizzleXXXX = 0x00u;
+    constexpr uint32_t SwizzleXYZW = 0xe4u;
+
+    /** Register allocation for the rewritten shader */
+    struct InstancedRegisters {
+        uint32_t stride;
+        uint32_t input;
+        uint32_t address;
+        uint32_t value;
+    };
+
+    /**
+     * \brief Rewrites one instruction
+     *
+     * Each read from the per-object constant buffer is preceded by a
+     * load of the same vector from the instance data into a temporary.
+     */
+    bool rewriteInstruction(
+      const uint32_t*                 pTokens,
+            uint32_t                  Length,
+            uint32_t                  Slot,
+      const InstancedRegisters&       Regs,
+            std::vector<uint32_t>&    Out) {
+        const uint32_t* end = pTokens + Length;
+        uint32_t opcodeTokens = getDxbcOpcodeTokenCount(pTokens, end);
+
+        if (!opcodeTokens)
+            return false;
+
+        std::vector<uint32_t> prelude;
+        std::vector<uint32_t> body(pTokens, pTokens + opcodeTokens);
+        uint32_t count = 0u;
+
+        for (const uint32_t* op = pTokens + opcodeTokens; op < end; ) {
+            uint32_t length = getDxbcOperandLength(op, end);
+
+            if (!length)
+                return false;
+
+            uint32_t token = op[0];
+            uint32_t headerLength = getDxbcOpcodeTokenCount(op, end);
+
+            bool isSlot = getDxbcOperandType(token) == DxbcOperandType::ConstantBuffer
+                && getDxbcIndexDimension(token) == 2u
+                && getDxbcIndexType(token, 0u) == DxbcIndexType::Imm32
+                && op[headerLength] == Slot;
+
+            if (!isSlot) {
+                body.insert(body.end(), op, op + length);
+                op += length;
+                continue;
+            }
+
+            if (count == MaxBufferOperands)
+                return false;
+
+            const uint32_t* index = op + headerLength + 1u;
+
+            switch (getDxbcIndexType(token, 1u)) {
+                case DxbcIndexType::Imm32: {
+                    /* imad rA.x, vI.x, l(stride), l(index) */
+                    prelude.insert(prelude.end(), {
+                        makeOpcodeToken(DxbcOpcode::Imad, 9u),
+                        makeMaskOperand(DxbcOperandType::Temp, 0x1u), Regs.address,
+                        makeSelectOperand(DxbcOperandType::Input, 0u), Regs.input,
+                        Imm32Operand, Regs.stride,
+                        Imm32Operand, index[0] });
+                } break;
+
+                case DxbcIndexType::Relative: {
+                    /* imad rA.x, vI.x, l(stride), <relative> */
+                    uint32_t relative = getDxbcOperandLength(index, end);
+
+                    prelude.insert(prelude.end(), {
+                        makeOpcodeToken(DxbcOpcode::Imad, 7u + relative),
+                        makeMaskOperand(DxbcOperandType::Temp, 0x1u), Regs.address,
+                        makeSelectOperand(DxbcOperandType::Input, 0u), Regs.input,
+                        Imm32Operand, Regs.stride });
+                    prelude.insert(prelude.end(), index, index + relative);
+                } break;
+
+                case DxbcIndexType::Imm32Relative: {
+                    /* iadd rA.x, <relative>, l(index)
+                     * imad rA.x, vI.x, l(stride), rA.x */
+                    uint32_t relative = getDxbcOperandLength(index + 1u, end);
+
+                    prelude.insert(prelude.end(), {
+                        makeOpcodeToken(DxbcOpcode::Iadd, 5u + relative),
+                        makeMaskOperand(DxbcOperandType::Temp, 0x1u), Regs.address });
+                    prelude.insert(prelude.end(), index + 1u, index + 1u + relative);
+                    prelude.insert(prelude.end(), {
+                        Imm32Operand, index[0],
+                        makeOpcodeToken(DxbcOpcode::Imad, 9u),
+                        makeMaskOperand(DxbcOperandType::Temp, 0x1u), Regs.address,
+                        makeSelectOperand(DxbcOperandType::Input, 0u), Regs.input,
+                        Imm32Operand, Regs.stride,
+                        makeSelectOperand(DxbcOperandType::Temp, 0u), Regs.address });
+                } break;
+
+                default:
+                    return false;
+            }
+
+            /* ld rV.xyzw, rA.xxxx, t127.xyzw */
+            uint32_t value = Regs.value + count++;
+
+            prelude.insert(prelude.end(), {
+                makeOpcodeToken(DxbcOpcode::Ld, 7u),
+                makeMaskOperand(DxbcOperandType::Temp, 0xfu), value,
+                makeSwizzleOperand(DxbcOperandType::Temp, SwizzleXXXX), Regs.address,
+                makeSwizzleOperand(DxbcOperandType::Resource, SwizzleXYZW), InstanceDataSlot });
+
+            /* Same component selection and modifiers, but reading the temporary */
+            uint32_t newToken = token & ~((0xffu << 12) | (0x3u << 20) | (0x1ffu << 22));
+            newToken |= (uint32_t(DxbcOperandType::Temp) << 12) | (1u << 20);
+
+            body.push_back(newToken);
+            body.insert(body.end(), op + 1u, op + headerLength);
+            body.push_back(value);
+
+            op += length;
+        }
+
+        if (!count) {
+            Out.insert(Out.end(), pTokens, end);
+            return true;
+        }
+
+        if (body.size() > 0x7fu)
+            return false;
+
+        body[0] = (body[0] & ~(0x7fu << 24)) | (uint32_t(body.size()) << 24);
+
+        Out.insert(Out.end(), prelude.begin(), prelude.end());
+        Out.insert(Out.end(), body.begin(), body.end());
+        return true;
+    }
+
+
+    struct InstancedShader {
+        ID3D11VertexShader* shader      = nullptr;
+        uint32_t            slot        = 0u;
+        uint32_t            vectorCount = 0u;
+    };
+
+    mutex g_shaderMutex;
+    std::unordered_map<ID3D11VertexShader*, InstancedShader> g_instancedShaders;
+
+    /** Immediate context state, only used on the rendering thread */
+    struct InstancingState {
+        InstancedShader           shader;
+
+        ID3D11Buffer*             shadowBuffer  = nullptr;
+        D3D11_USAGE               shadowUsage   = D3D11_USAGE_DEFAULT;
+        std::vector<uint8_t>      shadow;
+        bool                      shadowMapped  = false;
+        bool                      shadowDirty   = false;
+
+        UINT                      indexCount    = 0u;
+        UINT                      startIndex    = 0u;
+        INT                       baseVertex    = 0;
+        std::vector<uint8_t>      instanceData;
+
+        ID3D11Buffer*             instanceBuffer = nullptr;
+        ID3D11ShaderResourceView* instanceView  = nullptr;
+        UINT                      instanceBufferSize = 0u;
+    };
+
+    InstancingState g_instancing;
+
+
+    bool prepareShadow(ID3D11Resource* pResource) {
+        auto& s = g_instancing;
+
+        if (s.shadowBuffer == pResource)
+            return true;
+
+        D3D11_BUFFER_DESC desc = { };
+        static_cast<ID3D11Buffer*>(pResource)->GetDesc(&desc);
+
+        s.shadowBuffer = static_cast<ID3D11Buffer*>(pResource);
+        s.shadowUsage = desc.Usage;
+        s.shadow.resize(desc.ByteWidth);
+        return true;
+    }
+
+    void uploadConstantBuffer(ID3D11DeviceContext* pContext, const void* pData) {
+        auto& s = g_instancing;
+        const auto* procs = &g_immContextProcs;
+
+        if (s.shadowUsage == D3D11_USAGE_DYNAMIC) {
+            D3D11_MAPPED_SUBRESOURCE sr = { };
+
+            if (SUCCEEDED(procs->Map(pContext, s.shadowBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sr))) {
+                std::memcpy(sr.pData, pData, s.shadow.size());
+                procs->Unmap(pContext, s.shadowBuffer, 0);
+            }
+        } else {
+            procs->UpdateSubresource(pContext, s.shadowBuffer, 0, nullptr, pData, 0, 0);
+        }
+    }
+
+    /** Writes the CPU copy back once no pending draw needs the old contents */
+    void applyShadow(ID3D11DeviceContext* pContext) {
+        auto& s = g_instancing;
+
+        if (hasPendingInstances()) {
+            s.shadowDirty = true;
+            return;
+        }
+
+        flushPendingDraw(pContext);
+        uploadConstantBuffer(pContext, s.shadow.data());
+        s.shadowDirty = false;
+    }
+
+    bool createInstanceBuffer(ID3D11DeviceContext* pContext, UINT Size) {
+        auto& s = g_instancing;
+
+        if (Size <= s.instanceBufferSize)
+            return true;
+
+        if (s.instanceView)
+            s.instanceView->Release();
+
+        if (s.instanceBuffer)
+            s.instanceBuffer->Release();
+
+        s.instanceView = nullptr;
+        s.instanceBuffer = nullptr;
+        s.instanceBufferSize = 0u;
+
+        UINT size = 4096u;
+
+        while (size < Size)
+            size *= 2u;
+
+        ID3D11Device* device = nullptr;
+        pContext->GetDevice(&device);
+
+        D3D11_BUFFER_DESC desc = { };
+        desc.ByteWidth = size;
+        desc.Usage = D3D11_USAGE_DYNAMIC;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+        HRESULT hr = getDeviceProcs(device)->CreateBuffer(device, &desc, nullptr, &s.instanceBuffer);
+
+        if (SUCCEEDED(hr)) {
+            D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = { };
+            viewDesc.Format = DXGI_FORMAT_R32G32B32A32_UINT;
+            viewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+            viewDesc.Buffer.FirstElement = 0u;
+            viewDesc.Buffer.NumElements = size / 16u;
+
+            hr = device->CreateShaderResourceView(s.instanceBuffer, &viewDesc, &s.instanceView);
+        }
+
+        device->Release();
+
+        if (FAILED(hr)) {
+#ifndef NDEBUG
+            log("Instancing: Failed to create ", size, " byte instance buffer: ", hr);
+#endif
+            if (s.instanceBuffer)
+                s.instanceBuffer->Release();
+
+            s.instanceBuffer = nullptr;
+            return false;
+        }
+
+        s.instanceBufferSize = size;
+        return true;
+    }
+
+    bool drawInstanced(ID3D11DeviceContext* pContext, UINT InstanceCount) {
+        auto& s = g_instancing;
+        const auto* procs = &g_immContextProcs;
+
+        if (!createInstanceBuffer(pContext, UINT(s.instanceData.size())))
+            return false;
+
+        D3D11_MAPPED_SUBRESOURCE sr = { };
+
+        if (FAILED(procs->Map(pContext, s.instanceBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &sr)))
+            return false;
+
+        std::memcpy(sr.pData, s.instanceData.data(), s.instanceData.size());
+        procs->Unmap(pContext, s.instanceBuffer, 0);
+
+        /* Nothing is pending anymore, so going through
+         * the hooked methods does not recurse */
+        ID3D11ShaderResourceView* prevView = nullptr;
+        pContext->VSGetShaderResources(InstanceDataSlot, 1, &prevView);
+        pContext->VSSetShaderResources(InstanceDataSlot, 1, &s.instanceView);
+
+        procs->VSSetShader(pContext, s.shader.shader, nullptr, 0);
+        procs->DrawIndexedInstanced(pContext, s.indexCount, InstanceCount, s.startIndex, s.baseVertex, 0);
+        procs->VSSetShader(pContext, getBoundVertexShader(), nullptr, 0);
+
+        pContext->VSSetShaderResources(InstanceDataSlot, 1, &prevView);
+
+        if (prevView)
+            prevView->Release();
+
+        return true;
+    }
+
+}
+
+
+bool rewriteInstancedShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        uint32_t                  Slot,
+        std::vector<uint8_t>*     pResult,
+        uint32_t*                 pVectorCount) {
+    DxbcContainer container;
+
+    if (!container.parse(pBytecode, BytecodeLength))
+        return false;
+
+    auto* code = container.findCodeChunk();
+    auto* isgn = container.findChunk(DxbcTagIsgn);
+
+    if (!code || !isgn || code->size() < 8u || code->size() % 4u)
+        return false;
+
+    std::vector<uint32_t> tokens(code->size() / 4u);
+    std::memcpy(tokens.data(), code->data(), code->size());
+
+    uint32_t programType = tokens[0] >> 16;
+    uint32_t major = (tokens[0] >> 4) & 0xfu;
+    uint32_t minor = tokens[0] & 0xfu;
+
+    /* Shader model 5.1 uses a different constant buffer operand layout */
+    if (programType != 1u || major > 5u || (major == 5u && minor > 0u) || tokens[1] > tokens.size())
+        return false;
+
+    DxbcSignature signature;
+
+    if (!signature.parse(*isgn))
+        return false;
+
+    InstancedRegisters regs = { };
+
+    for (const auto& e : signature.elements()) {
+        if (e.systemValue == DxbcNameInstanceId)
+            return false;
+
+        regs.input = std::max(regs.input, e.registerIndex + 1u);
+    }
+
+    const uint32_t* begin = tokens.data() + 2u;
+    const uint32_t* end = tokens.data() + tokens[1];
+
+    uint32_t tempCount = 0u;
+    bool hasTempDcl = false;
+
+    for (const uint32_t* p = begin; p < end; ) {
+        uint32_t length = getDxbcInstructionLength(p);
+
+        if (!length || p + length > end)
+            return false;
+
+        switch (getDxbcOpcode(p[0])) {
+            case DxbcOpcode::InterfaceCall:
+            case DxbcOpcode::DclFunctionBody:
+            case DxbcOpcode::DclFunctionTable:
+            case DxbcOpcode::DclInterface:
+                return false;
+
+            case DxbcOpcode::DclTemps:
+                tempCount = p[1];
+                hasTempDcl = true;
+                break;
+
+            case DxbcOpcode::DclConstantBuffer:
+                if (getDxbcIndexDimension(p[1]) == 2u && p[2] == Slot)
+                    regs.stride = p[3];
+                break;
+
+            case DxbcOpcode::DclResource:
+            case DxbcOpcode::DclResourceRaw:
+            case DxbcOpcode::DclResourceStructured:
+                if (p[2] == InstanceDataSlot)
+                    return false;
+                break;
+
+            default:
+                break;
+        }
+
+        p += length;
+    }
+
+    if (!regs.stride || regs.input >= MaxInputRegisters || tempCount + 1u + MaxBufferOperands > MaxTemps)
+        return false;
+
+    regs.address = tempCount;
+    regs.value = tempCount + 1u;
+
+    std::vector<uint32_t> out = { tokens[0], 0u };
+    bool declared = false;
+
+    for (const uint32_t* p = begin; p < end; p += getDxbcInstructionLength(p)) {
+        uint32_t length = getDxbcInstructionLength(p);
+        auto opcode = getDxbcOpcode(p[0]);
+
+        if (isDxbcDeclaration(opcode)) {
+            if (opcode == DxbcOpcode::DclTemps)
+                out.insert(out.end(), { p[0], tempCount + 1u + MaxBufferOperands });
+            else
+                out.insert(out.end(), p, p + length);
+            continue;
+        }
+
+        if (!declared) {
+            if (!hasTempDcl)
+                out.insert(out.end(), { makeOpcodeToken(DxbcOpcode::DclTemps, 2u), 1u + MaxBufferOperands });
+
+            /* dcl_resource_buffer (uint,uint,uint,uint) t127 */
+            out.insert(out.end(), {
+                makeOpcodeToken(DxbcOpcode::DclResource, 4u) | (1u << 11),
+                (uint32_t(DxbcOperandType::Resource) << 12) | (1u << 20), InstanceDataSlot,
+                0x4444u });
+
+            /* dcl_input_sgv vI.x, instance_id */
+            out.insert(out.end(), {
+                makeOpcodeToken(DxbcOpcode::DclInputSgv, 4u),
+                makeMaskOperand(DxbcOperandType::Input, 0x1u), regs.input,
+                DxbcNameInstanceId });
+
+            declared = true;
+        }
+
+        if (!rewriteInstruction(p, length, Slot, regs, out))
+            return false;
+    }
+
+    if (!declared)
+        return false;
+
+    out[1] = uint32_t(out.size());
+
+    code->resize(out.size() * sizeof(uint32_t));
+    std::memcpy(code->data(), out.data(), code->size());
+
+    signature.addElement({ "SV_InstanceID", 0u, DxbcNameInstanceId,
+        DxbcComponentUint32, regs.input, 0x1u, 0x1u });
+    *isgn = signature.serialize();
+
+    *pResult = container.serialize();
+    *pVectorCount = regs.stride;
+    return true;
+}
+
+
+void registerInstancingShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11VertexShader*       pShader) {
+    if (!g_config.autoInstancing)
+        return;
+
+    Hash128 hash = getDxbcHash(pBytecode, BytecodeLength);
+    InstancedShader variant;
+
+    for (const auto& entry : g_config.instancingShaders) {
+        if (entry.hash != hash)
+            continue;
+
+        std::vector<uint8_t> code;
+
+        if (!rewriteInstancedShader(pBytecode, BytecodeLength, entry.slot, &code, &variant.vectorCount)) {
+#ifndef NDEBUG
+            log("Instancing: Failed to rewrite vertex shader ", formatHash(hash));
+#endif
+            break;
+        }
+
+        HRESULT hr = getDeviceProcs(pDevice)->CreateVertexShader(pDevice,
+            code.data(), code.size(), nullptr, &variant.shader);
+
+        if (FAILED(hr)) {
+#ifndef NDEBUG
+            log("Instancing: Failed to create instanced variant of ", formatHash(hash), ": ", hr);
+#endif
+            variant.shader = nullptr;
+            break;
+        }
+
+        variant.slot = entry.slot;
+#ifndef NDEBUG
+        log("Instancing: Created variant of ", formatHash(hash), ", ", variant.vectorCount, " vectors per instance");
+#endif
+        break;
+    }
+
+    std::lock_guard lock(g_shaderMutex);
+
+    /* The application may reuse the address of a destroyed shader */
+    auto entry = g_instancedShaders.find(pShader);
+
+    if (entry != g_instancedShaders.end()) {
+        entry->second.shader->Release();
+        g_instancedShaders.erase(entry);
+    }
+
+    if (variant.shader)
+        g_instancedShaders.insert({ pShader, variant });
+}
+
+
+void setInstancingVertexShader(ID3D11VertexShader* pShader) {
+    if (!g_config.autoInstancing)
+        return;
+
+    std::lock_guard lock(g_shaderMutex);
+
+    auto entry = pShader ? g_instancedShaders.find(pShader) : g_instancedShaders.end();
+    g_instancing.shader = entry != g_instancedShaders.end() ? entry->second : InstancedShader();
+}
+
+
+bool isInstancingBuffer(ID3D11Resource* pResource) {
+    const auto& shader = g_instancing.shader;
+
+    return shader.shader && pResource
+        && pResource == g_immState.vsConstantBuffers[shader.slot]
+        && !(g_immState.vsConstantBufferRanges & (1u << shader.slot));
+}
+
+
+bool mapInstancingBuffer(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    auto& s = g_instancing;
+
+    if (Subresource || MapType != D3D11_MAP_WRITE_DISCARD || !pMappedResource || s.shadowMapped)
+        return false;
+
+    prepareShadow(pResource);
+
+    if (s.shadowUsage != D3D11_USAGE_DYNAMIC) {
+        s.shadowBuffer = nullptr;
+        return false;
+    }
+
+    pMappedResource->pData = s.shadow.data();
+    pMappedResource->RowPitch = UINT(s.shadow.size());
+    pMappedResource->DepthPitch = UINT(s.shadow.size());
+
+    s.shadowMapped = true;
+    return true;
+}
+
+
+bool unmapInstancingBuffer(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource) {
+    auto& s = g_instancing;
+
+    if (!s.shadowMapped || pResource != s.shadowBuffer || Subresource)
+        return false;
+
+    s.shadowMapped = false;
+    applyShadow(pContext);
+    return true;
+}
+
+
+bool updateInstancingBuffer(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData) {
+    auto& s = g_instancing;
+
+    if (Subresource || !pSrcData || s.shadowMapped)
+        return false;
+
+    if (!pDstBox) {
+        prepareShadow(pResource);
+        std::memcpy(s.shadow.data(), pSrcData, s.shadow.size());
+    } else {
+        /* Partial updates need the rest of the buffer to be known */
+        if (pResource != s.shadowBuffer || pDstBox->left >= pDstBox->right || pDstBox->right > s.shadow.size())
+            return false;
+
+        std::memcpy(&s.shadow[pDstBox->left], pSrcData, pDstBox->right - pDstBox->left);
+    }
+
+    applyShadow(pContext);
+    return true;
+}
+
+
+void invalidateInstancingBuffer(ID3D11Resource* pResource) {
+    auto& s = g_instancing;
+
+    if (!pResource || pResource == s.shadowBuffer) {
+        s.shadowBuffer = nullptr;
+        s.shadowMapped = false;
+    }
+}
+
+
+bool batchInstancedDraw(
+        ID3D11DeviceContext*      pContext,
+        UINT                      IndexCount,
+        UINT                      StartIndexLocation,
+        INT                       BaseVertexLocation) {
+    auto& s = g_instancing;
+
+    if (!s.shader.shader || !s.shadowBuffer || s.shadowMapped || !isInstancingBuffer(s.shadowBuffer))
+        return false;
+
+    /* The pixel shader would only see the constants of the first instance */
+    for (auto* buffer : g_immState.psConstantBuffers) {
+        if (buffer == s.shadowBuffer)
+            return false;
+    }
+
+    bool append = hasPendingInstances()
+        && IndexCount == s.indexCount
+        && StartIndexLocation == s.startIndex
+        && BaseVertexLocation == s.baseVertex
+        && g_pendingInstanceCount < g_config.maxInstances;
+
+    if (!append) {
+        flushPendingDraw(pContext);
+
+        s.indexCount = IndexCount;
+        s.startIndex = StartIndexLocation;
+        s.baseVertex = BaseVertexLocation;
+        s.instanceData.clear();
+    }
+
+    size_t stride = size_t(s.shader.vectorCount) * 16u;
+    size_t offset = s.instanceData.size();
+
+    s.instanceData.resize(offset + stride);
+    std::memcpy(&s.instanceData[offset], s.shadow.data(), std::min(stride, s.shadow.size()));
+
+    g_pendingInstanceCount += 1u;
+    return true;
+}
+
+
+void flushInstances(ID3D11DeviceContext* pContext) {
+    auto& s = g_instancing;
+    const auto* procs = &g_immContextProcs;
+
+    UINT count = g_pendingInstanceCount;
+    g_pendingInstanceCount = 0u;
+
+    if (count == 1u) {
+        /* The constant buffer still holds the data of this draw */
+        procs->DrawIndexed(pContext, s.indexCount, s.startIndex, s.baseVertex);
+    } else if (!drawInstanced(pContext, count)) {
+        /* Replay the draws with their constants if instancing failed */
+        size_t stride = size_t(s.shader.vectorCount) * 16u;
+        std::vector<uint8_t> data = s.shadow;
+
+        for (UINT i = 0; i < count; i++) {
+            std::memcpy(data.data(), &s.instanceData[i * stride], std::min(stride, data.size()));
+            uploadConstantBuffer(pContext, data.data());
+            procs->DrawIndexed(pContext, s.indexCount, s.startIndex, s.baseVertex);
+        }
+
+        s.shadowDirty = true;
+    }
+
+    if (s.shadowDirty) {
+        uploadConstantBuffer(pContext, s.shadow.data());
+        s.shadowDirty = false;
+    }
+}
+
+}
@@ -0,0 +1,100 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <cstdint>
+#include <vector>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Rewrites a vertex shader to read per-object constants per instance
+ *
+ * All reads from the given constant buffer slot are replaced by loads
+ * from a \c uint4 buffer at \c t127, indexed by \c SV_InstanceID times
+ * the declared size of the constant buffer.
+ * \param [in] pBytecode Original DXBC
+ * \param [in] BytecodeLength Size of the original DXBC
+ * \param [in] Slot Constant buffer slot holding per-object data
+ * \param [out] pResult Rewritten DXBC
+ * \param [out] pVectorCount Declared size of the constant buffer in vectors
+ * \returns \c false if the shader cannot be rewritten
+ */
+bool rewriteInstancedShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        uint32_t                  Slot,
+        std::vector<uint8_t>*     pResult,
+        uint32_t*                 pVectorCount);
+
+/**
+ * \brief Creates the instanced variant of a configured vertex shader
+ *
+ * Must be called for every vertex shader created by the application,
+ * since it also drops stale variants of destroyed shaders.
+ */
+void registerInstancingShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11VertexShader*       pShader);
+
+/** Looks up the instanced variant of the vertex shader being bound */
+void setInstancingVertexShader(ID3D11VertexShader* pShader);
+
+/**
+ * \brief Checks whether a resource is the per-object constant buffer
+ *
+ * Updates to it are captured into a CPU copy and deferred while
+ * instances are pending, instead of flushing the pending draws.
+ */
+bool isInstancingBuffer(ID3D11Resource* pResource);
+
+/** Maps the CPU copy of the per-object constant buffer */
+bool mapInstancingBuffer(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+        D3D11_MAP                 MapType,
+        D3D11_MAPPED_SUBRESOURCE* pMappedResource);
+
+/** Unmaps the CPU copy, returns \c false if it was not mapped */
+bool unmapInstancingBuffer(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource);
+
+/** Applies an \c UpdateSubresource to the CPU copy */
+bool updateInstancingBuffer(
+        ID3D11DeviceContext*      pContext,
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData);
+
+/** Drops the CPU copy if the resource was modified by other means */
+void invalidateInstancingBuffer(ID3D11Resource* pResource);
+
+/**
+ * \brief Adds an indexed draw to the pending instances
+ * \returns \c true if the draw was consumed
+ */
+bool batchInstancedDraw(
+        ID3D11DeviceContext*      pContext,
+        UINT                      IndexCount,
+        UINT                      StartIndexLocation,
+        INT                       BaseVertexLocation);
+
+/** Issues the pending instances as one instanced draw */
+void flushInstances(ID3D11DeviceContext* pContext);
+
+/* lives in instancing.cpp */
+extern UINT g_pendingInstanceCount;
+
+inline bool hasPendingInstances() {
+    return g_pendingInstanceCount != 0u;
+}
+
+}
+
+#endif
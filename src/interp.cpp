@@ -0,0 +1,1500 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+
+#include <emmintrin.h>
+
+#include "dxbc.h"
+#include "interp.h"
+
+namespace atfix {
+
+namespace {
+
+    constexpr uint32_t MaxTemps = 4096u;
+    constexpr uint32_t MaxResources = 128u;
+    constexpr uint32_t MaxLoopIterations = 1024u;
+    constexpr uint32_t TextureSize = 256u;
+    constexpr uint32_t AllLanes = (1u << DxbcInterpLanes) - 1u;
+
+    /* Opcode token bits */
+    constexpr uint32_t SaturateBit = 1u << 13;
+    constexpr uint32_t TestNonZeroBit = 1u << 18;
+
+    /* Custom data class of immediate constant buffers */
+    constexpr uint32_t CustomDataIcb = 3u;
+
+    /* Extended operand token modifiers */
+    constexpr uint32_t ModifierNeg = 1u;
+    constexpr uint32_t ModifierAbs = 2u;
+
+    /* MXCSR flush-to-zero and denormals-are-zero, which is what GPUs do for fp32 */
+    constexpr uint32_t FlushDenormals = 0x8040u;
+
+    /* Instruction properties */
+    constexpr uint32_t OP_INT       = (1u << 0);  /**< Source modifiers are integer negation and absolute value */
+    constexpr uint32_t OP_FLOW      = (1u << 1);  /**< Flow control, runs even if no invocation is active */
+    constexpr uint32_t OP_FETCH     = (1u << 2);  /**< Reads a texture */
+
+    struct InterpOpInfo {
+        DxbcOpcode opcode;
+        uint32_t   destinations;
+        uint32_t   operands;
+        uint32_t   flags;
+    };
+
+    /** Instructions the interpreter runs, anything else is rejected */
+    constexpr InterpOpInfo InterpOps[] = {
+        { DxbcOpcode::Add,            1u, 3u, 0u },
+        { DxbcOpcode::And,            1u, 3u, OP_INT },
+        { DxbcOpcode::Break,          0u, 0u, OP_FLOW },
+        { DxbcOpcode::Breakc,         0u, 1u, OP_FLOW | OP_INT },
+        { DxbcOpcode::Continue,       0u, 0u, OP_FLOW },
+        { DxbcOpcode::Continuec,      0u, 1u, OP_FLOW | OP_INT },
+        { DxbcOpcode::DerivRtx,       1u, 2u, 0u },
+        { DxbcOpcode::DerivRty,       1u, 2u, 0u },
+        { DxbcOpcode::Discard,        0u, 1u, OP_INT },
+        { DxbcOpcode::Div,            1u, 3u, 0u },
+        { DxbcOpcode::Dp2,            1u, 3u, 0u },
+        { DxbcOpcode::Dp3,            1u, 3u, 0u },
+        { DxbcOpcode::Dp4,            1u, 3u, 0u },
+        { DxbcOpcode::Else,           0u, 0u, OP_FLOW },
+        { DxbcOpcode::Endif,          0u, 0u, OP_FLOW },
+        { DxbcOpcode::Endloop,        0u, 0u, OP_FLOW },
+        { DxbcOpcode::Eq,             1u, 3u, 0u },
+        { DxbcOpcode::Exp,            1u, 2u, 0u },
+        { DxbcOpcode::Frc,            1u, 2u, 0u },
+        { DxbcOpcode::Ftoi,           1u, 2u, 0u },
+        { DxbcOpcode::Ftou,           1u, 2u, 0u },
+        { DxbcOpcode::Ge,             1u, 3u, 0u },
+        { DxbcOpcode::Iadd,           1u, 3u, OP_INT },
+        { DxbcOpcode::If,             0u, 1u, OP_FLOW | OP_INT },
+        { DxbcOpcode::Ieq,            1u, 3u, OP_INT },
+        { DxbcOpcode::Ige,            1u, 3u, OP_INT },
+        { DxbcOpcode::Ilt,            1u, 3u, OP_INT },
+        { DxbcOpcode::Imad,           1u, 4u, OP_INT },
+        { DxbcOpcode::Imax,           1u, 3u, OP_INT },
+        { DxbcOpcode::Imin,           1u, 3u, OP_INT },
+        { DxbcOpcode::Imul,           2u, 4u, OP_INT },
+        { DxbcOpcode::Ine,            1u, 3u, OP_INT },
+        { DxbcOpcode::Ineg,           1u, 2u, OP_INT },
+        { DxbcOpcode::Ishl,           1u, 3u, OP_INT },
+        { DxbcOpcode::Ishr,           1u, 3u, OP_INT },
+        { DxbcOpcode::Itof,           1u, 2u, OP_INT },
+        { DxbcOpcode::Ld,             1u, 3u, OP_INT | OP_FETCH },
+        { DxbcOpcode::LdMs,           1u, 4u, OP_INT | OP_FETCH },
+        { DxbcOpcode::Log,            1u, 2u, 0u },
+        { DxbcOpcode::Loop,           0u, 0u, OP_FLOW },
+        { DxbcOpcode::Lt,             1u, 3u, 0u },
+        { DxbcOpcode::Mad,            1u, 4u, 0u },
+        { DxbcOpcode::Min,            1u, 3u, 0u },
+        { DxbcOpcode::Max,            1u, 3u, 0u },
+        { DxbcOpcode::Mov,            1u, 2u, 0u },
+        { DxbcOpcode::Movc,           1u, 4u, 0u },
+        { DxbcOpcode::Mul,            1u, 3u, 0u },
+        { DxbcOpcode::Ne,             1u, 3u, 0u },
+        { DxbcOpcode::Nop,            0u, 0u, 0u },
+        { DxbcOpcode::Not,            1u, 2u, OP_INT },
+        { DxbcOpcode::Or,             1u, 3u, OP_INT },
+        { DxbcOpcode::Resinfo,        1u, 3u, OP_INT },
+        { DxbcOpcode::Ret,            0u, 0u, OP_FLOW },
+        { DxbcOpcode::Retc,           0u, 1u, OP_FLOW | OP_INT },
+        { DxbcOpcode::RoundNe,        1u, 2u, 0u },
+        { DxbcOpcode::RoundNi,        1u, 2u, 0u },
+        { DxbcOpcode::RoundPi,        1u, 2u, 0u },
+        { DxbcOpcode::RoundZ,         1u, 2u, 0u },
+        { DxbcOpcode::Rsq,            1u, 2u, 0u },
+        { DxbcOpcode::Sample,         1u, 4u, OP_FETCH },
+        { DxbcOpcode::SampleC,        1u, 5u, OP_FETCH },
+        { DxbcOpcode::SampleCLz,      1u, 5u, OP_FETCH },
+        { DxbcOpcode::SampleL,        1u, 5u, OP_FETCH },
+        { DxbcOpcode::SampleD,        1u, 6u, OP_FETCH },
+        { DxbcOpcode::SampleB,        1u, 5u, OP_FETCH },
+        { DxbcOpcode::Sqrt,           1u, 2u, 0u },
+        { DxbcOpcode::Sincos,         2u, 3u, 0u },
+        { DxbcOpcode::Udiv,           2u, 4u, OP_INT },
+        { DxbcOpcode::Ult,            1u, 3u, OP_INT },
+        { DxbcOpcode::Uge,            1u, 3u, OP_INT },
+        { DxbcOpcode::Umul,           2u, 4u, OP_INT },
+        { DxbcOpcode::Umad,           1u, 4u, OP_INT },
+        { DxbcOpcode::Umax,           1u, 3u, OP_INT },
+        { DxbcOpcode::Umin,           1u, 3u, OP_INT },
+        { DxbcOpcode::Ushr,           1u, 3u, OP_INT },
+        { DxbcOpcode::Utof,           1u, 2u, OP_INT },
+        { DxbcOpcode::Xor,            1u, 3u, OP_INT },
+        { DxbcOpcode::Gather4,        1u, 4u, OP_FETCH },
+        { DxbcOpcode::DerivRtxCoarse, 1u, 2u, 0u },
+        { DxbcOpcode::DerivRtxFine,   1u, 2u, 0u },
+        { DxbcOpcode::DerivRtyCoarse, 1u, 2u, 0u },
+        { DxbcOpcode::DerivRtyFine,   1u, 2u, 0u },
+        { DxbcOpcode::Rcp,            1u, 2u, 0u },
+        { DxbcOpcode::Countbits,      1u, 2u, OP_INT },
+        { DxbcOpcode::FirstbitHi,     1u, 2u, OP_INT },
+        { DxbcOpcode::FirstbitLo,     1u, 2u, OP_INT },
+        { DxbcOpcode::FirstbitShi,    1u, 2u, OP_INT },
+        { DxbcOpcode::Ubfe,           1u, 4u, OP_INT },
+        { DxbcOpcode::Ibfe,           1u, 4u, OP_INT },
+        { DxbcOpcode::Bfi,            1u, 5u, OP_INT },
+        { DxbcOpcode::Bfrev,          1u, 2u, OP_INT },
+        { DxbcOpcode::Swapc,          2u, 5u, 0u },
+    };
+
+    const InterpOpInfo* findInterpOp(DxbcOpcode Opcode) {
+        for (const auto& op : InterpOps) {
+            if (op.opcode == Opcode)
+                return &op;
+        }
+
+        return nullptr;
+    }
+
+
+    /** One register of all lanes, component-major so that each component is one SSE vector */
+    struct alignas(16) Vec4 {
+        uint32_t c[4][DxbcInterpLanes];
+    };
+
+    __m128i load(const uint32_t* p) {
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(p));
+    }
+
+    void store(uint32_t* p, __m128i v) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(p), v);
+    }
+
+    __m128 ps(__m128i v) {
+        return _mm_castsi128_ps(v);
+    }
+
+    __m128i pi(__m128 v) {
+        return _mm_castps_si128(v);
+    }
+
+    __m128i blend(__m128i Mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(Mask, a), _mm_andnot_si128(Mask, b));
+    }
+
+    __m128i isNaN(__m128i v) {
+        return pi(_mm_cmpunord_ps(ps(v), ps(v)));
+    }
+
+    __m128i getLaneMask(uint32_t Mask) {
+        return _mm_set_epi32(
+          (Mask & 8u) ? -1 : 0, (Mask & 4u) ? -1 : 0,
+          (Mask & 2u) ? -1 : 0, (Mask & 1u) ? -1 : 0);
+    }
+
+    float asFloat(uint32_t v) {
+        return std::bit_cast<float>(v);
+    }
+
+    uint32_t asUint(float v) {
+        return std::bit_cast<uint32_t>(v);
+    }
+
+    template<typename Fn>
+    Vec4 map(const Vec4& a, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++)
+            store(r.c[k], fn(load(a.c[k])));
+
+        return r;
+    }
+
+    template<typename Fn>
+    Vec4 map(const Vec4& a, const Vec4& b, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++)
+            store(r.c[k], fn(load(a.c[k]), load(b.c[k])));
+
+        return r;
+    }
+
+    template<typename Fn>
+    Vec4 map(const Vec4& a, const Vec4& b, const Vec4& c, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++)
+            store(r.c[k], fn(load(a.c[k]), load(b.c[k]), load(c.c[k])));
+
+        return r;
+    }
+
+    /* Operations SSE2 has no instruction for run per lane */
+    template<typename Fn>
+    Vec4 mapLanes(const Vec4& a, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++) {
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++)
+                r.c[k][l] = fn(a.c[k][l]);
+        }
+
+        return r;
+    }
+
+    template<typename Fn>
+    Vec4 mapLanes(const Vec4& a, const Vec4& b, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++) {
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++)
+                r.c[k][l] = fn(a.c[k][l], b.c[k][l]);
+        }
+
+        return r;
+    }
+
+    template<typename Fn>
+    Vec4 mapLanes(const Vec4& a, const Vec4& b, const Vec4& c, const Fn& fn) {
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++) {
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++)
+                r.c[k][l] = fn(a.c[k][l], b.c[k][l], c.c[k][l]);
+        }
+
+        return r;
+    }
+
+    template<typename Fn>
+    Vec4 mapFloat(const Vec4& a, const Fn& fn) {
+        return mapLanes(a, [&fn] (uint32_t x) {
+            return asUint(fn(asFloat(x)));
+        });
+    }
+
+    /** Scalar result of a dot product in all components */
+    Vec4 dot(const Vec4& a, const Vec4& b, uint32_t Components) {
+        __m128 sum = _mm_mul_ps(ps(load(a.c[0])), ps(load(b.c[0])));
+
+        for (uint32_t k = 1; k < Components; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(ps(load(a.c[k])), ps(load(b.c[k]))));
+
+        Vec4 r;
+
+        for (uint32_t k = 0; k < 4u; k++)
+            store(r.c[k], pi(sum));
+
+        return r;
+    }
+
+    /**
+     * \brief Derivative within the quad
+     *
+     * Lanes are ordered top left, top right, bottom left, bottom right.
+     * Coarse derivatives use the top left pixel's row or column for
+     * the whole quad.
+     */
+    template<int A0, int A1, int A2, int A3, int B0, int B1, int B2, int B3>
+    Vec4 derivative(const Vec4& a) {
+        return map(a, [] (__m128i v) {
+            __m128 hi = _mm_shuffle_ps(ps(v), ps(v), _MM_SHUFFLE(A3, A2, A1, A0));
+            __m128 lo = _mm_shuffle_ps(ps(v), ps(v), _MM_SHUFFLE(B3, B2, B1, B0));
+            return pi(_mm_sub_ps(hi, lo));
+        });
+    }
+
+    uint32_t floatToInt(float v) {
+        if (std::isnan(v))
+            return 0u;
+
+        if (v >= 2147483647.0f)
+            return uint32_t(std::numeric_limits<int32_t>::max());
+
+        if (v <= -2147483648.0f)
+            return uint32_t(std::numeric_limits<int32_t>::min());
+
+        return uint32_t(int32_t(v));
+    }
+
+    uint32_t floatToUint(float v) {
+        if (std::isnan(v) || v <= 0.0f)
+            return 0u;
+
+        if (v >= 4294967295.0f)
+            return ~0u;
+
+        return uint32_t(v);
+    }
+
+    uint32_t extractBits(uint32_t Width, uint32_t Offset, uint32_t Value, bool Signed) {
+        Width &= 31u;
+        Offset &= 31u;
+
+        if (!Width)
+            return 0u;
+
+        if (Width + Offset < 32u) {
+            return Signed
+              ? uint32_t(int32_t(Value << (32u - Width - Offset)) >> (32u - Width))
+              : (Value << (32u - Width - Offset)) >> (32u - Width);
+        }
+
+        return Signed ? uint32_t(int32_t(Value) >> Offset) : Value >> Offset;
+    }
+
+    uint32_t hashValue(uint32_t a, uint32_t b) {
+        uint32_t h = a * 0x9e3779b9u ^ (b + 0x7f4a7c15u);
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+
+    struct OperandIndex {
+        uint32_t        offset       = 0u;
+        DxbcOperandType relative     = DxbcOperandType::Null;   /**< Register added to the offset, if any */
+        uint32_t        relIndex     = 0u;
+        uint32_t        relComponent = 0u;
+    };
+
+    struct Operand {
+        DxbcOperandType type      = DxbcOperandType::Null;
+        uint32_t        mask      = 0xfu;   /**< Write mask of destinations */
+        uint8_t         swizzle[4] = { 0u, 1u, 2u, 3u };
+        uint32_t        modifier  = 0u;
+        uint32_t        dims      = 0u;
+        bool            relative  = false;
+        OperandIndex    index[3];
+        uint32_t        imm[4]    = { };
+    };
+
+    struct Instruction {
+        const InterpOpInfo*   info;
+        uint32_t              token;
+        int32_t               offsets[3] = { };   /**< Immediate texel offsets */
+        std::vector<Operand>  operands;
+    };
+
+    struct Program {
+        std::vector<Instruction>  code;
+        std::vector<uint32_t>     icb;
+        std::unordered_map<uint32_t, uint32_t> indexableTemps;   /**< Register count of each array */
+        std::array<uint8_t, MaxResources> coords = { };         /**< Coordinates of each texture */
+        uint32_t                  tempCount = 0u;
+    };
+
+    /** Coordinate count of a resource dimension, including the array index */
+    uint32_t getResourceCoords(uint32_t Dimension) {
+        static constexpr uint8_t Counts[] = { 0u, 1u, 1u, 2u, 2u, 3u, 3u, 2u, 3u, 3u, 4u };
+        return Dimension < std::size(Counts) ? Counts[Dimension] : 0u;
+    }
+
+    bool parseOperand(const uint32_t* pTokens, const uint32_t* pEnd, Operand* pOperand, uint32_t* pLength) {
+        uint32_t length = getDxbcOperandLength(pTokens, pEnd);
+
+        if (!length)
+            return false;
+
+        const uint32_t* p = pTokens;
+        uint32_t token = *p++;
+
+        Operand op;
+        op.type = getDxbcOperandType(token);
+
+        switch (token & 0x3u) {
+            case 0u:
+                op.mask = 0u;
+                break;
+
+            case 1u:
+                op.mask = 0x1u;
+                std::memset(op.swizzle, 0, sizeof(op.swizzle));
+                break;
+
+            case 2u: {
+                uint32_t bits = (token >> 4) & 0xffu;
+
+                switch ((token >> 2) & 0x3u) {
+                    case 0u:
+                        op.mask = bits & 0xfu;
+                        break;
+
+                    case 1u:
+                        for (uint32_t k = 0; k < 4u; k++)
+                            op.swizzle[k] = (bits >> (2u * k)) & 0x3u;
+                        break;
+
+                    case 2u:
+                        std::memset(op.swizzle, bits & 0x3u, sizeof(op.swizzle));
+                        break;
+
+                    default:
+                        return false;
+                }
+            } break;
+
+            default:
+                return false;
+        }
+
+        bool extended = token >> 31;
+
+        while (extended) {
+            uint32_t ext = *p++;
+
+            if ((ext & 0x3fu) == 1u)
+                op.modifier = (ext >> 6) & 0xffu;
+
+            extended = ext >> 31;
+        }
+
+        if (op.type == DxbcOperandType::Imm32) {
+            uint32_t count = (token & 0x3u) == 1u ? 1u : 4u;
+
+            for (uint32_t k = 0; k < 4u; k++)
+                op.imm[k] = p[count == 1u ? 0u : k];
+
+            p += count;
+        } else if (op.type == DxbcOperandType::Imm64) {
+            return false;
+        }
+
+        op.dims = getDxbcIndexDimension(token);
+
+        for (uint32_t d = 0; d < op.dims; d++) {
+            DxbcIndexType indexType = getDxbcIndexType(token, d);
+            auto& index = op.index[d];
+
+            if (indexType == DxbcIndexType::Imm32 || indexType == DxbcIndexType::Imm32Relative)
+                index.offset = *p++;
+
+            if (indexType == DxbcIndexType::Relative || indexType == DxbcIndexType::Imm32Relative) {
+                Operand rel;
+                uint32_t relLength = 0u;
+
+                if (!parseOperand(p, pEnd, &rel, &relLength) || rel.relative || rel.modifier || rel.dims != 1u
+                 || (rel.type != DxbcOperandType::Temp && rel.type != DxbcOperandType::Input))
+                    return false;
+
+                index.relative = rel.type;
+                index.relIndex = rel.index[0].offset;
+                index.relComponent = rel.swizzle[0];
+                op.relative = true;
+                p += relLength;
+            } else if (indexType != DxbcIndexType::Imm32) {
+                return false;
+            }
+        }
+
+        if (p != pTokens + length)
+            return false;
+
+        *pOperand = op;
+        *pLength = length;
+        return true;
+    }
+
+    bool parseDeclaration(const uint32_t* pTokens, uint32_t Length, Program* pProgram) {
+        switch (getDxbcOpcode(pTokens[0])) {
+            case DxbcOpcode::CustomData:
+                if ((pTokens[0] >> 11) == CustomDataIcb)
+                    pProgram->icb.assign(pTokens + 2u, pTokens + Length);
+                return true;
+
+            case DxbcOpcode::DclTemps:
+                pProgram->tempCount = pTokens[1];
+                return Length == 2u && pTokens[1] <= MaxTemps;
+
+            case DxbcOpcode::DclIndexableTemp:
+                if (Length != 4u || pTokens[2] > MaxTemps)
+                    return false;
+
+                pProgram->indexableTemps[pTokens[1]] = pTokens[2];
+                return true;
+
+            case DxbcOpcode::DclResource: {
+                Operand op;
+                uint32_t length = 0u;
+
+                if (!parseOperand(pTokens + 1u, pTokens + Length, &op, &length) || op.dims != 1u
+                 || op.index[0].offset >= MaxResources)
+                    return false;
+
+                pProgram->coords[op.index[0].offset] = getResourceCoords((pTokens[0] >> 11) & 0x1fu);
+                return true;
+            }
+
+            /* Inputs, outputs and buffers need no setup, and anything
+             * that matters for the result shows up in the code */
+            default:
+                return true;
+        }
+    }
+
+    bool parseProgram(const void* pBytecode, size_t BytecodeLength, Program* pProgram) {
+        DxbcContainer container;
+
+        if (!container.parse(pBytecode, BytecodeLength))
+            return false;
+
+        const auto* chunk = container.findCodeChunk();
+
+        if (!chunk || chunk->size() < 8u || chunk->size() % 4u)
+            return false;
+
+        std::vector<uint32_t> tokens(chunk->size() / 4u);
+        std::memcpy(tokens.data(), chunk->data(), chunk->size());
+
+        uint32_t programType = tokens[0] >> 16;
+        uint32_t major = (tokens[0] >> 4) & 0xfu;
+        uint32_t minor = tokens[0] & 0xfu;
+
+        /* Pixel and vertex shaders up to shader model 5.0 */
+        if (programType > 1u || major > 5u || (major == 5u && minor > 0u) || tokens[1] > tokens.size())
+            return false;
+
+        const uint32_t* end = tokens.data() + tokens[1];
+
+        for (const uint32_t* p = tokens.data() + 2u; p < end; ) {
+            uint32_t length = getDxbcInstructionLength(p);
+
+            if (!length || p + length > end)
+                return false;
+
+            DxbcOpcode opcode = getDxbcOpcode(p[0]);
+
+            if (isDxbcDeclaration(opcode)) {
+                if (!parseDeclaration(p, length, pProgram))
+                    return false;
+
+                p += length;
+                continue;
+            }
+
+            Instruction ins;
+            ins.info = findInterpOp(opcode);
+            ins.token = p[0];
+
+            if (!ins.info)
+                return false;
+
+            uint32_t header = getDxbcOpcodeTokenCount(p, p + length);
+
+            if (!header)
+                return false;
+
+            for (uint32_t i = 1u; i < header; i++) {
+                /* Sample controls, the offsets are signed 4-bit values */
+                if ((p[i] & 0x3fu) == 1u) {
+                    for (uint32_t k = 0; k < 3u; k++)
+                        ins.offsets[k] = int32_t(p[i] << (19u - 4u * k)) >> 28;
+                }
+            }
+
+            for (uint32_t offset = header; offset < length; ) {
+                Operand op;
+                uint32_t operandLength = 0u;
+
+                if (!parseOperand(p + offset, p + length, &op, &operandLength))
+                    return false;
+
+                ins.operands.push_back(op);
+                offset += operandLength;
+            }
+
+            if (ins.operands.size() != ins.info->operands)
+                return false;
+
+            pProgram->code.push_back(std::move(ins));
+            p += length;
+        }
+
+        return true;
+    }
+
+
+    /** Block of structured flow control */
+    struct Frame {
+        bool     loop;
+        uint32_t parent;        /**< Lanes active when entering the block */
+        uint32_t taken = 0u;    /**< Lanes that took the \c if branch */
+        uint32_t active = 0u;   /**< Lanes that did not break out of the loop */
+        uint32_t continued = 0u;
+        uint32_t start = 0u;
+        uint32_t iterations = 0u;
+    };
+
+    class Machine {
+
+    public:
+
+        Machine(const Program& Prog, const DxbcInterpInputs& Inputs)
+        : m_program(Prog), m_seed(Inputs.seed) {
+            for (const auto& c : Inputs.constants)
+                m_constants[(uint64_t(c.location.buffer) << 32) | c.location.element] = c.value;
+        }
+
+        bool run(uint32_t Quad, DxbcInterpResult* pResult) {
+            m_temps.assign(m_program.tempCount, Vec4());
+
+            for (const auto& a : m_program.indexableTemps)
+                m_indexable[a.first].assign(a.second, Vec4());
+
+            for (auto& reg : m_outputs)
+                reg = Vec4();
+
+            setupInputs(Quad);
+
+            m_stack.clear();
+            m_mask = AllLanes;
+            m_alive = AllLanes;
+            m_killed = 0u;
+
+            const auto& code = m_program.code;
+
+            for (uint32_t pc = 0; pc < code.size() && m_alive; pc++) {
+                const auto& ins = code[pc];
+                uint32_t active = uint32_t(std::popcount(m_mask));
+
+                if (!(ins.info->flags & OP_FLOW) && !m_mask)
+                    continue;
+
+                pResult->instructions += active;
+
+                if (ins.info->flags & OP_FLOW)
+                    pResult->branches += active;
+
+                if (ins.info->flags & OP_FETCH)
+                    pResult->fetches += active;
+
+                if (!execute(ins, pc))
+                    return false;
+            }
+
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                uint32_t invocation = Quad * DxbcInterpLanes + l;
+                uint32_t* out = &pResult->outputs[invocation * DxbcInterpOutputStride];
+
+                for (uint32_t r = 0; r < m_outputs.size(); r++) {
+                    for (uint32_t k = 0; k < 4u; k++)
+                        out[4u * r + k] = m_outputs[r].c[k][l];
+                }
+
+                pResult->discarded[invocation] = (m_killed >> l) & 1u;
+            }
+
+            return true;
+        }
+
+    private:
+
+        const Program&  m_program;
+        uint32_t        m_seed;
+
+        std::unordered_map<uint64_t, uint32_t> m_constants;
+
+        std::vector<Vec4> m_temps;
+        std::unordered_map<uint32_t, std::vector<Vec4>> m_indexable;
+        std::array<Vec4, DxbcMaxOutputRegisters> m_inputs;
+        std::array<Vec4, DxbcMaxOutputRegisters + 1u> m_outputs;
+
+        std::vector<Frame> m_stack;
+        uint32_t m_mask   = 0u;     /**< Lanes running the current instruction */
+        uint32_t m_alive  = 0u;     /**< Lanes that did not return or discard */
+        uint32_t m_killed = 0u;
+
+        /**
+         * \brief Synthetic interpolants
+         *
+         * Smooth in the pixel position so that derivatives are
+         * meaningful, and different for each register and component.
+         */
+        void setupInputs(uint32_t Quad) {
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                float x = float(2u * (Quad % 16u) + (l & 1u)) + 0.5f;
+                float y = float(2u * ((Quad * 7u) % 16u) + (l >> 1)) + 0.5f;
+
+                for (uint32_t r = 0; r < m_inputs.size(); r++) {
+                    for (uint32_t k = 0; k < 4u; k++) {
+                        float phase = 0.37f * float(k + 1u) * x + 0.23f * float(r + 2u) * y
+                                    + 0.61f * float(m_seed) + 0.5f * float(r) + float(k);
+                        m_inputs[r].c[k][l] = asUint(0.5f + 0.5f * std::sin(phase));
+                    }
+                }
+            }
+        }
+
+        uint32_t getConstant(uint32_t Buffer, uint32_t Element) const {
+            auto entry = m_constants.find((uint64_t(Buffer) << 32) | Element);
+
+            if (entry != m_constants.end())
+                return entry->second;
+
+            /* Positive and in a range where most math stays finite */
+            uint32_t h = hashValue(Buffer * 65536u + Element, m_seed);
+            return asUint(0.0625f + 0.9375f * float(h >> 8) / 16777216.0f);
+        }
+
+        uint32_t getIndex(const OperandIndex& Index, uint32_t Lane) const {
+            uint32_t index = Index.offset;
+
+            if (Index.relative == DxbcOperandType::Temp) {
+                if (Index.relIndex >= m_temps.size())
+                    return ~0u;
+
+                index += m_temps[Index.relIndex].c[Index.relComponent][Lane];
+            } else if (Index.relative == DxbcOperandType::Input) {
+                if (Index.relIndex >= m_inputs.size())
+                    return ~0u;
+
+                index += m_inputs[Index.relIndex].c[Index.relComponent][Lane];
+            }
+
+            return index;
+        }
+
+        /** Register an operand refers to for a lane, or \c nullptr if out of bounds */
+        Vec4* getRegister(const Operand& Op, uint32_t Lane) {
+            uint32_t index = Op.dims ? getIndex(Op.index[Op.dims - 1u], Lane) : 0u;
+
+            switch (Op.type) {
+                case DxbcOperandType::Temp:
+                    return index < m_temps.size() ? &m_temps[index] : nullptr;
+
+                case DxbcOperandType::Input:
+                    return index < m_inputs.size() ? &m_inputs[index] : nullptr;
+
+                case DxbcOperandType::Output:
+                    return index < DxbcMaxOutputRegisters ? &m_outputs[index] : nullptr;
+
+                case DxbcOperandType::OutputDepth:
+                case DxbcOperandType::OutputDepthGe:
+                case DxbcOperandType::OutputDepthLe:
+                    return &m_outputs[DxbcInterpDepthOutput];
+
+                case DxbcOperandType::IndexableTemp: {
+                    auto entry = m_indexable.find(Op.index[0].offset);
+
+                    if (entry == m_indexable.end() || index >= entry->second.size())
+                        return nullptr;
+
+                    return &entry->second[index];
+                }
+
+                default:
+                    return nullptr;
+            }
+        }
+
+        bool readSource(const Operand& Op, bool Integer, Vec4* pValue) {
+            Vec4 raw;
+
+            switch (Op.type) {
+                case DxbcOperandType::Imm32:
+                    for (uint32_t k = 0; k < 4u; k++)
+                        store(raw.c[k], _mm_set1_epi32(int32_t(Op.imm[k])));
+                    break;
+
+                case DxbcOperandType::ConstantBuffer:
+                    if (Op.dims != 2u)
+                        return false;
+
+                    for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                        uint32_t index = getIndex(Op.index[1], l);
+
+                        for (uint32_t k = 0; k < 4u; k++)
+                            raw.c[k][l] = getConstant(Op.index[0].offset, 4u * index + k);
+                    }
+                    break;
+
+                case DxbcOperandType::ImmediateConstantBuffer:
+                    if (Op.dims != 1u)
+                        return false;
+
+                    for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                        uint32_t index = getIndex(Op.index[0], l);
+
+                        for (uint32_t k = 0; k < 4u; k++) {
+                            size_t element = 4u * size_t(index) + k;
+                            raw.c[k][l] = element < m_program.icb.size() ? m_program.icb[element] : 0u;
+                        }
+                    }
+                    break;
+
+                case DxbcOperandType::Temp:
+                case DxbcOperandType::Input:
+                case DxbcOperandType::Output:
+                case DxbcOperandType::IndexableTemp:
+                    for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                        const Vec4* reg = getRegister(Op, l);
+
+                        for (uint32_t k = 0; k < 4u; k++)
+                            raw.c[k][l] = reg ? reg->c[k][l] : 0u;
+                    }
+                    break;
+
+                default:
+                    return false;
+            }
+
+            for (uint32_t k = 0; k < 4u; k++)
+                std::memcpy(pValue->c[k], raw.c[Op.swizzle[k]], sizeof(pValue->c[k]));
+
+            if (Op.modifier & ModifierAbs) {
+                *pValue = Integer
+                  ? mapLanes(*pValue, [] (uint32_t x) { return uint32_t(std::abs(int64_t(int32_t(x)))); })
+                  : map(*pValue, [] (__m128i x) { return _mm_and_si128(x, _mm_set1_epi32(0x7fffffff)); });
+            }
+
+            if (Op.modifier & ModifierNeg) {
+                *pValue = Integer
+                  ? map(*pValue, [] (__m128i x) { return _mm_sub_epi32(_mm_setzero_si128(), x); })
+                  : map(*pValue, [] (__m128i x) { return _mm_xor_si128(x, _mm_set1_epi32(int32_t(0x80000000u))); });
+            }
+
+            return true;
+        }
+
+        void writeDestination(const Operand& Op, const Vec4& Value, bool Saturate) {
+            if (Op.type == DxbcOperandType::Null)
+                return;
+
+            Vec4 value = Value;
+
+            if (Saturate) {
+                /* Also turns NaN into zero */
+                value = map(value, [] (__m128i x) {
+                    return pi(_mm_min_ps(_mm_max_ps(ps(x), _mm_setzero_ps()), _mm_set1_ps(1.0f)));
+                });
+            }
+
+            if (!Op.relative) {
+                Vec4* reg = getRegister(Op, 0u);
+
+                if (!reg)
+                    return;
+
+                __m128i mask = getLaneMask(m_mask);
+
+                for (uint32_t k = 0; k < 4u; k++) {
+                    if (Op.mask & (1u << k))
+                        store(reg->c[k], blend(mask, load(value.c[k]), load(reg->c[k])));
+                }
+            } else {
+                for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                    Vec4* reg = (m_mask & (1u << l)) ? getRegister(Op, l) : nullptr;
+
+                    for (uint32_t k = 0; reg && k < 4u; k++) {
+                        if (Op.mask & (1u << k))
+                            reg->c[k][l] = value.c[k][l];
+                    }
+                }
+            }
+        }
+
+        /** Lanes whose first condition component passes the instruction's test */
+        uint32_t testCondition(const Instruction& Ins, const Vec4& Cond) const {
+            bool nonZero = Ins.token & TestNonZeroBit;
+            uint32_t mask = 0u;
+
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                if ((Cond.c[0][l] != 0u) == nonZero)
+                    mask |= 1u << l;
+            }
+
+            return mask;
+        }
+
+        Frame* findLoop() {
+            for (auto i = m_stack.rbegin(); i != m_stack.rend(); i++) {
+                if (i->loop)
+                    return &*i;
+            }
+
+            return nullptr;
+        }
+
+        /** Lanes that may run again after leaving a block */
+        uint32_t getResumeMask(uint32_t Parent) {
+            uint32_t mask = Parent & m_alive;
+
+            if (const Frame* loop = findLoop())
+                mask &= loop->active & ~loop->continued;
+
+            return mask;
+        }
+
+        /**
+         * \brief Synthetic texture
+         *
+         * Each channel is a different smooth function of the
+         * coordinates, so filtering-like changes in the coordinates
+         * show up in the result.
+         */
+        void fetchTexel(uint32_t Slot, const float* pCoords, float* pTexel) const {
+            for (uint32_t k = 0; k < 4u; k++) {
+                float phase = 6.2831853f * (pCoords[0] * float(k + 1u)
+                  + pCoords[1] * (0.7f + 0.3f * float(Slot)) + 0.37f * pCoords[2] + 0.11f * pCoords[3])
+                  + float(k) + 0.1f * float(m_seed);
+                pTexel[k] = 0.5f + 0.5f * std::sin(phase);
+            }
+        }
+
+        bool sample(const Instruction& Ins, const Vec4* pSrc, Vec4* pResult) {
+            const auto& resource = Ins.operands[2];
+
+            if (resource.type != DxbcOperandType::Resource || resource.index[0].offset >= MaxResources)
+                return false;
+
+            uint32_t slot = resource.index[0].offset;
+            uint32_t coords = m_program.coords[slot];
+            DxbcOpcode opcode = Ins.info->opcode;
+
+            bool integer = opcode == DxbcOpcode::Ld || opcode == DxbcOpcode::LdMs;
+            bool compare = opcode == DxbcOpcode::SampleC || opcode == DxbcOpcode::SampleCLz;
+
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                float coord[4] = { };
+                float texel[4];
+
+                for (uint32_t k = 0; k < coords; k++) {
+                    coord[k] = integer
+                      ? (float(int32_t(pSrc[0].c[k][l])) + 0.5f) / float(TextureSize)
+                      : asFloat(pSrc[0].c[k][l]);
+                }
+
+                for (uint32_t k = 0; k < 3u; k++)
+                    coord[k] += float(Ins.offsets[k]) / float(TextureSize);
+
+                if (opcode == DxbcOpcode::Gather4) {
+                    /* Four texels around the coordinate, from the selected channel */
+                    static constexpr float OffsetsU[] = { 0.0f, 1.0f, 1.0f, 0.0f };
+                    static constexpr float OffsetsV[] = { 1.0f, 1.0f, 0.0f, 0.0f };
+
+                    float gathered[4];
+
+                    for (uint32_t k = 0; k < 4u; k++) {
+                        float at[4] = { coord[0] + OffsetsU[k] / float(TextureSize),
+                                        coord[1] + OffsetsV[k] / float(TextureSize), coord[2], coord[3] };
+                        fetchTexel(slot, at, texel);
+                        gathered[k] = texel[Ins.operands[3].swizzle[0]];
+                    }
+
+                    std::memcpy(texel, gathered, sizeof(texel));
+                } else {
+                    fetchTexel(slot, coord, texel);
+
+                    if (compare) {
+                        float result = asFloat(pSrc[3].c[0][l]) <= texel[0] ? 1.0f : 0.0f;
+                        std::fill(std::begin(texel), std::end(texel), result);
+                    }
+                }
+
+                for (uint32_t k = 0; k < 4u; k++)
+                    pResult->c[k][l] = asUint(texel[resource.swizzle[k]]);
+            }
+
+            return true;
+        }
+
+        bool resinfo(const Instruction& Ins, const Vec4& Mip, Vec4* pResult) {
+            const auto& resource = Ins.operands[2];
+
+            if (resource.type != DxbcOperandType::Resource)
+                return false;
+
+            static constexpr uint32_t MipCount = uint32_t(std::bit_width(TextureSize));
+            uint32_t returnType = (Ins.token >> 11) & 0x3u;
+
+            for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                uint32_t mip = Mip.c[0][l];
+                uint32_t size = mip < MipCount ? TextureSize >> mip : 0u;
+                uint32_t info[4] = { size, size, 1u, MipCount };
+
+                for (uint32_t k = 0; k < 4u; k++) {
+                    uint32_t v = info[resource.swizzle[k]];
+
+                    switch (returnType) {
+                        case 0u: v = asUint(float(v)); break;
+                        case 1u: v = asUint(resource.swizzle[k] < 3u && v ? 1.0f / float(v) : float(v)); break;
+                        default: break;
+                    }
+
+                    pResult->c[k][l] = v;
+                }
+            }
+
+            return true;
+        }
+
+        bool execute(const Instruction& Ins, uint32_t& Pc) {
+            std::array<Vec4, 5> src;
+            bool integer = Ins.info->flags & OP_INT;
+
+            for (uint32_t i = Ins.info->destinations; i < Ins.operands.size(); i++) {
+                const auto& op = Ins.operands[i];
+
+                /* Resources and samplers are handled by the instruction */
+                if (op.type == DxbcOperandType::Resource || op.type == DxbcOperandType::Sampler)
+                    continue;
+
+                if (!readSource(op, integer, &src[i - Ins.info->destinations]))
+                    return false;
+            }
+
+            const Vec4& a = src[0];
+            const Vec4& b = src[1];
+            const Vec4& c = src[2];
+
+            Vec4 result;
+            Vec4 second;
+
+            switch (Ins.info->opcode) {
+                case DxbcOpcode::Add:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_add_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Mul:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_mul_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Mad:
+                    result = map(a, b, c, [] (__m128i x, __m128i y, __m128i z) {
+                        return pi(_mm_add_ps(_mm_mul_ps(ps(x), ps(y)), ps(z)));
+                    });
+                    break;
+
+                case DxbcOpcode::Div:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_div_ps(ps(x), ps(y))); });
+                    break;
+
+                /* Return the other operand if one is NaN */
+                case DxbcOpcode::Min:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        return blend(isNaN(y), x, pi(_mm_min_ps(ps(x), ps(y))));
+                    });
+                    break;
+
+                case DxbcOpcode::Max:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        return blend(isNaN(y), x, pi(_mm_max_ps(ps(x), ps(y))));
+                    });
+                    break;
+
+                case DxbcOpcode::Eq:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_cmpeq_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Ne:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_cmpneq_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Lt:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_cmplt_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Ge:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return pi(_mm_cmpge_ps(ps(x), ps(y))); });
+                    break;
+
+                case DxbcOpcode::Dp2: result = dot(a, b, 2u); break;
+                case DxbcOpcode::Dp3: result = dot(a, b, 3u); break;
+                case DxbcOpcode::Dp4: result = dot(a, b, 4u); break;
+
+                case DxbcOpcode::Sqrt:
+                    result = map(a, [] (__m128i x) { return pi(_mm_sqrt_ps(ps(x))); });
+                    break;
+
+                case DxbcOpcode::Rsq:
+                    result = map(a, [] (__m128i x) { return pi(_mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(ps(x)))); });
+                    break;
+
+                case DxbcOpcode::Rcp:
+                    result = map(a, [] (__m128i x) { return pi(_mm_div_ps(_mm_set1_ps(1.0f), ps(x))); });
+                    break;
+
+                case DxbcOpcode::Exp:     result = mapFloat(a, [] (float x) { return std::exp2(x); });           break;
+                case DxbcOpcode::Log:     result = mapFloat(a, [] (float x) { return std::log2(x); });           break;
+                case DxbcOpcode::Frc:     result = mapFloat(a, [] (float x) { return x - std::floor(x); });      break;
+                case DxbcOpcode::RoundNe: result = mapFloat(a, [] (float x) { return std::nearbyint(x); });      break;
+                case DxbcOpcode::RoundNi: result = mapFloat(a, [] (float x) { return std::floor(x); });          break;
+                case DxbcOpcode::RoundPi: result = mapFloat(a, [] (float x) { return std::ceil(x); });           break;
+                case DxbcOpcode::RoundZ:  result = mapFloat(a, [] (float x) { return std::trunc(x); });          break;
+
+                case DxbcOpcode::Sincos:
+                    result = mapFloat(a, [] (float x) { return std::sin(x); });
+                    second = mapFloat(a, [] (float x) { return std::cos(x); });
+                    break;
+
+                case DxbcOpcode::Ftoi:
+                    result = mapLanes(a, [] (uint32_t x) { return floatToInt(asFloat(x)); });
+                    break;
+
+                case DxbcOpcode::Ftou:
+                    result = mapLanes(a, [] (uint32_t x) { return floatToUint(asFloat(x)); });
+                    break;
+
+                case DxbcOpcode::Itof:
+                    result = map(a, [] (__m128i x) { return pi(_mm_cvtepi32_ps(x)); });
+                    break;
+
+                case DxbcOpcode::Utof:
+                    result = mapLanes(a, [] (uint32_t x) { return asUint(float(x)); });
+                    break;
+
+                case DxbcOpcode::Mov:
+                    result = a;
+                    break;
+
+                case DxbcOpcode::Movc:
+                    result = map(a, b, c, [] (__m128i x, __m128i y, __m128i z) {
+                        return blend(_mm_cmpeq_epi32(x, _mm_setzero_si128()), z, y);
+                    });
+                    break;
+
+                case DxbcOpcode::Swapc: {
+                    const Vec4& d = src[2];
+                    result = map(a, b, d, [] (__m128i x, __m128i y, __m128i z) {
+                        return blend(_mm_cmpeq_epi32(x, _mm_setzero_si128()), y, z);
+                    });
+                    second = map(a, b, d, [] (__m128i x, __m128i y, __m128i z) {
+                        return blend(_mm_cmpeq_epi32(x, _mm_setzero_si128()), z, y);
+                    });
+                } break;
+
+                case DxbcOpcode::And:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_and_si128(x, y); });
+                    break;
+
+                case DxbcOpcode::Or:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_or_si128(x, y); });
+                    break;
+
+                case DxbcOpcode::Xor:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_xor_si128(x, y); });
+                    break;
+
+                case DxbcOpcode::Not:
+                    result = map(a, [] (__m128i x) { return _mm_xor_si128(x, _mm_set1_epi32(-1)); });
+                    break;
+
+                case DxbcOpcode::Iadd:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_add_epi32(x, y); });
+                    break;
+
+                case DxbcOpcode::Ineg:
+                    result = map(a, [] (__m128i x) { return _mm_sub_epi32(_mm_setzero_si128(), x); });
+                    break;
+
+                case DxbcOpcode::Ieq:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_cmpeq_epi32(x, y); });
+                    break;
+
+                case DxbcOpcode::Ine:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        return _mm_xor_si128(_mm_cmpeq_epi32(x, y), _mm_set1_epi32(-1));
+                    });
+                    break;
+
+                case DxbcOpcode::Ilt:
+                    result = map(a, b, [] (__m128i x, __m128i y) { return _mm_cmplt_epi32(x, y); });
+                    break;
+
+                case DxbcOpcode::Ige:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        return _mm_xor_si128(_mm_cmplt_epi32(x, y), _mm_set1_epi32(-1));
+                    });
+                    break;
+
+                /* Unsigned compares as signed compares with the sign bit flipped */
+                case DxbcOpcode::Ult:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        __m128i sign = _mm_set1_epi32(int32_t(0x80000000u));
+                        return _mm_cmplt_epi32(_mm_xor_si128(x, sign), _mm_xor_si128(y, sign));
+                    });
+                    break;
+
+                case DxbcOpcode::Uge:
+                    result = map(a, b, [] (__m128i x, __m128i y) {
+                        __m128i sign = _mm_set1_epi32(int32_t(0x80000000u));
+                        return _mm_xor_si128(_mm_cmplt_epi32(_mm_xor_si128(x, sign), _mm_xor_si128(y, sign)), _mm_set1_epi32(-1));
+                    });
+                    break;
+
+                case DxbcOpcode::Imad:
+                case DxbcOpcode::Umad:
+                    result = mapLanes(a, b, c, [] (uint32_t x, uint32_t y, uint32_t z) { return x * y + z; });
+                    break;
+
+                case DxbcOpcode::Imul:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) {
+                        return uint32_t(uint64_t(int64_t(int32_t(x)) * int64_t(int32_t(y))) >> 32);
+                    });
+                    second = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return x * y; });
+                    break;
+
+                case DxbcOpcode::Umul:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return uint32_t((uint64_t(x) * uint64_t(y)) >> 32); });
+                    second = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return x * y; });
+                    break;
+
+                case DxbcOpcode::Udiv:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return y ? x / y : ~0u; });
+                    second = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return y ? x % y : ~0u; });
+                    break;
+
+                case DxbcOpcode::Imax:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return uint32_t(std::max(int32_t(x), int32_t(y))); });
+                    break;
+
+                case DxbcOpcode::Imin:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return uint32_t(std::min(int32_t(x), int32_t(y))); });
+                    break;
+
+                case DxbcOpcode::Umax:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return std::max(x, y); });
+                    break;
+
+                case DxbcOpcode::Umin:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return std::min(x, y); });
+                    break;
+
+                case DxbcOpcode::Ishl:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return x << (y & 31u); });
+                    break;
+
+                case DxbcOpcode::Ishr:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return uint32_t(int32_t(x) >> (y & 31u)); });
+                    break;
+
+                case DxbcOpcode::Ushr:
+                    result = mapLanes(a, b, [] (uint32_t x, uint32_t y) { return x >> (y & 31u); });
+                    break;
+
+                case DxbcOpcode::Countbits:
+                    result = mapLanes(a, [] (uint32_t x) { return uint32_t(std::popcount(x)); });
+                    break;
+
+                case DxbcOpcode::FirstbitHi:
+                    result = mapLanes(a, [] (uint32_t x) { return x ? uint32_t(std::countl_zero(x)) : ~0u; });
+                    break;
+
+                case DxbcOpcode::FirstbitLo:
+                    result = mapLanes(a, [] (uint32_t x) { return x ? uint32_t(std::countr_zero(x)) : ~0u; });
+                    break;
+
+                case DxbcOpcode::FirstbitShi:
+                    result = mapLanes(a, [] (uint32_t x) {
+                        uint32_t v = int32_t(x) < 0 ? ~x : x;
+                        return v ? uint32_t(std::countl_zero(v)) : ~0u;
+                    });
+                    break;
+
+                case DxbcOpcode::Bfrev:
+                    result = mapLanes(a, [] (uint32_t x) {
+                        uint32_t r = 0u;
+
+                        for (uint32_t i = 0; i < 32u; i++)
+                            r |= ((x >> i) & 1u) << (31u - i);
+
+                        return r;
+                    });
+                    break;
+
+                case DxbcOpcode::Ubfe:
+                case DxbcOpcode::Ibfe: {
+                    bool sign = Ins.info->opcode == DxbcOpcode::Ibfe;
+                    result = mapLanes(a, b, c, [sign] (uint32_t w, uint32_t o, uint32_t v) {
+                        return extractBits(w, o, v, sign);
+                    });
+                } break;
+
+                case DxbcOpcode::Bfi:
+                    for (uint32_t k = 0; k < 4u; k++) {
+                        for (uint32_t l = 0; l < DxbcInterpLanes; l++) {
+                            uint32_t width = a.c[k][l] & 31u;
+                            uint32_t offset = b.c[k][l] & 31u;
+                            uint32_t mask = (((1u << width) - 1u) << offset);
+                            result.c[k][l] = ((c.c[k][l] << offset) & mask) | (src[3].c[k][l] & ~mask);
+                        }
+                    }
+                    break;
+
+                case DxbcOpcode::DerivRtx:
+                case DxbcOpcode::DerivRtxCoarse:
+                    result = derivative<1, 1, 1, 1, 0, 0, 0, 0>(a);
+                    break;
+
+                case DxbcOpcode::DerivRtxFine:
+                    result = derivative<1, 1, 3, 3, 0, 0, 2, 2>(a);
+                    break;
+
+                case DxbcOpcode::DerivRty:
+                case DxbcOpcode::DerivRtyCoarse:
+                    result = derivative<2, 2, 2, 2, 0, 0, 0, 0>(a);
+                    break;
+
+                case DxbcOpcode::DerivRtyFine:
+                    result = derivative<2, 3, 2, 3, 0, 1, 0, 1>(a);
+                    break;
+
+                case DxbcOpcode::Sample:
+                case DxbcOpcode::SampleC:
+                case DxbcOpcode::SampleCLz:
+                case DxbcOpcode::SampleL:
+                case DxbcOpcode::SampleD:
+                case DxbcOpcode::SampleB:
+                case DxbcOpcode::Gather4:
+                case DxbcOpcode::Ld:
+                case DxbcOpcode::LdMs:
+                    if (!sample(Ins, src.data(), &result))
+                        return false;
+                    break;
+
+                case DxbcOpcode::Resinfo:
+                    if (!resinfo(Ins, a, &result))
+                        return false;
+                    break;
+
+                case DxbcOpcode::Nop:
+                    return true;
+
+                case DxbcOpcode::Discard: {
+                    uint32_t kill = m_mask & testCondition(Ins, a);
+                    m_killed |= kill;
+                    m_alive &= ~kill;
+                    m_mask &= ~kill;
+                } return true;
+
+                case DxbcOpcode::If: {
+                    Frame frame = { false, m_mask };
+                    frame.taken = m_mask & testCondition(Ins, a);
+                    m_mask = frame.taken;
+                    m_stack.push_back(frame);
+                } return true;
+
+                case DxbcOpcode::Else: {
+                    if (m_stack.empty() || m_stack.back().loop)
+                        return false;
+
+                    const auto& frame = m_stack.back();
+                    m_mask = getResumeMask(frame.parent & ~frame.taken);
+                } return true;
+
+                case DxbcOpcode::Endif: {
+                    if (m_stack.empty() || m_stack.back().loop)
+                        return false;
+
+                    uint32_t parent = m_stack.back().parent;
+                    m_stack.pop_back();
+                    m_mask = getResumeMask(parent);
+                } return true;
+
+                case DxbcOpcode::Loop: {
+                    Frame frame = { true, m_mask };
+                    frame.active = m_mask;
+                    frame.start = Pc;
+                    m_stack.push_back(frame);
+                } return true;
+
+                case DxbcOpcode::Endloop: {
+                    if (m_stack.empty() || !m_stack.back().loop)
+                        return false;
+
+                    auto& frame = m_stack.back();
+                    frame.active &= m_alive;
+                    frame.continued = 0u;
+
+                    if (frame.active) {
+                        if (++frame.iterations >= MaxLoopIterations)
+                            return false;
+
+                        m_mask = frame.active;
+                        Pc = frame.start;
+                    } else {
+                        uint32_t parent = frame.parent;
+                        m_stack.pop_back();
+                        m_mask = getResumeMask(parent);
+                    }
+                } return true;
+
+                case DxbcOpcode::Break:
+                case DxbcOpcode::Breakc:
+                case DxbcOpcode::Continue:
+                case DxbcOpcode::Continuec: {
+                    Frame* loop = findLoop();
+
+                    if (!loop)
+                        return false;
+
+                    DxbcOpcode opcode = Ins.info->opcode;
+                    bool conditional = opcode == DxbcOpcode::Breakc || opcode == DxbcOpcode::Continuec;
+                    uint32_t lanes = conditional ? m_mask & testCondition(Ins, a) : m_mask;
+
+                    if (opcode == DxbcOpcode::Break || opcode == DxbcOpcode::Breakc)
+                        loop->active &= ~lanes;
+                    else
+                        loop->continued |= lanes;
+
+                    m_mask &= ~lanes;
+                } return true;
+
+                case DxbcOpcode::Ret:
+                case DxbcOpcode::Retc: {
+                    uint32_t lanes = Ins.info->opcode == DxbcOpcode::Retc
+                      ? m_mask & testCondition(Ins, a) : m_mask;
+                    m_alive &= ~lanes;
+                    m_mask &= ~lanes;
+                } return true;
+
+                default:
+                    return false;
+            }
+
+            bool saturate = Ins.token & SaturateBit;
+            writeDestination(Ins.operands[0], result, saturate);
+
+            if (Ins.info->destinations > 1u)
+                writeDestination(Ins.operands[1], second, saturate);
+
+            return true;
+        }
+
+    };
+
+}
+
+
+bool runDxbcShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+  const DxbcInterpInputs&         Inputs,
+        DxbcInterpResult*         pResult) {
+    Program program;
+
+    if (!parseProgram(pBytecode, BytecodeLength, &program))
+        return false;
+
+    uint32_t invocations = Inputs.quads * DxbcInterpLanes;
+
+    *pResult = DxbcInterpResult();
+    pResult->outputs.resize(size_t(invocations) * DxbcInterpOutputStride);
+    pResult->discarded.resize(invocations);
+
+    uint32_t csr = _mm_getcsr();
+    _mm_setcsr(csr | FlushDenormals);
+
+    Machine machine(program, Inputs);
+    bool success = true;
+
+    for (uint32_t q = 0; q < Inputs.quads && success; q++)
+        success = machine.run(q, pResult);
+
+    _mm_setcsr(csr);
+    return success;
+}
+
+}
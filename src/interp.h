@@ -0,0 +1,63 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "shaderopt.h"
+
+namespace atfix {
+
+/** Invocations run together, one 2x2 pixel quad */
+constexpr uint32_t DxbcInterpLanes = 4u;
+
+/** Output slot holding \c oDepth, after the regular output registers */
+constexpr uint32_t DxbcInterpDepthOutput = DxbcMaxOutputRegisters;
+
+/** Output dwords per invocation */
+constexpr uint32_t DxbcInterpOutputStride = (DxbcMaxOutputRegisters + 1u) * 4u;
+
+/** Synthetic inputs of an interpreter run */
+struct DxbcInterpInputs {
+    uint32_t quads = 16u;   /**< Pixel quads, or groups of four vertices */
+    uint32_t seed  = 0u;    /**< Varies inputs, constants and textures */
+
+    /** Values that replace the synthetic constant buffer contents */
+    std::vector<DxbcConstant> constants;
+};
+
+/** Outputs and cost of an interpreter run */
+struct DxbcInterpResult {
+    std::vector<uint32_t> outputs;    /**< Output registers of each invocation */
+    std::vector<uint8_t>  discarded;  /**< Per invocation */
+    uint64_t instructions = 0u;       /**< Executed, summed over invocations */
+    uint64_t fetches      = 0u;       /**< Texture samples and loads */
+    uint64_t branches     = 0u;       /**< Flow control instructions */
+};
+
+/**
+ * \brief Runs a vertex or pixel shader on the CPU
+ *
+ * Interprets the common SM4 and SM5 arithmetic, texture and flow
+ * control instructions, four invocations at a time in SSE lanes.
+ * Inputs are smooth functions of the pixel position, constant
+ * buffers hold pseudo-random values and textures return smooth
+ * functions of the coordinates, so runs are deterministic for the
+ * same seed and two shaders can be compared output by output.
+ * \param [in] pBytecode Shader DXBC
+ * \param [in] BytecodeLength Size of the shader
+ * \param [in] Inputs Number of invocations and values to assume
+ * \param [out] pResult Outputs and instruction counts
+ * \returns \c false if the shader uses unsupported instructions
+ *    or operands, or a loop does not terminate
+ */
+bool runDxbcShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+  const DxbcInterpInputs&         Inputs,
+        DxbcInterpResult*         pResult);
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "impl.h"
+#include "learn.h"
+#include "rules.h"
+#include "worker.h"
+
+namespace atfix {
+
+namespace {
+
+    struct DrawFingerprintHasher {
+        size_t operator () (const DrawFingerprint& f) const {
+            uint64_t h = detail::hashMix(f.vs ^ detail::HashPrime64_1, f.ps ^ detail::HashPrime64_2);
+            h ^= detail::hashMix((uint64_t(f.count) << 32 | f.instanceCount) ^ detail::HashPrime64_1,
+                (uint64_t(f.rtFormat) << 48 | uint64_t(f.dsvFormat) << 32 | uint64_t(f.viewportWidth) << 16 | f.viewportHeight)
+              ^ (uint64_t(f.type) << 8 | f.depthFlags));
+            return size_t(h);
+        }
+    };
+
+    struct DrawStats {
+        Hash128   vsHash      = { };
+        Hash128   psHash      = { };
+        uint64_t  draws       = 0u;
+        uint64_t  ticks       = 0u;
+        uint32_t  frames      = 0u;
+        uint32_t  lastFrame   = 0u;
+    };
+
+    using DrawTableEntry = std::pair<DrawFingerprint, DrawStats>;
+
+    std::unordered_map<DrawFingerprint, DrawStats, DrawFingerprintHasher> g_drawTable;
+    uint64_t g_droppedDraws = 0u;
+    uint32_t g_learnFrame = 1u;
+
+    WorkerThread g_learnWorker;
+
+    const char* getDrawTypeName(uint8_t Type) {
+        static const char* names[] = {
+            "Draw", "DrawIndexed", "DrawInstanced", "DrawIndexedInstanced", "DrawAuto",
+            "DrawInstancedIndirect", "DrawIndexedInstancedIndirect", "Dispatch", "DispatchIndirect",
+        };
+
+        return Type < std::size(names) ? names[Type] : "Unknown";
+    }
+
+    /** Draw types whose count is an index count, which rules can match */
+    bool hasIndexCount(uint8_t Type) {
+        return Type == 1u || Type == 3u;
+    }
+
+    /**
+     * \brief Writes the table as rule sections
+     *
+     * Each fingerprint becomes a commented-out rule so that expensive
+     * draws can be targeted by copying a section and picking an action.
+     */
+    void writeDrawTable(
+      const std::string&              Path,
+            std::vector<DrawTableEntry> Entries,
+            uint32_t                  Frames,
+            uint64_t                  Dropped) {
+        using period = std::chrono::steady_clock::period;
+        constexpr double TicksToUs = 1.0e6 * double(period::num) / double(period::den);
+
+        std::sort(Entries.begin(), Entries.end(), [] (const DrawTableEntry& a, const DrawTableEntry& b) {
+            return a.second.ticks > b.second.ticks;
+        });
+
+        std::ofstream file(Path, std::ios::out | std::ios::trunc);
+
+        file << "; Draw fingerprints by CPU time spent in the draw call" << std::endl
+             << "; frames=" << Frames << " fingerprints=" << Entries.size()
+             << " dropped_draws=" << Dropped << std::endl << std::endl;
+
+        char line[256];
+        uint32_t index = 0u;
+
+        for (const auto& [f, stats] : Entries) {
+            double totalUs = double(stats.ticks) * TicksToUs;
+
+            std::snprintf(line, sizeof(line),
+                "; total_ms=%.3f avg_us=%.3f draws=%llu frames=%u per_frame=%.2f type=%s instances=%u depth=%s%s dsv_format=%u",
+                totalUs / 1000.0, totalUs / double(stats.draws),
+                static_cast<unsigned long long>(stats.draws), stats.frames,
+                double(stats.draws) / double(stats.frames),
+                getDrawTypeName(f.type), f.instanceCount,
+                (f.depthFlags & DRAW_DEPTH_TEST) ? "test" : "off",
+                (f.depthFlags & DRAW_DEPTH_WRITE) ? ",write" : "",
+                uint32_t(f.dsvFormat));
+
+            file << line << std::endl;
+
+            std::snprintf(line, sizeof(line), "[rule.learned_%04u]", ++index);
+            file << line << std::endl;
+
+            if (f.vs)
+                file << "VS=" << formatHash(stats.vsHash) << std::endl;
+
+            if (f.ps)
+                file << "PS=" << formatHash(stats.psHash) << std::endl;
+
+            if (f.count && hasIndexCount(f.type))
+                file << "IndexCount=" << f.count << std::endl;
+
+            if (f.rtFormat)
+                file << "RTFormat=" << f.rtFormat << std::endl;
+
+            if (f.viewportWidth || f.viewportHeight)
+                file << "Viewport=" << f.viewportWidth << "x" << f.viewportHeight << std::endl;
+
+            file << ";Action=skip" << std::endl << std::endl;
+        }
+    }
+
+}
+
+
+void recordDrawFingerprint(
+  const DrawFingerprint&  Fingerprint,
+  const void*             pVertexShader,
+  const void*             pPixelShader,
+        uint64_t          Ticks) {
+    auto entry = g_drawTable.find(Fingerprint);
+
+    if (entry == g_drawTable.end()) {
+        if (g_drawTable.size() >= g_config.learnMaxFingerprints) {
+            g_droppedDraws += 1u;
+            return;
+        }
+
+        if (g_drawTable.empty())
+            g_drawTable.reserve(g_config.learnMaxFingerprints);
+
+        /* Resolve hashes now, the shaders may be gone by the time the table is written */
+        DrawStats stats;
+
+        if (Fingerprint.vs)
+            getRuleShaderHash(pVertexShader, &stats.vsHash);
+
+        if (Fingerprint.ps)
+            getRuleShaderHash(pPixelShader, &stats.psHash);
+
+        entry = g_drawTable.insert({ Fingerprint, stats }).first;
+    }
+
+    auto& stats = entry->second;
+    stats.draws += 1u;
+    stats.ticks += Ticks;
+
+    if (stats.lastFrame != g_learnFrame) {
+        stats.lastFrame = g_learnFrame;
+        stats.frames += 1u;
+    }
+}
+
+
+void endLearningFrame() {
+    if (g_learnFrame++ % g_config.learnDumpInterval)
+        return;
+
+    std::vector<DrawTableEntry> entries(g_drawTable.begin(), g_drawTable.end());
+    uint32_t frames = g_learnFrame - 1u;
+    uint64_t dropped = g_droppedDraws;
+
+    g_learnWorker.submit([entries = std::move(entries), frames, dropped] () mutable {
+        writeDrawTable(g_config.learnFile, std::move(entries), frames, dropped);
+    });
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef LEARN_H
+#define LEARN_H
+
+#include <cstdint>
+
+namespace atfix {
+
+/**
+ * \brief Compact description of a draw
+ *
+ * Holds the state that draw rules can match on, plus some
+ * that helps telling similar draws apart.
+ */
+struct DrawFingerprint {
+    uint64_t  vs              = 0u;
+    uint64_t  ps              = 0u;
+    uint32_t  count           = 0u;   /**< Index or vertex count per instance */
+    uint32_t  instanceCount   = 0u;
+    uint16_t  rtFormat        = 0u;
+    uint16_t  dsvFormat       = 0u;
+    uint16_t  viewportWidth   = 0u;
+    uint16_t  viewportHeight  = 0u;
+    uint8_t   type            = 0u;
+    uint8_t   depthFlags      = 0u;
+
+    bool operator == (const DrawFingerprint&) const = default;
+};
+
+constexpr uint8_t DRAW_DEPTH_TEST  = (1u << 0);
+constexpr uint8_t DRAW_DEPTH_WRITE = (1u << 1);
+
+/**
+ * \brief Counts a draw in the fingerprint table
+ *
+ * Must be called on the rendering thread. Once the table is
+ * full, draws with unseen fingerprints are only counted.
+ * \param [in] Fingerprint The draw
+ * \param [in] pVertexShader Bound vertex shader, to resolve its hash
+ * \param [in] pPixelShader Bound pixel shader, to resolve its hash
+ * \param [in] Ticks CPU time spent in the draw call, in \c steady_clock ticks
+ */
+void recordDrawFingerprint(
+  const DrawFingerprint&  Fingerprint,
+  const void*             pVertexShader,
+  const void*             pPixelShader,
+        uint64_t          Ticks);
+
+/**
+ * \brief Ends a frame of learning mode
+ *
+ * Writes the table to disk on a worker thread every few frames.
+ */
+void endLearningFrame();
+
+}
+
+#endif
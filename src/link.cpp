@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <unordered_map>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "link.h"
+#include "shaderopt.h"
+#include "worker.h"
+#include "util.h"
+
+namespace atfix {
+
+namespace {
+
+    constexpr uint32_t NoVariant = ~0u;
+
+    /** Vertex shader specialized for the inputs of a set of pixel shaders */
+    struct LinkedVariant {
+        std::array<uint8_t, DxbcMaxOutputRegisters> liveOutputs;
+        uint32_t              unusedOutputs = 0u;
+        ID3D11VertexShader*   shader        = nullptr;    /**< Null while pending or if linking failed */
+    };
+
+    struct LinkVertexShader {
+        uint64_t              id;         /**< Tells apart shaders created at the same address */
+        Hash128               hash;
+        ID3D11Device*         device;
+        std::vector<uint8_t>  code;
+        std::vector<DxbcSignature::Element> outputs;
+        std::vector<LinkedVariant> variants;
+    };
+
+    struct LinkPixelShader {
+        std::vector<DxbcSignature::Element> inputs;
+    };
+
+    struct LinkKey {
+        ID3D11VertexShader*   vs;
+        ID3D11PixelShader*    ps;
+
+        bool operator == (const LinkKey&) const = default;
+    };
+
+    struct LinkKeyHasher {
+        size_t operator () (const LinkKey& k) const {
+            return std::hash<const void*>()(k.vs) ^ (std::hash<const void*>()(k.ps) << 1);
+        }
+    };
+
+    mutex g_linkMutex;
+    std::unordered_map<ID3D11VertexShader*, LinkVertexShader> g_linkVertexShaders;
+    std::unordered_map<ID3D11PixelShader*, LinkPixelShader> g_linkPixelShaders;
+    std::unordered_map<LinkKey, uint32_t, LinkKeyHasher> g_linkPairs;   /**< Variant index, or \c NoVariant */
+    uint64_t g_linkShaderId = 0u;
+
+    WorkerThread g_linkWorker;
+
+    bool readSignature(const void* pBytecode, size_t BytecodeLength, uint32_t Tag, std::vector<DxbcSignature::Element>* pElements) {
+        DxbcContainer container;
+        DxbcSignature signature;
+
+        if (!container.parse(pBytecode, BytecodeLength))
+            return false;
+
+        const auto* chunk = container.findChunk(Tag);
+
+        if (!chunk || !signature.parse(*chunk))
+            return false;
+
+        *pElements = signature.elements();
+        return true;
+    }
+
+    /* Semantic names are not case sensitive */
+    bool isSameSemantic(const DxbcSignature::Element& a, const DxbcSignature::Element& b) {
+        return a.semanticIndex == b.semanticIndex
+            && std::equal(a.name.begin(), a.name.end(), b.name.begin(), b.name.end(),
+                [] (char x, char y) { return std::tolower(uint8_t(x)) == std::tolower(uint8_t(y)); });
+    }
+
+    /**
+     * \brief Computes which vertex shader outputs a pixel shader needs
+     *
+     * System values are always kept. Other outputs are matched to
+     * inputs by semantic, and only the components the pixel shader
+     * reads stay live. Outputs the pixel shader does not declare at
+     * all can be removed from the signature.
+     * \returns \c false if linking would not remove anything
+     */
+    bool getLinkOptions(
+      const std::vector<DxbcSignature::Element>& Outputs,
+      const std::vector<DxbcSignature::Element>& Inputs,
+            DxbcOptimizeOptions*      pOptions) {
+        std::array<uint8_t, DxbcMaxOutputRegisters> written = { };
+        uint32_t declared = 0u;
+        uint32_t kept = 0u;
+
+        for (const auto& e : Outputs) {
+            if (e.registerIndex >= DxbcMaxOutputRegisters)
+                return false;
+
+            pOptions->liveOutputs[e.registerIndex] = 0u;
+            declared |= 1u << e.registerIndex;
+        }
+
+        for (const auto& e : Outputs) {
+            auto& live = pOptions->liveOutputs[e.registerIndex];
+            written[e.registerIndex] |= e.mask;
+
+            if (e.systemValue) {
+                live = 0xfu;
+                kept |= 1u << e.registerIndex;
+                continue;
+            }
+
+            auto input = std::find_if(Inputs.begin(), Inputs.end(),
+                [&e] (const DxbcSignature::Element& i) { return isSameSemantic(e, i); });
+
+            if (input != Inputs.end()) {
+                live |= input->rwMask & e.mask;
+                kept |= 1u << e.registerIndex;
+            }
+        }
+
+        pOptions->unusedOutputs = declared & ~kept;
+
+        bool dead = pOptions->unusedOutputs != 0u;
+
+        for (uint32_t i = 0; i < DxbcMaxOutputRegisters; i++)
+            dead |= (written[i] & ~pOptions->liveOutputs[i]) != 0u;
+
+        return dead;
+    }
+
+    void createVariantAsync(ID3D11VertexShader* pShader, const LinkVertexShader& Vs, uint32_t Index, const DxbcOptimizeOptions& Options) {
+        g_linkWorker.submit([pShader, Index, Options,
+            id = Vs.id, hash = Vs.hash, device = Vs.device, code = Vs.code] {
+            std::vector<uint8_t> linked;
+            DxbcOptimizeStats stats;
+            ID3D11VertexShader* shader = nullptr;
+
+            if (optimizeDxbcShader(code.data(), code.size(), Options, &linked, &stats)) {
+                HRESULT hr = getDeviceProcs(device)->CreateVertexShader(device,
+                    linked.data(), linked.size(), nullptr, &shader);
+
+                if (FAILED(hr))
+                    shader = nullptr;
+
+#ifndef NDEBUG
+                if (FAILED(hr))
+                    log("Link: Failed to create variant of ", formatHash(hash), ": ", hr);
+                else
+                    log("Link: Created variant of ", formatHash(hash), ", ", stats.outputs, " outputs and ",
+                        stats.removed, " instructions removed, ", stats.trimmed, " trimmed");
+#endif
+            }
+
+            std::lock_guard lock(g_linkMutex);
+            auto entry = g_linkVertexShaders.find(pShader);
+
+            if (entry != g_linkVertexShaders.end() && entry->second.id == id)
+                entry->second.variants[Index].shader = shader;
+            else if (shader)
+                shader->Release();
+        });
+    }
+
+    uint32_t findVariant(ID3D11VertexShader* pShader, LinkVertexShader& Vs, ID3D11PixelShader* pPixelShader) {
+        static const std::vector<DxbcSignature::Element> NoInputs;
+        const auto* inputs = &NoInputs;
+
+        if (pPixelShader) {
+            auto ps = g_linkPixelShaders.find(pPixelShader);
+
+            if (ps == g_linkPixelShaders.end())
+                return NoVariant;
+
+            inputs = &ps->second.inputs;
+        }
+
+        DxbcOptimizeOptions options;
+        options.validate = g_config.validateShaders;
+
+        if (!getLinkOptions(Vs.outputs, *inputs, &options))
+            return NoVariant;
+
+        /* Pixel shaders reading the same inputs share a variant */
+        for (uint32_t i = 0; i < Vs.variants.size(); i++) {
+            const auto& v = Vs.variants[i];
+
+            if (v.liveOutputs == options.liveOutputs && v.unusedOutputs == options.unusedOutputs)
+                return i;
+        }
+
+        LinkedVariant variant;
+        variant.liveOutputs = options.liveOutputs;
+        variant.unusedOutputs = options.unusedOutputs;
+        Vs.variants.push_back(variant);
+
+        uint32_t index = uint32_t(Vs.variants.size() - 1u);
+        createVariantAsync(pShader, Vs, index, options);
+        return index;
+    }
+
+}
+
+
+void registerLinkVertexShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11VertexShader*       pShader) {
+    if (!g_config.linkShaders)
+        return;
+
+    LinkVertexShader vs;
+    bool valid = readSignature(pBytecode, BytecodeLength, DxbcTagOsgn, &vs.outputs);
+
+    if (valid) {
+        const auto* bytes = static_cast<const uint8_t*>(pBytecode);
+
+        vs.hash = getDxbcHash(pBytecode, BytecodeLength);
+        vs.device = pDevice;
+        vs.code.assign(bytes, bytes + BytecodeLength);
+    }
+
+    std::lock_guard lock(g_linkMutex);
+
+    /* The application may reuse the address of a destroyed shader */
+    auto entry = g_linkVertexShaders.find(pShader);
+
+    if (entry != g_linkVertexShaders.end()) {
+        for (const auto& v : entry->second.variants) {
+            if (v.shader)
+                v.shader->Release();
+        }
+
+        g_linkVertexShaders.erase(entry);
+        std::erase_if(g_linkPairs, [pShader] (const auto& pair) { return pair.first.vs == pShader; });
+    }
+
+    if (valid) {
+        vs.id = ++g_linkShaderId;
+        g_linkVertexShaders.insert({ pShader, std::move(vs) });
+    }
+}
+
+
+void registerLinkPixelShader(
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11PixelShader*        pShader) {
+    if (!g_config.linkShaders)
+        return;
+
+    LinkPixelShader ps;
+    bool valid = readSignature(pBytecode, BytecodeLength, DxbcTagIsgn, &ps.inputs);
+
+    std::lock_guard lock(g_linkMutex);
+    std::erase_if(g_linkPairs, [pShader] (const auto& pair) { return pair.first.ps == pShader; });
+
+    if (valid)
+        g_linkPixelShaders[pShader] = std::move(ps);
+    else
+        g_linkPixelShaders.erase(pShader);
+}
+
+
+ID3D11VertexShader* getLinkedVertexShader(
+        ID3D11VertexShader*       pVertexShader,
+        ID3D11PixelShader*        pPixelShader) {
+    if (!pVertexShader)
+        return nullptr;
+
+    std::lock_guard lock(g_linkMutex);
+    auto vs = g_linkVertexShaders.find(pVertexShader);
+
+    if (vs == g_linkVertexShaders.end())
+        return nullptr;
+
+    LinkKey key = { pVertexShader, pPixelShader };
+    auto pair = g_linkPairs.find(key);
+    uint32_t index;
+
+    if (pair != g_linkPairs.end()) {
+        index = pair->second;
+    } else {
+        index = findVariant(pVertexShader, vs->second, pPixelShader);
+        g_linkPairs.insert({ key, index });
+    }
+
+    return index != NoVariant ? vs->second.variants[index].shader : nullptr;
+}
+
+}
@@ -0,0 +1,45 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Records the outputs of a vertex shader
+ *
+ * Must be called for every vertex shader created by the application,
+ * since it also drops stale variants of destroyed shaders.
+ */
+void registerLinkVertexShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11VertexShader*       pShader);
+
+/**
+ * \brief Records which inputs a pixel shader reads
+ *
+ * Also needed for pixel shaders that replace the application's, so
+ * that they are linked against the outputs they actually read.
+ */
+void registerLinkPixelShader(
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11PixelShader*        pShader);
+
+/**
+ * \brief Looks up the variant of a vertex shader linked to a pixel shader
+ *
+ * Linked variants do not compute, declare or export outputs that the
+ * pixel shader does not read. They are created on a worker thread the
+ * first time a pair is bound, and used from the next bind on.
+ * \returns Linked variant, or \c nullptr to use the vertex shader as is
+ */
+ID3D11VertexShader* getLinkedVertexShader(
+        ID3D11VertexShader*       pVertexShader,
+        ID3D11PixelShader*        pPixelShader);
+
+}
+
+#endif
@@ -188,6 +188,9 @@ DLLEXPORT HRESULT __stdcall D3D11CreateDeviceAndSwapChain(
   atfix::hookDevice(device);
   atfix::hookContext(context);
 
+  if (ppSwapChain && *ppSwapChain)
+    atfix::hookSwapChain(*ppSwapChain);
+
   if (ppDevice) {
     device->AddRef();
     *ppDevice = device;
@@ -0,0 +1,124 @@
+#include <cstring>
+#include <unordered_map>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "packs.h"
+#include "rules.h"
+
+namespace atfix {
+
+namespace {
+
+    /** Replacement bytecode, with the tier of the pack it came from */
+    struct ShaderPack {
+        ShaderTier            tier;
+        std::vector<uint8_t>  code;
+    };
+
+    /* Filled in once before any shader is created, read-only afterwards */
+    std::unordered_map<Hash128, ShaderPack, Hash128Hasher> g_shaderPacks;
+
+    /* Dedicated video memory below which the automatic tier gets cheaper */
+    constexpr uint64_t BalancedTierMemory = 6ull << 30;
+    constexpr uint64_t PerformanceTierMemory = 3ull << 30;
+
+    ShaderTier getAdapterTier(ID3D11Device* pDevice) {
+        IDXGIDevice* dxgiDevice = nullptr;
+        IDXGIAdapter* adapter = nullptr;
+        DXGI_ADAPTER_DESC desc = { };
+
+        if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(&dxgiDevice)))) {
+            if (SUCCEEDED(dxgiDevice->GetAdapter(&adapter))) {
+                adapter->GetDesc(&desc);
+                adapter->Release();
+            }
+
+            dxgiDevice->Release();
+        }
+
+        uint64_t memory = desc.DedicatedVideoMemory;
+
+        /* Integrated GPUs report little or no dedicated memory */
+        ShaderTier tier = memory < PerformanceTierMemory ? ShaderTier::Performance
+                        : memory < BalancedTierMemory ? ShaderTier::Balanced
+                        : ShaderTier::Quality;
+
+#ifndef NDEBUG
+        log("Packs: Adapter has ", memory >> 20, " MB of video memory, using tier ", uint32_t(tier));
+#endif
+
+        return tier;
+    }
+
+    /** Checks that the bytecode is a pixel shader container */
+    bool isPixelShader(const std::vector<uint8_t>& Code) {
+        DxbcContainer container;
+
+        if (!container.parse(Code.data(), Code.size()))
+            return false;
+
+        const auto* chunk = container.findCodeChunk();
+        uint32_t version = 0u;
+
+        if (!chunk || chunk->size() < sizeof(version))
+            return false;
+
+        /* Program type in the upper half of the version token, 0 for pixel shaders */
+        std::memcpy(&version, chunk->data(), sizeof(version));
+        return !(version >> 16);
+    }
+
+}
+
+
+void initShaderPacks(ID3D11Device* pDevice) {
+    if (g_config.shaderPacks.empty())
+        return;
+
+    ShaderTier tier = g_config.shaderTier;
+
+    if (tier == ShaderTier::Auto)
+        tier = getAdapterTier(pDevice);
+
+    for (const auto& config : g_config.shaderPacks) {
+        if (config.tier > tier)
+            continue;
+
+        auto entry = g_shaderPacks.find(config.ps);
+
+        /* Packs for the same shader: the one closest to the selected tier wins */
+        if (entry != g_shaderPacks.end() && entry->second.tier >= config.tier)
+            continue;
+
+        ShaderPack pack;
+        pack.tier = config.tier;
+
+        if (!loadShaderBytecode(config.shader, &pack.code) || !isPixelShader(pack.code)) {
+#ifndef NDEBUG
+            log("Packs: Failed to load pixel shader ", config.shader, " for [", config.name, "]");
+#endif
+            continue;
+        }
+
+        g_shaderPacks[config.ps] = std::move(pack);
+    }
+
+#ifndef NDEBUG
+    log("Packs: ", g_shaderPacks.size(), " pixel shaders replaced at tier ", uint32_t(tier));
+#endif
+}
+
+
+bool hasShaderPacks() {
+    return !g_shaderPacks.empty();
+}
+
+
+const std::vector<uint8_t>* findShaderPackReplacement(const void* pBytecode, size_t BytecodeLength) {
+    auto entry = g_shaderPacks.find(getDxbcHash(pBytecode, BytecodeLength));
+    return entry != g_shaderPacks.end() ? &entry->second.code : nullptr;
+}
+
+}
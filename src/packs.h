@@ -0,0 +1,31 @@
+#ifndef PACKS_H
+#define PACKS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Loads the shader packs for the selected tier
+ *
+ * Resolves the automatic tier from the adapter, and keeps the
+ * bytecode of the pack closest to the tier for each shader.
+ */
+void initShaderPacks(ID3D11Device* pDevice);
+
+/** Checks whether any pixel shader is replaced at the selected tier */
+bool hasShaderPacks();
+
+/**
+ * \brief Looks up the replacement for a pixel shader
+ * \returns Replacement bytecode, or \c nullptr to keep the shader
+ */
+const std::vector<uint8_t>* findShaderPackReplacement(const void* pBytecode, size_t BytecodeLength);
+
+}
+
+#endif
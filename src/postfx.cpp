@@ -0,0 +1,877 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "blit.h"
+#include "config.h"
+#include "formats.h"
+#include "impl.h"
+#include "postfx.h"
+#include "rules.h"
+
+namespace atfix {
+
+namespace {
+
+    const char* g_bilinearUpsampleShader = R"(
+Texture2D src : register(t0);
+SamplerState smp : register(s0);
+
+float4 main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+    return src.SampleLevel(smp, uv, 0.0f);
+}
+)";
+
+    /* Bilinear weights, scaled down for texels whose depth differs from the pixel's */
+    const char* g_depthAwareUpsampleShader = R"(
+cbuffer params : register(b0) { float2 halfSize; };
+Texture2D<float4> src : register(t0);
+Texture2D<float> depth : register(t1);
+
+float4 main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+    uint2 depthSize;
+    depth.GetDimensions(depthSize.x, depthSize.y);
+
+    int2 maxDepth = int2(depthSize) - 1;
+    int2 maxTexel = int2(halfSize) - 1;
+
+    float z = depth.Load(int3(min(int2(uv * float2(depthSize)), maxDepth), 0));
+
+    float2 p = uv * halfSize - 0.5f;
+    float2 base = floor(p);
+    float2 f = p - base;
+
+    float4 sum = float4(0.0f, 0.0f, 0.0f, 0.0f);
+    float weights = 0.0f;
+
+    [unroll] for (int i = 0; i < 4; i++) {
+        int2 t = clamp(int2(base) + int2(i & 1, i >> 1), int2(0, 0), maxTexel);
+        int2 d = min(int2((float2(t) + 0.5f) / halfSize * float2(depthSize)), maxDepth);
+
+        float zt = depth.Load(int3(d, 0));
+        float dz = abs(z - zt) / max(max(z, zt), 1.0e-6f);
+        float w = ((i & 1) ? f.x : 1.0f - f.x) * ((i >> 1) ? f.y : 1.0f - f.y) / (dz + 1.0e-3f);
+
+        sum += w * src.Load(int3(t, 0));
+        weights += w;
+    }
+
+    return sum / weights;
+}
+)";
+
+    /* Farthest depth of each 2x2 block, so that particles are not hidden by edges of geometry behind them */
+    const char* g_depthDownsampleShader = R"(
+cbuffer params : register(b0) { float reverseZ; };
+Texture2D<float> depth : register(t0);
+
+float main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Depth {
+    uint2 depthSize;
+    depth.GetDimensions(depthSize.x, depthSize.y);
+
+    int2 maxDepth = int2(depthSize) - 1;
+    int2 base = int2(pos.xy) * 2;
+
+    float a = depth.Load(int3(min(base, maxDepth), 0));
+    float b = depth.Load(int3(min(base + int2(1, 0), maxDepth), 0));
+    float c = depth.Load(int3(min(base + int2(0, 1), maxDepth), 0));
+    float d = depth.Load(int3(min(base + int2(1, 1), maxDepth), 0));
+
+    return reverseZ != 0.0f ? min(min(a, b), min(c, d)) : max(max(a, b), max(c, d));
+}
+)";
+
+    /** Half-resolution target, shared by passes with the same size and format */
+    struct HalfResTarget {
+        ID3D11Texture2D*          texture = nullptr;
+        ID3D11RenderTargetView*   rtv     = nullptr;
+        ID3D11ShaderResourceView* srv     = nullptr;
+        UINT                      width   = 0u;
+        UINT                      height  = 0u;
+        DXGI_FORMAT               format  = DXGI_FORMAT_UNKNOWN;
+    };
+
+    /** Application state replaced while a pass is redirected, with references */
+    struct HalfResPass {
+        HalfResTarget             target;
+        ID3D11RenderTargetView*   rtv         = nullptr;
+        ID3D11ShaderResourceView* depth       = nullptr;
+        ID3D11BlendState*         blend       = nullptr;
+        std::array<float, 4>      blendFactor = { };
+        UINT                      sampleMask  = ~0u;
+        UINT                      viewportCount = 0u;
+        UINT                      scissorCount = 0u;
+        std::array<D3D11_VIEWPORT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> viewports = { };
+        std::array<D3D11_RECT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> scissors = { };
+    };
+
+    /**
+     * \brief Targets of a particle batch
+     *
+     * Particles accumulate premultiplied colour, and transmittance
+     * in alpha, so that the composite is a single blend.
+     */
+    struct ParticleTargets {
+        HalfResTarget             color;
+        ID3D11Texture2D*          depth     = nullptr;
+        ID3D11DepthStencilView*   dsv       = nullptr;
+        ID3D11Texture2D*          depthCopy = nullptr;    /**< Full-size, readable copy of the application's depth */
+        ID3D11ShaderResourceView* depthSrv  = nullptr;
+        UINT                      width     = 0u;
+        UINT                      height    = 0u;
+        DXGI_FORMAT               depthFormat = DXGI_FORMAT_UNKNOWN;
+    };
+
+    /** Open particle batch, with references to the application's targets */
+    struct ParticleBatch {
+        bool                      active    = false;
+        ParticleTargets           targets;
+        ID3D11RenderTargetView*   rtv       = nullptr;
+        ID3D11DepthStencilView*   dsv       = nullptr;
+        bool                      reverseZ  = false;
+        D3D11_VIEWPORT            viewport  = { };
+        ID3D11Query*              query     = nullptr;
+    };
+
+    /** Per-frame particle statistics, summed up over the reporting interval */
+    struct ParticleStats {
+        uint64_t                  draws     = 0u;
+        uint64_t                  batches   = 0u;
+        uint64_t                  fallbacks = 0u;
+        uint64_t                  pixels    = 0u;
+        uint32_t                  frames    = 0u;
+    };
+
+    /* Depth inputs are looked for in the first few slots only */
+    constexpr UINT MaxDepthSlot = 16u;
+
+    constexpr uint32_t PostFxStatsInterval = 600u;
+
+    /* Statistics are dropped rather than stalling if the GPU falls behind */
+    constexpr size_t MaxPendingQueries = 64u;
+
+    ID3D11Device*           g_device = nullptr;
+    bool                    g_enabled = false;
+    BlitPass                g_blit;
+    ID3D11PixelShader*      g_bilinearShader = nullptr;
+    ID3D11PixelShader*      g_depthAwareShader = nullptr;
+    ID3D11PixelShader*      g_downsampleShader = nullptr;
+    ID3D11BlendState*       g_compositeBlend = nullptr;
+
+    std::vector<HalfResTarget> g_halfResTargets;
+    HalfResPass             g_pass;
+
+    std::vector<ParticleTargets> g_particleTargets;
+    std::vector<std::pair<ID3D11BlendState*, ID3D11BlendState*>> g_particleBlendStates;
+    ParticleBatch           g_batch;
+    ParticleStats           g_particleStats;
+
+    std::vector<ID3D11Query*> g_freeQueries;
+    std::vector<ID3D11Query*> g_pendingQueries;
+
+    template<typename T>
+    void release(T*& pObject) {
+        if (pObject)
+            pObject->Release();
+
+        pObject = nullptr;
+    }
+
+    bool getHalfResTarget(UINT Width, UINT Height, DXGI_FORMAT Format, HalfResTarget* pTarget) {
+        for (const auto& t : g_halfResTargets) {
+            if (t.width == Width && t.height == Height && t.format == Format) {
+                *pTarget = t;
+                return true;
+            }
+        }
+
+        HalfResTarget target;
+        target.width = Width;
+        target.height = Height;
+        target.format = Format;
+
+        D3D11_TEXTURE2D_DESC desc = { };
+        desc.Width = Width;
+        desc.Height = Height;
+        desc.MipLevels = 1u;
+        desc.ArraySize = 1u;
+        desc.Format = Format;
+        desc.SampleDesc.Count = 1u;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+
+        if (FAILED(g_device->CreateTexture2D(&desc, nullptr, &target.texture)))
+            return false;
+
+        if (FAILED(g_device->CreateRenderTargetView(target.texture, nullptr, &target.rtv))
+         || FAILED(g_device->CreateShaderResourceView(target.texture, nullptr, &target.srv))) {
+            release(target.rtv);
+            release(target.texture);
+            return false;
+        }
+
+#ifndef NDEBUG
+        log("PostFx: Created ", Width, "x", Height, " target, format ", Format);
+#endif
+
+        g_halfResTargets.push_back(target);
+        *pTarget = target;
+        return true;
+    }
+
+    bool getParticleTargets(UINT Width, UINT Height, DXGI_FORMAT DepthFormat, ParticleTargets* pTargets) {
+        for (const auto& t : g_particleTargets) {
+            if (t.width == Width && t.height == Height && t.depthFormat == DepthFormat) {
+                *pTargets = t;
+                return true;
+            }
+        }
+
+        DepthFormats formats;
+
+        if (!getDepthFormats(DepthFormat, &formats))
+            return false;
+
+        ParticleTargets targets;
+        targets.width = Width;
+        targets.height = Height;
+        targets.depthFormat = DepthFormat;
+
+        UINT halfWidth = (Width + 1u) / 2u;
+        UINT halfHeight = (Height + 1u) / 2u;
+
+        if (!getHalfResTarget(halfWidth, halfHeight, DXGI_FORMAT_R16G16B16A16_FLOAT, &targets.color))
+            return false;
+
+        D3D11_TEXTURE2D_DESC desc = { };
+        desc.Width = halfWidth;
+        desc.Height = halfHeight;
+        desc.MipLevels = 1u;
+        desc.ArraySize = 1u;
+        desc.Format = DXGI_FORMAT_D32_FLOAT;
+        desc.SampleDesc.Count = 1u;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = { };
+        srvDesc.Format = formats.srv;
+        srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+        srvDesc.Texture2D.MipLevels = 1u;
+
+        bool success = SUCCEEDED(g_device->CreateTexture2D(&desc, nullptr, &targets.depth))
+                    && SUCCEEDED(g_device->CreateDepthStencilView(targets.depth, nullptr, &targets.dsv));
+
+        desc.Width = Width;
+        desc.Height = Height;
+        desc.Format = formats.typeless;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+        success = success
+               && SUCCEEDED(g_device->CreateTexture2D(&desc, nullptr, &targets.depthCopy))
+               && SUCCEEDED(g_device->CreateShaderResourceView(targets.depthCopy, &srvDesc, &targets.depthSrv));
+
+        if (!success) {
+            release(targets.depthSrv);
+            release(targets.depthCopy);
+            release(targets.dsv);
+            release(targets.depth);
+            return false;
+        }
+
+#ifndef NDEBUG
+        log("PostFx: Created particle targets for ", Width, "x", Height, ", depth format ", DepthFormat);
+#endif
+
+        g_particleTargets.push_back(targets);
+        *pTargets = targets;
+        return true;
+    }
+
+    /**
+     * \brief Derives the blend state to accumulate particles with
+     *
+     * Only blending over or adding onto the target is supported, since
+     * either can be composited afterwards. Alpha tracks transmittance.
+     * \returns Blend state, or \c nullptr if the draw blends otherwise
+     */
+    ID3D11BlendState* getParticleBlendState(ID3D11BlendState* pBlend) {
+        if (!pBlend)
+            return nullptr;
+
+        for (const auto& entry : g_particleBlendStates) {
+            if (entry.first == pBlend)
+                return entry.second;
+        }
+
+        D3D11_BLEND_DESC desc = { };
+        pBlend->GetDesc(&desc);
+
+        auto& rt = desc.RenderTarget[0];
+
+        bool eligible = !desc.AlphaToCoverageEnable && rt.BlendEnable && rt.BlendOp == D3D11_BLEND_OP_ADD
+                     && (rt.SrcBlend == D3D11_BLEND_ONE || rt.SrcBlend == D3D11_BLEND_SRC_ALPHA)
+                     && (rt.DestBlend == D3D11_BLEND_ONE || rt.DestBlend == D3D11_BLEND_INV_SRC_ALPHA)
+                     && (rt.RenderTargetWriteMask & 0x7) == 0x7;
+
+        ID3D11BlendState* result = nullptr;
+
+        if (eligible) {
+            desc.IndependentBlendEnable = FALSE;
+            rt.SrcBlendAlpha = D3D11_BLEND_ZERO;
+            rt.DestBlendAlpha = rt.DestBlend == D3D11_BLEND_ONE ? D3D11_BLEND_ONE : D3D11_BLEND_INV_SRC_ALPHA;
+            rt.BlendOpAlpha = D3D11_BLEND_OP_ADD;
+            rt.RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+
+            g_device->CreateBlendState(&desc, &result);
+        }
+
+        /* Keep the application's state alive so that the pointer is not reused */
+        pBlend->AddRef();
+        g_particleBlendStates.push_back({ pBlend, result });
+        return result;
+    }
+
+    /**
+     * \brief Checks that particles only test depth
+     * \returns \c false if the state writes depth or uses stencil
+     */
+    bool getParticleDepthMode(ID3D11DepthStencilState* pState, bool* pReverseZ) {
+        if (!pState)
+            return false;
+
+        D3D11_DEPTH_STENCIL_DESC desc = { };
+        pState->GetDesc(&desc);
+
+        *pReverseZ = desc.DepthFunc == D3D11_COMPARISON_GREATER
+                  || desc.DepthFunc == D3D11_COMPARISON_GREATER_EQUAL;
+
+        return (!desc.DepthEnable || desc.DepthWriteMask == D3D11_DEPTH_WRITE_MASK_ZERO) && !desc.StencilEnable;
+    }
+
+    /** Finds a bound depth texture of the given size, with a reference */
+    ID3D11ShaderResourceView* findDepthInput(ID3D11DeviceContext* pContext, UINT Width, UINT Height) {
+        std::array<ID3D11ShaderResourceView*, MaxDepthSlot> srvs = { };
+        pContext->PSGetShaderResources(0, MaxDepthSlot, srvs.data());
+
+        ID3D11ShaderResourceView* result = nullptr;
+
+        for (auto*& srv : srvs) {
+            if (!srv || result)
+                continue;
+
+            ID3D11Resource* resource = nullptr;
+            D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+
+            srv->GetResource(&resource);
+            resource->GetType(&dimension);
+
+            if (dimension == D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+                D3D11_TEXTURE2D_DESC desc = { };
+                static_cast<ID3D11Texture2D*>(resource)->GetDesc(&desc);
+
+                if ((desc.BindFlags & D3D11_BIND_DEPTH_STENCIL) && desc.SampleDesc.Count == 1u
+                 && desc.Width == Width && desc.Height == Height)
+                    std::swap(result, srv);
+            }
+
+            resource->Release();
+        }
+
+        for (auto* srv : srvs) {
+            if (srv)
+                srv->Release();
+        }
+
+        return result;
+    }
+
+    /**
+     * \brief Queries the bound targets, with references
+     * \returns \c false if other than a single render target is bound,
+     *    in which case no references are held
+     */
+    bool getBoundTargets(ID3D11DeviceContext* pContext, ID3D11RenderTargetView** ppRtv, ID3D11DepthStencilView** ppDsv) {
+        std::array<ID3D11RenderTargetView*, D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT> rtvs = { };
+        pContext->OMGetRenderTargets(UINT(rtvs.size()), rtvs.data(), ppDsv);
+
+        uint32_t rtvCount = 0u;
+
+        for (auto* rtv : rtvs)
+            rtvCount += rtv ? 1u : 0u;
+
+        bool single = rtvs[0] && rtvCount == 1u;
+
+        for (uint32_t i = single ? 1u : 0u; i < rtvs.size(); i++)
+            release(rtvs[i]);
+
+        if (!single)
+            release(*ppDsv);
+
+        *ppRtv = rtvs[0];
+        return single;
+    }
+
+    bool isTopLevel2D(ID3D11RenderTargetView* pView) {
+        D3D11_RENDER_TARGET_VIEW_DESC desc = { };
+        pView->GetDesc(&desc);
+        return desc.ViewDimension == D3D11_RTV_DIMENSION_TEXTURE2D && !desc.Texture2D.MipSlice;
+    }
+
+    bool isTopLevel2D(ID3D11DepthStencilView* pView) {
+        D3D11_DEPTH_STENCIL_VIEW_DESC desc = { };
+        pView->GetDesc(&desc);
+        return desc.ViewDimension == D3D11_DSV_DIMENSION_TEXTURE2D && !desc.Texture2D.MipSlice;
+    }
+
+    /**
+     * \brief Looks up the texture behind a view, with a reference
+     * \returns \c false unless the view is of the top level of a
+     *    single-sampled 2D texture
+     */
+    template<typename View>
+    bool getViewTexture(View* pView, ID3D11Texture2D** ppTexture, D3D11_TEXTURE2D_DESC* pDesc) {
+        if (!isTopLevel2D(pView))
+            return false;
+
+        ID3D11Resource* resource = nullptr;
+        D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+
+        pView->GetResource(&resource);
+        resource->GetType(&dimension);
+
+        if (dimension != D3D11_RESOURCE_DIMENSION_TEXTURE2D) {
+            resource->Release();
+            return false;
+        }
+
+        *ppTexture = static_cast<ID3D11Texture2D*>(resource);
+        (*ppTexture)->GetDesc(pDesc);
+
+        if (pDesc->SampleDesc.Count != 1u) {
+            release(*ppTexture);
+            return false;
+        }
+
+        return true;
+    }
+
+    /** Checks that the viewport is the whole target, as for full-screen passes */
+    bool coversTarget(const D3D11_VIEWPORT& Viewport, UINT Width, UINT Height) {
+        return Viewport.TopLeftX == 0.0f && Viewport.TopLeftY == 0.0f
+            && std::abs(Viewport.Width - float(Width)) < 1.0f
+            && std::abs(Viewport.Height - float(Height)) < 1.0f;
+    }
+
+    /** Saves the blend state, viewports and scissor rects */
+    void saveRasterState(ID3D11DeviceContext* pContext, HalfResPass* pPass) {
+        pPass->viewportCount = UINT(pPass->viewports.size());
+        pContext->RSGetViewports(&pPass->viewportCount, pPass->viewports.data());
+
+        pPass->scissorCount = UINT(pPass->scissors.size());
+        pContext->RSGetScissorRects(&pPass->scissorCount, pPass->scissors.data());
+
+        pContext->OMGetBlendState(&pPass->blend, pPass->blendFactor.data(), &pPass->sampleMask);
+    }
+
+    /** Binds the saved viewports and scissor rects, scaled to a half-resolution target */
+    void bindScaledViewports(
+            ID3D11DeviceContext*        pContext,
+      const ContextProcs*               procs,
+      const HalfResPass&                Pass,
+            float                       ScaleX,
+            float                       ScaleY) {
+        std::array<D3D11_VIEWPORT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> viewports;
+        std::array<D3D11_RECT, D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE> scissors;
+
+        for (uint32_t i = 0; i < Pass.viewportCount; i++) {
+            viewports[i] = Pass.viewports[i];
+            viewports[i].TopLeftX *= ScaleX;
+            viewports[i].TopLeftY *= ScaleY;
+            viewports[i].Width *= ScaleX;
+            viewports[i].Height *= ScaleY;
+        }
+
+        for (uint32_t i = 0; i < Pass.scissorCount; i++) {
+            scissors[i].left = LONG(std::floor(float(Pass.scissors[i].left) * ScaleX));
+            scissors[i].top = LONG(std::floor(float(Pass.scissors[i].top) * ScaleY));
+            scissors[i].right = LONG(std::ceil(float(Pass.scissors[i].right) * ScaleX));
+            scissors[i].bottom = LONG(std::ceil(float(Pass.scissors[i].bottom) * ScaleY));
+        }
+
+        procs->RSSetViewports(pContext, Pass.viewportCount, viewports.data());
+        procs->RSSetScissorRects(pContext, Pass.scissorCount, scissors.data());
+    }
+
+    /** Restores the saved blend state, viewports and scissor rects */
+    void restoreRasterState(
+            ID3D11DeviceContext*        pContext,
+      const ContextProcs*               procs,
+      const HalfResPass&                Pass) {
+        procs->OMSetBlendState(pContext, Pass.blend, Pass.blendFactor.data(), Pass.sampleMask);
+        procs->RSSetViewports(pContext, Pass.viewportCount, Pass.viewports.data());
+        procs->RSSetScissorRects(pContext, Pass.scissorCount, Pass.scissors.data());
+    }
+
+    void releasePass() {
+        release(g_pass.rtv);
+        release(g_pass.depth);
+        release(g_pass.blend);
+    }
+
+    /**
+     * \brief Starts a particle batch on the given targets
+     *
+     * Copies the depth buffer, since the application's may not be
+     * readable, and downsamples it into the batch's depth buffer.
+     */
+    bool openParticleBatch(
+            ID3D11DeviceContext*        pContext,
+      const ContextProcs*               procs,
+            ID3D11RenderTargetView*     pRtv,
+            ID3D11DepthStencilView*     pDsv,
+            ID3D11Texture2D*            pDepth,
+      const D3D11_TEXTURE2D_DESC&       DepthDesc,
+            bool                        ReverseZ) {
+        auto& batch = g_batch;
+
+        if (!getParticleTargets(DepthDesc.Width, DepthDesc.Height, DepthDesc.Format, &batch.targets))
+            return false;
+
+        const auto& targets = batch.targets;
+
+        procs->CopyResource(pContext, targets.depthCopy, pDepth);
+
+        BlitArgs args;
+        args.ps = g_downsampleShader;
+        args.srv = targets.depthSrv;
+        args.dsv = targets.dsv;
+        args.viewport = { 0.0f, 0.0f, float(targets.color.width), float(targets.color.height), 0.0f, 1.0f };
+        args.linear = false;
+        args.constants[0] = ReverseZ ? 1.0f : 0.0f;
+
+        g_blit.run(pContext, args);
+
+        /* No particles yet, so nothing is added and the background fully transmitted */
+        static const float clearColor[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+        procs->ClearRenderTargetView(pContext, targets.color.rtv, clearColor);
+
+        batch.active = true;
+        batch.rtv = pRtv;
+        batch.dsv = pDsv;
+        batch.reverseZ = ReverseZ;
+        batch.viewport = { 0.0f, 0.0f, float(DepthDesc.Width), float(DepthDesc.Height), 0.0f, 1.0f };
+
+        batch.rtv->AddRef();
+        batch.dsv->AddRef();
+
+        if (!g_freeQueries.empty()) {
+            batch.query = g_freeQueries.back();
+            g_freeQueries.pop_back();
+        } else if (g_pendingQueries.size() < MaxPendingQueries) {
+            D3D11_QUERY_DESC queryDesc = { D3D11_QUERY_PIPELINE_STATISTICS, 0u };
+            g_device->CreateQuery(&queryDesc, &batch.query);
+        }
+
+        if (batch.query)
+            pContext->Begin(batch.query);
+
+        g_particleStats.batches += 1u;
+        return true;
+    }
+
+    /** Reads back finished statistics queries, in the order they were issued */
+    void collectParticleQueries(ID3D11DeviceContext* pContext) {
+        size_t done = 0u;
+
+        for (auto* query : g_pendingQueries) {
+            D3D11_QUERY_DATA_PIPELINE_STATISTICS data = { };
+
+            if (pContext->GetData(query, &data, sizeof(data), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+                break;
+
+            g_particleStats.pixels += data.PSInvocations;
+            g_freeQueries.push_back(query);
+            done++;
+        }
+
+        g_pendingQueries.erase(g_pendingQueries.begin(), g_pendingQueries.begin() + done);
+    }
+
+}
+
+
+void initPostFx(ID3D11Device* pDevice) {
+    if (g_config.halfResShaders.empty() && g_config.particleShaders.empty())
+        return;
+
+    g_device = pDevice;
+
+    D3D11_BLEND_DESC blendDesc = { };
+    auto& rt = blendDesc.RenderTarget[0];
+    rt.BlendEnable = TRUE;
+    rt.SrcBlend = D3D11_BLEND_ONE;
+    rt.DestBlend = D3D11_BLEND_SRC_ALPHA;
+    rt.BlendOp = D3D11_BLEND_OP_ADD;
+    rt.SrcBlendAlpha = D3D11_BLEND_ZERO;
+    rt.DestBlendAlpha = D3D11_BLEND_ONE;
+    rt.BlendOpAlpha = D3D11_BLEND_OP_ADD;
+    rt.RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+
+    if (!g_blit.init(pDevice)
+     || !(g_bilinearShader = g_blit.createPixelShader(g_bilinearUpsampleShader))
+     || !(g_depthAwareShader = g_blit.createPixelShader(g_depthAwareUpsampleShader))
+     || !(g_downsampleShader = g_blit.createPixelShader(g_depthDownsampleShader))
+     || FAILED(pDevice->CreateBlendState(&blendDesc, &g_compositeBlend))) {
+#ifndef NDEBUG
+        log("PostFx: Failed to create upsample passes, disabling");
+#endif
+        return;
+    }
+
+    g_enabled = true;
+}
+
+
+bool isHalfResEnabled() {
+    return g_enabled;
+}
+
+
+bool isHalfResShader(const void* pShader) {
+    const auto& shaders = g_config.halfResShaders;
+    Hash128 hash;
+
+    if (!g_enabled || !pShader || shaders.empty() || !getRuleShaderHash(pShader, &hash))
+        return false;
+
+    return std::find(shaders.begin(), shaders.end(), hash) != shaders.end();
+}
+
+
+bool isHalfResParticleShader(const void* pShader) {
+    const auto& shaders = g_config.particleShaders;
+    Hash128 hash;
+
+    if (!g_enabled || !pShader || shaders.empty() || !getRuleShaderHash(pShader, &hash))
+        return false;
+
+    return std::find(shaders.begin(), shaders.end(), hash) != shaders.end();
+}
+
+
+bool beginHalfResPass(ID3D11DeviceContext* pContext) {
+    const auto* procs = getContextProcs(pContext);
+    auto& pass = g_pass;
+
+    ID3D11DepthStencilView* dsv = nullptr;
+
+    if (!getBoundTargets(pContext, &pass.rtv, &dsv))
+        return false;
+
+    if (dsv) {
+        release(dsv);
+        releasePass();
+        return false;
+    }
+
+    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = { };
+    pass.rtv->GetDesc(&rtvDesc);
+
+    ID3D11Texture2D* texture = nullptr;
+    D3D11_TEXTURE2D_DESC desc = { };
+
+    if (!getViewTexture(pass.rtv, &texture, &desc)) {
+        releasePass();
+        return false;
+    }
+
+    texture->Release();
+    saveRasterState(pContext, &pass);
+
+    /* Tiny targets, such as the end of a bloom chain, are not worth it */
+    if (desc.Width < 16u || desc.Height < 16u
+     || !pass.viewportCount || !coversTarget(pass.viewports[0], desc.Width, desc.Height)
+     || !getHalfResTarget((desc.Width + 1u) / 2u, (desc.Height + 1u) / 2u, rtvDesc.Format, &pass.target)) {
+        releasePass();
+        return false;
+    }
+
+    pass.depth = findDepthInput(pContext, desc.Width, desc.Height);
+
+    /* Pixels the pass discards must not blend anything in when upsampled */
+    static const float clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    flushPendingDraw(pContext);
+
+    procs->OMSetRenderTargets(pContext, 1, &pass.target.rtv, nullptr);
+    procs->OMSetBlendState(pContext, nullptr, nullptr, ~0u);
+    bindScaledViewports(pContext, procs, pass,
+        float(pass.target.width) / float(desc.Width),
+        float(pass.target.height) / float(desc.Height));
+    procs->ClearRenderTargetView(pContext, pass.target.rtv, clearColor);
+    return true;
+}
+
+
+void endHalfResPass(ID3D11DeviceContext* pContext) {
+    const auto* procs = getContextProcs(pContext);
+    auto& pass = g_pass;
+
+    procs->OMSetRenderTargets(pContext, 1, &pass.rtv, nullptr);
+    restoreRasterState(pContext, procs, pass);
+
+    BlitArgs args;
+    args.ps = pass.depth ? g_depthAwareShader : g_bilinearShader;
+    args.srv = pass.target.srv;
+    args.depthSrv = pass.depth;
+    args.rtv = pass.rtv;
+    args.viewport = pass.viewports[0];
+    args.constants[0] = float(pass.target.width);
+    args.constants[1] = float(pass.target.height);
+    args.blend = pass.blend;
+    args.blendFactor = pass.blendFactor;
+    args.sampleMask = pass.sampleMask;
+
+    g_blit.run(pContext, args);
+
+    releasePass();
+}
+
+
+bool beginParticleDraw(ID3D11DeviceContext* pContext) {
+    const auto* procs = getContextProcs(pContext);
+    auto& pass = g_pass;
+    auto& batch = g_batch;
+
+    ID3D11DepthStencilView* dsv = nullptr;
+    ID3D11DepthStencilState* depthState = nullptr;
+    UINT stencilRef = 0u;
+    bool reverseZ = false;
+
+    bool eligible = getBoundTargets(pContext, &pass.rtv, &dsv) && dsv;
+
+    pContext->OMGetDepthStencilState(&depthState, &stencilRef);
+    eligible = eligible && getParticleDepthMode(depthState, &reverseZ);
+    release(depthState);
+
+    saveRasterState(pContext, &pass);
+
+    ID3D11BlendState* particleBlend = getParticleBlendState(pass.blend);
+    eligible = eligible && particleBlend && pass.viewportCount;
+
+    /* Anything else ends the batch, and continues at full resolution */
+    if (batch.active && (!eligible || pass.rtv != batch.rtv || dsv != batch.dsv || reverseZ != batch.reverseZ))
+        flushParticleBatch(pContext);
+
+    if (eligible && !batch.active) {
+        ID3D11Texture2D* color = nullptr;
+        ID3D11Texture2D* depth = nullptr;
+        D3D11_TEXTURE2D_DESC colorDesc = { };
+        D3D11_TEXTURE2D_DESC depthDesc = { };
+
+        eligible = getViewTexture(pass.rtv, &color, &colorDesc)
+                && getViewTexture(dsv, &depth, &depthDesc)
+                && colorDesc.Width == depthDesc.Width && colorDesc.Height == depthDesc.Height
+                && depthDesc.MipLevels == 1u && depthDesc.ArraySize == 1u
+                && colorDesc.Width >= 16u && colorDesc.Height >= 16u
+                && coversTarget(pass.viewports[0], colorDesc.Width, colorDesc.Height);
+
+        if (eligible) {
+            flushPendingDraw(pContext);
+            eligible = openParticleBatch(pContext, procs, pass.rtv, dsv, depth, depthDesc, reverseZ);
+        }
+
+        release(color);
+        release(depth);
+    }
+
+    release(dsv);
+
+    if (!eligible) {
+        g_particleStats.fallbacks += 1u;
+        releasePass();
+        return false;
+    }
+
+    flushPendingDraw(pContext);
+
+    const auto& targets = batch.targets;
+
+    procs->OMSetRenderTargets(pContext, 1, &targets.color.rtv, targets.dsv);
+    procs->OMSetBlendState(pContext, particleBlend, pass.blendFactor.data(), pass.sampleMask);
+    bindScaledViewports(pContext, procs, pass,
+        float(targets.color.width) / float(targets.width),
+        float(targets.color.height) / float(targets.height));
+    return true;
+}
+
+
+void endParticleDraw(ID3D11DeviceContext* pContext) {
+    const auto* procs = getContextProcs(pContext);
+    const auto& batch = g_batch;
+
+    procs->OMSetRenderTargets(pContext, 1, &batch.rtv, batch.dsv);
+    restoreRasterState(pContext, procs, g_pass);
+
+    g_particleStats.draws += 1u;
+    releasePass();
+}
+
+
+void flushParticleBatch(ID3D11DeviceContext* pContext) {
+    auto& batch = g_batch;
+
+    if (!batch.active)
+        return;
+
+    if (batch.query) {
+        pContext->End(batch.query);
+        g_pendingQueries.push_back(batch.query);
+    }
+
+    const auto& targets = batch.targets;
+
+    BlitArgs args;
+    args.ps = g_depthAwareShader;
+    args.srv = targets.color.srv;
+    args.depthSrv = targets.depthSrv;
+    args.rtv = batch.rtv;
+    args.viewport = batch.viewport;
+    args.constants[0] = float(targets.color.width);
+    args.constants[1] = float(targets.color.height);
+    args.blend = g_compositeBlend;
+
+    g_blit.run(pContext, args);
+
+    release(batch.rtv);
+    release(batch.dsv);
+
+    batch.active = false;
+    batch.query = nullptr;
+}
+
+
+void endPostFxFrame(ID3D11DeviceContext* pContext) {
+    flushParticleBatch(pContext);
+    collectParticleQueries(pContext);
+
+    auto& stats = g_particleStats;
+
+    if (++stats.frames < PostFxStatsInterval)
+        return;
+
+#ifndef NDEBUG
+    if (stats.draws || stats.fallbacks) {
+        /* At full resolution, the same particles would shade about four times the pixels */
+        log("PostFx: Per frame, ", stats.draws / stats.frames, " particle draws in ",
+            stats.batches / stats.frames, " batches, ", stats.fallbacks / stats.frames,
+            " at full resolution, ", stats.pixels / stats.frames, " pixels shaded, ",
+            3u * stats.pixels / stats.frames, " saved");
+    }
+#endif
+
+    stats = ParticleStats();
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef POSTFX_H
+#define POSTFX_H
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/** Sets up the upsample pass if any post-processing or particles run at half resolution */
+void initPostFx(ID3D11Device* pDevice);
+
+/** Checks whether half-resolution passes or particles are active */
+bool isHalfResEnabled();
+
+/** Checks whether a pixel shader's full-screen passes run at half resolution */
+bool isHalfResShader(const void* pShader);
+
+/** Checks whether a pixel shader's draws are batched as half-resolution particles */
+bool isHalfResParticleShader(const void* pShader);
+
+/**
+ * \brief Redirects a full-screen pass to a half-resolution target
+ *
+ * Only applies if a single render target and no depth buffer is
+ * bound, and the viewport covers the whole target. Blending is
+ * disabled for the pass and applied when upsampling instead.
+ * \returns \c true if the pass was redirected, in which case
+ *    \ref endHalfResPass must follow the draw
+ */
+bool beginHalfResPass(ID3D11DeviceContext* pContext);
+
+/**
+ * \brief Restores the application's state and upsamples the result
+ *
+ * Upsampling takes the depth buffer into account if the pass
+ * sampled one, so that edges of nearby geometry do not bleed.
+ */
+void endHalfResPass(ID3D11DeviceContext* pContext);
+
+/**
+ * \brief Redirects a particle draw to the half-resolution batch
+ *
+ * Starts a batch if none is open for the bound targets, with the
+ * depth buffer downsampled for depth testing. Only applies to draws
+ * that blend over or onto the single bound render target and do not
+ * write depth.
+ * \returns \c true if the draw was redirected, in which case
+ *    \ref endParticleDraw must follow the draw. Otherwise, any
+ *    open batch has been composited.
+ */
+bool beginParticleDraw(ID3D11DeviceContext* pContext);
+
+/** Restores the application's state after a particle draw */
+void endParticleDraw(ID3D11DeviceContext* pContext);
+
+/**
+ * \brief Composites the open particle batch, if any
+ *
+ * Must be called before anything else draws, copies or clears,
+ * since the application's target does not have the particles yet.
+ */
+void flushParticleBatch(ID3D11DeviceContext* pContext);
+
+/** Composites particles, and collects and reports frame statistics */
+void endPostFxFrame(ID3D11DeviceContext* pContext);
+
+}
+
+#endif
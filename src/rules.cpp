@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "dxbc.h"
+#include "impl.h"
+#include "link.h"
+#include "rules.h"
+#include "util.h"
+#include "shaders/snow.hpp"
+
+namespace atfix {
+
+uint32_t g_drawRuleFields = 0u;
+
+namespace {
+
+    /**
+     * \brief Rules matching the same set of fields
+     *
+     * Perfect hash using hash-and-displace: keys are grouped into
+     * buckets, and each bucket gets a displacement that moves all
+     * of its keys into free slots. A lookup hashes the key once,
+     * reads the bucket's displacement and probes a single slot.
+     */
+    struct DrawRuleTable {
+        uint32_t                  fields  = 0u;
+        uint64_t                  seed    = 0u;
+        uint32_t                  mask    = 0u;
+        uint32_t                  bucketMask = 0u;
+        std::vector<uint32_t>     displacements;
+        std::vector<int32_t>      slots;
+        std::vector<DrawRuleKey>  keys;
+        std::vector<DrawRule>     rules;
+    };
+
+    std::vector<DrawRuleTable> g_ruleTables;
+
+    struct RuleShader {
+        Hash128   hash;
+        uint64_t  id;
+    };
+
+    mutex g_ruleShaderMutex;
+    std::unordered_map<const void*, RuleShader> g_ruleShaders;
+
+    uint64_t getShaderId(const Hash128& Hash) {
+        /* Never 0, which stands for no or unknown shader */
+        return detail::hashMix(Hash.lo ^ detail::HashPrime64_1, Hash.hi ^ detail::HashPrime64_2) | 1u;
+    }
+
+    DrawRuleKey maskKey(const DrawRuleKey& Key, uint32_t Fields) {
+        DrawRuleKey result;
+
+        if (Fields & DRAW_RULE_VS)
+            result.vs = Key.vs;
+
+        if (Fields & DRAW_RULE_PS)
+            result.ps = Key.ps;
+
+        if (Fields & DRAW_RULE_COUNT)
+            result.count = Key.count;
+
+        if (Fields & DRAW_RULE_RT_FORMAT)
+            result.rtFormat = Key.rtFormat;
+
+        if (Fields & DRAW_RULE_VIEWPORT) {
+            result.viewportWidth = Key.viewportWidth;
+            result.viewportHeight = Key.viewportHeight;
+        }
+
+        return result;
+    }
+
+    uint64_t hashKey(const DrawRuleKey& Key, uint64_t Seed) {
+        uint64_t h = detail::hashMix(Key.vs ^ Seed, Key.ps ^ detail::HashPrime64_1);
+        h ^= detail::hashMix((uint64_t(Key.count) << 32 | Key.rtFormat) ^ detail::HashPrime64_2,
+                             (uint64_t(Key.viewportWidth) << 32 | Key.viewportHeight) ^ Seed);
+        return detail::hashAvalanche(h);
+    }
+
+    uint32_t getBucket(uint64_t Hash, uint32_t BucketMask) {
+        return uint32_t(Hash >> 40) & BucketMask;
+    }
+
+    uint32_t getSlot(uint64_t Hash, uint32_t Displacement, uint32_t Mask) {
+        return uint32_t(detail::hashAvalanche(Hash + Displacement * detail::HashPrime64_2)) & Mask;
+    }
+
+    constexpr uint32_t MaxDisplacement = 1u << 16;
+
+    bool placeBuckets(DrawRuleTable& Table, const std::vector<uint64_t>& Hashes) {
+        std::vector<std::vector<uint32_t>> buckets(Table.bucketMask + 1u);
+
+        for (uint32_t i = 0; i < Hashes.size(); i++)
+            buckets[getBucket(Hashes[i], Table.bucketMask)].push_back(i);
+
+        std::vector<uint32_t> order(buckets.size());
+
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        /* Large buckets are hardest to place, so they go first */
+        std::stable_sort(order.begin(), order.end(), [&buckets] (uint32_t a, uint32_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        std::fill(Table.slots.begin(), Table.slots.end(), -1);
+        std::vector<uint32_t> placed;
+
+        for (uint32_t b : order) {
+            const auto& keys = buckets[b];
+
+            if (keys.empty())
+                break;
+
+            uint32_t d = 0u;
+
+            for (; d < MaxDisplacement; d++) {
+                placed.clear();
+
+                for (uint32_t k : keys) {
+                    uint32_t slot = getSlot(Hashes[k], d, Table.mask);
+
+                    if (Table.slots[slot] >= 0 || std::find(placed.begin(), placed.end(), slot) != placed.end())
+                        break;
+
+                    placed.push_back(slot);
+                }
+
+                if (placed.size() == keys.size())
+                    break;
+            }
+
+            if (d == MaxDisplacement)
+                return false;
+
+            for (uint32_t i = 0; i < keys.size(); i++)
+                Table.slots[placed[i]] = int32_t(keys[i]);
+
+            Table.displacements[b] = d;
+        }
+
+        return true;
+    }
+
+    bool buildPerfectHash(DrawRuleTable& Table) {
+        uint32_t count = uint32_t(Table.keys.size());
+
+        Table.mask = std::bit_ceil(std::max(2u, count + count / 2u)) - 1u;
+        Table.bucketMask = std::bit_ceil(std::max(1u, count / 4u)) - 1u;
+        Table.slots.resize(Table.mask + 1u);
+        Table.displacements.assign(Table.bucketMask + 1u, 0u);
+
+        std::vector<uint64_t> hashes(count);
+
+        for (uint64_t seed = 1u; seed <= 16u; seed++) {
+            for (uint32_t i = 0; i < count; i++)
+                hashes[i] = hashKey(Table.keys[i], seed);
+
+            if (placeBuckets(Table, hashes)) {
+                Table.seed = seed;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool loadShaderFile(const std::string& Path, std::vector<uint8_t>* pCode) {
+        std::ifstream file(Path, std::ios::binary);
+
+        if (!file)
+            return false;
+
+        pCode->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return !pCode->empty();
+    }
+
+    bool createRule(ID3D11Device* pDevice, const DrawRuleConfig& Config, DrawRule* pRule) {
+        const auto* procs = getDeviceProcs(pDevice);
+
+        pRule->action = Config.action;
+        pRule->maxInstances = Config.maxInstances;
+
+        if (Config.action != DrawRuleAction::ReplacePixelShader
+         && Config.action != DrawRuleAction::ReplaceVertexShader)
+            return true;
+
+        std::vector<uint8_t> code;
+
+        if (!loadShaderBytecode(Config.shader, &code)) {
+#ifndef NDEBUG
+            log("Rules: Failed to load ", Config.shader, " for [", Config.name, "]");
+#endif
+            return false;
+        }
+
+        HRESULT hr = Config.action == DrawRuleAction::ReplacePixelShader
+            ? procs->CreatePixelShader(pDevice, code.data(), code.size(), nullptr, &pRule->ps)
+            : procs->CreateVertexShader(pDevice, code.data(), code.size(), nullptr, &pRule->vs);
+
+        if (FAILED(hr)) {
+#ifndef NDEBUG
+            log("Rules: Failed to create shader for [", Config.name, "]: ", hr);
+#endif
+            return false;
+        }
+
+        /* Created through the original method, so the hook does not see it */
+        if (pRule->ps)
+            registerLinkPixelShader(code.data(), code.size(), pRule->ps);
+
+        return true;
+    }
+
+    std::vector<DrawRuleConfig> getBuiltinRules() {
+        std::vector<DrawRuleConfig> rules;
+
+        /* Valheim snow draws, which need the fixed pixel shader */
+        for (uint32_t count : { 9000u, 3942u }) {
+            DrawRuleConfig rule;
+            rule.name = "builtin.snow";
+            rule.fields = DRAW_RULE_COUNT;
+            rule.count = count;
+            rule.action = DrawRuleAction::ReplacePixelShader;
+            rule.shader = "builtin:snow";
+            rules.push_back(std::move(rule));
+        }
+
+        return rules;
+    }
+
+}
+
+
+bool loadShaderBytecode(const std::string& Name, std::vector<uint8_t>* pCode) {
+    if (Name == "builtin:snow") {
+        pCode->assign(data.begin(), data.end());
+        return true;
+    }
+
+    if (Name == "builtin:snow_original") {
+        pCode->assign(original.begin(), original.end());
+        return true;
+    }
+
+    return loadShaderFile(Name, pCode);
+}
+
+
+void compileDrawRules(ID3D11Device* pDevice) {
+    std::vector<DrawRuleConfig> configs = g_config.drawRules;
+
+    if (g_config.builtinDrawRules) {
+        auto builtins = getBuiltinRules();
+        configs.insert(configs.end(), builtins.begin(), builtins.end());
+    }
+
+    for (const auto& config : configs) {
+        DrawRuleKey key;
+        key.vs = getShaderId(config.vs);
+        key.ps = getShaderId(config.ps);
+        key.count = config.count;
+        key.rtFormat = config.rtFormat;
+        key.viewportWidth = config.viewportWidth;
+        key.viewportHeight = config.viewportHeight;
+        key = maskKey(key, config.fields);
+
+        auto table = std::find_if(g_ruleTables.begin(), g_ruleTables.end(),
+            [&config] (const DrawRuleTable& t) { return t.fields == config.fields; });
+
+        if (table == g_ruleTables.end()) {
+            table = g_ruleTables.emplace(g_ruleTables.end());
+            table->fields = config.fields;
+        }
+
+        /* Rules from the config file come first and win */
+        if (std::find(table->keys.begin(), table->keys.end(), key) != table->keys.end()) {
+#ifndef NDEBUG
+            log("Rules: [", config.name, "] duplicates an earlier rule");
+#endif
+            continue;
+        }
+
+        DrawRule rule;
+
+        if (!createRule(pDevice, config, &rule))
+            continue;
+
+        table->keys.push_back(key);
+        table->rules.push_back(rule);
+    }
+
+    std::erase_if(g_ruleTables, [] (DrawRuleTable& t) {
+        if (!t.keys.empty() && buildPerfectHash(t))
+            return false;
+
+#ifndef NDEBUG
+        if (!t.keys.empty())
+            log("Rules: Failed to build lookup table for fields ", t.fields);
+#endif
+        return true;
+    });
+
+    /* Most specific tables first */
+    std::stable_sort(g_ruleTables.begin(), g_ruleTables.end(),
+        [] (const DrawRuleTable& a, const DrawRuleTable& b) {
+            return std::popcount(a.fields) > std::popcount(b.fields);
+        });
+
+    g_drawRuleFields = 0u;
+
+    for (const auto& t : g_ruleTables) {
+        g_drawRuleFields |= t.fields;
+#ifndef NDEBUG
+        log("Rules: ", t.rules.size(), " rules on fields ", t.fields, ", ", t.slots.size(), " slots");
+#endif
+    }
+}
+
+
+const DrawRule* matchDrawRule(const DrawRuleKey& Key, uint32_t Fields) {
+    for (const auto& t : g_ruleTables) {
+        if (t.fields & ~Fields)
+            continue;
+
+        DrawRuleKey key = maskKey(Key, t.fields);
+        uint64_t hash = hashKey(key, t.seed);
+
+        uint32_t d = t.displacements[getBucket(hash, t.bucketMask)];
+        int32_t index = t.slots[getSlot(hash, d, t.mask)];
+
+        if (index >= 0 && t.keys[index] == key)
+            return &t.rules[index];
+    }
+
+    return nullptr;
+}
+
+
+void registerRuleShader(const void* pShader, const void* pBytecode, size_t BytecodeLength) {
+    if (!(g_drawRuleFields & (DRAW_RULE_VS | DRAW_RULE_PS)) && !needsShaderHashes())
+        return;
+
+    RuleShader shader;
+    shader.hash = getDxbcHash(pBytecode, BytecodeLength);
+    shader.id = getShaderId(shader.hash);
+
+    std::lock_guard lock(g_ruleShaderMutex);
+    g_ruleShaders[pShader] = shader;
+}
+
+
+bool needsShaderHashes() {
+    return g_config.learnDraws
+        || (g_config.cullSmallCasters && !g_config.shadowCasterShaders.empty())
+        || !g_config.grassShaders.empty()
+        || !g_config.halfResShaders.empty()
+        || !g_config.particleShaders.empty();
+}
+
+
+uint64_t getRuleShaderId(const void* pShader) {
+    if (!pShader)
+        return 0u;
+
+    std::lock_guard lock(g_ruleShaderMutex);
+    auto entry = g_ruleShaders.find(pShader);
+    return entry != g_ruleShaders.end() ? entry->second.id : 0u;
+}
+
+
+bool getRuleShaderHash(const void* pShader, Hash128* pHash) {
+    std::lock_guard lock(g_ruleShaderMutex);
+    auto entry = g_ruleShaders.find(pShader);
+
+    if (entry == g_ruleShaders.end())
+        return false;
+
+    *pHash = entry->second.hash;
+    return true;
+}
+
+}
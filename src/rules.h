@@ -0,0 +1,88 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <d3d11.h>
+
+#include "config.h"
+
+namespace atfix {
+
+/** Draw state a rule is matched against */
+struct DrawRuleKey {
+    uint64_t  vs              = 0u;
+    uint64_t  ps              = 0u;
+    uint32_t  count           = 0u;
+    uint32_t  rtFormat        = 0u;
+    uint32_t  viewportWidth   = 0u;
+    uint32_t  viewportHeight  = 0u;
+
+    bool operator == (const DrawRuleKey&) const = default;
+};
+
+/** Compiled rule with its replacement shaders created */
+struct DrawRule {
+    DrawRuleAction        action        = DrawRuleAction::Skip;
+    ID3D11VertexShader*   vs            = nullptr;
+    ID3D11PixelShader*    ps            = nullptr;
+    UINT                  maxInstances  = 1u;
+};
+
+/**
+ * \brief Loads replacement shader bytecode
+ *
+ * Names starting with \c builtin: refer to shaders embedded in the
+ * binary, anything else is a file relative to the game directory.
+ * \returns \c false if the shader is unknown or cannot be read
+ */
+bool loadShaderBytecode(const std::string& Name, std::vector<uint8_t>* pCode);
+
+/**
+ * \brief Compiles the configured and built-in draw rules
+ *
+ * Creates replacement shaders and builds a perfect hash table for
+ * each combination of matched fields, so that matching a draw costs
+ * one lookup per combination regardless of the number of rules.
+ */
+void compileDrawRules(ID3D11Device* pDevice);
+
+/**
+ * \brief Finds the rule for a draw
+ *
+ * Rules matching more fields take precedence.
+ * \param [in] Key Draw state
+ * \param [in] Fields Fields known for the draw, rules
+ *    on any other field are skipped
+ * \returns The matching rule, or \c nullptr
+ */
+const DrawRule* matchDrawRule(const DrawRuleKey& Key, uint32_t Fields);
+
+/** Remembers the bytecode hash of a shader if rules or learning mode need it */
+void registerRuleShader(const void* pShader, const void* pBytecode, size_t BytecodeLength);
+
+/** Checks whether features other than draw rules look up shader hashes */
+bool needsShaderHashes();
+
+/** Returns the shader identifier used in rule keys */
+uint64_t getRuleShaderId(const void* pShader);
+
+/**
+ * \brief Returns the bytecode hash of a registered shader
+ * \returns \c false if the shader is unknown
+ */
+bool getRuleShaderHash(const void* pShader, Hash128* pHash);
+
+/* lives in rules.cpp */
+extern uint32_t g_drawRuleFields;
+
+/** Fields matched by any rule, 0 if there are no rules */
+inline uint32_t getDrawRuleFields() {
+    return g_drawRuleFields;
+}
+
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "shadercache.h"
+#include "shaderopt.h"
+#include "worker.h"
+#include "util.h"
+
+namespace atfix {
+
+namespace {
+
+    struct OptimizedShader {
+        bool                  done = false;
+        std::vector<uint8_t>  code;   /**< Empty if the shader could not be improved */
+    };
+
+    mutex g_optimizerMutex;
+    std::unordered_map<Hash128, OptimizedShader, Hash128Hasher> g_optimizedShaders;
+
+    WorkerThread g_optimizerWorker;
+
+    std::string getCachePath(const Hash128& Hash) {
+        return g_config.shaderCacheDir + "/" + formatHash(Hash)
+            + "_v" + std::to_string(DxbcOptimizerVersion) + ".dxbc";
+    }
+
+    /**
+     * \brief Reads a cached result
+     *
+     * An empty file records that the shader could not be improved.
+     * \returns \c false if there is no usable cache file
+     */
+    bool readCacheFile(const Hash128& Hash, std::vector<uint8_t>* pCode) {
+        std::ifstream file(getCachePath(Hash), std::ios::binary);
+
+        if (!file)
+            return false;
+
+        pCode->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+        if (pCode->empty())
+            return true;
+
+        DxbcContainer container;
+        return container.parse(pCode->data(), pCode->size());
+    }
+
+    void writeCacheFile(const Hash128& Hash, const std::vector<uint8_t>& Code) {
+        CreateDirectoryA(g_config.shaderCacheDir.c_str(), nullptr);
+
+        std::ofstream file(getCachePath(Hash), std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(Code.data()), std::streamsize(Code.size()));
+    }
+
+    void storeOptimizedShader(const Hash128& Hash, std::vector<uint8_t>&& Code) {
+        std::lock_guard lock(g_optimizerMutex);
+
+        auto& entry = g_optimizedShaders[Hash];
+        entry.done = true;
+        entry.code = std::move(Code);
+    }
+
+    void optimizeShaderAsync(const Hash128& Hash, std::vector<uint8_t>&& Bytecode) {
+        g_optimizerWorker.submit([Hash, bytecode = std::move(Bytecode)] {
+            std::vector<uint8_t> code;
+            DxbcOptimizeOptions options;
+            DxbcOptimizeStats stats;
+
+            options.validate = g_config.validateShaders;
+
+            if (optimizeDxbcShader(bytecode.data(), bytecode.size(), options, &code, &stats)) {
+#ifndef NDEBUG
+                log("ShaderOpt: ", formatHash(Hash), ": ", bytecode.size(), " -> ", code.size(), " bytes, ",
+                    stats.removed, " removed, ", stats.trimmed, " trimmed, ",
+                    stats.folded, " folded, ", stats.propagated, " propagated");
+
+                if (options.validate) {
+                    log("ShaderOpt: ", formatHash(Hash), ": ", stats.instructionsBefore, " -> ", stats.instructionsAfter,
+                        " instructions, ", stats.fetchesBefore, " -> ", stats.fetchesAfter, " fetches run on validation inputs");
+                }
+#endif
+            } else {
+#ifndef NDEBUG
+                if (stats.rejected)
+                    log("ShaderOpt: ", formatHash(Hash), ": Optimized shader failed validation, keeping the original");
+#endif
+                code.clear();
+            }
+
+            writeCacheFile(Hash, code);
+            storeOptimizedShader(Hash, std::move(code));
+        });
+    }
+
+}
+
+
+bool getOptimizedShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        std::vector<uint8_t>*     pCode) {
+    if (!g_config.optimizeShaders)
+        return false;
+
+    Hash128 hash = getDxbcHash(pBytecode, BytecodeLength);
+
+    {   std::lock_guard lock(g_optimizerMutex);
+        auto entry = g_optimizedShaders.find(hash);
+
+        if (entry != g_optimizedShaders.end()) {
+            if (!entry->second.done || entry->second.code.empty())
+                return false;
+
+            *pCode = entry->second.code;
+            return true;
+        }
+
+        /* Pending until the cache file is read or the worker is done */
+        g_optimizedShaders.insert({ hash, OptimizedShader() });
+    }
+
+    std::vector<uint8_t> code;
+
+    if (readCacheFile(hash, &code)) {
+        *pCode = code;
+        storeOptimizedShader(hash, std::move(code));
+        return !pCode->empty();
+    }
+
+    const auto* bytes = static_cast<const uint8_t*>(pBytecode);
+    optimizeShaderAsync(hash, std::vector<uint8_t>(bytes, bytes + BytecodeLength));
+    return false;
+}
+
+}
@@ -0,0 +1,28 @@
+#ifndef SHADERCACHE_H
+#define SHADERCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace atfix {
+
+/**
+ * \brief Looks up the optimized variant of a shader
+ *
+ * Variants are cached in memory and in the cache directory, keyed
+ * by the hash of the original shader. On a miss, the shader is
+ * optimized on a worker thread and the caller has to create the
+ * original, so the variant applies from the next time the shader
+ * is created, at the latest on the next start of the game.
+ * \returns \c true if \c pCode holds the optimized shader
+ */
+bool getOptimizedShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        std::vector<uint8_t>*     pCode);
+
+
+}
+
+#endif
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "shadercost.h"
+#include "worker.h"
+#include "util.h"
+
+namespace atfix {
+
+namespace {
+
+    /* Relative cost of a texture instruction compared to an arithmetic one */
+    constexpr uint64_t TextureWeight = 4u;
+
+    enum class ShaderStage : uint8_t {
+        Pixel   = 0,
+        Vertex  = 1,
+    };
+
+    struct ShaderCost {
+        Hash128     hash          = { };
+        ShaderStage stage         = ShaderStage::Pixel;
+        uint32_t    alu           = 0u;
+        uint32_t    texture       = 0u;
+        uint32_t    branches      = 0u;
+        uint32_t    temps         = 0u;
+        uint32_t    interpolants  = 0u;
+
+        /* Updated on the rendering thread only */
+        uint64_t    binds         = 0u;
+        uint64_t    draws         = 0u;
+        uint64_t    work          = 0u;   /**< Vertices or pixels */
+
+        uint64_t getCost() const {
+            return (alu + TextureWeight * texture) * work;
+        }
+    };
+
+    /* Costs are shared by all shaders created from the same bytecode,
+     * and entries are never removed so that pointers stay valid */
+    mutex g_costMutex;
+    std::unordered_map<Hash128, ShaderCost, Hash128Hasher> g_costs;
+    std::unordered_map<const void*, ShaderCost*> g_costShaders;
+
+    ShaderCost* g_costVs = nullptr;
+    ShaderCost* g_costPs = nullptr;
+    uint32_t g_costFrame = 1u;
+
+    WorkerThread g_costWorker;
+
+    /**
+     * \brief Counts instructions in the shader code
+     *
+     * Uses the code rather than the compiler's STAT chunk, since
+     * shipped shaders are usually stripped of it.
+     */
+    bool analyzeShaderCode(const DxbcContainer& Container, ShaderCost* pCost) {
+        const auto* chunk = Container.findChunk(DxbcTagShex);
+
+        if (!chunk)
+            chunk = Container.findChunk(DxbcTagShdr);
+
+        if (!chunk || chunk->size() < 8u || chunk->size() % 4u)
+            return false;
+
+        std::vector<uint32_t> tokens(chunk->size() / 4u);
+        std::memcpy(tokens.data(), chunk->data(), chunk->size());
+
+        uint32_t programType = tokens[0] >> 16;
+
+        if (programType > 1u || tokens[1] > tokens.size())
+            return false;
+
+        pCost->stage = ShaderStage(programType);
+
+        for (uint32_t i = 2u; i < tokens[1]; ) {
+            uint32_t length = getDxbcInstructionLength(&tokens[i]);
+
+            if (!length || i + length > tokens[1])
+                return false;
+
+            switch (getDxbcOpcode(tokens[i])) {
+                case DxbcOpcode::DclTemps:
+                    pCost->temps += tokens[i + 1u];
+                    break;
+
+                case DxbcOpcode::DclIndexableTemp:
+                    pCost->temps += tokens[i + 2u];
+                    break;
+
+                case DxbcOpcode::Ld:
+                case DxbcOpcode::LdMs:
+                case DxbcOpcode::Sample:
+                case DxbcOpcode::SampleC:
+                case DxbcOpcode::SampleCLz:
+                case DxbcOpcode::SampleL:
+                case DxbcOpcode::SampleD:
+                case DxbcOpcode::SampleB:
+                case DxbcOpcode::Lod:
+                case DxbcOpcode::Gather4:
+                case DxbcOpcode::Gather4C:
+                case DxbcOpcode::Gather4Po:
+                case DxbcOpcode::Gather4PoC:
+                    pCost->texture += 1u;
+                    break;
+
+                case DxbcOpcode::If:
+                case DxbcOpcode::Loop:
+                case DxbcOpcode::Switch:
+                case DxbcOpcode::Breakc:
+                case DxbcOpcode::Continuec:
+                case DxbcOpcode::Retc:
+                case DxbcOpcode::Callc:
+                    pCost->branches += 1u;
+                    break;
+
+                /* Block structure, no work of its own */
+                case DxbcOpcode::Else:
+                case DxbcOpcode::Endif:
+                case DxbcOpcode::Endloop:
+                case DxbcOpcode::Endswitch:
+                case DxbcOpcode::Case:
+                case DxbcOpcode::Default:
+                case DxbcOpcode::Break:
+                case DxbcOpcode::Continue:
+                case DxbcOpcode::Ret:
+                case DxbcOpcode::Call:
+                case DxbcOpcode::Label:
+                case DxbcOpcode::Nop:
+                    break;
+
+                default:
+                    if (!isDxbcDeclaration(getDxbcOpcode(tokens[i])))
+                        pCost->alu += 1u;
+            }
+
+            i += length;
+        }
+
+        return true;
+    }
+
+    /** Registers passing user values from the vertex to the pixel shader */
+    uint32_t countInterpolants(const DxbcContainer& Container, ShaderStage Stage) {
+        const auto* chunk = Container.findChunk(Stage == ShaderStage::Pixel ? DxbcTagIsgn : DxbcTagOsgn);
+        DxbcSignature signature;
+
+        if (!chunk || !signature.parse(*chunk))
+            return 0u;
+
+        uint64_t registers = 0u;
+
+        for (const auto& e : signature.elements()) {
+            if (!e.systemValue && e.registerIndex < 64u)
+                registers |= 1ull << e.registerIndex;
+        }
+
+        return uint32_t(std::popcount(registers));
+    }
+
+    ShaderCost* findShaderCost(const void* pShader) {
+        if (!pShader)
+            return nullptr;
+
+        std::lock_guard lock(g_costMutex);
+        auto entry = g_costShaders.find(pShader);
+        return entry != g_costShaders.end() ? entry->second : nullptr;
+    }
+
+    const char* getStageName(ShaderStage Stage) {
+        return Stage == ShaderStage::Vertex ? "VS" : "PS";
+    }
+
+    /**
+     * \brief Writes the report
+     *
+     * Shaders are ranked by their static cost times the work they were
+     * drawn with. Each stage's share is relative to that stage only.
+     */
+    void writeShaderCosts(
+      const std::string&              Path,
+            std::vector<ShaderCost>   Entries,
+            uint32_t                  Frames) {
+        std::sort(Entries.begin(), Entries.end(), [] (const ShaderCost& a, const ShaderCost& b) {
+            return a.getCost() > b.getCost();
+        });
+
+        uint64_t totals[2] = { };
+
+        for (const auto& e : Entries)
+            totals[uint32_t(e.stage)] += e.getCost();
+
+        std::ofstream file(Path, std::ios::out | std::ios::trunc);
+
+        file << "; Shaders by estimated cost, (alu + " << TextureWeight << " * tex) * work" << std::endl
+             << "; Vertex shader work is vertices drawn, pixel shader work the viewport area of each draw,"
+             << " which is an upper bound" << std::endl
+             << "; frames=" << Frames << " shaders=" << Entries.size() << std::endl << std::endl;
+
+        char line[320];
+
+        for (const auto& e : Entries) {
+            uint64_t total = totals[uint32_t(e.stage)];
+
+            std::snprintf(line, sizeof(line),
+                "%s %s share=%.2f%% binds_per_frame=%.2f draws_per_frame=%.2f work_per_frame=%.0f"
+                " alu=%u tex=%u branches=%u temps=%u interpolants=%u",
+                getStageName(e.stage), formatHash(e.hash).c_str(),
+                total ? 100.0 * double(e.getCost()) / double(total) : 0.0,
+                double(e.binds) / double(Frames), double(e.draws) / double(Frames),
+                double(e.work) / double(Frames),
+                e.alu, e.texture, e.branches, e.temps, e.interpolants);
+
+            file << line << std::endl;
+        }
+    }
+
+}
+
+
+void registerShaderCost(const void* pShader, const void* pBytecode, size_t BytecodeLength) {
+    if (!g_config.shaderReport)
+        return;
+
+    DxbcContainer container;
+    ShaderCost cost;
+
+    if (!container.parse(pBytecode, BytecodeLength) || !analyzeShaderCode(container, &cost))
+        return;
+
+    cost.hash = getDxbcHash(pBytecode, BytecodeLength);
+    cost.interpolants = countInterpolants(container, cost.stage);
+
+    std::lock_guard lock(g_costMutex);
+    auto entry = g_costs.insert({ cost.hash, cost }).first;
+    g_costShaders[pShader] = &entry->second;
+}
+
+
+void bindShaderCostVertexShader(const void* pShader) {
+    g_costVs = findShaderCost(pShader);
+
+    if (g_costVs)
+        g_costVs->binds += 1u;
+}
+
+
+void bindShaderCostPixelShader(const void* pShader) {
+    g_costPs = findShaderCost(pShader);
+
+    if (g_costPs)
+        g_costPs->binds += 1u;
+}
+
+
+void recordShaderCostDraw(uint64_t Vertices, uint64_t Pixels) {
+    if (g_costVs) {
+        g_costVs->draws += 1u;
+        g_costVs->work += Vertices;
+    }
+
+    if (g_costPs) {
+        g_costPs->draws += 1u;
+        g_costPs->work += Pixels;
+    }
+}
+
+
+void endShaderCostFrame() {
+    if (g_costFrame++ % g_config.learnDumpInterval)
+        return;
+
+    std::vector<ShaderCost> entries;
+
+    {   std::lock_guard lock(g_costMutex);
+        entries.reserve(g_costs.size());
+
+        for (const auto& e : g_costs) {
+            if (e.second.binds)
+                entries.push_back(e.second);
+        }
+    }
+
+    uint32_t frames = g_costFrame - 1u;
+
+    g_costWorker.submit([entries = std::move(entries), frames] () mutable {
+        writeShaderCosts(g_config.shaderReportFile, std::move(entries), frames);
+    });
+}
+
+}
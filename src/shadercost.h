@@ -0,0 +1,43 @@
+#ifndef SHADERCOST_H
+#define SHADERCOST_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace atfix {
+
+/**
+ * \brief Records the static cost of a shader created by the application
+ *
+ * Counts arithmetic, texture and branch instructions, temporary
+ * registers and interpolants of vertex and pixel shaders. Does
+ * nothing unless the shader report is enabled.
+ */
+void registerShaderCost(const void* pShader, const void* pBytecode, size_t BytecodeLength);
+
+/** Counts a vertex shader change on the immediate context */
+void bindShaderCostVertexShader(const void* pShader);
+
+/** Counts a pixel shader change on the immediate context */
+void bindShaderCostPixelShader(const void* pShader);
+
+/**
+ * \brief Counts a draw for the bound shaders
+ *
+ * Must be called on the rendering thread.
+ * \param [in] Vertices Vertices processed, 0 if unknown
+ * \param [in] Pixels Pixels the draw may cover, 0 if unknown
+ */
+void recordShaderCostDraw(uint64_t Vertices, uint64_t Pixels);
+
+/**
+ * \brief Ends a frame of the shader report
+ *
+ * Writes the report ranked by estimated cost on a worker
+ * thread every few frames.
+ */
+void endShaderCostFrame();
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "shaderdump.h"
+#include "worker.h"
+#include "util.h"
+
+namespace atfix {
+
+namespace {
+
+    struct DumpedShader {
+        Hash128               hash;
+        std::time_t           firstSeen;
+        std::vector<uint8_t>  code;
+    };
+
+    mutex g_dumpMutex;
+    std::unordered_set<Hash128, Hash128Hasher> g_dumpSeen;
+    std::vector<DumpedShader> g_dumpQueue;
+    bool g_dumpScheduled = false;
+
+    /* Only accessed on the worker */
+    std::unordered_set<Hash128, Hash128Hasher> g_dumpStored;
+    bool g_dumpIndexRead = false;
+
+    WorkerThread g_dumpWorker;
+
+    std::string getIndexPath() {
+        return g_config.shaderDumpDir + "/index.txt";
+    }
+
+    const char* getStageName(const DxbcContainer& Container) {
+        static const char* names[] = { "ps", "vs", "gs", "hs", "ds", "cs" };
+
+        auto* chunk = Container.findChunk(DxbcTagShex);
+
+        if (!chunk)
+            chunk = Container.findChunk(DxbcTagShdr);
+
+        if (!chunk || chunk->size() < 4u)
+            return "unknown";
+
+        uint32_t programType = (uint32_t((*chunk)[2]) | (uint32_t((*chunk)[3]) << 8));
+        return programType < std::size(names) ? names[programType] : "unknown";
+    }
+
+    /** Picks up shaders stored by earlier sessions, so that they are not written again */
+    void readDumpIndex() {
+        std::ifstream file(getIndexPath());
+        std::string line;
+
+        while (std::getline(file, line)) {
+            Hash128 hash;
+
+            if (line.size() >= 32u && parseHash(line.substr(0u, 32u).c_str(), &hash))
+                g_dumpStored.insert(hash);
+        }
+    }
+
+    /**
+     * \brief Writes all queued shaders
+     *
+     * Shaders created while a batch is written go into the next one.
+     * Index lines are only added once the shader file is complete.
+     */
+    void writeDumpBatch() {
+        std::vector<DumpedShader> batch;
+
+        {   std::lock_guard lock(g_dumpMutex);
+            batch.swap(g_dumpQueue);
+            g_dumpScheduled = false;
+        }
+
+        if (!g_dumpIndexRead) {
+            CreateDirectoryA(g_config.shaderDumpDir.c_str(), nullptr);
+            readDumpIndex();
+            g_dumpIndexRead = true;
+        }
+
+        std::string index;
+
+        for (const auto& shader : batch) {
+            if (!g_dumpStored.insert(shader.hash).second)
+                continue;
+
+            std::string name = formatHash(shader.hash);
+            std::ofstream file(g_config.shaderDumpDir + "/" + name + ".dxbc", std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(shader.code.data()), std::streamsize(shader.code.size()));
+
+            if (!file) {
+#ifndef NDEBUG
+                log("ShaderDump: Failed to write ", name);
+#endif
+                continue;
+            }
+
+            DxbcContainer container;
+            container.parse(shader.code.data(), shader.code.size());
+
+            /* The CRT keeps the result of gmtime per thread */
+            char time[32] = { };
+
+            if (const std::tm* tm = std::gmtime(&shader.firstSeen))
+                std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", tm);
+
+            char line[128];
+            std::snprintf(line, sizeof(line), "%s %s %zu %s\n",
+                name.c_str(), getStageName(container), shader.code.size(), time);
+            index += line;
+        }
+
+        if (!index.empty()) {
+            std::ofstream file(getIndexPath(), std::ios::app);
+            file << index;
+        }
+    }
+
+}
+
+
+void dumpShader(const void* pBytecode, size_t BytecodeLength) {
+    if (!g_config.dumpShaders || !pBytecode)
+        return;
+
+    Hash128 hash = getDxbcHash(pBytecode, BytecodeLength);
+
+    std::lock_guard lock(g_dumpMutex);
+
+    if (!g_dumpSeen.insert(hash).second)
+        return;
+
+    const auto* bytes = static_cast<const uint8_t*>(pBytecode);
+    g_dumpQueue.push_back({ hash, std::time(nullptr), std::vector<uint8_t>(bytes, bytes + BytecodeLength) });
+
+    /* One job drains everything queued until it runs */
+    if (!g_dumpScheduled) {
+        g_dumpScheduled = true;
+        g_dumpWorker.submit(&writeDumpBatch);
+    }
+}
+
+}
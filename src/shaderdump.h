@@ -0,0 +1,21 @@
+#ifndef SHADERDUMP_H
+#define SHADERDUMP_H
+
+#include <cstddef>
+
+namespace atfix {
+
+/**
+ * \brief Queues shader bytecode for the dump directory
+ *
+ * Each distinct shader is written once, named by its hash, and
+ * listed in the directory's index with its stage and the time it
+ * was first seen. Only hashes and copies the bytecode on the calling
+ * thread; files are written in batches on a worker thread. Does
+ * nothing unless shader dumps are enabled.
+ */
+void dumpShader(const void* pBytecode, size_t BytecodeLength);
+
+}
+
+#endif
@@ -0,0 +1,1336 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+#include "dxbc.h"
+#include "interp.h"
+#include "shaderopt.h"
+
+namespace atfix {
+
+namespace {
+
+    constexpr uint32_t MaxPasses = 8u;
+    constexpr uint32_t MaxTemps = 4096u;
+    constexpr uint32_t MaxInstructionLength = 0x7fu;
+
+    /* Opcode token bits of arithmetic instructions */
+    constexpr uint32_t SaturateBit = 1u << 13;
+    constexpr uint32_t TestNonZeroBit = 1u << 18;
+    constexpr uint32_t PreciseMask = 0xfu << 19;
+    constexpr uint32_t ExtendedBit = 1u << 31;
+
+    constexpr uint32_t NoCopy = ~0u;
+
+    /* Arithmetic instruction properties */
+    constexpr uint32_t ALU_COMPONENTWISE    = (1u << 0);  /**< Each result component reads the same source component */
+    constexpr uint32_t ALU_FOLD             = (1u << 1);  /**< Can be evaluated exactly on the CPU */
+
+    struct AluOpInfo {
+        DxbcOpcode opcode;
+        uint32_t   operands;
+        uint32_t   flags;
+    };
+
+    /**
+     * \brief Instructions the passes understand
+     *
+     * All of them write their first operand and nothing else, and
+     * have no side effects. Anything not listed is a barrier.
+     */
+    constexpr AluOpInfo AluOps[] = {
+        { DxbcOpcode::Add,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::And,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::DerivRtx,       2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::DerivRty,       2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Div,            3u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Dp2,            3u, 0u },
+        { DxbcOpcode::Dp3,            3u, 0u },
+        { DxbcOpcode::Dp4,            3u, 0u },
+        { DxbcOpcode::Eq,             3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Exp,            2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Frc,            2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Ftoi,           2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ftou,           2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ge,             3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Iadd,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ieq,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ige,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ilt,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Imad,           4u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Imax,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Imin,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ine,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ineg,           2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ishl,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ishr,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Itof,           2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ld,             3u, 0u },
+        { DxbcOpcode::LdMs,           4u, 0u },
+        { DxbcOpcode::Log,            2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Lt,             3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Mad,            4u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Min,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Max,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Mov,            2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Movc,           4u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Mul,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ne,             3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Not,            2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Or,             3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Resinfo,        3u, 0u },
+        { DxbcOpcode::RoundNe,        2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::RoundNi,        2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::RoundPi,        2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::RoundZ,         2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Rsq,            2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Sample,         4u, 0u },
+        { DxbcOpcode::SampleC,        5u, 0u },
+        { DxbcOpcode::SampleCLz,      5u, 0u },
+        { DxbcOpcode::SampleL,        5u, 0u },
+        { DxbcOpcode::SampleD,        6u, 0u },
+        { DxbcOpcode::SampleB,        5u, 0u },
+        { DxbcOpcode::Sqrt,           2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Ult,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Uge,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Umad,           4u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Umax,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Umin,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Ushr,           3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Utof,           2u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Xor,            3u, ALU_COMPONENTWISE | ALU_FOLD },
+        { DxbcOpcode::Lod,            4u, 0u },
+        { DxbcOpcode::Gather4,        4u, 0u },
+        { DxbcOpcode::SamplePos,      3u, 0u },
+        { DxbcOpcode::SampleInfo,     2u, 0u },
+        { DxbcOpcode::Bufinfo,        2u, 0u },
+        { DxbcOpcode::DerivRtxCoarse, 2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::DerivRtxFine,   2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::DerivRtyCoarse, 2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::DerivRtyFine,   2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Rcp,            2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::F32tof16,       2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::F16tof32,       2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Countbits,      2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::FirstbitHi,     2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::FirstbitLo,     2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::FirstbitShi,    2u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Ubfe,           4u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Ibfe,           4u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Bfi,            5u, ALU_COMPONENTWISE },
+        { DxbcOpcode::Bfrev,          2u, ALU_COMPONENTWISE },
+    };
+
+    const AluOpInfo* findAluOp(DxbcOpcode Opcode) {
+        for (const auto& op : AluOps) {
+            if (op.opcode == Opcode)
+                return &op;
+        }
+
+        return nullptr;
+    }
+
+
+    struct Operand {
+        uint32_t offset;    /**< First token within the instruction */
+        uint32_t length;
+        uint32_t header;    /**< Operand token and extended operand tokens */
+    };
+
+    struct Instruction {
+        std::vector<uint32_t> tokens;
+        std::vector<Operand>  operands;   /**< Only parsed for arithmetic instructions and \c if */
+        const AluOpInfo*      alu     = nullptr;
+        bool                  removed = false;
+    };
+
+    uint32_t getSelectionMode(uint32_t Token) {
+        return (Token >> 2) & 0x3u;
+    }
+
+    uint32_t getWriteMask(uint32_t Token) {
+        return (Token >> 4) & 0xfu;
+    }
+
+    /** Source component feeding the given result component */
+    uint32_t getSourceComponent(uint32_t Token, uint32_t Component) {
+        switch (getSelectionMode(Token)) {
+            case 1u: return (Token >> (4u + 2u * Component)) & 0x3u;
+            case 2u: return (Token >> 4) & 0x3u;
+            default: return Component;
+        }
+    }
+
+    /** Source components read for the given result components */
+    uint32_t getReadMask(uint32_t Token, uint32_t Components) {
+        uint32_t mask = 0u;
+
+        for (uint32_t i = 0; i < 4u; i++) {
+            if (Components & (1u << i))
+                mask |= 1u << getSourceComponent(Token, i);
+        }
+
+        return mask;
+    }
+
+    /** Checks for a four-component rN or oN operand with an immediate index */
+    bool isDirectRegister(const Instruction& Ins, const Operand& Op, DxbcOperandType Type) {
+        uint32_t token = Ins.tokens[Op.offset];
+
+        return getDxbcOperandType(token) == Type
+            && (token & 0x3u) == 2u
+            && getDxbcIndexDimension(token) == 1u
+            && getDxbcIndexType(token, 0u) == DxbcIndexType::Imm32;
+    }
+
+    uint32_t getRegisterIndex(const Instruction& Ins, const Operand& Op) {
+        return Ins.tokens[Op.offset + Op.header];
+    }
+
+    /**
+     * \brief Checks for a cbN[M] operand with immediate indices
+     * \returns Location of the first component, the selected
+     *    components are added to it
+     */
+    bool getConstantLocation(const Instruction& Ins, const Operand& Op, DxbcConstantRef* pLocation) {
+        uint32_t token = Ins.tokens[Op.offset];
+
+        if (getDxbcOperandType(token) != DxbcOperandType::ConstantBuffer
+         || (token & 0x3u) != 2u || !getSelectionMode(token)
+         || getDxbcIndexDimension(token) != 2u
+         || getDxbcIndexType(token, 0u) != DxbcIndexType::Imm32
+         || getDxbcIndexType(token, 1u) != DxbcIndexType::Imm32)
+            return false;
+
+        pLocation->buffer = Ins.tokens[Op.offset + Op.header];
+        pLocation->element = Ins.tokens[Op.offset + Op.header + 1u] * 4u;
+        return true;
+    }
+
+    bool hasModifiers(const Operand& Op) {
+        return Op.header > 1u;
+    }
+
+    /** Result components written, all of them unless the operand uses a write mask */
+    uint32_t getDstMask(const Instruction& Ins) {
+        uint32_t token = Ins.tokens[Ins.operands[0].offset];
+
+        return (token & 0x3u) == 2u && !getSelectionMode(token)
+            ? getWriteMask(token) : 0xfu;
+    }
+
+    /** Result components each source operand is read for */
+    uint32_t getSourcePositions(const Instruction& Ins) {
+        /* Branch conditions read a single component */
+        if (!Ins.alu)
+            return 0x1u;
+
+        return (Ins.alu->flags & ALU_COMPONENTWISE) ? getDstMask(Ins) : 0xfu;
+    }
+
+    bool parseInstruction(Instruction* pIns) {
+        auto& tokens = pIns->tokens;
+        auto opcode = getDxbcOpcode(tokens[0]);
+
+        pIns->operands.clear();
+        pIns->alu = findAluOp(opcode);
+
+        uint32_t operandCount = pIns->alu ? pIns->alu->operands
+            : opcode == DxbcOpcode::If ? 1u : 0u;
+
+        if (!operandCount)
+            return true;
+
+        const uint32_t* begin = tokens.data();
+        const uint32_t* end = begin + tokens.size();
+        uint32_t offset = getDxbcOpcodeTokenCount(begin, end);
+
+        if (!offset)
+            return false;
+
+        while (offset < tokens.size()) {
+            uint32_t length = getDxbcOperandLength(begin + offset, end);
+
+            if (!length)
+                return false;
+
+            pIns->operands.push_back({ offset, length, getDxbcOpcodeTokenCount(begin + offset, end) });
+            offset += length;
+        }
+
+        return pIns->operands.size() == operandCount;
+    }
+
+    /** Replaces an operand and updates the instruction length */
+    bool replaceOperand(Instruction* pIns, uint32_t Index, const std::vector<uint32_t>& Tokens) {
+        const Operand op = pIns->operands[Index];
+        size_t length = pIns->tokens.size() - op.length + Tokens.size();
+
+        if (length > MaxInstructionLength)
+            return false;
+
+        auto& tokens = pIns->tokens;
+        tokens.erase(tokens.begin() + op.offset, tokens.begin() + op.offset + op.length);
+        tokens.insert(tokens.begin() + op.offset, Tokens.begin(), Tokens.end());
+        tokens[0] = (tokens[0] & ~(MaxInstructionLength << 24)) | (uint32_t(length) << 24);
+        return parseInstruction(pIns);
+    }
+
+    /** Marks temporaries used as relative indices of an operand as fully live */
+    void markIndexReads(const uint32_t* pOperand, const uint32_t* pEnd, std::vector<uint8_t>& LiveTemps) {
+        uint32_t token = pOperand[0];
+        const uint32_t* index = pOperand + getDxbcOpcodeTokenCount(pOperand, pEnd);
+
+        for (uint32_t i = 0; i < getDxbcIndexDimension(token); i++) {
+            auto type = getDxbcIndexType(token, i);
+
+            if (type == DxbcIndexType::Imm32) {
+                index += 1u;
+                continue;
+            }
+
+            if (type == DxbcIndexType::Imm64) {
+                index += 2u;
+                continue;
+            }
+
+            index += type == DxbcIndexType::Imm64Relative ? 2u
+                   : type == DxbcIndexType::Imm32Relative ? 1u : 0u;
+
+            uint32_t subToken = index[0];
+            uint32_t subHeader = getDxbcOpcodeTokenCount(index, pEnd);
+
+            if (getDxbcOperandType(subToken) == DxbcOperandType::Temp
+             && getDxbcIndexDimension(subToken) == 1u
+             && getDxbcIndexType(subToken, 0u) == DxbcIndexType::Imm32
+             && index[subHeader] < LiveTemps.size())
+                LiveTemps[index[subHeader]] = 0xfu;
+
+            markIndexReads(index, pEnd, LiveTemps);
+            index += getDxbcOperandLength(index, pEnd);
+        }
+    }
+
+
+    float asFloat(uint32_t Bits) {
+        float value;
+        std::memcpy(&value, &Bits, sizeof(value));
+        return value;
+    }
+
+    uint32_t asBits(float Value) {
+        uint32_t bits;
+        std::memcpy(&bits, &Value, sizeof(bits));
+        return bits;
+    }
+
+    /* Shader arithmetic flushes denormals */
+    float flushDenorm(float Value) {
+        return std::fpclassify(Value) == FP_SUBNORMAL ? std::copysign(0.0f, Value) : Value;
+    }
+
+    bool foldFloat(float Value, uint32_t* pResult) {
+        /* NaN encodings are up to the hardware */
+        if (std::isnan(Value))
+            return false;
+
+        *pResult = asBits(flushDenorm(Value));
+        return true;
+    }
+
+    bool foldBool(bool Value, uint32_t* pResult) {
+        *pResult = Value ? ~0u : 0u;
+        return true;
+    }
+
+    /**
+     * \brief Evaluates one result component
+     *
+     * Only covers operations whose result is fully specified, so that
+     * the folded value matches what any GPU computes.
+     * \returns \c false if the operation cannot be folded
+     */
+    bool foldComponent(DxbcOpcode Opcode, const uint32_t* pSrc, uint32_t* pResult) {
+        uint32_t a = pSrc[0], b = pSrc[1], c = pSrc[2];
+        float fa = flushDenorm(asFloat(a));
+        float fb = flushDenorm(asFloat(b));
+        float fc = flushDenorm(asFloat(c));
+
+        switch (Opcode) {
+            case DxbcOpcode::Mov:     *pResult = a; return true;
+            case DxbcOpcode::Movc:    *pResult = a ? b : c; return true;
+
+            case DxbcOpcode::Add:     return foldFloat(fa + fb, pResult);
+            case DxbcOpcode::Mul:     return foldFloat(fa * fb, pResult);
+            case DxbcOpcode::Mad:     return foldFloat(fa * fb + fc, pResult);
+            case DxbcOpcode::Min:     return foldFloat(std::fmin(fa, fb), pResult);
+            case DxbcOpcode::Max:     return foldFloat(std::fmax(fa, fb), pResult);
+            case DxbcOpcode::RoundNe: return foldFloat(std::nearbyint(fa), pResult);
+            case DxbcOpcode::RoundNi: return foldFloat(std::floor(fa), pResult);
+            case DxbcOpcode::RoundPi: return foldFloat(std::ceil(fa), pResult);
+            case DxbcOpcode::RoundZ:  return foldFloat(std::trunc(fa), pResult);
+
+            case DxbcOpcode::Eq:      return foldBool(fa == fb, pResult);
+            case DxbcOpcode::Ne:      return foldBool(!(fa == fb), pResult);
+            case DxbcOpcode::Lt:      return foldBool(fa < fb, pResult);
+            case DxbcOpcode::Ge:      return foldBool(fa >= fb, pResult);
+
+            case DxbcOpcode::Ftoi:
+                *pResult = std::isnan(fa) ? 0u
+                    : fa >= 2147483648.0f ? 0x7fffffffu
+                    : fa <= -2147483648.0f ? 0x80000000u
+                    : uint32_t(int32_t(fa));
+                return true;
+
+            case DxbcOpcode::Ftou:
+                *pResult = std::isnan(fa) || fa <= 0.0f ? 0u
+                    : fa >= 4294967296.0f ? ~0u
+                    : uint32_t(fa);
+                return true;
+
+            /* Only fold conversions that are exact, rounding is not specified */
+            case DxbcOpcode::Itof:
+                if (int32_t(a) < -(1 << 24) || int32_t(a) > (1 << 24))
+                    return false;
+
+                *pResult = asBits(float(int32_t(a)));
+                return true;
+
+            case DxbcOpcode::Utof:
+                if (a > (1u << 24))
+                    return false;
+
+                *pResult = asBits(float(a));
+                return true;
+
+            case DxbcOpcode::Iadd:    *pResult = a + b; return true;
+            case DxbcOpcode::Ineg:    *pResult = 0u - a; return true;
+            case DxbcOpcode::Imad:
+            case DxbcOpcode::Umad:    *pResult = a * b + c; return true;
+            case DxbcOpcode::Imax:    *pResult = uint32_t(std::max(int32_t(a), int32_t(b))); return true;
+            case DxbcOpcode::Imin:    *pResult = uint32_t(std::min(int32_t(a), int32_t(b))); return true;
+            case DxbcOpcode::Umax:    *pResult = std::max(a, b); return true;
+            case DxbcOpcode::Umin:    *pResult = std::min(a, b); return true;
+            case DxbcOpcode::And:     *pResult = a & b; return true;
+            case DxbcOpcode::Or:      *pResult = a | b; return true;
+            case DxbcOpcode::Xor:     *pResult = a ^ b; return true;
+            case DxbcOpcode::Not:     *pResult = ~a; return true;
+            case DxbcOpcode::Ishl:    *pResult = a << (b & 31u); return true;
+            case DxbcOpcode::Ishr:    *pResult = uint32_t(int32_t(a) >> (b & 31u)); return true;
+            case DxbcOpcode::Ushr:    *pResult = a >> (b & 31u); return true;
+
+            case DxbcOpcode::Ieq:     return foldBool(a == b, pResult);
+            case DxbcOpcode::Ine:     return foldBool(a != b, pResult);
+            case DxbcOpcode::Ilt:     return foldBool(int32_t(a) < int32_t(b), pResult);
+            case DxbcOpcode::Ige:     return foldBool(int32_t(a) >= int32_t(b), pResult);
+            case DxbcOpcode::Ult:     return foldBool(a < b, pResult);
+            case DxbcOpcode::Uge:     return foldBool(a >= b, pResult);
+
+            default:
+                return false;
+        }
+    }
+
+
+    /** Per-component knowledge about temporaries within a basic block */
+    class TempState {
+
+    public:
+
+        explicit TempState(uint32_t TempCount)
+        : m_values(TempCount * 4u), m_known(TempCount), m_copies(TempCount * 4u, NoCopy) { }
+
+        void reset() {
+            std::fill(m_known.begin(), m_known.end(), 0u);
+            std::fill(m_copies.begin(), m_copies.end(), NoCopy);
+        }
+
+        /** Forgets what was known about the written components */
+        void write(uint32_t Reg, uint32_t Mask) {
+            m_known[Reg] &= ~Mask;
+
+            for (auto& copy : m_copies) {
+                if (copy != NoCopy && copy / 4u == Reg && (Mask & (1u << (copy % 4u))))
+                    copy = NoCopy;
+            }
+
+            for (uint32_t i = 0; i < 4u; i++) {
+                if (Mask & (1u << i))
+                    m_copies[Reg * 4u + i] = NoCopy;
+            }
+        }
+
+        void setValue(uint32_t Reg, uint32_t Component, uint32_t Value) {
+            m_known[Reg] |= 1u << Component;
+            m_values[Reg * 4u + Component] = Value;
+        }
+
+        void setCopy(uint32_t Reg, uint32_t Component, uint32_t Source) {
+            m_copies[Reg * 4u + Component] = Source;
+        }
+
+        bool isKnown(uint32_t Reg, uint32_t Mask) const {
+            return (m_known[Reg] & Mask) == Mask;
+        }
+
+        uint32_t getValue(uint32_t Reg, uint32_t Component) const {
+            return m_values[Reg * 4u + Component];
+        }
+
+        uint32_t getCopy(uint32_t Reg, uint32_t Component) const {
+            return m_copies[Reg * 4u + Component];
+        }
+
+    private:
+
+        std::vector<uint32_t> m_values;
+        std::vector<uint8_t>  m_known;
+        std::vector<uint32_t> m_copies;   /**< Register * 4 + component holding the same value */
+
+    };
+
+    /** Replaces a temporary source by an immediate if all components read are known */
+    bool propagateConstant(Instruction* pIns, uint32_t Index, const TempState& State) {
+        const Operand& op = pIns->operands[Index];
+        uint32_t token = pIns->tokens[op.offset];
+        uint32_t reg = getRegisterIndex(*pIns, op);
+        uint32_t positions = getSourcePositions(*pIns);
+
+        if (hasModifiers(op) || !State.isKnown(reg, getReadMask(token, positions)))
+            return false;
+
+        std::vector<uint32_t> imm;
+
+        if (getSelectionMode(token) == 2u) {
+            imm = { 1u | (uint32_t(DxbcOperandType::Imm32) << 12),
+                    State.getValue(reg, getSourceComponent(token, 0u)) };
+        } else {
+            imm = { 2u | (uint32_t(DxbcOperandType::Imm32) << 12), 0u, 0u, 0u, 0u };
+
+            for (uint32_t i = 0; i < 4u; i++) {
+                if (positions & (1u << i))
+                    imm[1u + i] = State.getValue(reg, getSourceComponent(token, i));
+            }
+        }
+
+        return replaceOperand(pIns, Index, imm);
+    }
+
+    /** Reads the original of a copied temporary instead of the copy */
+    bool propagateCopy(Instruction* pIns, uint32_t Index, const TempState& State) {
+        const Operand& op = pIns->operands[Index];
+        uint32_t token = pIns->tokens[op.offset];
+        uint32_t reg = getRegisterIndex(*pIns, op);
+        uint32_t mode = getSelectionMode(token);
+
+        if (mode == 0u)
+            return false;
+
+        uint32_t positions = mode == 2u ? 0x1u : getSourcePositions(*pIns);
+        uint32_t source = NoCopy;
+        uint32_t components[4] = { };
+
+        for (uint32_t i = 0; i < 4u; i++) {
+            if (!(positions & (1u << i)))
+                continue;
+
+            uint32_t copy = State.getCopy(reg, getSourceComponent(token, i));
+
+            if (copy == NoCopy || (source != NoCopy && copy / 4u != source))
+                return false;
+
+            source = copy / 4u;
+            components[i] = copy % 4u;
+        }
+
+        if (source == NoCopy)
+            return false;
+
+        /* Unused components select one that is read anyway */
+        uint32_t first = components[std::countr_zero(positions)];
+        uint32_t selection = mode == 2u ? first : 0u;
+
+        if (mode == 1u) {
+            for (uint32_t i = 0; i < 4u; i++)
+                selection |= ((positions & (1u << i)) ? components[i] : first) << (2u * i);
+        }
+
+        pIns->tokens[op.offset] = (token & ~(0xffu << 4)) | (selection << 4);
+        pIns->tokens[op.offset + op.header] = source;
+        return true;
+    }
+
+    /** Replaces an instruction whose sources are all immediates by a move */
+    bool foldInstruction(Instruction* pIns) {
+        const auto& dst = pIns->operands[0];
+        uint32_t mask = getDstMask(*pIns);
+        uint32_t values[4] = { };
+
+        for (uint32_t i = 1; i < pIns->operands.size(); i++) {
+            const auto& op = pIns->operands[i];
+
+            if (getDxbcOperandType(pIns->tokens[op.offset]) != DxbcOperandType::Imm32 || hasModifiers(op))
+                return false;
+        }
+
+        for (uint32_t c = 0; c < 4u; c++) {
+            if (!(mask & (1u << c)))
+                continue;
+
+            uint32_t src[3] = { };
+
+            for (uint32_t i = 1; i < pIns->operands.size(); i++) {
+                const auto& op = pIns->operands[i];
+                bool scalar = (pIns->tokens[op.offset] & 0x3u) == 1u;
+                src[i - 1u] = pIns->tokens[op.offset + 1u + (scalar ? 0u : c)];
+            }
+
+            if (!foldComponent(getDxbcOpcode(pIns->tokens[0]), src, &values[c]))
+                return false;
+        }
+
+        std::vector<uint32_t> tokens = { 0u };
+        tokens.insert(tokens.end(), pIns->tokens.begin() + dst.offset, pIns->tokens.begin() + dst.offset + dst.length);
+        tokens.insert(tokens.end(), { 2u | (uint32_t(DxbcOperandType::Imm32) << 12), values[0], values[1], values[2], values[3] });
+        tokens[0] = uint32_t(DxbcOpcode::Mov) | (uint32_t(tokens.size()) << 24);
+
+        pIns->tokens = std::move(tokens);
+        return parseInstruction(pIns);
+    }
+
+    /** Checks for a move of a temporary onto itself */
+    bool isSelfMove(const Instruction& Ins) {
+        if (getDxbcOpcode(Ins.tokens[0]) != DxbcOpcode::Mov)
+            return false;
+
+        const auto& dst = Ins.operands[0];
+        const auto& src = Ins.operands[1];
+
+        if (!isDirectRegister(Ins, dst, DxbcOperandType::Temp) || hasModifiers(dst)
+         || !isDirectRegister(Ins, src, DxbcOperandType::Temp) || hasModifiers(src)
+         || getRegisterIndex(Ins, dst) != getRegisterIndex(Ins, src))
+            return false;
+
+        uint32_t mask = getDstMask(Ins);
+        uint32_t token = Ins.tokens[src.offset];
+
+        for (uint32_t i = 0; i < 4u; i++) {
+            if ((mask & (1u << i)) && getSourceComponent(token, i) != i)
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * \brief Forward pass over each basic block
+     *
+     * Tracks temporaries holding immediates or copies of other
+     * temporaries, rewrites reads accordingly, folds instructions
+     * that end up with immediate sources only, and drops moves
+     * that became no-ops.
+     */
+    bool propagateValues(std::vector<Instruction>& Code, uint32_t TempCount, DxbcOptimizeStats& Stats) {
+        TempState state(TempCount);
+        bool progress = false;
+
+        for (auto& ins : Code) {
+            if (ins.removed || isDxbcDeclaration(getDxbcOpcode(ins.tokens[0])))
+                continue;
+
+            if (!ins.alu) {
+                /* Conditions known here let the branch be resolved */
+                if (getDxbcOpcode(ins.tokens[0]) == DxbcOpcode::If
+                 && isDirectRegister(ins, ins.operands[0], DxbcOperandType::Temp)
+                 && propagateConstant(&ins, 0u, state)) {
+                    Stats.propagated += 1u;
+                    progress = true;
+                }
+
+                state.reset();
+                continue;
+            }
+
+            bool plain = !(ins.tokens[0] & (SaturateBit | PreciseMask | ExtendedBit));
+
+            for (uint32_t i = 1; i < ins.operands.size(); i++) {
+                if (!isDirectRegister(ins, ins.operands[i], DxbcOperandType::Temp))
+                    continue;
+
+                bool changed = (ins.alu->flags & ALU_FOLD) && propagateConstant(&ins, i, state);
+
+                if (!changed)
+                    changed = propagateCopy(&ins, i, state);
+
+                if (changed) {
+                    Stats.propagated += 1u;
+                    progress = true;
+                }
+            }
+
+            if (plain && (ins.alu->flags & ALU_FOLD)
+             && getDxbcOpcode(ins.tokens[0]) != DxbcOpcode::Mov
+             && foldInstruction(&ins)) {
+                Stats.folded += 1u;
+                progress = true;
+            }
+
+            if (plain && isSelfMove(ins)) {
+                ins.removed = true;
+                Stats.removed += 1u;
+                progress = true;
+                continue;
+            }
+
+            const auto& dst = ins.operands[0];
+
+            if (!isDirectRegister(ins, dst, DxbcOperandType::Temp))
+                continue;
+
+            uint32_t reg = getRegisterIndex(ins, dst);
+            uint32_t mask = getDstMask(ins);
+            state.write(reg, mask);
+
+            if (!plain || getDxbcOpcode(ins.tokens[0]) != DxbcOpcode::Mov)
+                continue;
+
+            const auto& src = ins.operands[1];
+            uint32_t token = ins.tokens[src.offset];
+
+            if (hasModifiers(src))
+                continue;
+
+            if (getDxbcOperandType(token) == DxbcOperandType::Imm32) {
+                bool scalar = (token & 0x3u) == 1u;
+
+                for (uint32_t i = 0; i < 4u; i++) {
+                    if (mask & (1u << i))
+                        state.setValue(reg, i, ins.tokens[src.offset + 1u + (scalar ? 0u : i)]);
+                }
+            } else if (isDirectRegister(ins, src, DxbcOperandType::Temp) && getRegisterIndex(ins, src) != reg) {
+                uint32_t source = getRegisterIndex(ins, src);
+
+                for (uint32_t i = 0; i < 4u; i++) {
+                    if (mask & (1u << i))
+                        state.setCopy(reg, i, source * 4u + getSourceComponent(token, i));
+                }
+            }
+        }
+
+        return progress;
+    }
+
+    /**
+     * \brief Replaces constant buffer reads by assumed values
+     *
+     * Only applies to operands without modifiers whose selected
+     * components all have a value.
+     */
+    void substituteConstants(
+            std::vector<Instruction>& Code,
+      const std::vector<DxbcConstant>& Constants,
+            DxbcOptimizeStats&        Stats) {
+        std::unordered_map<uint64_t, uint32_t> values;
+
+        for (const auto& c : Constants)
+            values.insert({ (uint64_t(c.location.buffer) << 32) | c.location.element, c.value });
+
+        auto findValue = [&values] (const DxbcConstantRef& Location, uint32_t Component, uint32_t* pValue) {
+            auto entry = values.find((uint64_t(Location.buffer) << 32) | (Location.element + Component));
+
+            if (entry == values.end())
+                return false;
+
+            *pValue = entry->second;
+            return true;
+        };
+
+        for (auto& ins : Code) {
+            if (ins.removed || ins.operands.empty())
+                continue;
+
+            /* The first operand of arithmetic instructions is the destination */
+            for (uint32_t i = ins.alu ? 1u : 0u; i < ins.operands.size(); i++) {
+                const auto& op = ins.operands[i];
+                uint32_t token = ins.tokens[op.offset];
+                uint32_t positions = getSourcePositions(ins);
+                DxbcConstantRef location;
+
+                if (hasModifiers(op) || !getConstantLocation(ins, op, &location))
+                    continue;
+
+                std::vector<uint32_t> imm;
+                bool known = true;
+
+                if (getSelectionMode(token) == 2u) {
+                    imm = { 1u | (uint32_t(DxbcOperandType::Imm32) << 12), 0u };
+                    known = findValue(location, getSourceComponent(token, 0u), &imm[1]);
+                } else {
+                    imm = { 2u | (uint32_t(DxbcOperandType::Imm32) << 12), 0u, 0u, 0u, 0u };
+
+                    for (uint32_t c = 0; c < 4u && known; c++) {
+                        if (positions & (1u << c))
+                            known = findValue(location, getSourceComponent(token, c), &imm[1u + c]);
+                    }
+                }
+
+                if (known && replaceOperand(&ins, i, imm))
+                    Stats.propagated += 1u;
+            }
+        }
+    }
+
+    /**
+     * \brief Removes \c if blocks with immediate conditions
+     *
+     * Keeps the body that runs and drops the other one along
+     * with the branch instructions.
+     */
+    bool resolveBranches(std::vector<Instruction>& Code, DxbcOptimizeStats& Stats) {
+        bool progress = false;
+
+        for (size_t i = 0; i < Code.size(); i++) {
+            auto& ins = Code[i];
+
+            if (ins.removed || getDxbcOpcode(ins.tokens[0]) != DxbcOpcode::If)
+                continue;
+
+            uint32_t condition = ins.tokens[ins.operands[0].offset];
+
+            if (getDxbcOperandType(condition) != DxbcOperandType::Imm32 || (condition & 0x3u) != 1u)
+                continue;
+
+            size_t elseIndex = 0u;
+            size_t endIndex = 0u;
+            uint32_t depth = 0u;
+
+            for (size_t j = i + 1u; j < Code.size() && !endIndex; j++) {
+                if (Code[j].removed)
+                    continue;
+
+                switch (getDxbcOpcode(Code[j].tokens[0])) {
+                    case DxbcOpcode::If:
+                        depth += 1u;
+                        break;
+
+                    case DxbcOpcode::Else:
+                        if (!depth)
+                            elseIndex = j;
+                        break;
+
+                    case DxbcOpcode::Endif:
+                        if (!depth)
+                            endIndex = j;
+                        else
+                            depth -= 1u;
+                        break;
+
+                    default:
+                        break;
+                }
+            }
+
+            if (!endIndex)
+                return progress;
+
+            uint32_t value = ins.tokens[ins.operands[0].offset + 1u];
+            bool taken = (ins.tokens[0] & TestNonZeroBit) ? value != 0u : value == 0u;
+
+            /* Range of the body that does not run */
+            size_t deadBegin = taken ? (elseIndex ? elseIndex : endIndex) : i;
+            size_t deadEnd = taken ? endIndex : (elseIndex ? elseIndex : endIndex);
+
+            ins.removed = true;
+            Code[endIndex].removed = true;
+
+            for (size_t j = deadBegin; j <= deadEnd; j++) {
+                if (!Code[j].removed) {
+                    Code[j].removed = true;
+                    Stats.removed += 1u;
+                }
+            }
+
+            Stats.branches += 1u;
+            progress = true;
+        }
+
+        return progress;
+    }
+
+    /**
+     * \brief Backward pass removing writes nothing reads
+     *
+     * Liveness is tracked per component. Barriers make everything
+     * live, except for an unconditional \c ret, after which only the
+     * outputs are read.
+     */
+    bool eliminateDeadCode(
+            std::vector<Instruction>& Code,
+            uint32_t                  TempCount,
+      const DxbcOptimizeOptions&      Options,
+            DxbcOptimizeStats&        Stats) {
+        std::vector<uint8_t> temps(TempCount, 0u);
+        auto outputs = Options.liveOutputs;
+        bool progress = false;
+
+        for (auto i = Code.rbegin(); i != Code.rend(); i++) {
+            auto& ins = *i;
+            auto opcode = getDxbcOpcode(ins.tokens[0]);
+
+            if (ins.removed || isDxbcDeclaration(opcode))
+                continue;
+
+            if (!ins.alu) {
+                std::fill(temps.begin(), temps.end(), opcode == DxbcOpcode::Ret ? 0u : 0xfu);
+                outputs = Options.liveOutputs;
+                continue;
+            }
+
+            const auto& dst = ins.operands[0];
+            uint32_t token = ins.tokens[dst.offset];
+            uint32_t written = getDstMask(ins);
+            uint8_t* live = nullptr;
+
+            if (isDirectRegister(ins, dst, DxbcOperandType::Temp))
+                live = &temps[getRegisterIndex(ins, dst)];
+            else if (isDirectRegister(ins, dst, DxbcOperandType::Output) && getRegisterIndex(ins, dst) < DxbcMaxOutputRegisters)
+                live = &outputs[getRegisterIndex(ins, dst)];
+
+            uint32_t liveMask = live ? *live
+                : getDxbcOperandType(token) == DxbcOperandType::Null ? 0u : 0xfu;
+
+            if (!(written & liveMask)) {
+                ins.removed = true;
+                Stats.removed += 1u;
+                progress = true;
+                continue;
+            }
+
+            if (live && (ins.alu->flags & ALU_COMPONENTWISE) && (written & ~liveMask) && !getSelectionMode(token)) {
+                written &= liveMask;
+                ins.tokens[dst.offset] = (token & ~(0xfu << 4)) | (written << 4);
+                Stats.trimmed += 1u;
+                progress = true;
+            }
+
+            if (live)
+                *live &= ~written;
+
+            const uint32_t* end = ins.tokens.data() + ins.tokens.size();
+            markIndexReads(&ins.tokens[dst.offset], end, temps);
+
+            uint32_t positions = getSourcePositions(ins);
+
+            for (uint32_t s = 1; s < ins.operands.size(); s++) {
+                const auto& src = ins.operands[s];
+
+                if (isDirectRegister(ins, src, DxbcOperandType::Temp))
+                    temps[getRegisterIndex(ins, src)] |= getReadMask(ins.tokens[src.offset], positions);
+
+                markIndexReads(&ins.tokens[src.offset], end, temps);
+            }
+        }
+
+        return progress;
+    }
+
+
+    /**
+     * \brief Finds output registers that instructions still access
+     * \returns Register mask, all bits set if outputs are indexed
+     *    dynamically or an instruction cannot be decoded
+     */
+    uint32_t getAccessedOutputs(const std::vector<Instruction>& Code) {
+        uint32_t mask = 0u;
+
+        for (const auto& ins : Code) {
+            if (ins.removed || isDxbcDeclaration(getDxbcOpcode(ins.tokens[0])))
+                continue;
+
+            const uint32_t* begin = ins.tokens.data();
+            const uint32_t* end = begin + ins.tokens.size();
+            const uint32_t* p = begin + getDxbcOpcodeTokenCount(begin, end);
+
+            if (p == begin)
+                return ~0u;
+
+            while (p < end) {
+                uint32_t length = getDxbcOperandLength(p, end);
+
+                if (!length)
+                    return ~0u;
+
+                if (getDxbcOperandType(p[0]) == DxbcOperandType::Output) {
+                    uint32_t header = getDxbcOpcodeTokenCount(p, end);
+
+                    if (getDxbcIndexDimension(p[0]) != 1u
+                     || getDxbcIndexType(p[0], 0u) != DxbcIndexType::Imm32
+                     || p[header] >= DxbcMaxOutputRegisters)
+                        return ~0u;
+
+                    mask |= 1u << p[header];
+                }
+
+                p += length;
+            }
+        }
+
+        return mask;
+    }
+
+    /**
+     * \brief Drops declarations and signature elements of unused outputs
+     *
+     * Only applies to registers that nothing writes anymore and that
+     * hold no system values.
+     */
+    uint32_t removeUnusedOutputs(
+            DxbcContainer&            Container,
+            std::vector<Instruction>& Code,
+            uint32_t                  Registers) {
+        auto* osgn = Container.findChunk(DxbcTagOsgn);
+        DxbcSignature signature;
+
+        if (!osgn || !signature.parse(*osgn))
+            return 0u;
+
+        Registers &= ~getAccessedOutputs(Code);
+
+        for (const auto& e : signature.elements()) {
+            if (e.systemValue && e.registerIndex < DxbcMaxOutputRegisters)
+                Registers &= ~(1u << e.registerIndex);
+        }
+
+        if (!Registers)
+            return 0u;
+
+        for (auto& ins : Code) {
+            const auto& t = ins.tokens;
+
+            if (getDxbcOpcode(t[0]) == DxbcOpcode::DclOutput && t.size() == 3u
+             && getDxbcOperandType(t[1]) == DxbcOperandType::Output
+             && t[2] < DxbcMaxOutputRegisters && (Registers & (1u << t[2])))
+                ins.removed = true;
+        }
+
+        signature.removeElements([Registers] (const DxbcSignature::Element& e) {
+            return e.registerIndex < DxbcMaxOutputRegisters && (Registers & (1u << e.registerIndex));
+        });
+
+        *osgn = signature.serialize();
+        return uint32_t(std::popcount(Registers));
+    }
+
+
+    /** Compares outputs, allowing for rounding in folded and reordered math */
+    bool isSameOutput(uint32_t a, uint32_t b) {
+        if (a == b)
+            return true;
+
+        float fa = std::bit_cast<float>(a);
+        float fb = std::bit_cast<float>(b);
+
+        if (std::isnan(fa) || std::isnan(fb))
+            return std::isnan(fa) && std::isnan(fb);
+
+        /* Integer outputs look like denormals and must match exactly */
+        if (std::fpclassify(fa) == FP_SUBNORMAL || std::fpclassify(fb) == FP_SUBNORMAL)
+            return false;
+
+        return std::abs(fa - fb) <= 1.0e-4f * std::max({ 1.0f, std::abs(fa), std::abs(fb) });
+    }
+
+    /**
+     * \brief Checks an optimized shader against the original
+     *
+     * Runs both on the same synthetic inputs, with the assumed constant
+     * buffer values, and compares discards and the live output components.
+     * \returns \c false if the outputs differ or either shader cannot be run
+     */
+    bool validateOptimizedShader(
+      const void*                     pOriginal,
+            size_t                    OriginalLength,
+      const std::vector<uint8_t>&     Optimized,
+      const DxbcOptimizeOptions&      Options,
+            DxbcOptimizeStats&        Stats) {
+        DxbcInterpInputs inputs;
+        inputs.constants = Options.constants;
+
+        DxbcInterpResult before;
+        DxbcInterpResult after;
+
+        if (!runDxbcShader(pOriginal, OriginalLength, inputs, &before)
+         || !runDxbcShader(Optimized.data(), Optimized.size(), inputs, &after))
+            return false;
+
+        Stats.instructionsBefore = before.instructions;
+        Stats.instructionsAfter = after.instructions;
+        Stats.fetchesBefore = before.fetches;
+        Stats.fetchesAfter = after.fetches;
+
+        for (size_t i = 0; i < before.discarded.size(); i++) {
+            if (before.discarded[i] != after.discarded[i])
+                return false;
+
+            if (before.discarded[i])
+                continue;
+
+            const uint32_t* a = &before.outputs[i * DxbcInterpOutputStride];
+            const uint32_t* b = &after.outputs[i * DxbcInterpOutputStride];
+
+            for (uint32_t r = 0; r <= DxbcMaxOutputRegisters; r++) {
+                uint32_t live = r < DxbcMaxOutputRegisters ? Options.liveOutputs[r] : 0x1u;
+
+                if (r < DxbcMaxOutputRegisters && (Options.unusedOutputs & (1u << r)))
+                    live = 0u;
+
+                for (uint32_t k = 0; k < 4u; k++) {
+                    if ((live & (1u << k)) && !isSameOutput(a[4u * r + k], b[4u * r + k]))
+                        return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /** Copies the tokens of the shader code chunk */
+    bool readCodeTokens(const DxbcContainer& Container, std::vector<uint32_t>* pTokens) {
+        const auto* chunk = Container.findChunk(DxbcTagShex);
+
+        if (!chunk)
+            chunk = Container.findChunk(DxbcTagShdr);
+
+        if (!chunk || chunk->size() < 8u || chunk->size() % 4u)
+            return false;
+
+        pTokens->resize(chunk->size() / 4u);
+        std::memcpy(pTokens->data(), chunk->data(), chunk->size());
+        return true;
+    }
+
+    /**
+     * \brief Decodes the instructions of a shader
+     *
+     * Rejects shaders the passes do not support.
+     * \returns \c false if the code cannot be optimized
+     */
+    bool parseShaderCode(
+      const std::vector<uint32_t>&    Tokens,
+            std::vector<Instruction>* pCode,
+            uint32_t*                 pTempCount) {
+        uint32_t programType = Tokens[0] >> 16;
+        uint32_t major = (Tokens[0] >> 4) & 0xfu;
+        uint32_t minor = Tokens[0] & 0xfu;
+
+        /* Pixel and vertex shaders up to shader model 5.0 */
+        if (programType > 1u || major > 5u || (major == 5u && minor > 0u) || Tokens[1] > Tokens.size())
+            return false;
+
+        auto& code = *pCode;
+        uint32_t tempCount = 0u;
+
+        const uint32_t* begin = Tokens.data() + 2u;
+        const uint32_t* end = Tokens.data() + Tokens[1];
+
+        for (const uint32_t* p = begin; p < end; ) {
+            uint32_t length = getDxbcInstructionLength(p);
+
+            if (!length || p + length > end)
+                return false;
+
+            switch (getDxbcOpcode(p[0])) {
+                /* Subroutines would need liveness across calls */
+                case DxbcOpcode::Call:
+                case DxbcOpcode::Callc:
+                case DxbcOpcode::Label:
+                case DxbcOpcode::InterfaceCall:
+                case DxbcOpcode::DclFunctionBody:
+                case DxbcOpcode::DclFunctionTable:
+                case DxbcOpcode::DclInterface:
+                    return false;
+
+                case DxbcOpcode::DclTemps:
+                    tempCount = p[1];
+                    break;
+
+                default:
+                    break;
+            }
+
+            Instruction ins;
+            ins.tokens.assign(p, p + length);
+
+            if (!parseInstruction(&ins))
+                return false;
+
+            code.push_back(std::move(ins));
+            p += length;
+        }
+
+        if (tempCount > MaxTemps)
+            return false;
+
+        for (const auto& ins : code) {
+            for (const auto& op : ins.operands) {
+                if (isDirectRegister(ins, op, DxbcOperandType::Temp) && getRegisterIndex(ins, op) >= tempCount)
+                    return false;
+            }
+        }
+
+        *pTempCount = tempCount;
+        return true;
+    }
+
+}
+
+
+bool optimizeDxbcShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+  const DxbcOptimizeOptions&      Options,
+        std::vector<uint8_t>*     pResult,
+        DxbcOptimizeStats*        pStats) {
+    DxbcContainer container;
+    std::vector<uint32_t> tokens;
+    std::vector<Instruction> code;
+    uint32_t tempCount = 0u;
+
+    if (!container.parse(pBytecode, BytecodeLength)
+     || !readCodeTokens(container, &tokens)
+     || !parseShaderCode(tokens, &code, &tempCount))
+        return false;
+
+    DxbcOptimizeStats stats;
+
+    if (!Options.constants.empty())
+        substituteConstants(code, Options.constants, stats);
+
+    for (uint32_t i = 0; i < MaxPasses; i++) {
+        bool progress = propagateValues(code, tempCount, stats);
+        progress |= resolveBranches(code, stats);
+        progress |= eliminateDeadCode(code, tempCount, Options, stats);
+
+        if (!progress)
+            break;
+    }
+
+    if (Options.unusedOutputs)
+        stats.outputs = removeUnusedOutputs(container, code, Options.unusedOutputs);
+
+    if (pStats)
+        *pStats = stats;
+
+    if (!stats.removed && !stats.trimmed && !stats.folded && !stats.propagated
+     && !stats.outputs && !stats.branches)
+        return false;
+
+    std::vector<uint32_t> out = { tokens[0], 0u };
+
+    for (const auto& ins : code) {
+        if (!ins.removed)
+            out.insert(out.end(), ins.tokens.begin(), ins.tokens.end());
+    }
+
+    out[1] = uint32_t(out.size());
+
+    auto* chunk = container.findCodeChunk();
+    chunk->resize(out.size() * sizeof(uint32_t));
+    std::memcpy(chunk->data(), out.data(), chunk->size());
+
+    *pResult = container.serialize();
+
+    if (Options.validate && !validateOptimizedShader(pBytecode, BytecodeLength, *pResult, Options, stats)) {
+        stats.rejected = 1u;
+
+        if (pStats)
+            *pStats = stats;
+
+        return false;
+    }
+
+    if (pStats)
+        *pStats = stats;
+
+    return true;
+}
+
+
+bool findDxbcBranchConstants(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        std::vector<DxbcConstantRef>* pConstants) {
+    DxbcContainer container;
+    std::vector<uint32_t> tokens;
+    std::vector<Instruction> code;
+    uint32_t tempCount = 0u;
+
+    if (!container.parse(pBytecode, BytecodeLength)
+     || !readCodeTokens(container, &tokens)
+     || !parseShaderCode(tokens, &code, &tempCount))
+        return false;
+
+    pConstants->clear();
+
+    for (const auto& ins : code) {
+        uint32_t first = 1u;
+        uint32_t last = uint32_t(ins.operands.size());
+
+        switch (getDxbcOpcode(ins.tokens[0])) {
+            case DxbcOpcode::If:
+                first = 0u;
+                break;
+
+            case DxbcOpcode::Eq:
+            case DxbcOpcode::Ne:
+            case DxbcOpcode::Lt:
+            case DxbcOpcode::Ge:
+            case DxbcOpcode::Ieq:
+            case DxbcOpcode::Ine:
+            case DxbcOpcode::Ilt:
+            case DxbcOpcode::Ige:
+            case DxbcOpcode::Ult:
+            case DxbcOpcode::Uge:
+            case DxbcOpcode::And:
+            case DxbcOpcode::Or:
+                break;
+
+            /* Only the selector decides which value is used */
+            case DxbcOpcode::Movc:
+                last = 2u;
+                break;
+
+            default:
+                continue;
+        }
+
+        uint32_t positions = getSourcePositions(ins);
+
+        for (uint32_t i = first; i < last; i++) {
+            const auto& op = ins.operands[i];
+            DxbcConstantRef location;
+
+            if (!getConstantLocation(ins, op, &location))
+                continue;
+
+            uint32_t components = getReadMask(ins.tokens[op.offset], positions);
+
+            for (uint32_t c = 0; c < 4u; c++) {
+                DxbcConstantRef ref = { location.buffer, location.element + c };
+
+                if ((components & (1u << c)) && std::find(pConstants->begin(), pConstants->end(), ref) == pConstants->end())
+                    pConstants->push_back(ref);
+            }
+        }
+    }
+
+    std::sort(pConstants->begin(), pConstants->end(), [] (const DxbcConstantRef& a, const DxbcConstantRef& b) {
+        return a.buffer < b.buffer || (a.buffer == b.buffer && a.element < b.element);
+    });
+
+    return true;
+}
+
+}
@@ -0,0 +1,111 @@
+#ifndef SHADEROPT_H
+#define SHADEROPT_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace atfix {
+
+constexpr uint32_t DxbcMaxOutputRegisters = 32u;
+
+/** Part of the cache file names, bump when the passes change */
+constexpr uint32_t DxbcOptimizerVersion = 2u;
+
+/** Constant buffer component read with immediate indices */
+struct DxbcConstantRef {
+    uint32_t buffer;    /**< Constant buffer slot */
+    uint32_t element;   /**< Vector index times four, plus the component */
+
+    bool operator == (const DxbcConstantRef&) const = default;
+};
+
+/** Value to assume for a constant buffer component */
+struct DxbcConstant {
+    DxbcConstantRef location;
+    uint32_t        value;
+};
+
+/** Optimizer input beyond the shader itself */
+struct DxbcOptimizeOptions {
+    /** Components of each output register that are consumed downstream */
+    std::array<uint8_t, DxbcMaxOutputRegisters> liveOutputs;
+
+    /** Output registers whose declarations and signature elements can be dropped */
+    uint32_t unusedOutputs = 0u;
+
+    /** Constant buffer values to fold into the code */
+    std::vector<DxbcConstant> constants;
+
+    /** Run both shaders on the CPU and reject results whose live outputs differ */
+    bool validate = false;
+
+    DxbcOptimizeOptions() {
+        liveOutputs.fill(0xfu);
+    }
+};
+
+/** What the optimizer changed */
+struct DxbcOptimizeStats {
+    uint32_t removed    = 0u;   /**< Dead or redundant instructions */
+    uint32_t trimmed    = 0u;   /**< Write masks reduced to live components */
+    uint32_t folded     = 0u;   /**< Instructions evaluated on immediates */
+    uint32_t propagated = 0u;   /**< Operands replaced by immediates or copy sources */
+    uint32_t outputs    = 0u;   /**< Output registers no longer declared */
+    uint32_t branches   = 0u;   /**< Branches resolved on immediate conditions */
+    uint32_t rejected   = 0u;   /**< Results dropped because validation failed */
+
+    /* Cost on the validation inputs, summed over all invocations */
+    uint64_t instructionsBefore = 0u;
+    uint64_t instructionsAfter  = 0u;
+    uint64_t fetchesBefore      = 0u;
+    uint64_t fetchesAfter       = 0u;
+};
+
+/**
+ * \brief Optimizes vertex or pixel shader bytecode
+ *
+ * Runs constant folding and propagation, copy propagation and
+ * dead code elimination until nothing changes. The passes work
+ * on straight-line code only, and treat control flow and any
+ * instruction with side effects as a barrier, except for \c if
+ * blocks whose condition becomes an immediate. Declarations and
+ * signatures are kept, so the result is interchangeable with the
+ * original shader, unless unused outputs are dropped or constant
+ * buffer values are assumed. With validation, the result is only
+ * returned if the interpreter can run both shaders and they agree.
+ * \param [in] pBytecode Original DXBC
+ * \param [in] BytecodeLength Size of the original DXBC
+ * \param [in] Options Output components to keep, values to assume
+ * \param [out] pResult Optimized DXBC
+ * \param [out] pStats Changes made, optional
+ * \returns \c false if the shader is not supported or nothing changed
+ */
+bool optimizeDxbcShader(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+  const DxbcOptimizeOptions&      Options,
+        std::vector<uint8_t>*     pResult,
+        DxbcOptimizeStats*        pStats);
+
+/**
+ * \brief Finds constant buffer components that branches depend on
+ *
+ * Collects components that \c if conditions, comparisons, bit
+ * tests and selects read directly, which is how shaders test
+ * material toggles. Fixing these values lets the optimizer
+ * resolve the branches.
+ * \param [in] pBytecode Shader DXBC
+ * \param [in] BytecodeLength Size of the shader
+ * \param [out] pConstants Components, sorted by slot and element
+ * \returns \c false if the shader is not supported
+ */
+bool findDxbcBranchConstants(
+  const void*                     pBytecode,
+        size_t                    BytecodeLength,
+        std::vector<DxbcConstantRef>* pConstants);
+
+}
+
+#endif
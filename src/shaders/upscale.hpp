@@ -0,0 +1,130 @@
+/*
+ * Edge-adaptive upscale and sharpening passes for dynamic resolution,
+ * compiled at runtime. src/upscale.cpp mirrors both on the CPU, keep
+ * them in sync.
+ */
+
+/* Constants: uvScale, uvMax as for the bilinear rescale, texSize is the
+ * full texture size in texels. Filters a 4x4 neighbourhood with a
+ * Lanczos-2 approximation that is stretched along local edges, then
+ * clamps to the nearest 2x2 texels to avoid ringing. */
+constexpr const char* upscaleShader = R"(
+cbuffer params : register(b0) {
+    float2 uvScale;
+    float2 uvMax;
+    float2 texSize;
+    float  sharpness;
+    float  unused;
+};
+
+Texture2D<float4> src : register(t0);
+
+float getLuma(float3 c) {
+    return dot(c, float3(0.25f, 0.5f, 0.25f));
+}
+
+float getWeight(float d2, float lobe) {
+    float a = 0.4f * d2 - 1.0f;
+    float b = lobe * d2 - 1.0f;
+    return (1.5625f * a * a - 0.5625f) * (b * b);
+}
+
+float4 main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+    int2 maxTexel = int2(uvMax * texSize);
+    float2 p = uv * uvScale * texSize - 0.5f;
+    float2 base = floor(p);
+    float2 f = p - base;
+
+    float4 c[16];
+    float l[16];
+
+    [unroll] for (int i = 0; i < 16; i++) {
+        int2 t = clamp(int2(base) + int2(i & 3, i >> 2) - 1, int2(0, 0), maxTexel);
+        c[i] = src.Load(int3(t, 0));
+        l[i] = getLuma(c[i].rgb);
+    }
+
+    float2 dir = float2(0.0f, 0.0f);
+    float len = 0.0f;
+
+    [unroll] for (int q = 0; q < 4; q++) {
+        int k = 5 + (q & 1) + 4 * (q >> 1);
+        float w = ((q & 1) ? f.x : 1.0f - f.x) * ((q >> 1) ? f.y : 1.0f - f.y);
+
+        float dx = l[k + 1] - l[k - 1];
+        float dy = l[k + 4] - l[k - 4];
+        float ex = max(abs(l[k + 1] - l[k]), abs(l[k] - l[k - 1]));
+        float ey = max(abs(l[k + 4] - l[k]), abs(l[k] - l[k - 4]));
+        float sx = saturate(abs(dx) / max(ex, 1.0f / 32768.0f));
+        float sy = saturate(abs(dy) / max(ey, 1.0f / 32768.0f));
+
+        dir += w * float2(dx, dy);
+        len += w * 0.5f * (sx * sx + sy * sy);
+    }
+
+    float dirLen2 = dot(dir, dir);
+    dir = dirLen2 < 1.0f / 32768.0f ? float2(1.0f, 0.0f) : dir * rsqrt(dirLen2);
+
+    float stretch = 1.0f / max(abs(dir.x), abs(dir.y));
+    float2 axisScale = float2(1.0f + (stretch - 1.0f) * len, 1.0f - 0.5f * len);
+    float lobe = 0.5f - 0.29f * len;
+    float clip = 1.0f / lobe;
+
+    float4 sum = float4(0.0f, 0.0f, 0.0f, 0.0f);
+    float weights = 0.0f;
+
+    [unroll] for (int j = 0; j < 16; j++) {
+        float2 d = float2(j & 3, j >> 2) - 1.0f - f;
+        float2 r = float2(dot(d, dir), dot(d, float2(-dir.y, dir.x))) * axisScale;
+        float w = getWeight(min(dot(r, r), clip), lobe);
+
+        sum += w * c[j];
+        weights += w;
+    }
+
+    float4 lo = min(min(c[5], c[6]), min(c[9], c[10]));
+    float4 hi = max(max(c[5], c[6]), max(c[9], c[10]));
+    return clamp(sum / max(weights, 1.0f / 32768.0f), lo, hi);
+}
+)";
+
+/* Constants: texSize is the size of the upscaled region in pixels,
+ * sharpness goes from 0 to 1. Sharpens with a negative lobe on the
+ * four direct neighbours, limited so that no channel overshoots the
+ * neighbourhood's range. */
+constexpr const char* sharpenShader = R"(
+cbuffer params : register(b0) {
+    float2 uvScale;
+    float2 uvMax;
+    float2 texSize;
+    float  sharpness;
+    float  unused;
+};
+
+Texture2D<float4> src : register(t0);
+
+float4 main(float4 pos : SV_Position, float2 uv : TEXCOORD0) : SV_Target {
+    int2 p = int2(pos.xy);
+    int2 maxTexel = int2(texSize) - 1;
+
+    float4 e = src.Load(int3(p, 0));
+    float3 b = src.Load(int3(clamp(p + int2( 0, -1), int2(0, 0), maxTexel), 0)).rgb;
+    float3 d = src.Load(int3(clamp(p + int2(-1,  0), int2(0, 0), maxTexel), 0)).rgb;
+    float3 f = src.Load(int3(clamp(p + int2( 1,  0), int2(0, 0), maxTexel), 0)).rgb;
+    float3 h = src.Load(int3(clamp(p + int2( 0,  1), int2(0, 0), maxTexel), 0)).rgb;
+
+    float3 lo = min(min(min(b, d), min(f, h)), e.rgb);
+    float3 hi = max(max(max(b, d), max(f, h)), e.rgb);
+
+    float range = max(max(max(hi.r, hi.g), hi.b), 1.0f);
+    lo /= range;
+    hi /= range;
+
+    float3 hitMin = lo / (4.0f * max(hi, 1.0f / 32768.0f));
+    float3 hitMax = (1.0f - hi) / min(4.0f * lo - 4.0f, -1.0f / 32768.0f);
+    float3 lobes = max(-hitMin, hitMax);
+    float lobe = max(-0.1875f, min(max(max(lobes.r, lobes.g), lobes.b), 0.0f)) * sharpness;
+
+    return float4((lobe * (b + d + f + h) + e.rgb) / (4.0f * lobe + 1.0f), e.a);
+}
+)";
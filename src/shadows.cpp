@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <array>
+
+#include "config.h"
+#include "impl.h"
+#include "rules.h"
+#include "shadows.h"
+
+namespace atfix {
+
+namespace {
+
+    struct ShadowCullStats {
+        uint64_t  draws       = 0u;
+        uint64_t  primitives  = 0u;
+    };
+
+    constexpr uint32_t ShadowStatsInterval = 600u;
+
+    std::array<ShadowCullStats, MaxShadowCascades> g_shadowCullStats = { };
+    uint32_t g_shadowFrame = 0u;
+
+    /* {6d1a7c3e-5b0f-4c2a-9e47-2f83b1d0c5a9} */
+    const GUID ScaledShadowMapGuid = { 0x6d1a7c3e, 0x5b0f, 0x4c2a, { 0x9e, 0x47, 0x2f, 0x83, 0xb1, 0xd0, 0xc5, 0xa9 } };
+
+    uint32_t getMinIndexCount(uint32_t Cascade) {
+        const auto& counts = g_config.casterMinIndexCounts;
+
+        if (counts.empty())
+            return 0u;
+
+        return counts[std::min<size_t>(Cascade, counts.size() - 1u)];
+    }
+
+}
+
+
+bool isShadowCasterShader(const void* pShader) {
+    const auto& shaders = g_config.shadowCasterShaders;
+
+    if (shaders.empty())
+        return pShader != nullptr;
+
+    Hash128 hash;
+
+    if (!pShader || !getRuleShaderHash(pShader, &hash))
+        return false;
+
+    return std::find(shaders.begin(), shaders.end(), hash) != shaders.end();
+}
+
+
+bool cullShadowDraw(
+        uint32_t          Cascade,
+        uint32_t          Count,
+        uint32_t          InstanceCount,
+        uint32_t          PrimitiveSize) {
+    if (Count >= getMinIndexCount(Cascade))
+        return false;
+
+    /* Strips are counted as such, which overestimates by two primitives */
+    uint32_t primitives = PrimitiveSize ? Count / PrimitiveSize : Count;
+
+    auto& stats = g_shadowCullStats[Cascade];
+    stats.draws += 1u;
+    stats.primitives += uint64_t(primitives) * InstanceCount;
+    return true;
+}
+
+
+void endShadowFrame() {
+    if (++g_shadowFrame % ShadowStatsInterval)
+        return;
+
+    /* Also logged in release builds to tune the thresholds */
+    for (uint32_t i = 0; i < MaxShadowCascades; i++) {
+        const auto& stats = g_shadowCullStats[i];
+
+        if (stats.draws) {
+            log("Shadows: Cascade ", i, " dropped ", stats.draws, " draws, ",
+                stats.primitives, " primitives in ", ShadowStatsInterval, " frames");
+        }
+    }
+
+    g_shadowCullStats = { };
+}
+
+
+bool tryCreateScaledShadowMap(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Texture2D**         ppTexture,
+        HRESULT*                  pResult) {
+    const auto* procs = getDeviceProcs(pDevice);
+    uint32_t size = g_config.shadowMapSize;
+
+    if (!size || !pDesc || pInitialData || !(pDesc->BindFlags & D3D11_BIND_DEPTH_STENCIL)
+     || pDesc->Width != size || pDesc->Height != size || pDesc->MipLevels > 1u)
+        return false;
+
+    D3D11_TEXTURE2D_DESC desc = *pDesc;
+    desc.Width = g_config.shadowMapSizeOverride;
+    desc.Height = g_config.shadowMapSizeOverride;
+
+    *pResult = procs->CreateTexture2D(pDevice, &desc, nullptr, ppTexture);
+
+    if (SUCCEEDED(*pResult) && ppTexture && *ppTexture) {
+        uint32_t originalSize = size;
+        (*ppTexture)->SetPrivateData(ScaledShadowMapGuid, sizeof(originalSize), &originalSize);
+
+#ifndef NDEBUG
+        log("Shadows: Created ", size, "x", size, " shadow map at ", desc.Width, "x", desc.Height);
+#endif
+    }
+
+    return true;
+}
+
+
+bool isScaledShadowMap(ID3D11DepthStencilView* pView) {
+    if (!pView)
+        return false;
+
+    ID3D11Resource* resource = nullptr;
+    pView->GetResource(&resource);
+
+    uint32_t originalSize = 0u;
+    UINT dataSize = sizeof(originalSize);
+
+    bool scaled = SUCCEEDED(resource->GetPrivateData(ScaledShadowMapGuid, &dataSize, &originalSize));
+    resource->Release();
+    return scaled;
+}
+
+
+float getShadowMapScale() {
+    return float(g_config.shadowMapSizeOverride) / float(g_config.shadowMapSize);
+}
+
+}
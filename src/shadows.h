@@ -0,0 +1,64 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include <cstdint>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/** Cascades told apart by their position in the shadow map atlas */
+constexpr uint32_t MaxShadowCascades = 4u;
+
+/**
+ * \brief Checks whether a vertex shader renders shadow casters
+ *
+ * Any shader qualifies if no caster shaders are configured.
+ */
+bool isShadowCasterShader(const void* pShader);
+
+/**
+ * \brief Decides whether to drop a shadow caster draw
+ *
+ * Draws below the index count threshold of their cascade are
+ * dropped and counted. Must be called on the rendering thread.
+ * \param [in] Cascade Cascade index, less than \c MaxShadowCascades
+ * \param [in] Count Index or vertex count per instance
+ * \param [in] InstanceCount Number of instances
+ * \param [in] PrimitiveSize Vertices per primitive, 0 for strips
+ * \returns \c true if the draw should be skipped
+ */
+bool cullShadowDraw(
+        uint32_t          Cascade,
+        uint32_t          Count,
+        uint32_t          InstanceCount,
+        uint32_t          PrimitiveSize);
+
+/** Ends a frame, logging the per-cascade counters now and then */
+void endShadowFrame();
+
+/**
+ * \brief Creates shadow maps at the configured resolution
+ *
+ * Depth textures with the configured shadow map size are created
+ * at the override size instead, and marked so that render target
+ * tracking can recognize them.
+ * \returns \c true if the texture was handled, with the
+ *    result in \c pResult
+ */
+bool tryCreateScaledShadowMap(
+        ID3D11Device*             pDevice,
+  const D3D11_TEXTURE2D_DESC*     pDesc,
+  const D3D11_SUBRESOURCE_DATA*   pInitialData,
+        ID3D11Texture2D**         ppTexture,
+        HRESULT*                  pResult);
+
+/** Checks whether a depth view belongs to a scaled shadow map */
+bool isScaledShadowMap(ID3D11DepthStencilView* pView);
+
+/** Factor to apply to viewports and scissors of scaled shadow maps */
+float getShadowMapScale();
+
+}
+
+#endif
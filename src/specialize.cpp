@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "config.h"
+#include "dxbc.h"
+#include "impl.h"
+#include "shaderopt.h"
+#include "specialize.h"
+#include "worker.h"
+#include "util.h"
+
+namespace atfix {
+
+namespace {
+
+    /* Draws with unchanged values before a variant is built */
+    constexpr uint32_t StableDraws = 256u;
+    /* Value changes after which a shader is no longer profiled */
+    constexpr uint32_t MaxChanges = 4u;
+    /* Components profiled per shader */
+    constexpr uint32_t MaxConstants = 64u;
+
+    enum class SpecializeState : uint32_t {
+        Profiling,    /**< Waiting for the values to settle */
+        Pending,      /**< Variant being built */
+        Active,       /**< Variant used while the values match */
+        Rejected,     /**< Values change too often, or nothing to gain */
+    };
+
+    struct SpecializeShader {
+        uint64_t              id;         /**< Tells apart shaders created at the same address */
+        Hash128               hash;
+        ID3D11Device*         device;
+        std::vector<uint8_t>  code;
+        std::vector<DxbcConstantRef> constants;
+        std::vector<uint32_t> values;     /**< Last sampled values, empty before the first sample */
+        SpecializeState       state       = SpecializeState::Profiling;
+        uint32_t              stableDraws = 0u;
+        uint32_t              changes     = 0u;
+        uint32_t              generation  = 0u;   /**< Bumped whenever the variant is dropped */
+        ID3D11PixelShader*    variant     = nullptr;
+    };
+
+    /** Components of a constant buffer that profiled shaders read */
+    struct WatchedBuffer {
+        uint32_t              size    = 0u;       /**< In dwords */
+        std::vector<uint32_t> elements;
+        std::vector<uint32_t> values;
+        std::vector<uint8_t>  known;
+        const uint32_t*       mapped  = nullptr;  /**< Written by the application until unmapped */
+    };
+
+    mutex g_specializeMutex;
+    std::unordered_map<ID3D11PixelShader*, SpecializeShader> g_specializeShaders;
+    std::unordered_map<ID3D11Resource*, WatchedBuffer> g_watchedBuffers;
+    uint64_t g_specializeShaderId = 0u;
+    uint32_t g_specializedCount = 0u;   /**< Shaders with a pending or active variant */
+
+    WorkerThread g_specializeWorker;
+
+    /** Drops the variant, a pending one is discarded when done */
+    void resetVariant(SpecializeShader& Shader, SpecializeState State) {
+        if (Shader.variant)
+            Shader.variant->Release();
+
+        if (Shader.state == SpecializeState::Pending || Shader.state == SpecializeState::Active)
+            g_specializedCount -= 1u;
+
+        Shader.variant = nullptr;
+        Shader.state = State;
+        Shader.generation += 1u;
+    }
+
+    WatchedBuffer* getWatchedBuffer(ID3D11Buffer* pBuffer) {
+        if (!pBuffer)
+            return nullptr;
+
+        auto entry = g_watchedBuffers.find(pBuffer);
+
+        if (entry != g_watchedBuffers.end())
+            return &entry->second;
+
+        D3D11_BUFFER_DESC desc = { };
+        pBuffer->GetDesc(&desc);
+
+        WatchedBuffer watched;
+        watched.size = desc.ByteWidth / sizeof(uint32_t);
+
+        return &g_watchedBuffers.insert({ pBuffer, std::move(watched) }).first->second;
+    }
+
+    /**
+     * \brief Looks up the value of a constant buffer component
+     *
+     * Components not watched yet are known from the next write on.
+     * \returns \c false if the value is not known
+     */
+    bool readWatchedValue(WatchedBuffer& Buffer, uint32_t Element, uint32_t* pValue) {
+        auto entry = std::find(Buffer.elements.begin(), Buffer.elements.end(), Element);
+
+        if (entry == Buffer.elements.end()) {
+            Buffer.elements.push_back(Element);
+            Buffer.values.push_back(0u);
+            Buffer.known.push_back(0u);
+            return false;
+        }
+
+        size_t index = size_t(entry - Buffer.elements.begin());
+        *pValue = Buffer.values[index];
+        return Buffer.known[index] != 0u;
+    }
+
+    /**
+     * \brief Reads the current values of a shader's branch constants
+     * \returns \c false if any value is not known
+     */
+    bool readValues(const SpecializeShader& Shader, ID3D11Buffer* const* ppBuffers, uint32_t Ranges, uint32_t* pValues) {
+        WatchedBuffer* buffer = nullptr;
+        uint32_t slot = ~0u;
+        bool known = true;
+
+        for (size_t i = 0; i < Shader.constants.size(); i++) {
+            const auto& c = Shader.constants[i];
+
+            /* Constants are sorted by slot */
+            if (c.buffer != slot) {
+                slot = c.buffer;
+
+                /* Offsets of ranged bindings are not tracked */
+                if (slot >= D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT || (Ranges & (1u << slot)))
+                    return false;
+
+                buffer = getWatchedBuffer(ppBuffers[slot]);
+            }
+
+            if (!buffer)
+                return false;
+
+            known &= readWatchedValue(*buffer, c.element, &pValues[i]);
+        }
+
+        return known;
+    }
+
+    void createVariantAsync(ID3D11PixelShader* pShader, const SpecializeShader& Shader) {
+        DxbcOptimizeOptions options;
+        options.validate = g_config.validateShaders;
+
+        for (size_t i = 0; i < Shader.constants.size(); i++)
+            options.constants.push_back({ Shader.constants[i], Shader.values[i] });
+
+        g_specializeWorker.submit([pShader, options = std::move(options),
+            id = Shader.id, generation = Shader.generation, hash = Shader.hash,
+            device = Shader.device, code = Shader.code] {
+            std::vector<uint8_t> specialized;
+            DxbcOptimizeStats stats;
+            ID3D11PixelShader* shader = nullptr;
+
+            /* Folding the values alone does not pay for the extra shader switches */
+            if (optimizeDxbcShader(code.data(), code.size(), options, &specialized, &stats)
+             && (stats.branches || stats.removed)) {
+                HRESULT hr = getDeviceProcs(device)->CreatePixelShader(device,
+                    specialized.data(), specialized.size(), nullptr, &shader);
+
+                if (FAILED(hr))
+                    shader = nullptr;
+
+#ifndef NDEBUG
+                if (FAILED(hr))
+                    log("Specialize: Failed to create variant of ", formatHash(hash), ": ", hr);
+                else
+                    log("Specialize: Created variant of ", formatHash(hash), " for ", options.constants.size(),
+                        " constants, ", stats.branches, " branches resolved, ", stats.removed, " instructions removed");
+#endif
+            }
+
+            std::lock_guard lock(g_specializeMutex);
+            auto entry = g_specializeShaders.find(pShader);
+
+            if (entry == g_specializeShaders.end() || entry->second.id != id || entry->second.generation != generation) {
+                if (shader)
+                    shader->Release();
+                return;
+            }
+
+            auto& s = entry->second;
+
+            if (!shader) {
+                resetVariant(s, SpecializeState::Rejected);
+                return;
+            }
+
+            s.variant = shader;
+            s.state = SpecializeState::Active;
+        });
+    }
+
+}
+
+
+void registerSpecializePixelShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11PixelShader*        pShader) {
+    if (!g_config.specializeShaders)
+        return;
+
+    SpecializeShader ps;
+    bool valid = findDxbcBranchConstants(pBytecode, BytecodeLength, &ps.constants) && !ps.constants.empty();
+
+    if (valid) {
+        const auto* bytes = static_cast<const uint8_t*>(pBytecode);
+
+        if (ps.constants.size() > MaxConstants)
+            ps.constants.resize(MaxConstants);
+
+        ps.hash = getDxbcHash(pBytecode, BytecodeLength);
+        ps.device = pDevice;
+        ps.code.assign(bytes, bytes + BytecodeLength);
+    }
+
+    std::lock_guard lock(g_specializeMutex);
+
+    /* The application may reuse the address of a destroyed shader */
+    auto entry = g_specializeShaders.find(pShader);
+
+    if (entry != g_specializeShaders.end()) {
+        resetVariant(entry->second, SpecializeState::Rejected);
+        g_specializeShaders.erase(entry);
+    }
+
+    if (valid) {
+        ps.id = ++g_specializeShaderId;
+        g_specializeShaders.insert({ pShader, std::move(ps) });
+    }
+}
+
+
+bool isSpecializablePixelShader(ID3D11PixelShader* pShader) {
+    if (!pShader)
+        return false;
+
+    std::lock_guard lock(g_specializeMutex);
+    auto entry = g_specializeShaders.find(pShader);
+
+    return entry != g_specializeShaders.end()
+        && entry->second.state != SpecializeState::Rejected;
+}
+
+
+ID3D11PixelShader* getSpecializedPixelShader(
+        ID3D11PixelShader*        pShader,
+        ID3D11Buffer* const*      ppBuffers,
+        uint32_t                  Ranges) {
+    std::lock_guard lock(g_specializeMutex);
+    auto entry = g_specializeShaders.find(pShader);
+
+    if (entry == g_specializeShaders.end() || entry->second.state == SpecializeState::Rejected)
+        return nullptr;
+
+    auto& s = entry->second;
+    std::array<uint32_t, MaxConstants> values;
+
+    /* Unknown values may still match, so they do not count as a change */
+    if (!readValues(s, ppBuffers, Ranges, values.data()))
+        return nullptr;
+
+    if (s.values.empty() || !std::equal(s.values.begin(), s.values.end(), values.begin())) {
+        if (!s.values.empty()) {
+#ifndef NDEBUG
+            if (s.state == SpecializeState::Active)
+                log("Specialize: Values for ", formatHash(s.hash), " changed, dropping variant");
+#endif
+            s.changes += 1u;
+            resetVariant(s, s.changes > MaxChanges ? SpecializeState::Rejected : SpecializeState::Profiling);
+        }
+
+        s.values.assign(values.begin(), values.begin() + s.constants.size());
+        s.stableDraws = 0u;
+        return nullptr;
+    }
+
+    if (s.state == SpecializeState::Active)
+        return s.variant;
+
+    /* Shaders drawn most often reach the threshold first */
+    if (s.state == SpecializeState::Profiling && ++s.stableDraws >= StableDraws
+     && g_specializedCount < g_config.specializeShaders) {
+        s.state = SpecializeState::Pending;
+        g_specializedCount += 1u;
+        createVariantAsync(pShader, s);
+    }
+
+    return nullptr;
+}
+
+
+void trackSpecializationMap(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_MAPPED_SUBRESOURCE* pMappedResource) {
+    if (Subresource || !pMappedResource || !pMappedResource->pData)
+        return;
+
+    std::lock_guard lock(g_specializeMutex);
+    auto entry = g_watchedBuffers.find(pResource);
+
+    if (entry != g_watchedBuffers.end())
+        entry->second.mapped = static_cast<const uint32_t*>(pMappedResource->pData);
+}
+
+
+void trackSpecializationUnmap(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource) {
+    if (Subresource)
+        return;
+
+    std::lock_guard lock(g_specializeMutex);
+    auto entry = g_watchedBuffers.find(pResource);
+
+    if (entry == g_watchedBuffers.end() || !entry->second.mapped)
+        return;
+
+    auto& b = entry->second;
+
+    /* Only the watched components are read back from mapped memory */
+    for (size_t i = 0; i < b.elements.size(); i++) {
+        if (b.elements[i] < b.size) {
+            b.values[i] = b.mapped[b.elements[i]];
+            b.known[i] = 1u;
+        }
+    }
+
+    b.mapped = nullptr;
+}
+
+
+void trackSpecializationUpdate(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData) {
+    if (Subresource || !pSrcData)
+        return;
+
+    std::lock_guard lock(g_specializeMutex);
+    auto entry = g_watchedBuffers.find(pResource);
+
+    if (entry == g_watchedBuffers.end())
+        return;
+
+    auto& b = entry->second;
+    uint32_t begin = pDstBox ? pDstBox->left : 0u;
+    uint32_t end = pDstBox ? pDstBox->right : b.size * uint32_t(sizeof(uint32_t));
+
+    for (size_t i = 0; i < b.elements.size(); i++) {
+        uint32_t offset = b.elements[i] * uint32_t(sizeof(uint32_t));
+
+        if (offset >= begin && offset + sizeof(uint32_t) <= end && b.elements[i] < b.size) {
+            std::memcpy(&b.values[i], static_cast<const uint8_t*>(pSrcData) + (offset - begin), sizeof(uint32_t));
+            b.known[i] = 1u;
+        } else if (offset < end && offset + sizeof(uint32_t) > begin) {
+            b.known[i] = 0u;
+        }
+    }
+}
+
+
+void invalidateSpecializationBuffer(ID3D11Resource* pResource) {
+    if (!g_config.specializeShaders)
+        return;
+
+    std::lock_guard lock(g_specializeMutex);
+
+    if (!pResource) {
+        for (auto& entry : g_watchedBuffers)
+            std::fill(entry.second.known.begin(), entry.second.known.end(), 0u);
+        return;
+    }
+
+    /* A buffer reusing the address may differ in size, so it is
+     * looked up again and watched components are re-added on use */
+    g_watchedBuffers.erase(pResource);
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+#include <cstdint>
+
+#include <d3d11.h>
+
+namespace atfix {
+
+/**
+ * \brief Records the branch constants of a pixel shader
+ *
+ * Must be called for every pixel shader created by the application,
+ * since it also drops stale variants of destroyed shaders.
+ */
+void registerSpecializePixelShader(
+        ID3D11Device*             pDevice,
+  const void*                     pBytecode,
+        SIZE_T                    BytecodeLength,
+        ID3D11PixelShader*        pShader);
+
+/** Checks whether a pixel shader is profiled or has a variant */
+bool isSpecializablePixelShader(ID3D11PixelShader* pShader);
+
+/**
+ * \brief Picks the variant of a pixel shader for the next draw
+ *
+ * Samples the values of the shader's branch constants. Once they
+ * stayed the same for enough draws, a variant with these values
+ * folded in is built on a worker thread. The variant is only
+ * returned while the current values match, and dropped as soon
+ * as they change.
+ * \param [in] pShader Bound pixel shader
+ * \param [in] ppBuffers Bound pixel shader constant buffers
+ * \param [in] Ranges Slots bound with an offset
+ * \returns Variant to bind, or \c nullptr to use the shader as is
+ */
+ID3D11PixelShader* getSpecializedPixelShader(
+        ID3D11PixelShader*        pShader,
+        ID3D11Buffer* const*      ppBuffers,
+        uint32_t                  Ranges);
+
+/** Starts capturing the values written to a mapped constant buffer */
+void trackSpecializationMap(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_MAPPED_SUBRESOURCE* pMappedResource);
+
+/** Reads the values written to a constant buffer before it is unmapped */
+void trackSpecializationUnmap(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource);
+
+/** Reads the values written by \c UpdateSubresource */
+void trackSpecializationUpdate(
+        ID3D11Resource*           pResource,
+        UINT                      Subresource,
+  const D3D11_BOX*                pDstBox,
+  const void*                     pSrcData);
+
+/**
+ * \brief Forgets the values of a constant buffer
+ *
+ * For writes whose data is not visible, such as copies, command
+ * lists and newly created buffers reusing an address. A single
+ * buffer is forgotten entirely, including its size.
+ * \param [in] pResource Resource, or \c nullptr for all buffers
+ */
+void invalidateSpecializationBuffer(ID3D11Resource* pResource);
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "upscale.h"
+
+namespace atfix {
+
+namespace {
+
+    using Color = std::array<float, 4>;
+
+    constexpr float Epsilon = 1.0f / 32768.0f;
+
+    Color loadTexel(const float* pImage, uint32_t Width, uint32_t Height, int32_t X, int32_t Y) {
+        X = std::clamp(X, 0, int32_t(Width) - 1);
+        Y = std::clamp(Y, 0, int32_t(Height) - 1);
+
+        const float* texel = &pImage[4u * (size_t(Y) * Width + size_t(X))];
+        return { texel[0], texel[1], texel[2], texel[3] };
+    }
+
+    void storeTexel(float* pImage, uint32_t Width, uint32_t X, uint32_t Y, const Color& C) {
+        std::copy(C.begin(), C.end(), &pImage[4u * (size_t(Y) * Width + size_t(X))]);
+    }
+
+    float getLuma(const Color& C) {
+        return 0.25f * C[0] + 0.5f * C[1] + 0.25f * C[2];
+    }
+
+    float getWeight(float D2, float Lobe) {
+        float a = 0.4f * D2 - 1.0f;
+        float b = Lobe * D2 - 1.0f;
+        return (1.5625f * a * a - 0.5625f) * (b * b);
+    }
+
+}
+
+
+void upscaleReference(
+  const float*                    pSrc,
+        uint32_t                  SrcWidth,
+        uint32_t                  SrcHeight,
+        float*                    pDst,
+        uint32_t                  DstWidth,
+        uint32_t                  DstHeight) {
+    float scaleX = float(SrcWidth) / float(DstWidth);
+    float scaleY = float(SrcHeight) / float(DstHeight);
+
+    for (uint32_t y = 0; y < DstHeight; y++) {
+        for (uint32_t x = 0; x < DstWidth; x++) {
+            float px = (float(x) + 0.5f) * scaleX - 0.5f;
+            float py = (float(y) + 0.5f) * scaleY - 0.5f;
+            float bx = std::floor(px);
+            float by = std::floor(py);
+            float fx = px - bx;
+            float fy = py - by;
+
+            std::array<Color, 16> c;
+            std::array<float, 16> l;
+
+            for (int32_t i = 0; i < 16; i++) {
+                c[i] = loadTexel(pSrc, SrcWidth, SrcHeight, int32_t(bx) + (i & 3) - 1, int32_t(by) + (i >> 2) - 1);
+                l[i] = getLuma(c[i]);
+            }
+
+            /* Gradient and edge strength of the four center texels, bilinearly weighted */
+            float dirX = 0.0f;
+            float dirY = 0.0f;
+            float len = 0.0f;
+
+            for (int32_t q = 0; q < 4; q++) {
+                int32_t k = 5 + (q & 1) + 4 * (q >> 1);
+                float w = ((q & 1) ? fx : 1.0f - fx) * ((q >> 1) ? fy : 1.0f - fy);
+
+                float dx = l[k + 1] - l[k - 1];
+                float dy = l[k + 4] - l[k - 4];
+                float ex = std::max(std::abs(l[k + 1] - l[k]), std::abs(l[k] - l[k - 1]));
+                float ey = std::max(std::abs(l[k + 4] - l[k]), std::abs(l[k] - l[k - 4]));
+                float sx = std::clamp(std::abs(dx) / std::max(ex, Epsilon), 0.0f, 1.0f);
+                float sy = std::clamp(std::abs(dy) / std::max(ey, Epsilon), 0.0f, 1.0f);
+
+                dirX += w * dx;
+                dirY += w * dy;
+                len += w * 0.5f * (sx * sx + sy * sy);
+            }
+
+            float dirLen2 = dirX * dirX + dirY * dirY;
+
+            if (dirLen2 < Epsilon) {
+                dirX = 1.0f;
+                dirY = 0.0f;
+            } else {
+                float rcp = 1.0f / std::sqrt(dirLen2);
+                dirX *= rcp;
+                dirY *= rcp;
+            }
+
+            /* Stretch the kernel along edges, more so for diagonal ones */
+            float stretch = 1.0f / std::max(std::abs(dirX), std::abs(dirY));
+            float axisX = 1.0f + (stretch - 1.0f) * len;
+            float axisY = 1.0f - 0.5f * len;
+            float lobe = 0.5f - 0.29f * len;
+            float clip = 1.0f / lobe;
+
+            Color sum = { };
+            float weights = 0.0f;
+
+            for (int32_t j = 0; j < 16; j++) {
+                float dx = float(j & 3) - 1.0f - fx;
+                float dy = float(j >> 2) - 1.0f - fy;
+                float rx = (dx * dirX + dy * dirY) * axisX;
+                float ry = (dy * dirX - dx * dirY) * axisY;
+                float w = getWeight(std::min(rx * rx + ry * ry, clip), lobe);
+
+                for (uint32_t n = 0; n < 4; n++)
+                    sum[n] += w * c[j][n];
+
+                weights += w;
+            }
+
+            /* Clamp to the nearest texels to avoid ringing */
+            Color result;
+
+            for (uint32_t n = 0; n < 4; n++) {
+                float lo = std::min(std::min(c[5][n], c[6][n]), std::min(c[9][n], c[10][n]));
+                float hi = std::max(std::max(c[5][n], c[6][n]), std::max(c[9][n], c[10][n]));
+                result[n] = std::clamp(sum[n] / std::max(weights, Epsilon), lo, hi);
+            }
+
+            storeTexel(pDst, DstWidth, x, y, result);
+        }
+    }
+}
+
+
+void sharpenReference(
+  const float*                    pSrc,
+        float*                    pDst,
+        uint32_t                  Width,
+        uint32_t                  Height,
+        float                     Sharpness) {
+    for (uint32_t y = 0; y < Height; y++) {
+        for (uint32_t x = 0; x < Width; x++) {
+            Color e = loadTexel(pSrc, Width, Height, int32_t(x), int32_t(y));
+            Color b = loadTexel(pSrc, Width, Height, int32_t(x), int32_t(y) - 1);
+            Color d = loadTexel(pSrc, Width, Height, int32_t(x) - 1, int32_t(y));
+            Color f = loadTexel(pSrc, Width, Height, int32_t(x) + 1, int32_t(y));
+            Color h = loadTexel(pSrc, Width, Height, int32_t(x), int32_t(y) + 1);
+
+            std::array<float, 3> lo, hi;
+
+            for (uint32_t n = 0; n < 3; n++) {
+                lo[n] = std::min({ b[n], d[n], f[n], h[n], e[n] });
+                hi[n] = std::max({ b[n], d[n], f[n], h[n], e[n] });
+            }
+
+            /* Limits assume a 0 to 1 range, scale HDR values down to it */
+            float range = std::max({ hi[0], hi[1], hi[2], 1.0f });
+            float lobe = -1.0f;
+
+            for (uint32_t n = 0; n < 3; n++) {
+                float l = lo[n] / range;
+                float u = hi[n] / range;
+
+                float hitMin = l / (4.0f * std::max(u, Epsilon));
+                float hitMax = (1.0f - u) / std::min(4.0f * l - 4.0f, -Epsilon);
+                lobe = std::max(lobe, std::max(-hitMin, hitMax));
+            }
+
+            lobe = std::max(-0.1875f, std::min(lobe, 0.0f)) * Sharpness;
+
+            Color result;
+
+            for (uint32_t n = 0; n < 3; n++)
+                result[n] = (lobe * (b[n] + d[n] + f[n] + h[n]) + e[n]) / (4.0f * lobe + 1.0f);
+
+            result[3] = e[3];
+            storeTexel(pDst, Width, x, y, result);
+        }
+    }
+}
+
+}
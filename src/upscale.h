@@ -0,0 +1,36 @@
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include <cstdint>
+
+namespace atfix {
+
+/**
+ * \brief CPU reference of the edge-adaptive upscale pass
+ *
+ * Follows the shader in \c shaders/upscale.hpp step by step, so that
+ * GPU output can be checked against it. Images are tightly packed
+ * RGBA floats, \c pSrc only holds the rendered region.
+ */
+void upscaleReference(
+  const float*                    pSrc,
+        uint32_t                  SrcWidth,
+        uint32_t                  SrcHeight,
+        float*                    pDst,
+        uint32_t                  DstWidth,
+        uint32_t                  DstHeight);
+
+/**
+ * \brief CPU reference of the sharpening pass
+ * \param [in] Sharpness Strength from 0 to 1
+ */
+void sharpenReference(
+  const float*                    pSrc,
+        float*                    pDst,
+        uint32_t                  Width,
+        uint32_t                  Height,
+        float                     Sharpness);
+
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "vcache.h"
+
+namespace atfix {
+
+namespace {
+
+    constexpr uint32_t CacheSize        = 32u;
+    constexpr float    CacheDecayPower  = 1.5f;
+    constexpr float    LastTriScore     = 0.75f;
+    constexpr float    ValenceBoostScale = 2.0f;
+    constexpr float    ValenceBoostPower = 0.5f;
+
+    constexpr uint32_t MaxValence       = 32u;
+
+    struct ScoreTables {
+        float cache[CacheSize];
+        float valence[MaxValence];
+
+        ScoreTables() {
+            for (uint32_t i = 0; i < CacheSize; i++) {
+                if (i < 3u) {
+                    cache[i] = LastTriScore;
+                } else {
+                    float scaler = 1.0f / float(CacheSize - 3u);
+                    cache[i] = std::pow(1.0f - float(i - 3u) * scaler, CacheDecayPower);
+                }
+            }
+
+            valence[0] = 0.0f;
+
+            for (uint32_t i = 1; i < MaxValence; i++)
+                valence[i] = ValenceBoostScale * std::pow(float(i), -ValenceBoostPower);
+        }
+    };
+
+    const ScoreTables& scoreTables() {
+        static const ScoreTables tables;
+        return tables;
+    }
+
+    float vertexScore(int32_t CachePosition, uint32_t RemainingTris) {
+        const auto& tables = scoreTables();
+
+        if (!RemainingTris)
+            return -1.0f;
+
+        float score = CachePosition >= 0
+            ? tables.cache[CachePosition]
+            : 0.0f;
+
+        return score + tables.valence[std::min(RemainingTris, MaxValence - 1u)];
+    }
+
+    struct Vertex {
+        int32_t  cachePos     = -1;
+        uint32_t remaining    = 0u;
+        uint32_t firstTri     = 0u;
+        uint32_t triCount     = 0u;
+        float    score        = 0.0f;
+    };
+
+}
+
+
+void optimizeVertexCache(uint32_t* pIndices, size_t Count) {
+    size_t triCount = Count / 3u;
+
+    if (triCount < 2u)
+        return;
+
+    /* Remap to a dense vertex range so arbitrary index values work */
+    std::vector<uint32_t> unique(pIndices, pIndices + triCount * 3u);
+    std::sort(unique.begin(), unique.end());
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+    std::vector<uint32_t> local(triCount * 3u);
+
+    for (size_t i = 0; i < local.size(); i++)
+        local[i] = uint32_t(std::lower_bound(unique.begin(), unique.end(), pIndices[i]) - unique.begin());
+
+    std::vector<Vertex> vertices(unique.size());
+
+    for (uint32_t index : local)
+        vertices[index].triCount += 1u;
+
+    uint32_t offset = 0u;
+
+    for (auto& v : vertices) {
+        v.firstTri = offset;
+        v.remaining = v.triCount;
+        offset += v.triCount;
+        v.triCount = 0u;
+    }
+
+    std::vector<uint32_t> vertexTris(offset);
+
+    for (size_t t = 0; t < triCount; t++) {
+        for (uint32_t k = 0; k < 3u; k++) {
+            auto& v = vertices[local[3u * t + k]];
+            vertexTris[v.firstTri + v.triCount++] = uint32_t(t);
+        }
+    }
+
+    for (auto& v : vertices)
+        v.score = vertexScore(-1, v.remaining);
+
+    std::vector<bool> triEmitted(triCount, false);
+
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> newCache;
+    cache.reserve(CacheSize + 3u);
+    newCache.reserve(CacheSize + 3u);
+
+    std::vector<uint32_t> output;
+    output.reserve(triCount * 3u);
+
+    size_t scanPos = 0u;
+    int64_t bestTri = -1;
+
+    while (output.size() < triCount * 3u) {
+        if (bestTri < 0) {
+            /* Nothing left around the cached vertices, continue with the
+             * next triangle in input order to keep this linear-time */
+            while (triEmitted[scanPos])
+                scanPos++;
+
+            bestTri = int64_t(scanPos);
+        }
+
+        uint32_t tri = uint32_t(bestTri);
+        triEmitted[tri] = true;
+
+        for (uint32_t k = 0; k < 3u; k++)
+            output.push_back(pIndices[3u * tri + k]);
+
+        /* Move the triangle's vertices to the front of the LRU cache */
+        newCache.clear();
+
+        for (uint32_t k = 0; k < 3u; k++) {
+            uint32_t index = local[3u * tri + k];
+            auto& v = vertices[index];
+
+            uint32_t* tris = &vertexTris[v.firstTri];
+            uint32_t* pos = std::find(tris, tris + v.remaining, tri);
+            std::swap(*pos, tris[v.remaining - 1u]);
+            v.remaining -= 1u;
+
+            if (std::find(newCache.begin(), newCache.end(), index) == newCache.end())
+                newCache.push_back(index);
+        }
+
+        for (uint32_t index : cache) {
+            if (std::find(newCache.begin(), newCache.end(), index) == newCache.end())
+                newCache.push_back(index);
+        }
+
+        for (size_t i = CacheSize; i < newCache.size(); i++) {
+            auto& v = vertices[newCache[i]];
+            v.cachePos = -1;
+            v.score = vertexScore(-1, v.remaining);
+        }
+
+        newCache.resize(std::min<size_t>(newCache.size(), CacheSize));
+        std::swap(cache, newCache);
+
+        for (size_t i = 0; i < cache.size(); i++) {
+            auto& v = vertices[cache[i]];
+            v.cachePos = int32_t(i);
+            v.score = vertexScore(v.cachePos, v.remaining);
+        }
+
+        /* Rescore the triangles touching cached vertices */
+        float bestScore = -1.0f;
+        bestTri = -1;
+
+        for (uint32_t index : cache) {
+            const auto& v = vertices[index];
+
+            for (uint32_t i = 0; i < v.remaining; i++) {
+                uint32_t t = vertexTris[v.firstTri + i];
+
+                float score = vertices[local[3u * t + 0u]].score
+                            + vertices[local[3u * t + 1u]].score
+                            + vertices[local[3u * t + 2u]].score;
+
+                if (score > bestScore) {
+                    bestScore = score;
+                    bestTri = int64_t(t);
+                }
+            }
+        }
+    }
+
+    std::copy(output.begin(), output.end(), pIndices);
+}
+
+
+float computeAcmr(const uint32_t* pIndices, size_t Count, uint32_t CacheSize) {
+    size_t triCount = Count / 3u;
+
+    if (!triCount)
+        return 0.0f;
+
+    std::vector<uint32_t> fifo(CacheSize, ~0u);
+    size_t head = 0u;
+    size_t misses = 0u;
+
+    for (size_t i = 0; i < triCount * 3u; i++) {
+        if (std::find(fifo.begin(), fifo.end(), pIndices[i]) != fifo.end())
+            continue;
+
+        fifo[head] = pIndices[i];
+        head = (head + 1u) % CacheSize;
+        misses += 1u;
+    }
+
+    return float(misses) / float(triCount);
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef VCACHE_H
+#define VCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace atfix {
+
+/**
+ * \brief Reorders a triangle list for the post-transform vertex cache
+ *
+ * Forsyth's linear-speed greedy algorithm. Only the order of
+ * triangles changes, each triangle keeps its winding and the set
+ * of triangles stays the same.
+ * \param [in,out] pIndices Triangle list indices
+ * \param [in] Count Number of indices, must be a multiple of three
+ */
+void optimizeVertexCache(uint32_t* pIndices, size_t Count);
+
+/**
+ * \brief Computes the average cache miss ratio of a triangle list
+ *
+ * Simulates a FIFO cache of the given size and returns the number
+ * of vertex shader invocations per triangle.
+ */
+float computeAcmr(const uint32_t* pIndices, size_t Count, uint32_t CacheSize);
+
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <chrono>
+
+#include "config.h"
+#include "impl.h"
+#include "rules.h"
+#include "vegetation.h"
+
+namespace atfix {
+
+namespace {
+
+    /* Density in 1/256 steps, so that scaling is integer math */
+    constexpr uint32_t DensityOne = 256u;
+    constexpr uint32_t DensityStep = 16u;
+
+    /* Frames averaged before the density is adjusted */
+    constexpr uint32_t AdaptInterval = 30u;
+
+    uint32_t g_grassDensity = DensityOne;
+
+    std::chrono::steady_clock::time_point g_frameStart = { };
+    std::chrono::steady_clock::duration g_frameTimeSum = { };
+    uint32_t g_frameCount = 0u;
+
+    uint32_t getDensity(uint32_t Percent) {
+        return std::min(Percent, 100u) * DensityOne / 100u;
+    }
+
+    void adaptDensity(std::chrono::microseconds FrameTime) {
+        uint32_t budget = g_config.grassFrameBudgetUs;
+        uint32_t minDensity = getDensity(g_config.grassMinDensity);
+        uint32_t maxDensity = getDensity(g_config.grassDensity);
+
+        /* Only raise the density well below budget, to avoid oscillating */
+        if (uint32_t(FrameTime.count()) > budget)
+            g_grassDensity = std::max(g_grassDensity, minDensity + DensityStep) - DensityStep;
+        else if (uint32_t(FrameTime.count()) < budget - budget / 10u)
+            g_grassDensity = std::min(g_grassDensity + DensityStep, maxDensity);
+
+        g_grassDensity = std::clamp(g_grassDensity, std::min(minDensity, maxDensity), maxDensity);
+    }
+
+}
+
+
+bool isGrassShader(const void* pShader) {
+    const auto& shaders = g_config.grassShaders;
+    Hash128 hash;
+
+    if (!pShader || !getRuleShaderHash(pShader, &hash))
+        return false;
+
+    return std::find(shaders.begin(), shaders.end(), hash) != shaders.end();
+}
+
+
+uint32_t scaleGrassInstances(uint32_t InstanceCount) {
+    if (!InstanceCount)
+        return 0u;
+
+    uint32_t count = uint32_t((uint64_t(InstanceCount) * g_grassDensity + DensityOne / 2u) / DensityOne);
+    return std::max(count, 1u);
+}
+
+
+void endVegetationFrame() {
+    if (!g_config.grassFrameBudgetUs) {
+        g_grassDensity = getDensity(g_config.grassDensity);
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    if (g_frameStart != std::chrono::steady_clock::time_point())
+        g_frameTimeSum += now - g_frameStart;
+    else
+        g_grassDensity = getDensity(g_config.grassDensity);
+
+    g_frameStart = now;
+
+    if (++g_frameCount < AdaptInterval)
+        return;
+
+    auto average = std::chrono::duration_cast<std::chrono::microseconds>(g_frameTimeSum / g_frameCount);
+    [[maybe_unused]] uint32_t oldDensity = g_grassDensity;
+    adaptDensity(average);
+
+#ifndef NDEBUG
+    if (g_grassDensity != oldDensity)
+        log("Vegetation: Frame time ", average.count(), " us, grass density ", g_grassDensity * 100u / DensityOne, "%");
+#endif
+
+    g_frameTimeSum = { };
+    g_frameCount = 0u;
+}
+
+}
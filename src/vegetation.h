@@ -0,0 +1,29 @@
+#ifndef VEGETATION_H
+#define VEGETATION_H
+
+#include <cstdint>
+
+namespace atfix {
+
+/** Checks whether a vertex shader is one of the configured grass shaders */
+bool isGrassShader(const void* pShader);
+
+/**
+ * \brief Scales the instance count of a grass draw
+ *
+ * Keeps the first instances, so that a given chunk always
+ * loses the same ones at a given density.
+ * \returns Instance count to draw, at least 1
+ */
+uint32_t scaleGrassInstances(uint32_t InstanceCount);
+
+/**
+ * \brief Ends a frame
+ *
+ * Adapts the density to the frame time budget, if any.
+ */
+void endVegetationFrame();
+
+}
+
+#endif
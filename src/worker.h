@@ -0,0 +1,72 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <functional>
+#include <mutex>
+#include <queue>
+
+#include "util.h"
+
+namespace atfix {
+
+/**
+ * \brief Background worker thread
+ *
+ * Runs submitted jobs in order on a single low-priority
+ * thread that is created on first use. Jobs must not
+ * touch any device context.
+ */
+class WorkerThread {
+
+public:
+
+    using Job = std::function<void ()>;
+
+    WorkerThread() { }
+
+    WorkerThread(const WorkerThread&) = delete;
+    WorkerThread& operator = (const WorkerThread&) = delete;
+
+    void submit(Job&& job) {
+        std::unique_lock lock(m_mutex);
+
+        if (!m_thread) {
+            m_thread = CreateThread(nullptr, 0, &WorkerThread::threadProc, this, 0, nullptr);
+            SetThreadPriority(m_thread, THREAD_PRIORITY_BELOW_NORMAL);
+        }
+
+        m_jobs.push(std::move(job));
+        m_cond.notify_one();
+    }
+
+private:
+
+    mutex               m_mutex;
+    condition_variable  m_cond;
+    std::queue<Job>     m_jobs;
+    HANDLE              m_thread = nullptr;
+
+    static DWORD WINAPI threadProc(LPVOID pParam) {
+        auto* worker = static_cast<WorkerThread*>(pParam);
+
+        while (true) {
+            Job job;
+
+            {   std::unique_lock lock(worker->m_mutex);
+                worker->m_cond.wait(lock, [worker] { return !worker->m_jobs.empty(); });
+
+                job = std::move(worker->m_jobs.front());
+                worker->m_jobs.pop();
+            }
+
+            job();
+        }
+
+        return 0;
+    }
+
+};
+
+}
+
+#endif
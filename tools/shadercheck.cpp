@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "dxbc.h"
+#include "interp.h"
+#include "shaderopt.h"
+
+#include "shaders/snow.hpp"
+
+namespace {
+
+    struct CheckedShader {
+        std::string           name;
+        std::vector<uint8_t>  code;
+    };
+
+    enum class CheckResult : uint32_t {
+        Optimized,
+        Unchanged,
+        Skipped,
+        Failed,
+    };
+
+    /** Adds a shader file, or all \c .dxbc files of a dump directory */
+    bool addShaderPath(const std::filesystem::path& Path, std::vector<CheckedShader>& Shaders) {
+        std::error_code ec;
+
+        if (std::filesystem::is_directory(Path, ec)) {
+            std::vector<std::filesystem::path> files;
+
+            for (const auto& entry : std::filesystem::directory_iterator(Path, ec)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".dxbc")
+                    files.push_back(entry.path());
+            }
+
+            std::sort(files.begin(), files.end());
+
+            for (const auto& file : files) {
+                if (!addShaderPath(file, Shaders))
+                    return false;
+            }
+
+            return !ec;
+        }
+
+        std::ifstream file(Path, std::ios::binary);
+
+        if (!file) {
+            std::fprintf(stderr, "%s: cannot read file\n", Path.string().c_str());
+            return false;
+        }
+
+        CheckedShader shader;
+        shader.name = Path.string();
+        shader.code.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        Shaders.push_back(std::move(shader));
+        return true;
+    }
+
+    /**
+     * \brief Optimizes a shader with validation
+     *
+     * Shaders the interpreter cannot run are skipped, so a rejected
+     * result means the optimized shader computes something else.
+     */
+    CheckResult checkVariant(
+      const CheckedShader&                Shader,
+      const char*                         pVariant,
+      const atfix::DxbcOptimizeOptions&   Options) {
+        atfix::DxbcOptimizeStats stats;
+        std::vector<uint8_t> code;
+
+        if (!atfix::optimizeDxbcShader(Shader.code.data(), Shader.code.size(), Options, &code, &stats)) {
+            if (stats.rejected) {
+                std::printf("%s (%s): FAILED, optimized shader does not match the original\n", Shader.name.c_str(), pVariant);
+                return CheckResult::Failed;
+            }
+
+            std::printf("%s (%s): unchanged\n", Shader.name.c_str(), pVariant);
+            return CheckResult::Unchanged;
+        }
+
+        std::printf("%s (%s): %zu -> %zu bytes, %llu -> %llu instructions, %llu -> %llu fetches\n",
+            Shader.name.c_str(), pVariant, Shader.code.size(), code.size(),
+            static_cast<unsigned long long>(stats.instructionsBefore),
+            static_cast<unsigned long long>(stats.instructionsAfter),
+            static_cast<unsigned long long>(stats.fetchesBefore),
+            static_cast<unsigned long long>(stats.fetchesAfter));
+        return CheckResult::Optimized;
+    }
+
+    /**
+     * \brief Checks the generic variant and, if the shader has
+     *    branch constants, a variant specialized for zero values
+     */
+    void checkShader(const CheckedShader& Shader, uint32_t* pCounts) {
+        atfix::DxbcInterpResult result;
+
+        if (!atfix::runDxbcShader(Shader.code.data(), Shader.code.size(), atfix::DxbcInterpInputs(), &result)) {
+            std::printf("%s: skipped, not supported by the interpreter\n", Shader.name.c_str());
+            pCounts[uint32_t(CheckResult::Skipped)] += 1u;
+            return;
+        }
+
+        atfix::DxbcOptimizeOptions options;
+        options.validate = true;
+
+        pCounts[uint32_t(checkVariant(Shader, "generic", options))] += 1u;
+
+        std::vector<atfix::DxbcConstantRef> constants;
+
+        if (!atfix::findDxbcBranchConstants(Shader.code.data(), Shader.code.size(), &constants) || constants.empty())
+            return;
+
+        for (const auto& c : constants)
+            options.constants.push_back({ c, 0u });
+
+        pCounts[uint32_t(checkVariant(Shader, "specialized", options))] += 1u;
+    }
+}
+
+
+/**
+ * \brief Checks the shader optimizer against the interpreter
+ *
+ * Takes shader files and shader dump directories, or checks
+ * the embedded snow shaders if there are no arguments.
+ * Exits with 1 if any optimized shader fails validation.
+ */
+int main(int argc, char** argv) {
+    std::vector<CheckedShader> shaders;
+
+    if (argc < 2) {
+        shaders.push_back({ "builtin:snow", std::vector<uint8_t>(data.begin(), data.end()) });
+        shaders.push_back({ "builtin:snow_original", std::vector<uint8_t>(original.begin(), original.end()) });
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!addShaderPath(argv[i], shaders))
+            return 1;
+    }
+
+    uint32_t counts[4] = { };
+
+    for (const auto& shader : shaders)
+        checkShader(shader, counts);
+
+    std::printf("%u optimized, %u unchanged, %u skipped, %u failed\n",
+        counts[uint32_t(CheckResult::Optimized)], counts[uint32_t(CheckResult::Unchanged)],
+        counts[uint32_t(CheckResult::Skipped)], counts[uint32_t(CheckResult::Failed)]);
+
+    return counts[uint32_t(CheckResult::Failed)] ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "upscale.h"
+
+namespace {
+
+    using Image = std::vector<float>;
+
+    uint32_t g_failures = 0u;
+
+    void expect(bool Condition, const char* pTest, uint32_t X, uint32_t Y, float Value) {
+        if (Condition)
+            return;
+
+        std::printf("%s: FAILED at %u,%u, got %g\n", pTest, X, Y, Value);
+        g_failures += 1u;
+    }
+
+    Image makeImage(uint32_t Width, uint32_t Height, float (*pFunc) (uint32_t, uint32_t)) {
+        Image image(4u * Width * Height);
+
+        for (uint32_t y = 0; y < Height; y++) {
+            for (uint32_t x = 0; x < Width; x++) {
+                float v = pFunc(x, y);
+                float* texel = &image[4u * (y * Width + x)];
+                texel[0] = v;
+                texel[1] = v;
+                texel[2] = v;
+                texel[3] = 0.5f;
+            }
+        }
+
+        return image;
+    }
+
+    /** A flat image stays flat at any scale */
+    void checkUpscaleFlat() {
+        Image src = makeImage(5u, 3u, [] (uint32_t, uint32_t) { return 0.375f; });
+        Image dst(4u * 8u * 5u);
+
+        atfix::upscaleReference(src.data(), 5u, 3u, dst.data(), 8u, 5u);
+
+        for (uint32_t i = 0; i < dst.size(); i++)
+            expect(std::abs(dst[i] - (i % 4u == 3u ? 0.5f : 0.375f)) < 1.0e-6f, "upscale flat", (i / 4u) % 8u, i / 32u, dst[i]);
+    }
+
+    /**
+     * \brief A vertical edge stays sharp and does not ring
+     *
+     * Pixels whose nearest texels are on one side of the edge get
+     * exactly that side's value, and values rise monotonically
+     * from left to right, symmetrically around the edge.
+     */
+    void checkUpscaleEdge() {
+        Image src = makeImage(4u, 4u, [] (uint32_t x, uint32_t) { return x < 2u ? 0.0f : 1.0f; });
+        Image dst(4u * 8u * 8u);
+
+        atfix::upscaleReference(src.data(), 4u, 4u, dst.data(), 8u, 8u);
+
+        for (uint32_t y = 0; y < 8u; y++) {
+            const float* row = &dst[4u * 8u * y];
+
+            for (uint32_t x = 0; x < 8u; x++) {
+                float v = row[4u * x];
+
+                if (x < 3u)
+                    expect(v == 0.0f, "upscale edge dark side", x, y, v);
+                else if (x > 4u)
+                    expect(v == 1.0f, "upscale edge bright side", x, y, v);
+
+                if (x)
+                    expect(v >= row[4u * (x - 1u)], "upscale edge monotonic", x, y, v);
+
+                expect(std::abs(v + row[4u * (7u - x)] - 1.0f) < 1.0e-5f, "upscale edge symmetric", x, y, v);
+                expect(row[4u * x + 3u] == 0.5f, "upscale edge alpha", x, y, row[4u * x + 3u]);
+            }
+        }
+    }
+
+    /** Zero sharpness passes the image through */
+    void checkSharpenOff() {
+        Image src = makeImage(6u, 4u, [] (uint32_t x, uint32_t y) { return float((x * 7u + y * 3u) % 5u) * 0.25f; });
+        Image dst(src.size());
+
+        atfix::sharpenReference(src.data(), dst.data(), 6u, 4u, 0.0f);
+
+        for (uint32_t i = 0; i < dst.size(); i++)
+            expect(dst[i] == src[i], "sharpen off", (i / 4u) % 6u, i / 24u, dst[i]);
+    }
+
+    /**
+     * \brief Sharpens a single bright pixel by a known amount
+     *
+     * With a center of 0.5 on 0.25, the lobe limit is -0.125, so
+     * the center becomes (0.5 - 0.125 * 4 * 0.25) / (1 - 4 * 0.125).
+     */
+    void checkSharpenPeak() {
+        Image src = makeImage(3u, 3u, [] (uint32_t x, uint32_t y) { return x == 1u && y == 1u ? 0.5f : 0.25f; });
+        Image dst(src.size());
+
+        atfix::sharpenReference(src.data(), dst.data(), 3u, 3u, 1.0f);
+
+        const float* center = &dst[4u * 4u];
+
+        for (uint32_t n = 0; n < 3u; n++)
+            expect(std::abs(center[n] - 0.75f) < 1.0e-6f, "sharpen peak", 1u, 1u, center[n]);
+
+        expect(center[3] == 0.5f, "sharpen peak alpha", 1u, 1u, center[3]);
+    }
+
+}
+
+
+/**
+ * \brief Checks the CPU references of the upscale and sharpening
+ *    passes against outputs known from their construction
+ */
+int main() {
+    checkUpscaleFlat();
+    checkUpscaleEdge();
+    checkSharpenOff();
+    checkSharpenPeak();
+
+    std::printf("%u failures\n", g_failures);
+    return g_failures ? 1 : 0;
+}